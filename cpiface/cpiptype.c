@@ -47,4 +47,10 @@ static int cpiReadInfo(struct moduleinfostruct *m, struct ocpfilehandle_t *file,
 	return 0;
 }
 
-struct mdbreadinforegstruct cpiReadInfoReg = {"ANI", cpiReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig cpiReadInfoSigs[] =
+{
+	{0, 8, "CPANI\x1A\x00\x00"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct cpiReadInfoReg = {"ANI", cpiReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(cpiReadInfoSigs, 0)};
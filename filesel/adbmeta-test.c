@@ -50,6 +50,44 @@ const char test_blob[] = {
 	'T', 'E', 'X', 'T'
 };
 
+/* test_blob, after adbMetaCommit() converted it into a log */
+const char test_log_blob[] = {
+	/* header */
+	'O', 'C', 'P', 'A', 'r', 'c', 'h', 'i', 'v', 'e', 'M', 'e', 't', 'a', '\x1b', '\x01',
+
+	/* entry 1 */
+	'A',
+	'f', 'o', 'o', '1', 0,
+	's', 'z', 0,
+	0, 0, 0, 0, 0, 0, 0, 10,
+	0, 0, 0, 4,
+	't', 'e', 's', 't',
+
+	/* entry 2 */
+	'A',
+	'b', 'a', 'r', '2', 0,
+	't', 'u', 0,
+	0, 0, 0, 0, 0, 0, 0, 14,
+	0, 0, 0, 6,
+	'm', 'o', 'o', 'm', 'o', 'o',
+
+	/* entry 3 */
+	'A',
+	'o', 'p', 'e', 'n', 0,
+	'S', 'U', 0,
+	0, 0, 0, 0, 0, 0, 20, 12,
+	0, 0, 0, 3,
+	'T', 'X', 'T',
+
+	/* entry 4 */
+	'A',
+	's', 'o', 'u', 'r', 'c', 'e', 0,
+	'L', 'A', 'B', 0,
+	0, 0, 0, 0, 0, 0, 20, 14,
+	0, 0, 0, 4,
+	'T', 'E', 'X', 'T'
+};
+
 const struct adbMetaEntry_t test_expect[4] = {
 	{"foo1", 10, "sz", 4, (unsigned char *)"test"},
 	{"bar2", 14, "tu", 6, (unsigned char *)"moomoo"},
@@ -201,22 +239,23 @@ static int adbmeta_basic_test2 (void)
 
 	unlink ("/tmp/CPARCMETA.DAT");
 
-	if (fill != sizeof (test_blob))
+	if (fill != sizeof (test_log_blob))
 	{
 		retval |= 1;
-		fprintf (stderr, "adbmeta_basic_test2: " ANSI_COLOR_RED "new file size %d != %d" ANSI_COLOR_RESET "\n", fill, (int)sizeof (test_blob));
+		fprintf (stderr, "adbmeta_basic_test2: " ANSI_COLOR_RED "new file size %d != %d" ANSI_COLOR_RESET "\n", fill, (int)sizeof (test_log_blob));
 	}
-	if (memcmp (buffer, test_blob, (fill < sizeof (test_blob)) ? fill : sizeof (test_blob)))
+	if (memcmp (buffer, test_log_blob, (fill < sizeof (test_log_blob)) ? fill : sizeof (test_log_blob)))
 	{
+		retval |= 2;
 		fprintf (stderr, "adbmeta_basic_test2: " ANSI_COLOR_RED "new file content missmatch" ANSI_COLOR_RESET "\n");
 	}
 
 	if (retval)
 	{
 		fprintf (stderr, "expected data:\n");
-		for (i=0; i < sizeof (test_blob); i++)
+		for (i=0; i < sizeof (test_log_blob); i++)
 		{
-			fprintf (stderr, " %02x", (uint8_t)(test_blob[i]));
+			fprintf (stderr, " %02x", (uint8_t)(test_log_blob[i]));
 		}
 		fprintf (stderr, "\nactual data:\n");
 		for (i=0; i < fill; i++)
@@ -229,11 +268,35 @@ static int adbmeta_basic_test2 (void)
 	return retval;
 }
 
-static int adbmeta_basic_test3 (void)
+static int adbmeta_verify (const char *testname, const struct adbMetaEntry_t *expect, int count)
 {
 	int retval = 0;
 	int i;
 
+	for (i=0; i < count; i++)
+	{
+		unsigned char *data = 0;
+		size_t datasize = 0;
+
+		if (adbMetaGet (expect[i].filename, expect[i].filesize, expect[i].SIG, &data, &datasize))
+		{
+			retval |= 2;
+			fprintf (stderr, "%s: " ANSI_COLOR_RED "file \"%s\" (filesize=%d, SIG=%s) is missing" ANSI_COLOR_RESET "\n", testname, expect[i].filename, (int)(expect[i].filesize), expect[i].SIG);
+		} else if ((datasize != expect[i].datasize) || memcmp (data, expect[i].data, datasize))
+		{
+			retval |= 2;
+			fprintf (stderr, "%s: " ANSI_COLOR_RED "file \"%s\" (filesize=%d, SIG=%s) has the wrong data" ANSI_COLOR_RESET "\n", testname, expect[i].filename, (int)(expect[i].filesize), expect[i].SIG);
+		}
+		free (data);
+	}
+
+	return retval;
+}
+
+static int adbmeta_basic_test3 (void)
+{
+	int retval = 0;
+
 	unlink ("/tmp/CPARCMETA.DAT");
 
 	adbmeta_silene_open_errors = 1;
@@ -254,26 +317,7 @@ static int adbmeta_basic_test3 (void)
 		fprintf (stderr, "adbmeta_basic_test3: " ANSI_COLOR_RED "adbMetaCount != 4" ANSI_COLOR_RESET "\n");
 	}
 
-	for (i=0; i < adbMetaCount; i++)
-	{
-		if (strcmp (adbMetaEntries[i]->filename, test_expect[i].filename))
-		{
-			retval |= 2;
-		}
-	}
-
-	if (retval & 2)
-	{
-		for (i=0; i < adbMetaCount; i++)
-		{
-			if (strcmp (adbMetaEntries[i]->filename, test_expect[i].filename))
-			{
-				fprintf (stderr, "adbmeta_basic_test3: " ANSI_COLOR_RED "expected file \"%s\" (filesize=%d), but got \"%s\" (filesize=%d)" ANSI_COLOR_RESET "\n", test_expect[i].filename, (int)(test_expect[i].filesize), adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			} else {
-				fprintf (stderr, "adbmeta_basic_test3:      got file \"%s\" (filesize=%d)\n", adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			}
-		}
-	}
+	retval |= adbmeta_verify ("adbmeta_basic_test3", test_expect, 4);
 
 	adbMetaDirty = 0;
 
@@ -380,26 +424,7 @@ const struct adbMetaEntry_t test_many_expect[32] = {
 		fprintf (stderr, "adbmeta_basic_test4: " ANSI_COLOR_RED "adbMetaCount != 32" ANSI_COLOR_RESET "\n");
 	}
 
-	for (i=0; i < adbMetaCount; i++)
-	{
-		if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-		{
-			retval |= 2;
-		}
-	}
-
-	if (retval & 2)
-	{
-		for (i=0; i < adbMetaCount; i++)
-		{
-			if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-			{
-				fprintf (stderr, "adbmeta_basic_test4: " ANSI_COLOR_RED "expected file \"%s\" (filesize=%d), but got \"%s\" (filesize=%d)" ANSI_COLOR_RESET "\n", test_many_expect[i].filename, (int)(test_many_expect[i].filesize), adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			} else {
-				fprintf (stderr, "adbmeta_basic_test4:      got file \"%s\" (filesize=%d)\n", adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			}
-		}
-	}
+	retval |= adbmeta_verify ("adbmeta_basic_test4", test_many_expect, 32);
 
 	adbMetaDirty = 0;
 
@@ -506,26 +531,7 @@ const struct adbMetaEntry_t test_many_expect[32] = {
 		fprintf (stderr, "adbmeta_basic_test5: " ANSI_COLOR_RED "adbMetaCount != 32" ANSI_COLOR_RESET "\n");
 	}
 
-	for (i=0; i < adbMetaCount; i++)
-	{
-		if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-		{
-			retval |= 2;
-		}
-	}
-
-	if (retval & 2)
-	{
-		for (i=0; i < adbMetaCount; i++)
-		{
-			if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-			{
-				fprintf (stderr, "adbmeta_basic_test5: " ANSI_COLOR_RED "expected file \"%s\" (filesize=%d), but got \"%s\" (filesize=%d)" ANSI_COLOR_RESET "\n", test_many_expect[i].filename, (int)(test_many_expect[i].filesize), adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			} else {
-				fprintf (stderr, "adbmeta_basic_test5:      got file \"%s\" (filesize=%d)\n", adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			}
-		}
-	}
+	retval |= adbmeta_verify ("adbmeta_basic_test5", test_many_expect, 32);
 
 	adbMetaDirty = 0;
 
@@ -587,26 +593,7 @@ const struct adbMetaEntry_t test_many_insert[14] = {
 		fprintf (stderr, "adbmeta_basic_test6: " ANSI_COLOR_RED "adbMetaCount != 7" ANSI_COLOR_RESET "\n");
 	}
 
-	for (i=0; i < ((adbMetaCount <= 7) ? adbMetaCount : 7); i++)
-	{
-		if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-		{
-			retval |= 2;
-		}
-	}
-
-	if (retval & 2)
-	{
-		for (i=0; i < ((adbMetaCount <= 7) ? adbMetaCount : 7); i++)
-		{
-			if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-			{
-				fprintf (stderr, "adbmeta_basic_test6: " ANSI_COLOR_RED "expected file \"%s\" (filesize=%d), but got \"%s\" (filesize=%d)" ANSI_COLOR_RESET "\n", test_many_expect[i].filename, (int)(test_many_expect[i].filesize), adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			} else {
-				fprintf (stderr, "adbmeta_basic_test6:      got file \"%s\" (filesize=%d)\n", adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			}
-		}
-	}
+	retval |= adbmeta_verify ("adbmeta_basic_test6", test_many_expect, 7);
 
 	adbMetaDirty = 0;
 
@@ -671,26 +658,7 @@ const struct adbMetaEntry_t test_many_remove[3] = {
 		fprintf (stderr, "adbmeta_basic_test7: " ANSI_COLOR_RED "adbMetaCount != 4" ANSI_COLOR_RESET "\n");
 	}
 
-	for (i=0; i < ((adbMetaCount <= 4) ? adbMetaCount : 4); i++)
-	{
-		if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-		{
-			retval |= 2;
-		}
-	}
-
-	if (retval & 2)
-	{
-		for (i=0; i < ((adbMetaCount <= 4) ? adbMetaCount : 4); i++)
-		{
-			if (strcmp (adbMetaEntries[i]->filename, test_many_expect[i].filename))
-			{
-				fprintf (stderr, "adbmeta_basic_test7: " ANSI_COLOR_RED "expected file \"%s\" (filesize=%d), but got \"%s\" (filesize=%d)" ANSI_COLOR_RESET "\n", test_many_expect[i].filename, (int)(test_many_expect[i].filesize), adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			} else {
-				fprintf (stderr, "adbmeta_basic_test7:      got file \"%s\" (filesize=%d)\n", adbMetaEntries[i]->filename, (int)(adbMetaEntries[i]->filesize));
-			}
-		}
-	}
+	retval |= adbmeta_verify ("adbmeta_basic_test7", test_many_expect, 4);
 
 	adbMetaDirty = 0;
 
@@ -781,6 +749,184 @@ const struct adbMetaEntry_t test_many_insert[7] = {
 	return retval;
 }
 
+static off_t adbmeta_filesize (void)
+{
+	struct stat st;
+	if (stat ("/tmp/CPARCMETA.DAT", &st))
+	{
+		return -1;
+	}
+	return st.st_size;
+}
+
+static int adbmeta_basic_test9 (void)
+{
+const struct adbMetaEntry_t test_many_insert[3] = {
+	{"foo 11", 11, "test", 6, (unsigned char *)"moomo1"},
+	{"foo 12", 12, "test", 6, (unsigned char *)"moomo2"},
+	{"foo 13", 13, "test", 6, (unsigned char *)"moomo3"},
+};
+const struct adbMetaEntry_t test_many_expect[2] = {
+	{"foo 11", 11, "test", 6, (unsigned char *)"moomo1"},
+	{"foo 13", 13, "test", 6, (unsigned char *)"moomo3"},
+};
+	int retval = 0;
+	off_t size1, size2, size3;
+	char *before;
+	int f;
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	adbmeta_silene_open_errors = 1;
+
+	adbMetaInit();
+	adbMetaAdd (test_many_insert[0].filename, test_many_insert[0].filesize, test_many_insert[0].SIG, test_many_insert[0].data, test_many_insert[0].datasize);
+	adbMetaAdd (test_many_insert[1].filename, test_many_insert[1].filesize, test_many_insert[1].SIG, test_many_insert[1].data, test_many_insert[1].datasize);
+	adbMetaCommit ();
+	size1 = adbmeta_filesize ();
+
+	before = malloc (size1);
+	f = open ("/tmp/CPARCMETA.DAT", O_RDONLY);
+	if (read (f, before, size1) != size1)
+	{
+		retval |= 1;
+	}
+	close (f);
+
+	adbMetaAdd (test_many_insert[2].filename, test_many_insert[2].filesize, test_many_insert[2].SIG, test_many_insert[2].data, test_many_insert[2].datasize);
+	adbMetaCommit ();
+	size2 = adbmeta_filesize ();
+	/* 'A' + "foo 13\0" + "test\0" + filesize + datasize + data */
+	if (size2 != size1 + 1 + 7 + 5 + 8 + 4 + 6)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test9: " ANSI_COLOR_RED "file grew from %ld to %ld bytes, expected a single record to be appended" ANSI_COLOR_RESET "\n", (long)size1, (long)size2);
+	} else {
+		char *after = malloc (size1);
+		f = open ("/tmp/CPARCMETA.DAT", O_RDONLY);
+		if ((read (f, after, size1) != size1) || memcmp (before, after, size1))
+		{
+			retval |= 1;
+			fprintf (stderr, "adbmeta_basic_test9: " ANSI_COLOR_RED "existing records were modified" ANSI_COLOR_RESET "\n");
+		}
+		close (f);
+		free (after);
+	}
+	free (before);
+
+	adbMetaRemove (test_many_insert[1].filename, test_many_insert[1].filesize, test_many_insert[1].SIG);
+	adbMetaCommit ();
+	size3 = adbmeta_filesize ();
+	/* 'R' + "foo 12\0" + "test\0" + filesize */
+	if (size3 != size2 + 1 + 7 + 5 + 8)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test9: " ANSI_COLOR_RED "file grew from %ld to %ld bytes, expected a remove record to be appended" ANSI_COLOR_RESET "\n", (long)size2, (long)size3);
+	}
+	adbMetaClose ();
+
+	/* replay the log */
+	adbMetaInit();
+	if (adbMetaCount != 2)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test9: " ANSI_COLOR_RED "adbMetaCount != 2" ANSI_COLOR_RESET "\n");
+	}
+	retval |= adbmeta_verify ("adbmeta_basic_test9", test_many_expect, 2);
+	adbMetaDirty = 0;
+	adbMetaClose ();
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	return retval;
+}
+
+static int adbmeta_basic_test10 (void)
+{
+	unsigned char data[4096];
+	struct adbMetaEntry_t expect = {"foo 10", 10, "test", sizeof (data), data};
+	int retval = 0;
+	off_t size;
+	int i;
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	adbmeta_silene_open_errors = 1;
+
+	adbMetaInit();
+	for (i=0; i < 600; i++)
+	{
+		memset (data, i, sizeof (data));
+		adbMetaAdd ("foo 10", 10, "test", data, sizeof (data));
+		adbMetaCommit ();
+	}
+	size = adbmeta_filesize ();
+	if (size > 2 * ADBMETA_COMPACT_MINIMUM + 2 * sizeof (data) + 1024)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test10: " ANSI_COLOR_RED "file is %ld bytes, replaced records are never compacted" ANSI_COLOR_RESET "\n", (long)size);
+	}
+	adbMetaClose ();
+
+	adbMetaInit();
+	retval |= adbmeta_verify ("adbmeta_basic_test10", &expect, 1);
+	adbMetaDirty = 0;
+	adbMetaClose ();
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	return retval;
+}
+
+static int adbmeta_basic_test11 (void)
+{
+const struct adbMetaEntry_t test_many_expect[2] = {
+	{"foo 11", 11, "test", 6, (unsigned char *)"moomo1"},
+	{"foo 12", 12, "test", 6, (unsigned char *)"moomo2"},
+};
+	int retval = 0;
+	int f;
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	adbmeta_silene_open_errors = 1;
+
+	adbMetaInit();
+	adbMetaAdd (test_many_expect[0].filename, test_many_expect[0].filesize, test_many_expect[0].SIG, test_many_expect[0].data, test_many_expect[0].datasize);
+	adbMetaClose ();
+
+	/* simulate a crash while a record was appended */
+	f = open ("/tmp/CPARCMETA.DAT", O_WRONLY | O_APPEND);
+	if (write (f, "Afoo 99\0test\0\0\0", 15) != 15)
+	{
+		retval |= 1;
+	}
+	close (f);
+
+	adbMetaInit();
+	if (adbMetaCount != 1)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test11: " ANSI_COLOR_RED "adbMetaCount != 1 after loading a file with a broken record at the end" ANSI_COLOR_RESET "\n");
+	}
+	adbMetaAdd (test_many_expect[1].filename, test_many_expect[1].filesize, test_many_expect[1].SIG, test_many_expect[1].data, test_many_expect[1].datasize);
+	adbMetaClose ();
+
+	adbMetaInit();
+	if (adbMetaCount != 2)
+	{
+		retval |= 1;
+		fprintf (stderr, "adbmeta_basic_test11: " ANSI_COLOR_RED "adbMetaCount != 2, the broken record was not replaced" ANSI_COLOR_RESET "\n");
+	}
+	retval |= adbmeta_verify ("adbmeta_basic_test11", test_many_expect, 2);
+	adbMetaDirty = 0;
+	adbMetaClose ();
+
+	unlink ("/tmp/CPARCMETA.DAT");
+
+	return retval;
+}
+
 int main(int argc, char *argv[])
 {
 	int retval = 0;
@@ -788,7 +934,7 @@ int main(int argc, char *argv[])
 	fprintf (stderr, ANSI_COLOR_CYAN "Testing adbMetaInit()" ANSI_COLOR_RESET "\n");
 	retval |= adbmeta_basic_test1();
 
-	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaCommit()" ANSI_COLOR_RESET "\n");
+	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaCommit() // conversion into a log" ANSI_COLOR_RESET "\n");
 	retval |= adbmeta_basic_test2();
 
 	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaAdd() // simple insertion, all unique data" ANSI_COLOR_RESET "\n");
@@ -809,5 +955,14 @@ int main(int argc, char *argv[])
 	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaGet() // fetching back" ANSI_COLOR_RESET "\n");
 	retval |= adbmeta_basic_test8();
 
+	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaCommit() // appending to the log" ANSI_COLOR_RESET "\n");
+	retval |= adbmeta_basic_test9();
+
+	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaCommit() // compaction" ANSI_COLOR_RESET "\n");
+	retval |= adbmeta_basic_test10();
+
+	fprintf (stderr, "\n" ANSI_COLOR_CYAN "Testing adbMetaInit() // broken record at the end of the log" ANSI_COLOR_RESET "\n");
+	retval |= adbmeta_basic_test11();
+
 	return retval;
 }
@@ -23,8 +23,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -36,6 +38,10 @@
  #define ADBMETA_SILENCE_OPEN_ERRORS 0
 #endif
 
+#ifndef ADBMETA_COMPACT_MINIMUM
+ #define ADBMETA_COMPACT_MINIMUM (1024*1024) /* do not rewrite the file before this many bytes are wasted by old records */
+#endif
+
 const char adbMetaTag[16] = "OCPArchiveMeta\x1b\x00";
 /*
  16 bytes header
@@ -49,6 +55,23 @@ const char adbMetaTag[16] = "OCPArchiveMeta\x1b\x00";
   
  */
 
+const char adbMetaTagLog[16] = "OCPArchiveMeta\x1b\x01";
+/*
+ 16 bytes header
+
+ records until end of file:
+  1 byte  'A' (add/replace) or 'R' (remove)
+  X bytes FILENAME\0
+  X bytes SIG\0
+  8 bytes filesize
+  4 bytes datasize  ('A' only)
+  X bytes data      ('A' only)
+
+ Commits append new records to the end of the file. Once the replaced and
+ removed records use more space than the live ones, the file is rewritten.
+ A record that was cut short is ignored, and overwritten by the next commit.
+ */
+
 struct adbMetaHeader
 {
 	char Signature[16];
@@ -62,14 +85,129 @@ struct adbMetaEntry_t
 	char          *SIG;
 	uint32_t       datasize;
 	unsigned char *data;
+
+	uint32_t       hash;
+	uint32_t       disksize;  /* size of the record in the file, 0 if not written yet */
+	uint8_t        keyondisk; /* an older record with the same key is still in the file */
 };
 
-static struct adbMetaEntry_t **adbMetaEntries;
+static struct adbMetaEntry_t **adbMetaEntries; /* not sorted */
 static uint_fast32_t           adbMetaCount;
 static uint_fast32_t           adbMetaSize; /* slots allocated */
+static uint32_t               *adbMetaHash; /* index into adbMetaEntries, UINT32_MAX if unused */
+static uint_fast32_t           adbMetaHashSize; /* power of two */
 static char                   *adbMetaPath;
 static uint8_t                 adbMetaDirty;
 
+static uint8_t                *adbMetaMap; /* entries loaded by adbMetaInit() point into this */
+static size_t                  adbMetaMapSize;
+static int                     adbMetaMapIsMalloc;
+
+static uint64_t                adbMetaLogSize; /* valid data in the file, new records are appended here. 0 if the file needs to be rewritten */
+static uint64_t                adbMetaLogDead; /* bytes used by records that are replaced or removed */
+static uint8_t                *adbMetaPendingRemove; /* 'R' records waiting for adbMetaCommit() */
+static size_t                  adbMetaPendingRemoveFill;
+static size_t                  adbMetaPendingRemoveSize;
+
+static uint32_t adbMetaHashKey (const char *filename, uint64_t filesize, const char *SIG)
+{ /* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	int i;
+
+	for (; *filename; filename++)
+	{
+		hash = (hash ^ (uint8_t)*filename) * 0x01000193;
+	}
+	hash = (hash ^ 0) * 0x01000193;
+	for (; *SIG; SIG++)
+	{
+		hash = (hash ^ (uint8_t)*SIG) * 0x01000193;
+	}
+	for (i=0; i < 8; i++)
+	{
+		hash = (hash ^ (uint8_t)(filesize >> (i * 8))) * 0x01000193;
+	}
+	return hash;
+}
+
+/* returns the slot in adbMetaHash that holds the entry, or the empty slot where it would be inserted */
+static uint_fast32_t adbMetaHashFind (const char *filename, uint64_t filesize, const char *SIG, uint32_t hash)
+{
+	uint_fast32_t slot;
+
+	for (slot = hash & (adbMetaHashSize - 1); adbMetaHash[slot] != UINT32_MAX; slot = (slot + 1) & (adbMetaHashSize - 1))
+	{
+		struct adbMetaEntry_t *e = adbMetaEntries[adbMetaHash[slot]];
+		if ((e->hash == hash) && (e->filesize == filesize) && !strcmp (e->filename, filename) && !strcmp (e->SIG, SIG))
+		{
+			break;
+		}
+	}
+	return slot;
+}
+
+static uint_fast32_t adbMetaHashFindIndex (uint32_t index)
+{
+	uint_fast32_t slot;
+
+	for (slot = adbMetaEntries[index]->hash & (adbMetaHashSize - 1); adbMetaHash[slot] != index; slot = (slot + 1) & (adbMetaHashSize - 1))
+	{
+		assert (adbMetaHash[slot] != UINT32_MAX);
+	}
+	return slot;
+}
+
+static int adbMetaHashGrow (void)
+{
+	uint_fast32_t newsize = adbMetaHashSize ? adbMetaHashSize * 2 : 256;
+	uint32_t *newhash;
+	uint_fast32_t i;
+
+	newhash = malloc (newsize * sizeof (newhash[0]));
+	if (!newhash)
+	{
+		return -1;
+	}
+	memset (newhash, 0xff, newsize * sizeof (newhash[0]));
+	free (adbMetaHash);
+	adbMetaHash = newhash;
+	adbMetaHashSize = newsize;
+
+	for (i=0; i < adbMetaCount; i++)
+	{
+		adbMetaHash[adbMetaHashFind (adbMetaEntries[i]->filename, adbMetaEntries[i]->filesize, adbMetaEntries[i]->SIG, adbMetaEntries[i]->hash)] = i;
+	}
+	return 0;
+}
+
+/* the entry in slot must already be released */
+static void adbMetaHashDelete (uint_fast32_t slot)
+{
+	uint32_t index = adbMetaHash[slot];
+	uint_fast32_t next;
+
+	/* backward shift deletion, so no tombstones are needed */
+	for (next = (slot + 1) & (adbMetaHashSize - 1); adbMetaHash[next] != UINT32_MAX; next = (next + 1) & (adbMetaHashSize - 1))
+	{
+		uint_fast32_t home = adbMetaEntries[adbMetaHash[next]]->hash & (adbMetaHashSize - 1);
+		if (((next - home) & (adbMetaHashSize - 1)) >= ((next - slot) & (adbMetaHashSize - 1)))
+		{
+			adbMetaHash[slot] = adbMetaHash[next];
+			slot = next;
+		}
+	}
+	adbMetaHash[slot] = UINT32_MAX;
+
+	/* keep adbMetaEntries packed */
+	adbMetaCount--;
+	if (index != adbMetaCount)
+	{
+		adbMetaHash[adbMetaHashFindIndex (adbMetaCount)] = index;
+		adbMetaEntries[index] = adbMetaEntries[adbMetaCount];
+	}
+	adbMetaEntries[adbMetaCount] = 0;
+}
+
 static struct adbMetaEntry_t *adbMetaInit_CreateBlob (const char          *filename,
                                                       uint64_t             filesize,
                                                       const char          *signature,
@@ -80,12 +218,7 @@ static struct adbMetaEntry_t *adbMetaInit_CreateBlob (const char          *filen
 
 	long filename_length_sizeof = strlen (filename) + 1;
 	long signature_length_sizeof = strlen (signature) + 1;
-#if 0
-/* the famous standard power-of-two rounding up */
-#define _LONGSIZE(n) ((n + sizeof(long) - 1) & ~(sizeof(long) - 1))
-	filename_length_sizeof = _LONGSIZE (filename_length_sizeof + 1);
-	signature_length_sizeof = _LONGSIZE (signature_length_sizeof + 1);
-#endif
+
 	retval = calloc (sizeof (*retval) +
                          filename_length_sizeof +
                          signature_length_sizeof +
@@ -105,6 +238,7 @@ static struct adbMetaEntry_t *adbMetaInit_CreateBlob (const char          *filen
 	retval->SIG      = retval->filename + filename_length_sizeof;
 	retval->data     = (unsigned char *)(retval->SIG) + signature_length_sizeof;
 	retval->datasize = datasize;
+	retval->hash     = adbMetaHashKey (filename, filesize, signature);
 
 	strcpy (retval->filename, filename);
 	strcpy (retval->SIG, signature);
@@ -113,115 +247,179 @@ static struct adbMetaEntry_t *adbMetaInit_CreateBlob (const char          *filen
 	return retval;
 }
 
-static int adbMetaInit_ParseFd (const int f)
+/* entries loaded from the file, the strings and data are kept in the mapping */
+static struct adbMetaEntry_t *adbMetaInit_CreateMapped (char          *filename,
+                                                        uint64_t       filesize,
+                                                        char          *signature,
+                                                        unsigned char *data,
+                                                        uint32_t       datasize,
+                                                        uint32_t       disksize)
 {
-	/* record counter */
-	uint_fast32_t counter;
-	/* read buffer */
-	uint_fast32_t fill;
-	uint_fast32_t size;
-	uint8_t *data;
+	struct adbMetaEntry_t *retval = calloc (sizeof (*retval), 1);
 
-	fill = 0;
-	size = 65536;
-	data = malloc (size);
-	if (!data)
+	if (!retval)
 	{
-		fprintf (stderr, "adbMetaInit: malloc() readbuffer failed\n");
-		return -1;
+		return 0;
+	}
+	retval->filename = filename;
+	retval->filesize = filesize;
+	retval->SIG      = signature;
+	retval->data     = data;
+	retval->datasize = datasize;
+	retval->hash     = adbMetaHashKey (filename, filesize, signature);
+	retval->disksize = disksize;
+	return retval;
+}
+
+/* stores entry, replacing an existing one with the same key. Returns the replaced entry (caller must free it), or 0 */
+static int adbMetaStore (struct adbMetaEntry_t *entry, struct adbMetaEntry_t **replaced)
+{
+	uint_fast32_t slot;
+
+	*replaced = 0;
+
+	if ((adbMetaCount + 1) * 2 > adbMetaHashSize)
+	{
+		if (adbMetaHashGrow ())
+		{
+			fprintf (stderr, "adbMetaAdd: error allocating memory for index\n");
+			return -1;
+		}
 	}
 
-	for (counter = 0; counter < adbMetaSize; counter++)
+	slot = adbMetaHashFind (entry->filename, entry->filesize, entry->SIG, entry->hash);
+	if (adbMetaHash[slot] != UINT32_MAX)
+	{
+		*replaced = adbMetaEntries[adbMetaHash[slot]];
+		adbMetaEntries[adbMetaHash[slot]] = entry;
+		return 0;
+	}
+
+	if (adbMetaCount >= adbMetaSize)
+	{
+		struct adbMetaEntry_t **r;
+		uint_fast32_t newsize = adbMetaSize ? adbMetaSize * 2 : 64;
+		r = realloc (adbMetaEntries, newsize * sizeof (adbMetaEntries[0]));
+		if (!r)
+		{
+			fprintf (stderr, "adbMetaAdd: error allocating memory for index\n");
+			return -1;
+		}
+		adbMetaEntries = r;
+		adbMetaSize = newsize;
+	}
+	adbMetaEntries[adbMetaCount] = entry;
+	adbMetaHash[slot] = adbMetaCount;
+	adbMetaCount++;
+	return 0;
+}
+
+static int adbMetaInit_ParseV1 (uint8_t *data, size_t size)
+{
+	uint_fast32_t entries, counter;
+	size_t offset = 20;
+
+	entries = ((uint_fast32_t)data[16] << 24) |
+	          ((uint_fast32_t)data[17] << 16) |
+	          ((uint_fast32_t)data[18] << 8) |
+	          ((uint_fast32_t)data[19]);
+
+	for (counter = 0; counter < entries; counter++)
 	{
-		uint_fast32_t offset;
+		struct adbMetaEntry_t *e, *replaced;
+		char *filename, *signature;
+		uint8_t *eos;
 		uint_fast64_t filesize;
 		uint_fast32_t datasize;
 
-		/* char *filename == data */
-		char *signature;
+		filename = (char *)data + offset;
+		if (!(eos = memchr (data + offset, 0, size - offset)))
+		{
+			break;
+		}
+		offset = eos - data + 1;
+		signature = (char *)data + offset;
+		if (!(eos = memchr (data + offset, 0, size - offset)))
+		{
+			break;
+		}
+		offset = eos - data + 1;
+		if (offset + 12 > size)
+		{
+			break;
+		}
+		filesize = ((uint_fast64_t)data[offset+0] << 56) |
+		           ((uint_fast64_t)data[offset+1] << 48) |
+		           ((uint_fast64_t)data[offset+2] << 40) |
+		           ((uint_fast64_t)data[offset+3] << 32) |
+		           ((uint_fast64_t)data[offset+4] << 24) |
+		           ((uint_fast64_t)data[offset+5] << 16) |
+		           ((uint_fast64_t)data[offset+6] << 8) |
+		           ((uint_fast64_t)data[offset+7]);
+		datasize = ((uint_fast32_t)data[offset+8] << 24) |
+		           ((uint_fast32_t)data[offset+9] << 16) |
+		           ((uint_fast32_t)data[offset+10] << 8) |
+		           ((uint_fast32_t)data[offset+11]);
+		offset += 12;
+		if (offset + datasize > size)
+		{
+			break;
+		}
 
-#ifdef ADBMETA_DEBUG
-		fprintf (stderr, "adbMeta: attempt to parse entry %d/%d\n", (int)counter + 1, (int)adbMetaSize);
-#endif
-		if (fill < 16)
+		e = adbMetaInit_CreateMapped (filename, filesize, signature, data + offset, datasize, 0);
+		if ((!e) || adbMetaStore (e, &replaced))
 		{
-			int result;
-fillmore:
-			if (fill == size)
-			{
-				uint8_t *temp;
-				size += 65536;
-				temp = realloc (data, size);
-				if (!temp)
-				{
-					fprintf (stderr, "realloc() readbuffer failed\n");
-					adbMetaCount = counter;
-					free (data);
-					return 1;
-				}
-#ifdef ADBMETA_DEBUG
-				fprintf (stderr, "adbMeta: increased buffer size up to %d bytes\n", (int)size);
-#endif
-				data = temp;
-			}
-			result = size - fill;
-			if (result > 65536) result = 65536;
-			result = read (f, data + fill, result);
-			if (result < 0)
-			{
-				perror ("adbMetaInit: read");
-				adbMetaCount = counter;
-				free (data);
-				return 1;
-			}
-			if (result == 0)
-			{
-				fprintf (stderr, "ran out of data\n");
-				adbMetaCount = counter;
-				free (data);
-				return 1;
-			}
-			fill += result;
-#ifdef ADBMETA_DEBUG
-			fprintf (stderr, "adbMeta: input buffer is filled with %d (of %d possible)\n", (int)fill, (int)size);
-#endif
+			fprintf (stderr, "adbMetaInit: failed to allocate memory for entry #%ld\n", (long)counter);
+			free (e);
+			return -1;
 		}
+		free (replaced);
+		offset += datasize;
+	}
+
+	if (counter != entries)
+	{
+		fprintf (stderr, "ran out of data\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int adbMetaInit_ParseV2 (uint8_t *data, size_t size)
+{
+	size_t offset = 16;
 
-/* filename always start at data + 0 */
-		for (offset = 0; ; offset++)
+	adbMetaLogSize = offset;
+	while (offset < size)
+	{
+		struct adbMetaEntry_t *e, *replaced;
+		char *filename, *signature;
+		uint8_t *eos;
+		uint8_t type = data[offset];
+		uint_fast64_t filesize;
+		uint_fast32_t datasize;
+		size_t start = offset;
+
+		if ((type != 'A') && (type != 'R'))
 		{
-			if (offset >= fill)
-			{
-				goto fillmore;
-			}
-			if (data[offset])
-			{
-				continue;
-			}
-			//filename_length = offset;
-			offset++;
 			break;
 		}
+		offset++;
+		filename = (char *)data + offset;
+		if (!(eos = memchr (data + offset, 0, size - offset)))
+		{
+			break;
+		}
+		offset = eos - data + 1;
 		signature = (char *)data + offset;
-
-		for (; ; offset++)
+		if (!(eos = memchr (data + offset, 0, size - offset)))
 		{
-			if (offset >= fill)
-			{
-				goto fillmore;
-			}
-			if (data[offset])
-			{
-				continue;
-			}
-			//signature_length = (data + offset) - signature;
-			offset++;
 			break;
 		}
-
-		if (offset + 12 > fill)
+		offset = eos - data + 1;
+		if (offset + ((type == 'A') ? 12 : 8) > size)
 		{
-			goto fillmore;
+			break;
 		}
 		filesize = ((uint_fast64_t)data[offset+0] << 56) |
 		           ((uint_fast64_t)data[offset+1] << 48) |
@@ -232,45 +430,60 @@ fillmore:
 		           ((uint_fast64_t)data[offset+6] << 8) |
 		           ((uint_fast64_t)data[offset+7]);
 		offset += 8;
-		datasize = ((uint_fast64_t)data[offset+0] << 24) |
-		           ((uint_fast64_t)data[offset+1] << 16) |
-		           ((uint_fast64_t)data[offset+2] << 8) |
-		           ((uint_fast64_t)data[offset+3]);
-		offset += 4;
 
-		if (offset + datasize > fill)
+		if (type == 'R')
 		{
-			goto fillmore;
+			uint32_t hash = adbMetaHashKey (filename, filesize, signature);
+			uint_fast32_t slot;
+
+			adbMetaLogDead += offset - start;
+			if (adbMetaHashSize && (adbMetaHash[slot = adbMetaHashFind (filename, filesize, signature, hash)] != UINT32_MAX))
+			{
+				adbMetaLogDead += adbMetaEntries[adbMetaHash[slot]]->disksize;
+				free (adbMetaEntries[adbMetaHash[slot]]);
+				adbMetaHashDelete (slot);
+			}
+			adbMetaLogSize = offset;
+			continue;
 		}
 
-		adbMetaEntries[counter] = adbMetaInit_CreateBlob ((char *)data,
-		                                                  filesize,
-		                                                  signature,
-		                                                  data + offset,
-		                                                  datasize);
-		if (!adbMetaEntries[counter])
+		datasize = ((uint_fast32_t)data[offset+0] << 24) |
+		           ((uint_fast32_t)data[offset+1] << 16) |
+		           ((uint_fast32_t)data[offset+2] << 8) |
+		           ((uint_fast32_t)data[offset+3]);
+		offset += 4;
+		if (offset + datasize > size)
 		{
-			fprintf (stderr, "adbMetaInit: failed to allocate memory for entry #%ld\n", (long)counter);
-			adbMetaCount = counter;
-			free (data);
-			return -1;
+			break;
 		}
-
 		offset += datasize;
 
-		memmove (data, data + offset, fill - offset);
-		fill -= offset;
+		e = adbMetaInit_CreateMapped (filename, filesize, signature, data + offset - datasize, datasize, offset - start);
+		if ((!e) || adbMetaStore (e, &replaced))
+		{
+			fprintf (stderr, "adbMetaInit: failed to allocate memory for entry\n");
+			free (e);
+			return -1;
+		}
+		if (replaced)
+		{
+			adbMetaLogDead += replaced->disksize;
+			free (replaced);
+		}
+		adbMetaLogSize = offset;
 	}
-	adbMetaCount = counter;
-	free (data);
 
+	if (adbMetaLogSize != size)
+	{
+		fprintf (stderr, "adbMetaInit: ignoring %ld bytes of broken data at the end of the file\n", (long)(size - adbMetaLogSize));
+	}
 	return 0;
 }
 
 int adbMetaInit (void)
 {
 	int f, retval;
-	struct adbMetaHeader header;
+	struct stat st;
 
 	adbMetaPath = malloc(strlen(cfConfigDir)+13+1);
 	if (!adbMetaPath)
@@ -292,88 +505,281 @@ int adbMetaInit (void)
 
 	fprintf(stderr, "Loading %s ..\n", adbMetaPath);
 
-	if (read(f, &header, sizeof (header)) != sizeof (header))
+	if (fstat (f, &st) || (st.st_size < 16))
 	{
 		fprintf (stderr, "No header\n");
 		close (f);
 		return 1;
 	}
 
-	if (memcmp (header.Signature, adbMetaTag, 16))
+	/* entries refer directly into the mapping, so only the index is built up-front */
+	adbMetaMapSize = st.st_size;
+	adbMetaMap = mmap (0, adbMetaMapSize, PROT_READ, MAP_SHARED, f, 0);
+	if (adbMetaMap == MAP_FAILED)
 	{
+		size_t pos = 0;
+
+		adbMetaMapIsMalloc = 1;
+		adbMetaMap = malloc (adbMetaMapSize);
+		if (!adbMetaMap)
+		{
+			fprintf (stderr, "adbMetaInit: malloc() failed\n");
+			adbMetaMapSize = 0;
+			close (f);
+			return 1;
+		}
+		while (pos < adbMetaMapSize)
+		{
+			ssize_t res = read (f, adbMetaMap + pos, adbMetaMapSize - pos);
+			if (res <= 0)
+			{
+				perror ("adbMetaInit: read");
+				adbMetaMapSize = pos;
+				break;
+			}
+			pos += res;
+		}
+	}
+	close (f);
+
+	if (!memcmp (adbMetaMap, adbMetaTagLog, 16))
+	{
+		retval = adbMetaInit_ParseV2 (adbMetaMap, adbMetaMapSize);
+	} else if (!memcmp (adbMetaMap, adbMetaTag, 16) && (adbMetaMapSize >= sizeof (struct adbMetaHeader)))
+	{
+		retval = adbMetaInit_ParseV1 (adbMetaMap, adbMetaMapSize);
+		adbMetaLogSize = 0; /* convert into the new format on the next commit */
+	} else {
 		fprintf (stderr, "Invalid header\n");
-		close (f);
 		return 1;
 	}
 
-	adbMetaSize = uint32_big (header.entries);
-	if (!adbMetaSize)
+	return retval;
+}
+
+static int adbMetaCommit_Write (int f, const void *data, size_t len)
+{
+	while (len)
+	{
+		ssize_t res = write (f, data, len);
+		if (res < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		data = (const uint8_t *)data + res;
+		len -= res;
+	}
+	return 0;
+}
+
+/* record of the given type, without data */
+static size_t adbMetaCommit_Header (uint8_t *buffer, uint8_t type, const char *filename, uint64_t filesize, const char *SIG, uint32_t datasize)
+{
+	size_t len = 0;
+
+	buffer[len++] = type;
+	strcpy ((char *)buffer + len, filename);
+	len += strlen (filename) + 1;
+	strcpy ((char *)buffer + len, SIG);
+	len += strlen (SIG) + 1;
+	buffer[len++] = filesize >> 56;
+	buffer[len++] = filesize >> 48;
+	buffer[len++] = filesize >> 40;
+	buffer[len++] = filesize >> 32;
+	buffer[len++] = filesize >> 24;
+	buffer[len++] = filesize >> 16;
+	buffer[len++] = filesize >> 8;
+	buffer[len++] = filesize;
+	if (type == 'A')
 	{
-		close (f);
-		return 0;
+		buffer[len++] = datasize >> 24;
+		buffer[len++] = datasize >> 16;
+		buffer[len++] = datasize >> 8;
+		buffer[len++] = datasize;
 	}
-	adbMetaEntries = malloc (sizeof (adbMetaEntries[0]) * adbMetaSize);
-	if (!adbMetaEntries)
+	return len;
+}
+
+static size_t adbMetaCommit_HeaderSize (const char *filename, const char *SIG)
+{
+	return 1 + strlen (filename) + 1 + strlen (SIG) + 1 + 8 + 4;
+}
+
+static int adbMetaCommit_WriteEntry (int f, struct adbMetaEntry_t *e)
+{
+	uint8_t *buffer = malloc (adbMetaCommit_HeaderSize (e->filename, e->SIG));
+	size_t len;
+
+	if (!buffer)
 	{
-		fprintf (stderr, "malloc() failed\n");
-		close (f);
-		return 1;
+		return -1;
 	}
+	len = adbMetaCommit_Header (buffer, 'A', e->filename, e->filesize, e->SIG, e->datasize);
+	if (adbMetaCommit_Write (f, buffer, len) || adbMetaCommit_Write (f, e->data, e->datasize))
+	{
+		free (buffer);
+		return -1;
+	}
+	free (buffer);
+	return len + e->datasize;
+}
 
-	retval = adbMetaInit_ParseFd (f);
+/* write a new file with only the live entries and rename it into place */
+static void adbMetaCommit_Rewrite (void)
+{
+	char *pathtmp;
+	uint_fast32_t counter;
+	uint64_t logsize = 16;
+	int f;
 
+	pathtmp = malloc (strlen (adbMetaPath) + 4 + 1);
+	if (!pathtmp)
+	{
+		fprintf (stderr, "adbMetaCommit: malloc() failed\n");
+		return;
+	}
+	strcpy (pathtmp, adbMetaPath);
+	strcat (pathtmp, ".tmp");
+
+	if ((f = open (pathtmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+	{
+		perror ("adbMetaCommit: open(cfConfigDir/CPARCMETA.DAT.tmp)");
+		free (pathtmp);
+		return;
+	}
+
+	if (adbMetaCommit_Write (f, adbMetaTagLog, 16))
+	{
+		goto writeerror;
+	}
+	for (counter = 0; counter < adbMetaCount; counter++)
+	{
+		int len = adbMetaCommit_WriteEntry (f, adbMetaEntries[counter]);
+		if (len < 0)
+		{
+			goto writeerror;
+		}
+		logsize += len;
+	}
+	if (fsync (f))
+	{
+		goto writeerror;
+	}
 	close (f);
 
-	return retval;
+	if (rename (pathtmp, adbMetaPath))
+	{
+		perror ("adbMetaCommit: rename()");
+		unlink (pathtmp);
+		free (pathtmp);
+		return;
+	}
+	free (pathtmp);
+
+	/* the records in the new file are now the only ones */
+	for (counter = 0; counter < adbMetaCount; counter++)
+	{
+		adbMetaEntries[counter]->disksize = adbMetaCommit_HeaderSize (adbMetaEntries[counter]->filename, adbMetaEntries[counter]->SIG) + adbMetaEntries[counter]->datasize;
+		adbMetaEntries[counter]->keyondisk = 0;
+	}
+	adbMetaLogSize = logsize;
+	adbMetaLogDead = 0;
+	adbMetaPendingRemoveFill = 0;
+	adbMetaDirty = 0;
+	return;
+
+writeerror:
+	perror ("adbMetaCommit: write()");
+	close (f);
+	unlink (pathtmp);
+	free (pathtmp);
 }
 
 void adbMetaCommit (void)
 {
-	int f;
-	struct adbMetaHeader header;
-	/* record counter */
 	uint_fast32_t counter;
-
-	memcpy (header.Signature, adbMetaTag, sizeof (adbMetaTag));
-	header.entries = uint32_big (adbMetaCount);
+	uint64_t logsize;
+	struct stat st;
+	int f;
 
 	if ((!adbMetaPath) || (!adbMetaDirty))
 	{
 		return;
 	}
 
-	f = open(adbMetaPath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (!f)
+	if ((!adbMetaLogSize) || ((adbMetaLogDead > ADBMETA_COMPACT_MINIMUM) && (adbMetaLogDead > adbMetaLogSize - 16 - adbMetaLogDead)))
 	{
-		perror ("adbMetaCommit: open(cfConfigDir/CPARCMETA.DAT)");
+		adbMetaCommit_Rewrite ();
 		return;
 	}
 
-	if (write (f, &header, sizeof (header)) != sizeof (header)) { perror ("adbMetaCommit write #1"); };
+	if ((f = open (adbMetaPath, O_WRONLY)) < 0)
+	{ /* file is gone? */
+		adbMetaCommit_Rewrite ();
+		return;
+	}
+	if (fstat (f, &st) || (st.st_size < adbMetaLogSize))
+	{ /* file has been modified by someone else */
+		close (f);
+		adbMetaCommit_Rewrite ();
+		return;
+	}
+	if ((st.st_size > adbMetaLogSize) && ftruncate (f, adbMetaLogSize))
+	{ /* remove any broken record at the end */
+		perror ("adbMetaCommit: ftruncate()");
+		close (f);
+		return;
+	}
+	if (lseek (f, adbMetaLogSize, SEEK_SET) != adbMetaLogSize)
+	{
+		perror ("adbMetaCommit: lseek()");
+		close (f);
+		return;
+	}
 
-	for (counter = 0; counter < adbMetaCount; counter++)
+	logsize = adbMetaLogSize;
+	if (adbMetaPendingRemoveFill)
 	{
-		uint8_t buffer[12];
-		if (write (f, adbMetaEntries[counter]->filename, strlen (adbMetaEntries[counter]->filename) + 1) < 0) { perror ("adbMetaCommit write #2"); };
-		if (write (f, adbMetaEntries[counter]->SIG, strlen (adbMetaEntries[counter]->SIG) + 1) < 0) { perror ("adbMetaCommit write #3"); };
-		buffer[ 0] = adbMetaEntries[counter]->filesize >> 56;
-		buffer[ 1] = adbMetaEntries[counter]->filesize >> 48;
-		buffer[ 2] = adbMetaEntries[counter]->filesize >> 40;
-		buffer[ 3] = adbMetaEntries[counter]->filesize >> 32;
-		buffer[ 4] = adbMetaEntries[counter]->filesize >> 24;
-		buffer[ 5] = adbMetaEntries[counter]->filesize >> 16;
-		buffer[ 6] = adbMetaEntries[counter]->filesize >> 8;
-		buffer[ 7] = adbMetaEntries[counter]->filesize;
-		buffer[ 8] = adbMetaEntries[counter]->datasize >> 24;
-		buffer[ 9] = adbMetaEntries[counter]->datasize >> 16;
-		buffer[10] = adbMetaEntries[counter]->datasize >> 8;
-		buffer[11] = adbMetaEntries[counter]->datasize;
-		if (write (f, buffer, 12) != 12) { perror ("adbMetaCommit write #4"); };
-		if (write (f, adbMetaEntries[counter]->data, adbMetaEntries[counter]->datasize) != adbMetaEntries[counter]->datasize) { perror ("adbMetaCommit write #5"); };
+		if (adbMetaCommit_Write (f, adbMetaPendingRemove, adbMetaPendingRemoveFill))
+		{
+			goto writeerror;
+		}
+		logsize += adbMetaPendingRemoveFill;
 	}
+	for (counter = 0; counter < adbMetaCount; counter++)
+	{
+		int len;
 
+		if (adbMetaEntries[counter]->disksize)
+		{
+			continue;
+		}
+		len = adbMetaCommit_WriteEntry (f, adbMetaEntries[counter]);
+		if (len < 0)
+		{
+			goto writeerror;
+		}
+		logsize += len;
+		adbMetaEntries[counter]->disksize = len;
+		adbMetaEntries[counter]->keyondisk = 0;
+	}
 	close (f);
+
+	adbMetaLogDead += adbMetaPendingRemoveFill;
+	adbMetaPendingRemoveFill = 0;
+	adbMetaLogSize = logsize;
 	adbMetaDirty = 0;
+	return;
+
+writeerror:
+	perror ("adbMetaCommit: write()");
+	close (f);
+	/* we do not know how much that made it into the file, so write everything again next time */
+	adbMetaLogSize = 0;
 }
 
 void adbMetaClose (void)
@@ -388,150 +794,79 @@ void adbMetaClose (void)
 	free (adbMetaEntries);
 	adbMetaEntries = 0;
 	adbMetaCount = adbMetaSize = 0;
+	free (adbMetaHash);
+	adbMetaHash = 0;
+	adbMetaHashSize = 0;
+	if (adbMetaMap)
+	{
+		if (adbMetaMapIsMalloc)
+		{
+			free (adbMetaMap);
+		} else {
+			munmap (adbMetaMap, adbMetaMapSize);
+		}
+	}
+	adbMetaMap = 0;
+	adbMetaMapSize = 0;
+	adbMetaMapIsMalloc = 0;
+	free (adbMetaPendingRemove);
+	adbMetaPendingRemove = 0;
+	adbMetaPendingRemoveFill = adbMetaPendingRemoveSize = 0;
+	adbMetaLogSize = 0;
+	adbMetaLogDead = 0;
 	free (adbMetaPath);
 	adbMetaPath = 0;
 	adbMetaDirty = 0;
 }
 
-static uint32_t adbMetaBinarySearchFilesize (const size_t filesize)
+static struct adbMetaEntry_t *adbMetaLookup (const char *filename, const size_t filesize, const char *SIG, uint_fast32_t *slot)
 {
-	uint_fast32_t searchbase = 0, searchlen = adbMetaCount;
-
-//	fprintf (stderr, "\n SEARCH %d..\n", (int)filesize);
-
-	if (adbMetaCount == 0)
+	if (!adbMetaCount)
 	{
 		return 0;
 	}
-
-	while (searchlen > 1)
-	{
-		uint_fast32_t halfmark;
-
-//		int i;
-
-		halfmark = searchlen >> 1;
-
-//		for (i=0; i < searchlen; i++)
-//		{
-//			fprintf (stderr, " %d(%d)%s ", (int)(adbMetaEntries[searchbase + i]->filesize), (int)(searchbase + i), (i == halfmark)?"*":"");
-//		}
-//		fprintf (stderr, "\n");
-
-		if (filesize > adbMetaEntries[searchbase + halfmark]->filesize)
-		{
-			searchbase += halfmark;
-			searchlen -= halfmark;
-		} else {
-			searchlen = halfmark;
-		}
-
-//		for (i=0; i < searchlen; i++)
-//		{
-//			fprintf (stderr, " %d(%d) ", (int)(adbMetaEntries[searchbase + i]->filesize), (int)(searchbase + i));
-//		}
-//		fprintf (stderr, "\n\n");
-
-	}
-
-	/* fine-tune the position */
-	if (searchbase < adbMetaCount)
+	*slot = adbMetaHashFind (filename, filesize, SIG, adbMetaHashKey (filename, filesize, SIG));
+	if (adbMetaHash[*slot] == UINT32_MAX)
 	{
-/*
-		while (searchbase && (adbMetaEntries[searchbase]->filesize == filesize))
-		{
-			searchbase--;
-		}
-*/
-		if (adbMetaEntries[searchbase]->filesize < filesize)
-		{
-			searchbase++;
-		}
+		return 0;
 	}
-
-	return searchbase;
+	return adbMetaEntries[adbMetaHash[*slot]];
 }
 
 int adbMetaAdd (const char *filename, const size_t filesize, const char *SIG, const unsigned char *data, const size_t datasize)
 {
-	uint_fast32_t searchindex = adbMetaBinarySearchFilesize (filesize);
-	int_fast32_t search;
-	struct adbMetaEntry_t *temp;
+	struct adbMetaEntry_t *temp, *replaced;
+	uint_fast32_t slot;
 
 #ifdef ADBMETA_DEBUG
 	fprintf (stderr, "adbMetaAdd (\"%s\", %"PRId64", \"%s\", %p, %ld)\n", filename, filesize, SIG, data, datasize);
 #endif
 
-	if (searchindex == adbMetaCount)
-	{
-		goto DoInsert;
-	}
-
-	assert (adbMetaEntries[searchindex]->filesize >= filesize);
-
 	assert (datasize);
 
-	if (adbMetaEntries[searchindex]->filesize > filesize)
+	temp = adbMetaLookup (filename, filesize, SIG, &slot);
+	if (temp && (temp->datasize == datasize) && (!memcmp (temp->data, data, datasize)))
 	{
-		goto DoInsert;
-	}
-
-	for (search = searchindex; search < adbMetaCount; search++)
-	{
-		if (adbMetaEntries[search]->filesize != filesize)
-		{
-			break;
-		}
-		if (strcmp (adbMetaEntries[search]->filename, filename))
-		{
-			continue;
-		}
-		if (strcmp (adbMetaEntries[search]->SIG, SIG))
-		{
-			continue;
-		}
-		if ((adbMetaEntries[search]->datasize == datasize) && (!memcmp (adbMetaEntries[search]->data, data, datasize)))
-		{
-			return 0;
-		}
-
-		/* replace the entry */
-		temp = adbMetaInit_CreateBlob (filename, filesize, SIG, data, datasize);
-		if (!temp)
-		{
-			fprintf (stderr, "adbMetaAdd: error allocating memory for an entry\n");
-			return -1;
-		}
-		free (adbMetaEntries[search]);
-		adbMetaEntries[search] = temp;
-
-		adbMetaDirty = 1;
 		return 0;
 	}
 
-DoInsert:
-	if (adbMetaCount >= adbMetaSize)
-	{
-		struct adbMetaEntry_t **r;
-		r = realloc (adbMetaEntries, (adbMetaSize + 8) * sizeof (adbMetaEntries[0]));
-		if (!r)
-		{
-			fprintf (stderr, "adbMetaAdd: error allocating memory for index\n");
-			return -1;
-		}
-		adbMetaEntries = r;
-		adbMetaSize += 8;
-	}
-
 	temp = adbMetaInit_CreateBlob (filename, filesize, SIG, data, datasize);
 	if (!temp)
 	{
 		fprintf (stderr, "adbMetaAdd: error allocating memory for an entry\n");
 		return -1;
 	}
-	memmove (adbMetaEntries + searchindex + 1, adbMetaEntries + searchindex, (adbMetaCount - searchindex) * sizeof (adbMetaEntries[0]));
-	adbMetaEntries[searchindex] = temp;
-	adbMetaCount++;
+	if (adbMetaStore (temp, &replaced))
+	{
+		free (temp);
+		return -1;
+	}
+	if (replaced)
+	{ /* the new record in the file will supersede the old one */
+		adbMetaLogDead += replaced->disksize;
+		temp->keyondisk = replaced->keyondisk || replaced->disksize;
+		free (replaced);
+	}
 
 	adbMetaDirty = 1;
 
@@ -540,54 +875,48 @@ DoInsert:
 
 int adbMetaRemove (const char *filename, const size_t filesize, const char *SIG)
 {
-	uint_fast32_t searchindex = adbMetaBinarySearchFilesize (filesize);
-	int_fast32_t search;
+	struct adbMetaEntry_t *e;
+	uint_fast32_t slot;
 
 #ifdef ADBMETA_DEBUG
 	fprintf (stderr, "adbMetaRemove (\"%s\", %ld, \"%s\")\n", filename, filesize, SIG);
 #endif
 
-	if (searchindex == adbMetaCount)
+	e = adbMetaLookup (filename, filesize, SIG, &slot);
+	if (!e)
 	{
 		return 1; /* not found */
 	}
 
-	assert (adbMetaEntries[searchindex]->filesize >= filesize);
-
-	if (adbMetaEntries[searchindex]->filesize > filesize)
-	{
-		return 1; /* not found */
-	}
-
-	for (search = searchindex; search < adbMetaCount; search++)
-	{
-		if (adbMetaEntries[search]->filesize != filesize)
+	if (e->disksize || e->keyondisk)
+	{ /* a remove record is needed to cancel the one in the file */
+		size_t needed = adbMetaCommit_HeaderSize (filename, SIG);
+		if (adbMetaPendingRemoveFill + needed > adbMetaPendingRemoveSize)
 		{
-			return 1; /* not found */
-		}
-		if (strcmp (adbMetaEntries[search]->filename, filename))
-		{
-			continue;
-		}
-		if (strcmp (adbMetaEntries[search]->SIG, SIG))
-		{
-			continue;
+			size_t newsize = adbMetaPendingRemoveFill + needed + 1024;
+			uint8_t *temp = realloc (adbMetaPendingRemove, newsize);
+			if (!temp)
+			{
+				fprintf (stderr, "adbMetaRemove: error allocating memory\n");
+				return -1;
+			}
+			adbMetaPendingRemove = temp;
+			adbMetaPendingRemoveSize = newsize;
 		}
-
-		free (adbMetaEntries[search]);
-		memmove (adbMetaEntries + search, adbMetaEntries + search + 1, (adbMetaCount - search - 1) * sizeof (adbMetaEntries[0]));
-		adbMetaCount--;
-		adbMetaDirty = 1;
-		return 0;
+		adbMetaPendingRemoveFill += adbMetaCommit_Header (adbMetaPendingRemove + adbMetaPendingRemoveFill, 'R', filename, filesize, SIG, 0);
+		adbMetaLogDead += e->disksize;
 	}
 
-	return 1; /* not found */
+	free (e);
+	adbMetaHashDelete (slot);
+	adbMetaDirty = 1;
+	return 0;
 }
 
 int adbMetaGet (const char *filename, const size_t filesize, const char *SIG, unsigned char **data, size_t *datasize)
 {
-	uint_fast32_t searchindex = adbMetaBinarySearchFilesize (filesize);
-	int_fast32_t search;
+	struct adbMetaEntry_t *e;
+	uint_fast32_t slot;
 
 #ifdef ADBMETA_DEBUG
 	fprintf (stderr, "adbMetaGet (\"%s\", %"PRId64", \"%s\") ", filename, filesize, SIG);
@@ -596,60 +925,26 @@ int adbMetaGet (const char *filename, const size_t filesize, const char *SIG, un
 	*data = 0;
 	*datasize = 0;
 
-	if (searchindex == adbMetaCount)
-	{
-#ifdef ADBMETA_DEBUG
-		fprintf (stderr, " => NULL #1\n");
-#endif
-		return 1; /* not found */
-	}
-
-	assert (adbMetaEntries[searchindex]->filesize >= filesize);
-
-	if (adbMetaEntries[searchindex]->filesize > filesize)
+	e = adbMetaLookup (filename, filesize, SIG, &slot);
+	if (!e)
 	{
 #ifdef ADBMETA_DEBUG
-		fprintf (stderr, " => NULL #2\n");
+		fprintf (stderr, " => NULL\n");
 #endif
 		return 1; /* not found */
 	}
 
-	for (search = searchindex; search < adbMetaCount; search++)
+	*data = malloc (e->datasize);
+	if (!*data)
 	{
-		if (adbMetaEntries[search]->filesize != filesize)
-		{
-#ifdef ADBMETA_DEBUG
-		fprintf (stderr, " => NULL #3\n");
-#endif
-			return 1; /* not found */
-		}
-		if (strcmp (adbMetaEntries[search]->filename, filename))
-		{
-			continue;
-		}
-		if (strcmp (adbMetaEntries[search]->SIG, SIG))
-		{
-			continue;
-		}
-
-		*data = malloc (adbMetaEntries[search]->datasize);
-		if (!*data)
-		{
-			fprintf (stderr, "adbMetaGet: failed to allocate memory for BLOB\n");
-			return -1;
-		}
-		memcpy (*data, adbMetaEntries[search]->data, adbMetaEntries[search]->datasize);
-		*datasize = adbMetaEntries[search]->datasize;
-
-#ifdef ADBMETA_DEBUG
-		fprintf (stderr, " => %p %ld\n", *data, *datasize);
-#endif
-		return 0;
+		fprintf (stderr, "adbMetaGet: failed to allocate memory for BLOB\n");
+		return -1;
 	}
-
+	memcpy (*data, e->data, e->datasize);
+	*datasize = e->datasize;
 
 #ifdef ADBMETA_DEBUG
-	fprintf (stderr, " => NULL #4\n");
+	fprintf (stderr, " => %p %ld\n", *data, *datasize);
 #endif
-	return 1; /* not found */
+	return 0;
 }
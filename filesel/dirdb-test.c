@@ -22,11 +22,9 @@ uint32_t utf8_decode (const char *_src, size_t srclen, int *inc)
 
 static void clear_dirdb()
 {
-	int i;
-	for (i=0; i < dirdbNum; i++)
-	{
-		free(dirdbData[i].name);
-	}
+	dirdbPathCacheClear ();
+	dirdbMdbNodesClear ();
+	dirdbStringClear ();
 	free (dirdbData);
 	dirdbData=0;
 	dirdbNum=0;
@@ -1071,6 +1069,468 @@ static int dirdb_basic_test8(void)
 	return retval;
 }
 
+static int dirdb_basic_test9(void)
+{
+	/* layout used before names were moved into the string arena */
+	struct dirdbEntry_legacy
+	{
+		uint32_t parent;
+		uint32_t next;
+		uint32_t child;
+		uint32_t mdb_ref;
+		char *name;
+		int refcount;
+		uint32_t newmdb_ref;
+	};
+	int retval = 0;
+	uint32_t drive, dir1, dir2, node;
+	int i, j, k;
+	size_t legacy_strings = 0, legacy_nodes, nodes, strings;
+	uint32_t used = 0;
+	char name[64];
+	const char *tmp;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "Memory usage of dirdb with 200000 nodes\n" ANSI_COLOR_RESET);
+
+	drive = dirdbFindAndRef (DIRDB_NOPARENT, "file:", dirdb_use_dir);
+	for (i=0; i < 20; i++)
+	{
+		snprintf (name, sizeof (name), "Artist %02d", i);
+		dir1 = dirdbFindAndRef (drive, name, dirdb_use_dir);
+		for (j=0; j < 50; j++)
+		{
+			snprintf (name, sizeof (name), "CD%d", j); /* these names repeat, and are shared */
+			dir2 = dirdbFindAndRef (dir1, name, dirdb_use_dir);
+			for (k=0; k < 200; k++)
+			{
+				snprintf (name, sizeof (name), "%02d-%02d-%03d some song title.mod", i, j, k);
+				node = dirdbFindAndRef (dir2, name, dirdb_use_file);
+				if (node == DIRDB_NOPARENT)
+				{
+					retval++;
+				}
+			}
+			dirdbUnref (dir2, dirdb_use_dir);
+		}
+		dirdbUnref (dir1, dirdb_use_dir);
+	}
+	dirdbUnref (drive, dirdb_use_dir);
+
+	for (i=0; i < dirdbNum; i++)
+	{
+		if (dirdbData[i].name)
+		{
+			size_t len = strlen (dirdbStringGet (dirdbData[i].name)) + 1;
+			/* estimate glibc malloc() overhead: 8 bytes header, 16 byte alignment, 32 bytes minimum */
+			len = (len + 8 + 15) & ~15;
+			legacy_strings += (len < 32) ? 32 : len;
+			used++;
+		}
+	}
+	legacy_nodes = (size_t)dirdbNum * sizeof (struct dirdbEntry_legacy);
+	nodes = (size_t)dirdbNum * sizeof (struct dirdbEntry);
+	strings = (size_t)dirdbStringChunksCount * DIRDB_STRING_CHUNK_SIZE + (size_t)dirdbStringHashSize * sizeof (uint32_t);
+
+	fprintf (stderr, "nodes in use: %u\n", (unsigned int)used);
+	fprintf (stderr, "before (node array + malloc() per name): %8lu + %8lu = %8lu bytes\n", (unsigned long)legacy_nodes, (unsigned long)legacy_strings, (unsigned long)(legacy_nodes + legacy_strings));
+	fprintf (stderr, "after  (node array + string arena):      %8lu + %8lu = %8lu bytes\n", (unsigned long)nodes, (unsigned long)strings, (unsigned long)(nodes + strings));
+
+	if ((nodes + strings) >= (legacy_nodes + legacy_strings))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "string arena did not reduce memory usage\n" ANSI_COLOR_RESET);
+		retval++;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "string arena reduced memory usage\n" ANSI_COLOR_RESET);
+	}
+
+	node = dirdbResolvePathAndRef ("file:/Artist 07/CD3/07-03-123 some song title.mod", dirdb_use_file);
+	dirdbGetName_internalstr (node, &tmp);
+	if ((!tmp) || strcmp (tmp, "07-03-123 some song title.mod") || (dirdbData[node].refcount != 2))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "Failed to find node after bulk insert\n" ANSI_COLOR_RESET);
+		retval++;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "Found node after bulk insert\n" ANSI_COLOR_RESET);
+	}
+	dirdbUnref (node, dirdb_use_file);
+
+	/* shared directory names must stay alive as long as one user is left */
+	node = dirdbResolvePathAndRef ("file:/Artist 00/CD3", dirdb_use_dir);
+	for (k=0; k < 200; k++)
+	{
+		snprintf (name, sizeof (name), "00-03-%03d some song title.mod", k);
+		dir1 = dirdbFindAndRef (node, name, dirdb_use_file);
+		dirdbUnref (dir1, dirdb_use_file);
+		dirdbUnref (dir1, dirdb_use_file);
+	}
+	dirdbGetName_internalstr (node, &tmp);
+	if ((!tmp) || strcmp (tmp, "CD3") || (dirdbData[node].refcount != 1) || (dirdbStringRefCount (dirdbData[node].name) != 20))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "Shared name was not kept correctly when a sibling tree was removed\n" ANSI_COLOR_RESET);
+		retval++;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "Shared name was kept correctly when a sibling tree was removed\n" ANSI_COLOR_RESET);
+	}
+	dirdbUnref (node, dirdb_use_dir);
+
+	clear_dirdb();
+
+	fprintf (stderr, "\n");
+
+	return retval;
+}
+
+static int dirdb_basic_test10_verify (const char *path, uint32_t expected_mdb_ref)
+{
+	uint32_t node;
+	int retval = 0;
+
+	node = dirdbResolvePathAndRef (path, dirdb_use_file);
+	if ((node == DIRDB_NOPARENT) || (dirdbData[node].mdb_ref != expected_mdb_ref) || (dirdbData[node].refcount != (expected_mdb_ref == DIRDB_NO_MDBREF ? 1 : 2)))
+	{
+		fprintf (stderr, "%s " ANSI_COLOR_RED "not restored correctly" ANSI_COLOR_RESET "\n", path);
+		retval++;
+	} else {
+		fprintf (stderr, "%s " ANSI_COLOR_GREEN "restored" ANSI_COLOR_RESET "\n", path);
+	}
+	dirdbUnref (node, dirdb_use_file);
+	return retval;
+}
+
+static int dirdb_basic_test10(void)
+{
+	int retval = 0;
+	char tempdir[] = "/tmp/dirdb-test-XXXXXX";
+	char *olddir = cfConfigDir;
+	char path[64];
+	uint32_t node1, node2, node3, node4;
+	int f;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "dirdbFlush() and dirdbInit() round-trip\n" ANSI_COLOR_RESET);
+
+	if (!mkdtemp (tempdir))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mkdtemp() failed\n" ANSI_COLOR_RESET);
+		return 1;
+	}
+	snprintf (path, sizeof (path), "%s/", tempdir);
+	cfConfigDir = path;
+
+	node1 = dirdbResolvePathAndRef ("file:/tmp/foo/test.s3m", dirdb_use_file);
+	node4 = dirdbResolvePathAndRef ("file:/tmp/foo/bar.xm", dirdb_use_file);
+	node2 = dirdbResolvePathAndRef ("file:/tmp/foo/moo.s3m", dirdb_use_file);
+	node3 = dirdbResolvePathAndRef ("file:/tmp/test.s3m", dirdb_use_file);
+	dirdbTagSetParent (DIRDB_NOPARENT);
+	dirdbMakeMdbRef (node1, 0x1000);
+	dirdbMakeMdbRef (node2, 0x2000);
+	dirdbMakeMdbRef (node3, 0x3000);
+	dirdbTagRemoveUntaggedAndSubmit ();
+	dirdbUnref (node1, dirdb_use_file);
+	dirdbUnref (node2, dirdb_use_file);
+	dirdbUnref (node3, dirdb_use_file);
+	dirdbUnref (node4, dirdb_use_file); /* leaves a hole in the node array */
+	dirdbFlush ();
+	clear_dirdb ();
+
+	dirdbInit ();
+	retval += dirdb_basic_test10_verify ("file:/tmp/foo/test.s3m", 0x1000);
+	retval += dirdb_basic_test10_verify ("file:/tmp/foo/moo.s3m", 0x2000);
+	retval += dirdb_basic_test10_verify ("file:/tmp/test.s3m", 0x3000);
+	dirdbDirty = 1;
+	dirdbFlush ();
+	clear_dirdb ();
+
+	/* a v2 file with file: -> tmp -> mod.s3m (mdb_ref 0x4000) */
+	snprintf (path, sizeof (path), "%s/CPDIRDB.DAT", tempdir);
+	f = open (path, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+	if (f >= 0)
+	{
+		const uint8_t v2data[] =
+		{
+			0x03, 0x00, /* entries */ 0x00, 0x00,
+			0x05, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 'f', 'i', 'l', 'e', ':',
+			0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 't', 'm', 'p',
+			0x07, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 'm', 'o', 'd', '.', 's', '3', 'm'
+		};
+		if ((write (f, dirdbsigv2, sizeof (dirdbsigv2)) != sizeof (dirdbsigv2)) || (write (f, v2data, sizeof (v2data)) != sizeof (v2data)))
+		{
+			retval++;
+		}
+		close (f);
+	} else {
+		retval++;
+	}
+	snprintf (path, sizeof (path), "%s/", tempdir);
+	cfConfigDir = path;
+	dirdbInit ();
+	retval += dirdb_basic_test10_verify ("file:/tmp/mod.s3m", 0x4000);
+	clear_dirdb ();
+
+	snprintf (path, sizeof (path), "%s/CPDIRDB.DAT", tempdir);
+	unlink (path);
+	rmdir (tempdir);
+	cfConfigDir = olddir;
+
+	fprintf (stderr, "\n");
+
+	return retval;
+}
+
+static int dirdb_basic_test11_verify (uint32_t node, const char *expected, int flags)
+{
+	char buffer[256];
+	char *tmp;
+	int length;
+	int retval = 0;
+
+	length = dirdbGetFullname_buffer (node, buffer, sizeof (buffer), flags);
+	if ((length != (int)strlen (expected)) || strcmp (buffer, expected))
+	{
+		fprintf (stderr, "dirdbGetFullname_buffer(flags=%d) gave " ANSI_COLOR_RED "%s (%d)" ANSI_COLOR_RESET " instead of %s\n", flags, (length >= 0) ? buffer : "", length, expected);
+		retval++;
+	}
+	dirdbGetFullname_malloc (node, &tmp, flags);
+	if ((!tmp) || strcmp (tmp, expected))
+	{
+		fprintf (stderr, "dirdbGetFullname_malloc(flags=%d) gave " ANSI_COLOR_RED "%s" ANSI_COLOR_RESET " instead of %s\n", flags, tmp ? tmp : "NULL", expected);
+		retval++;
+	}
+	free (tmp);
+	return retval;
+}
+
+static int dirdb_basic_test11(void)
+{
+	int retval = 0;
+	uint32_t drive, dir1, dir2, node;
+	uint32_t nodes[30][6];
+	char name[64];
+	char expected[128];
+	char buffer[32];
+	int round, i, j;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "Testing cached paths of dirdbGetFullname_malloc() and dirdbGetFullname_buffer()\n" ANSI_COLOR_RESET);
+
+	/* more directories than the cache can hold, so entries are evicted and rebuilt */
+	drive = dirdbFindAndRef (DIRDB_NOPARENT, "file:", dirdb_use_dir);
+	dir1 = dirdbFindAndRef (drive, "music", dirdb_use_dir);
+	for (i=0; i < 30; i++)
+	{
+		snprintf (name, sizeof (name), "album%02d", i);
+		nodes[i][0] = dirdbFindAndRef (dir1, name, dirdb_use_dir);
+		for (j=1; j < 6; j++)
+		{
+			snprintf (name, sizeof (name), "track%d.mod", j);
+			nodes[i][j] = dirdbFindAndRef (nodes[i][0], name, dirdb_use_file);
+		}
+	}
+
+	for (round=0; round < 3; round++)
+	{
+		for (i=0; i < 30; i++)
+		{
+			int ii = round == 1 ? 29 - i : i;
+			for (j=5; j >= 0; j--)
+			{
+				if (j)
+				{
+					snprintf (expected, sizeof (expected), "file:/music/album%02d/track%d.mod", ii, j);
+				} else {
+					snprintf (expected, sizeof (expected), "file:/music/album%02d", ii);
+				}
+				retval |= dirdb_basic_test11_verify (nodes[ii][j], expected, 0);
+				retval |= dirdb_basic_test11_verify (nodes[ii][j], expected + 5, DIRDB_FULLNAME_NODRIVE);
+				strcat (expected, "/");
+				retval |= dirdb_basic_test11_verify (nodes[ii][j], expected, DIRDB_FULLNAME_ENDSLASH);
+				retval |= dirdb_basic_test11_verify (nodes[ii][j], expected + 5, DIRDB_FULLNAME_NODRIVE | DIRDB_FULLNAME_ENDSLASH);
+			}
+		}
+	}
+	retval |= dirdb_basic_test11_verify (drive, "file:", 0);
+	retval |= dirdb_basic_test11_verify (drive, "", DIRDB_FULLNAME_NODRIVE);
+	retval |= dirdb_basic_test11_verify (drive, "/", DIRDB_FULLNAME_NODRIVE | DIRDB_FULLNAME_ENDSLASH);
+	retval |= dirdb_basic_test11_verify (dir1, "/music", DIRDB_FULLNAME_NODRIVE);
+
+	/* a buffer that is too small is left alone, and the needed length is returned */
+	memset (buffer, 'x', sizeof (buffer));
+	i = dirdbGetFullname_buffer (nodes[3][3], buffer, 30, 0); /* file:/music/album03/track3.mod needs 31 bytes */
+	if ((i != 30) || (buffer[0] != 'x') || (buffer[29] != 'x'))
+	{
+		fprintf (stderr, "dirdbGetFullname_buffer() with a too small buffer gave " ANSI_COLOR_RED "%d" ANSI_COLOR_RESET ", expected 30 and an untouched buffer\n", i);
+		retval++;
+	}
+	if (dirdbGetFullname_buffer (dirdbNum + 10, buffer, sizeof (buffer), 0) != -1)
+	{
+		fprintf (stderr, "dirdbGetFullname_buffer(invalid node) did " ANSI_COLOR_RED "not fail" ANSI_COLOR_RESET "\n");
+		retval++;
+	}
+
+	/* delete a cached directory, its node number is reused by the next new node */
+	for (j=1; j < 6; j++)
+	{
+		dirdbUnref (nodes[29][j], dirdb_use_file);
+	}
+	dirdbUnref (nodes[29][0], dirdb_use_dir);
+	dir2 = dirdbFindAndRef (dir1, "replaced", dirdb_use_dir);
+	node = dirdbFindAndRef (dir2, "new.mod", dirdb_use_file);
+	if ((dir2 != nodes[29][0]) && (dir2 != nodes[29][1]) && (node != nodes[29][0]))
+	{
+		fprintf (stderr, ANSI_COLOR_YELLOW "node numbers were not reused, the test below is weaker" ANSI_COLOR_RESET "\n");
+	}
+	retval |= dirdb_basic_test11_verify (node, "file:/music/replaced/new.mod", 0);
+	retval |= dirdb_basic_test11_verify (dir2, "file:/music/replaced", 0);
+
+	if (!retval)
+	{
+		fprintf (stderr, ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+
+	clear_dirdb();
+
+	fprintf (stderr, "\n");
+
+	return retval;
+}
+
+/* the full scan that dirdbGetMdb() used before it got a list of songs */
+static int dirdb_basic_test12_reference (uint32_t *dirdbnode, uint32_t *mdb_ref, int *first)
+{
+	if (*first)
+	{
+		*dirdbnode=0;
+		*first=0;
+	} else {
+		(*dirdbnode)++;
+	}
+	for (;*dirdbnode<dirdbNum;(*dirdbnode)++)
+	{
+		if ((dirdbData[*dirdbnode].name)&&(dirdbData[*dirdbnode].mdb_ref!=DIRDB_NO_MDBREF))
+		{
+			*mdb_ref=dirdbData[*dirdbnode].mdb_ref;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int dirdb_basic_test12_compare (int round)
+{
+	uint32_t node1 = DIRDB_NOPARENT, node2 = DIRDB_NOPARENT;
+	uint32_t mdb1 = 0, mdb2 = 0;
+	int first1 = 1, first2 = 1;
+	int count = 0;
+
+	while (1)
+	{
+		int r1 = dirdbGetMdb (&node1, &mdb1, &first1);
+		int r2 = dirdb_basic_test12_reference (&node2, &mdb2, &first2);
+		if (r1 != r2)
+		{
+			fprintf (stderr, "round %d, song %d: dirdbGetMdb() returned " ANSI_COLOR_RED "%d" ANSI_COLOR_RESET ", expected %d\n", round, count, r1, r2);
+			return 1;
+		}
+		if (r1)
+		{
+			break;
+		}
+		if ((node1 != node2) || (mdb1 != mdb2))
+		{
+			fprintf (stderr, "round %d, song %d: dirdbGetMdb() gave " ANSI_COLOR_RED "node %"PRIu32" mdb %"PRIu32 ANSI_COLOR_RESET ", expected node %"PRIu32" mdb %"PRIu32"\n", round, count, node1, mdb1, node2, mdb2);
+			return 1;
+		}
+		count++;
+	}
+	return 0;
+}
+
+static int dirdb_basic_test12(void)
+{
+	int retval = 0;
+	uint32_t drive, dirs[10], files[10][100];
+	uint32_t node, mdb, node2, mdb2;
+	int first, first2;
+	char name[64];
+	int round, i, j;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "Testing dirdbGetMdb() against a scan of all nodes, while songs are added and removed\n" ANSI_COLOR_RESET);
+
+	drive = dirdbFindAndRef (DIRDB_NOPARENT, "file:", dirdb_use_dir);
+	for (i=0; i < 10; i++)
+	{
+		snprintf (name, sizeof (name), "dir%d", i);
+		dirs[i] = dirdbFindAndRef (drive, name, dirdb_use_dir);
+		for (j=0; j < 100; j++)
+		{
+			snprintf (name, sizeof (name), "song%d.mod", j);
+			files[i][j] = dirdbFindAndRef (dirs[i], name, dirdb_use_file);
+		}
+	}
+
+	srand (3);
+	for (round=0; round < 8; round++)
+	{
+		/* rescan one directory, keeping a random set of its files as songs */
+		i = rand() % 10;
+		dirdbTagSetParent (dirs[i]);
+		for (j=0; j < 100; j++)
+		{
+			if (rand() % 3)
+			{
+				dirdbMakeMdbRef (files[i][j], round * 1000 + j);
+			}
+		}
+		if (round == 5)
+		{ /* also preserve another directory that was never part of this scan */
+			dirdbTagPreserveTree (drive);
+		}
+		dirdbTagRemoveUntaggedAndSubmit ();
+
+		retval |= dirdb_basic_test12_compare (round);
+	}
+
+	/* two iterations that are interleaved */
+	first = 1; first2 = 1;
+	while (!dirdbGetMdb (&node, &mdb, &first))
+	{
+		if (dirdbGetMdb (&node2, &mdb2, &first2))
+		{
+			break;
+		}
+		if (node != node2)
+		{
+			fprintf (stderr, "interleaved dirdbGetMdb() gave " ANSI_COLOR_RED "%"PRIu32" and %"PRIu32 ANSI_COLOR_RESET "\n", node, node2);
+			retval |= 1;
+			break;
+		}
+	}
+
+	/* remove all songs again */
+	dirdbTagSetParent (drive);
+	dirdbTagRemoveUntaggedAndSubmit ();
+	first = 1;
+	if (!dirdbGetMdb (&node, &mdb, &first))
+	{
+		fprintf (stderr, "dirdbGetMdb() gave " ANSI_COLOR_RED "node %"PRIu32 ANSI_COLOR_RESET " after all songs were removed\n", node);
+		retval |= 1;
+	}
+	if (dirdbMdbNodesCount)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "%"PRIu32" nodes are still listed as songs" ANSI_COLOR_RESET "\n", dirdbMdbNodesCount);
+		retval |= 1;
+	}
+
+	if (!retval)
+	{
+		fprintf (stderr, ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+
+	clear_dirdb();
+
+	fprintf (stderr, "\n");
+
+	return retval;
+}
+
 int main(int argc, char *argv[])
 {
 	int retval = 0;
@@ -1087,9 +1547,17 @@ int main(int argc, char *argv[])
 
 	retval |= dirdb_basic_test6(); /* dirdbGetFullname_malloc() */
 
+	retval |= dirdb_basic_test11(); /* dirdbGetFullname_buffer(), path cache */
+
 	retval |= dirdb_basic_test8(); /* dirdbDiffPath() */
 
 	retval |= dirdb_basic_test7(); /* dirdbTagSetParent(), dirdbMakeMdbRef(), dirdbTagRemoveUntaggedAndSubmit(), dirdbGetMdb() */
 
+	retval |= dirdb_basic_test12(); /* dirdbGetMdb() using the list of songs */
+
+	retval |= dirdb_basic_test9(); /* string arena memory usage */
+
+	retval |= dirdb_basic_test10(); /* dirdbFlush(), dirdbInit() */
+
 	return retval;
 }
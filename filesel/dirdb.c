@@ -18,8 +18,6 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-#warning ADB_REF is outdated, should no longer be included
-
 
 #include "config.h"
 #include <assert.h>
@@ -27,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -47,8 +46,8 @@ struct dirdbEntry
 	uint32_t child;
 
 	uint32_t mdb_ref;
-	char *name; /* we pollute malloc a lot with this */
-	int refcount;
+	uint32_t name; /* reference into the string arena, 0 if node is not in use */
+	uint32_t refcount;
 #ifdef DIRDB_DEBUG
 	int refcount_children;
 	int refcount_directories;
@@ -71,6 +70,17 @@ struct __attribute__((packed)) dirdbheader
 };
 const char dirdbsigv1[60] = "Cubic Player Directory Data Base\x1B\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
 const char dirdbsigv2[60] = "Cubic Player Directory Data Base\x1B\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01";
+const char dirdbsigv3[60] = "Cubic Player Directory Data Base\x1B\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02";
+
+/* v3 is fixed-size records followed by a blob of zero-terminated names, so it can be loaded in one go */
+struct __attribute__((packed)) dirdbrecordv3
+{
+	uint32_t parent;
+	uint32_t mdb_ref;
+	uint32_t name_offset; /* into the name blob */
+	uint16_t name_length; /* 0 if node is not in use */
+	uint16_t reserved;
+};
 
 static struct dirdbEntry *dirdbData=0;
 static uint32_t dirdbNum=0;
@@ -79,6 +89,403 @@ static int dirdbDirty=0;
 static uint32_t dirdbRootChild = DIRDB_NOPARENT;
 static uint32_t dirdbFreeChild = DIRDB_NOPARENT;
 
+/* Full paths of the most recently used directories, most recent first. Files are usually
+ * looked up one directory at a time, so their paths are built from the cached path of their
+ * parent instead of walking all the way up to the drive again. An entry is dropped when its
+ * node is deleted, since the node number can be reused for something else. Like the rest of
+ * dirdb, the cache is only used from the main thread.
+ */
+#define DIRDB_PATHCACHE_SIZE 16
+struct dirdbPathCacheEntry
+{
+	uint32_t node;
+	char *path;    /* including the drive: prefix, NULL if the entry is not in use */
+	int length;
+	int drivelength;
+};
+static struct dirdbPathCacheEntry dirdbPathCache[DIRDB_PATHCACHE_SIZE];
+
+static void dirdbPathCacheClear (void)
+{
+	int i;
+
+	for (i=0; i < DIRDB_PATHCACHE_SIZE; i++)
+	{
+		free (dirdbPathCache[i].path);
+		dirdbPathCache[i].path = 0;
+	}
+}
+
+static void dirdbPathCacheForget (uint32_t node)
+{
+	int i;
+
+	for (i=0; i < DIRDB_PATHCACHE_SIZE; i++)
+	{
+		if (dirdbPathCache[i].path && (dirdbPathCache[i].node == node))
+		{
+			free (dirdbPathCache[i].path);
+			memmove (dirdbPathCache + i, dirdbPathCache + i + 1, (DIRDB_PATHCACHE_SIZE - i - 1) * sizeof (dirdbPathCache[0]));
+			dirdbPathCache[DIRDB_PATHCACHE_SIZE - 1].path = 0;
+			return;
+		}
+	}
+}
+
+/* Nodes that have a mdb_ref, in ascending order, so dirdbGetMdb() only has to visit songs.
+ * Nodes that got a mdb_ref during a scan are collected and merged in when the scan is
+ * submitted. Nodes that lost their mdb_ref are skipped by dirdbGetMdb() and dropped at the
+ * next merge. If memory runs out, dirdbGetMdb() falls back to visiting every node until
+ * the list can be rebuilt.
+ */
+static uint32_t *dirdbMdbNodes;
+static uint32_t  dirdbMdbNodesCount;
+static uint32_t *dirdbMdbNodesAdded;
+static uint32_t  dirdbMdbNodesAddedCount;
+static uint32_t  dirdbMdbNodesAddedSize;
+static uint32_t  dirdbMdbNodesHint; /* position of the last node given by dirdbGetMdb() */
+static int       dirdbMdbNodesValid = 1;
+
+static void dirdbMdbNodesClear (void)
+{
+	free (dirdbMdbNodes);
+	free (dirdbMdbNodesAdded);
+	dirdbMdbNodes = 0;
+	dirdbMdbNodesCount = 0;
+	dirdbMdbNodesAdded = 0;
+	dirdbMdbNodesAddedCount = 0;
+	dirdbMdbNodesAddedSize = 0;
+	dirdbMdbNodesHint = 0;
+	dirdbMdbNodesValid = 1;
+}
+
+static void dirdbMdbNodesRebuild (void)
+{
+	uint32_t i;
+
+	dirdbMdbNodesClear ();
+	for (i=0; i < dirdbNum; i++)
+	{
+		if (dirdbData[i].name && (dirdbData[i].mdb_ref != DIRDB_NO_MDBREF))
+		{
+			dirdbMdbNodesCount++;
+		}
+	}
+	if (!dirdbMdbNodesCount)
+	{
+		return;
+	}
+	dirdbMdbNodes = malloc (dirdbMdbNodesCount * sizeof (dirdbMdbNodes[0]));
+	if (!dirdbMdbNodes)
+	{
+		fprintf (stderr, "dirdbMdbNodesRebuild: malloc() failed\n");
+		dirdbMdbNodesCount = 0;
+		dirdbMdbNodesValid = 0;
+		return;
+	}
+	dirdbMdbNodesCount = 0;
+	for (i=0; i < dirdbNum; i++)
+	{
+		if (dirdbData[i].name && (dirdbData[i].mdb_ref != DIRDB_NO_MDBREF))
+		{
+			dirdbMdbNodes[dirdbMdbNodesCount++] = i;
+		}
+	}
+}
+
+static void dirdbMdbNodesAdd (uint32_t node)
+{
+	if (!dirdbMdbNodesValid)
+	{
+		return;
+	}
+	if (dirdbMdbNodesAddedCount == dirdbMdbNodesAddedSize)
+	{
+		uint32_t *temp = realloc (dirdbMdbNodesAdded, (dirdbMdbNodesAddedSize + 1024) * sizeof (dirdbMdbNodesAdded[0]));
+		if (!temp)
+		{
+			fprintf (stderr, "dirdbMdbNodesAdd: realloc() failed\n");
+			dirdbMdbNodesValid = 0;
+			return;
+		}
+		dirdbMdbNodesAdded = temp;
+		dirdbMdbNodesAddedSize += 1024;
+	}
+	dirdbMdbNodesAdded[dirdbMdbNodesAddedCount++] = node;
+}
+
+static int dirdbMdbNodesCompare (const void *_a, const void *_b)
+{
+	uint32_t a = *(const uint32_t *)_a;
+	uint32_t b = *(const uint32_t *)_b;
+	return (a > b) - (a < b);
+}
+
+/* merges dirdbMdbNodesAdded into dirdbMdbNodes, and drops nodes that no longer have a mdb_ref */
+static void dirdbMdbNodesCommit (void)
+{
+	uint32_t *merged;
+	uint32_t i = 0, j = 0, count = 0;
+
+	if (!dirdbMdbNodesValid)
+	{
+		dirdbMdbNodesRebuild ();
+		return;
+	}
+
+	merged = malloc ((dirdbMdbNodesCount + dirdbMdbNodesAddedCount + 1) * sizeof (merged[0]));
+	if (!merged)
+	{
+		fprintf (stderr, "dirdbMdbNodesCommit: malloc() failed\n");
+		dirdbMdbNodesRebuild ();
+		return;
+	}
+	qsort (dirdbMdbNodesAdded, dirdbMdbNodesAddedCount, sizeof (dirdbMdbNodesAdded[0]), dirdbMdbNodesCompare);
+
+	while ((i < dirdbMdbNodesCount) || (j < dirdbMdbNodesAddedCount))
+	{
+		uint32_t node;
+		if ((j >= dirdbMdbNodesAddedCount) || ((i < dirdbMdbNodesCount) && (dirdbMdbNodes[i] <= dirdbMdbNodesAdded[j])))
+		{
+			node = dirdbMdbNodes[i++];
+		} else {
+			node = dirdbMdbNodesAdded[j++];
+		}
+		if ((!dirdbData[node].name) || (dirdbData[node].mdb_ref == DIRDB_NO_MDBREF) || (count && (merged[count - 1] == node)))
+		{
+			continue;
+		}
+		merged[count++] = node;
+	}
+
+	free (dirdbMdbNodes);
+	dirdbMdbNodes = merged;
+	dirdbMdbNodesCount = count;
+	dirdbMdbNodesAddedCount = 0;
+	dirdbMdbNodesHint = 0;
+}
+
+/* Names are stored in a chunked string arena instead of one malloc() per node.
+ *
+ * Each string is stored as a 32bit reference-count followed by the zero-terminated
+ * name, padded to 4 bytes. A reference is (chunk << DIRDB_STRING_CHUNK_BITS | offset)
+ * and points to the name itself, so 0 is never a valid reference. Identical names are
+ * interned via a linear-probing hash-table, and released slots are recycled by size.
+ * Chunks are never moved, so the pointers from dirdbGetName_internalstr() stay valid.
+ */
+#define DIRDB_STRING_CHUNK_BITS 18
+#define DIRDB_STRING_CHUNK_SIZE (1 << DIRDB_STRING_CHUNK_BITS) /* must be able to hold UINT16_MAX + 1 + 4 */
+#define DIRDB_STRING_CHUNK_MASK (DIRDB_STRING_CHUNK_SIZE - 1)
+#define DIRDB_STRING_FREE_BUCKETS 64 /* slots up to 256 bytes are recycled */
+
+static char    **dirdbStringChunks;
+static uint32_t  dirdbStringChunksCount;
+static uint32_t  dirdbStringChunkFill; /* fill of the last chunk */
+static uint32_t  dirdbStringFree[DIRDB_STRING_FREE_BUCKETS];
+static uint32_t *dirdbStringHash;
+static uint32_t  dirdbStringHashSize; /* power of two */
+static uint32_t  dirdbStringHashFill;
+
+#define dirdbStringGet(ref) (dirdbStringChunks[(ref) >> DIRDB_STRING_CHUNK_BITS] + ((ref) & DIRDB_STRING_CHUNK_MASK))
+#define dirdbStringRefCount(ref) (*(uint32_t *)(dirdbStringGet(ref) - sizeof (uint32_t)))
+#define dirdbStringSlotSize(len) (((len) + 1 + sizeof (uint32_t) + 3) & ~3)
+
+static uint32_t dirdbStringHashName (const char *name)
+{ /* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	while (*name)
+	{
+		hash ^= (uint8_t)*(name++);
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static void dirdbStringClear (void)
+{
+	uint32_t i;
+	for (i=0; i < dirdbStringChunksCount; i++)
+	{
+		free (dirdbStringChunks[i]);
+	}
+	free (dirdbStringChunks);
+	dirdbStringChunks = 0;
+	dirdbStringChunksCount = 0;
+	dirdbStringChunkFill = 0;
+	for (i=0; i < DIRDB_STRING_FREE_BUCKETS; i++)
+	{
+		dirdbStringFree[i] = 0;
+	}
+	free (dirdbStringHash);
+	dirdbStringHash = 0;
+	dirdbStringHashSize = 0;
+	dirdbStringHashFill = 0;
+}
+
+static int dirdbStringHashResize (uint32_t newsize)
+{
+	uint32_t *newhash;
+	uint32_t i;
+
+	newhash = calloc (newsize, sizeof (uint32_t));
+	if (!newhash)
+	{
+		fprintf (stderr, "dirdbStringHashResize: calloc() failed\n");
+		return -1;
+	}
+	for (i=0; i < dirdbStringHashSize; i++)
+	{
+		if (dirdbStringHash[i])
+		{
+			uint32_t j = dirdbStringHashName (dirdbStringGet (dirdbStringHash[i])) & (newsize - 1);
+			while (newhash[j])
+			{
+				j = (j + 1) & (newsize - 1);
+			}
+			newhash[j] = dirdbStringHash[i];
+		}
+	}
+	free (dirdbStringHash);
+	dirdbStringHash = newhash;
+	dirdbStringHashSize = newsize;
+	return 0;
+}
+
+/* returns the hash-table slot that holds name, or the empty slot where it should be inserted */
+static uint32_t dirdbStringHashLocate (const char *name)
+{
+	uint32_t i = dirdbStringHashName (name) & (dirdbStringHashSize - 1);
+	while (dirdbStringHash[i] && strcmp (dirdbStringGet (dirdbStringHash[i]), name))
+	{
+		i = (i + 1) & (dirdbStringHashSize - 1);
+	}
+	return i;
+}
+
+/* does not add a reference, returns 0 if the name is not known */
+static uint32_t dirdbStringFind (const char *name)
+{
+	if (!dirdbStringHashSize)
+	{
+		return 0;
+	}
+	return dirdbStringHash[dirdbStringHashLocate (name)];
+}
+
+static uint32_t dirdbStringAllocate (uint32_t slotsize)
+{
+	uint32_t ref;
+
+	if ((slotsize / 4) < DIRDB_STRING_FREE_BUCKETS)
+	{
+		ref = dirdbStringFree[slotsize / 4];
+		if (ref)
+		{
+			dirdbStringFree[slotsize / 4] = dirdbStringRefCount (ref); /* next free slot of the same size is stored in the reference-count */
+			return ref;
+		}
+	}
+
+	if ((!dirdbStringChunksCount) || ((dirdbStringChunkFill + slotsize) > DIRDB_STRING_CHUNK_SIZE))
+	{
+		char **newchunks;
+
+		if (dirdbStringChunksCount >= (1 << (32 - DIRDB_STRING_CHUNK_BITS)))
+		{
+			fprintf (stderr, "dirdbStringAllocate: string arena is full\n");
+			return 0;
+		}
+		newchunks = realloc (dirdbStringChunks, (dirdbStringChunksCount + 1) * sizeof (char *));
+		if (!newchunks)
+		{
+			fprintf (stderr, "dirdbStringAllocate: realloc() failed\n");
+			return 0;
+		}
+		dirdbStringChunks = newchunks;
+		dirdbStringChunks[dirdbStringChunksCount] = malloc (DIRDB_STRING_CHUNK_SIZE);
+		if (!dirdbStringChunks[dirdbStringChunksCount])
+		{
+			fprintf (stderr, "dirdbStringAllocate: malloc() failed\n");
+			return 0;
+		}
+		dirdbStringChunksCount++;
+		dirdbStringChunkFill = 0;
+	}
+
+	ref = ((dirdbStringChunksCount - 1) << DIRDB_STRING_CHUNK_BITS) | (dirdbStringChunkFill + sizeof (uint32_t));
+	dirdbStringChunkFill += slotsize;
+	return ref;
+}
+
+/* returns a reference to the interned copy of name, with the reference-count increased, or 0 on failure */
+static uint32_t dirdbStringIntern (const char *name, uint16_t len)
+{
+	uint32_t slot, ref;
+
+	if ((dirdbStringHashFill + 1) * 4 > dirdbStringHashSize * 3)
+	{
+		if (dirdbStringHashResize (dirdbStringHashSize ? dirdbStringHashSize * 2 : 1024))
+		{
+			return 0;
+		}
+	}
+
+	slot = dirdbStringHashLocate (name);
+	if (dirdbStringHash[slot])
+	{
+		dirdbStringRefCount (dirdbStringHash[slot])++;
+		return dirdbStringHash[slot];
+	}
+
+	ref = dirdbStringAllocate (dirdbStringSlotSize (len));
+	if (!ref)
+	{
+		return 0;
+	}
+	memcpy (dirdbStringGet (ref), name, len);
+	dirdbStringGet (ref)[len] = 0;
+	dirdbStringRefCount (ref) = 1;
+
+	dirdbStringHash[slot] = ref;
+	dirdbStringHashFill++;
+
+	return ref;
+}
+
+static void dirdbStringRelease (uint32_t ref)
+{
+	uint32_t slotsize, i, j;
+
+	if (--dirdbStringRefCount (ref))
+	{
+		return;
+	}
+
+	/* remove from the hash-table, and shift the following entries of the cluster back into place */
+	i = dirdbStringHashLocate (dirdbStringGet (ref));
+	dirdbStringHash[i] = 0;
+	dirdbStringHashFill--;
+	for (j = (i + 1) & (dirdbStringHashSize - 1); dirdbStringHash[j]; j = (j + 1) & (dirdbStringHashSize - 1))
+	{
+		uint32_t k = dirdbStringHashName (dirdbStringGet (dirdbStringHash[j])) & (dirdbStringHashSize - 1);
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+		{
+			continue; /* entry is reachable from its home slot */
+		}
+		dirdbStringHash[i] = dirdbStringHash[j];
+		dirdbStringHash[j] = 0;
+		i = j;
+	}
+
+	/* recycle the slot, larger slots are lost until next restart */
+	slotsize = dirdbStringSlotSize (strlen (dirdbStringGet (ref)));
+	if ((slotsize / 4) < DIRDB_STRING_FREE_BUCKETS)
+	{
+		dirdbStringRefCount (ref) = dirdbStringFree[slotsize / 4];
+		dirdbStringFree[slotsize / 4] = ref;
+	}
+}
+
 #ifdef DIRDB_DEBUG
 static void dumpdb_parent(uint32_t firstchild, int ident)
 {
@@ -94,7 +501,7 @@ static void dumpdb_parent(uint32_t firstchild, int ident)
 		{
 			fprintf(stderr, " ");
 		}
-		fprintf(stderr, "%s (refcount=%d", dirdbData[iter].name, dirdbData[iter].refcount);
+		fprintf(stderr, "%s (refcount=%d", dirdbStringGet (dirdbData[iter].name), dirdbData[iter].refcount);
 		if (dirdbData[iter].refcount_children)
 		{
 			fprintf(stderr, "  children=%d", dirdbData[iter].refcount_children);
@@ -150,17 +557,136 @@ static void dumpdirdb(void)
 }
 #endif
 
+static int dirdbInitLoadV12 (const uint8_t *data, size_t size, int version)
+{ /* v1 and v2: uint16_t len, if len: uint32_t parent, uint32_t mdb_ref, [v2: uint32_t adb_ref], char name[len] */
+	char *namebuffer;
+	size_t pos = 0;
+	uint32_t i;
+
+	namebuffer = malloc (UINT16_MAX + 1);
+	if (!namebuffer)
+	{
+		return -1;
+	}
+
+	for (i=0; i<dirdbNum; i++)
+	{
+		uint16_t len;
+		uint32_t buf32;
+		if ((pos + sizeof (uint16_t)) > size)
+		{
+			goto endoffile;
+		}
+		memcpy (&len, data + pos, sizeof (uint16_t));
+		pos += sizeof (uint16_t);
+		if (len)
+		{
+			len = uint16_little(len);
+
+			if ((pos + (version == 2 ? 12 : 8) + len) > size)
+			{
+				goto endoffile;
+			}
+
+			memcpy (&buf32, data + pos, sizeof (uint32_t));
+			pos += sizeof (uint32_t);
+			dirdbData[i].parent = uint32_little(buf32);
+
+			memcpy (&buf32, data + pos, sizeof (uint32_t));
+			pos += sizeof (uint32_t);
+			/* If mdb has been reset, we need to clear all references */
+			dirdbData[i].mdb_ref = mdbCleanSlate ? DIRDB_NO_MDBREF : uint32_little(buf32);
+			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+
+			if (version == 2)
+			{
+				pos += sizeof (uint32_t); /* discard adb_ref */
+			}
+
+			memcpy (namebuffer, data + pos, len);
+			pos += len;
+			namebuffer[len]=0; /* terminate the string */
+			dirdbData[i].name=dirdbStringIntern(namebuffer, len);
+			if (!dirdbData[i].name)
+			{
+				free (namebuffer);
+				return -1;
+			}
+		} else {
+			dirdbData[i].parent = DIRDB_NOPARENT;
+			dirdbData[i].mdb_ref = DIRDB_NO_MDBREF;
+			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+			/* name is already 0 due to calloc() */
+		}
+	}
+	free (namebuffer);
+	return 0;
+endoffile:
+	free (namebuffer);
+	return 1;
+}
+
+static int dirdbInitLoadV3 (const uint8_t *data, size_t size)
+{ /* v3: struct dirdbrecordv3 records[entries], followed by a blob of zero-terminated names */
+	const struct dirdbrecordv3 *records = (const struct dirdbrecordv3 *)data;
+	const char *blob;
+	size_t blobsize;
+	uint32_t i;
+
+	if (((size_t)dirdbNum * sizeof (struct dirdbrecordv3)) > size)
+	{
+		return 1;
+	}
+	blob = (const char *)data + (size_t)dirdbNum * sizeof (struct dirdbrecordv3);
+	blobsize = size - (size_t)dirdbNum * sizeof (struct dirdbrecordv3);
+
+	for (i=0; i<dirdbNum; i++)
+	{
+		uint16_t len = uint16_little(records[i].name_length);
+		if (len)
+		{
+			uint32_t offset = uint32_little(records[i].name_offset);
+
+			if ((((size_t)offset + len) >= blobsize) || blob[offset + len] || (strlen (blob + offset) != len))
+			{
+				return 1;
+			}
+
+			dirdbData[i].parent = uint32_little(records[i].parent);
+			/* If mdb has been reset, we need to clear all references */
+			dirdbData[i].mdb_ref = mdbCleanSlate ? DIRDB_NO_MDBREF : uint32_little(records[i].mdb_ref);
+			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+
+			dirdbData[i].name=dirdbStringIntern(blob + offset, len);
+			if (!dirdbData[i].name)
+			{
+				return -1;
+			}
+		} else {
+			dirdbData[i].parent = DIRDB_NOPARENT;
+			dirdbData[i].mdb_ref = DIRDB_NO_MDBREF;
+			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+			/* name is already 0 due to calloc() */
+		}
+	}
+	return 0;
+}
+
 int dirdbInit(void)
 {
 	char *path;
-	struct dirdbheader header;
+	const struct dirdbheader *header;
+	struct stat st;
+	uint8_t *data;
+	int mapped = 1;
 	int f;
 	uint32_t i;
 	int retval;
-	int version;
 
 	dirdbRootChild = DIRDB_NOPARENT;
 	dirdbFreeChild = DIRDB_NOPARENT;
+	dirdbPathCacheClear ();
+	dirdbMdbNodesClear ();
 
 	path = malloc(strlen(cfConfigDir)+11+1);
 	if (!path)
@@ -183,87 +709,97 @@ int dirdbInit(void)
 	free (path);
 	path = 0;
 
-	if (read(f, &header, sizeof(header))!=sizeof(header))
+	if (fstat(f, &st) || (st.st_size < sizeof(struct dirdbheader)))
 	{
 		fprintf(stderr, "No header\n");
 		close(f);
 		return 1;
 	}
-	if (memcmp(header.sig, dirdbsigv1, 60))
+
+	/* the entire file is parsed in one go, from a mapping if possible */
+	data = mmap (0, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+	if (data == MAP_FAILED)
 	{
-		if (memcmp(header.sig, dirdbsigv2, 60))
+		size_t pos = 0;
+
+		mapped = 0;
+		data = malloc (st.st_size);
+		if (!data)
 		{
-			fprintf(stderr, "Invalid header\n");
 			close(f);
-			return 1;
-		} else {
-			version = 2;
+			fprintf(stderr, "out of memory\n");
+			return 0;
+		}
+		while (pos < st.st_size)
+		{
+			ssize_t res = read(f, data + pos, st.st_size - pos);
+			if (res <= 0)
+			{
+				fprintf(stderr, "EOF\n");
+				free (data);
+				close(f);
+				return 1;
+			}
+			pos += res;
 		}
-	} else {
-		version = 1;
 	}
-	dirdbNum=uint32_little(header.entries);
+	close(f);
+
+	header = (const struct dirdbheader *)data;
+	if (memcmp(header->sig, dirdbsigv1, 60) &&
+	    memcmp(header->sig, dirdbsigv2, 60) &&
+	    memcmp(header->sig, dirdbsigv3, 60))
+	{
+		fprintf(stderr, "Invalid header\n");
+		retval = 1;
+		goto unmap;
+	}
+	dirdbNum=uint32_little(header->entries);
 	if (!dirdbNum)
-		goto endoffile;
+	{
+		fprintf(stderr, "EOF\n");
+		retval = 1;
+		goto unmap;
+	}
 	dirdbData = calloc (dirdbNum, sizeof(struct dirdbEntry));
 	if (!dirdbData)
 	{
 		dirdbNum=0;
-		goto outofmemory;
+		fprintf(stderr, "out of memory\n");
+		retval = 0;
+		goto unmap;
 	}
 
-	for (i=0; i<dirdbNum; i++)
+	if (!memcmp(header->sig, dirdbsigv3, 60))
 	{
-		uint16_t len;
-		if (read(f, &len, sizeof(uint16_t))!=sizeof(uint16_t))
-		{
-			goto endoffile;
-		}
-		if (len)
-		{
-			len = uint16_little(len);
-
-			if (read(f, &dirdbData[i].parent, sizeof(uint32_t))!=sizeof(uint32_t))
-				goto endoffile;
-			dirdbData[i].parent = uint32_little(dirdbData[i].parent);
+		retval = dirdbInitLoadV3 (data + sizeof(struct dirdbheader), st.st_size - sizeof(struct dirdbheader));
+	} else {
+		retval = dirdbInitLoadV12 (data + sizeof(struct dirdbheader), st.st_size - sizeof(struct dirdbheader), memcmp(header->sig, dirdbsigv1, 60) ? 2 : 1);
+	}
 
-			if (read(f, &dirdbData[i].mdb_ref, sizeof(uint32_t))!=sizeof(uint32_t))
-				goto endoffile;
-			/* If mdb has been reset, we need to clear all references */
-			dirdbData[i].mdb_ref = mdbCleanSlate ? DIRDB_NO_MDBREF : uint32_little(dirdbData[i].mdb_ref);
-			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+	if (mapped)
+	{
+		munmap (data, st.st_size);
+	} else {
+		free (data);
+	}
 
-			if (version == 2)
-			{
-				uint32_t discard_adb_ref;
-				if (read(f, &discard_adb_ref, sizeof(uint32_t))!=sizeof(uint32_t))
-					goto endoffile;
-			}
+	if (retval)
+	{
+		fprintf(stderr, (retval > 0) ? "EOF\n" : "out of memory\n");
+		goto unload;
+	}
 
-			dirdbData[i].name=malloc(len+1);
-			if (!dirdbData[i].name)
-				goto outofmemory;
-			if (read(f, dirdbData[i].name, len)!=len)
-			{
-				free(dirdbData[i].name);
-				goto endoffile;
-			}
-			dirdbData[i].name[len]=0; /* terminate the string */
-			if (dirdbData[i].mdb_ref!=DIRDB_NO_MDBREF)
-			{
-				dirdbData[i].refcount++;
+	for (i=0; i<dirdbNum; i++)
+	{
+		if (dirdbData[i].mdb_ref!=DIRDB_NO_MDBREF)
+		{
+			dirdbData[i].refcount++;
 #ifdef DIRDB_DEBUG
-				dirdbData[i].refcount_mdb_medialib++;
+			dirdbData[i].refcount_mdb_medialib++;
 #endif
-			}
-		} else {
-			dirdbData[i].parent = DIRDB_NOPARENT;
-			dirdbData[i].mdb_ref = DIRDB_NO_MDBREF;
-			dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
-			/* name is already NULL due to calloc() */
 		}
 	}
-	close(f);
 	for (i=0; i<dirdbNum; i++)
 	{
 		if (dirdbData[i].parent != DIRDB_NOPARENT)
@@ -272,7 +808,7 @@ int dirdbInit(void)
 			{
 				fprintf(stderr, "Invalid parent in a node .. (out of range)\n");
 				dirdbData[i].parent = DIRDB_NOPARENT;
-				free (dirdbData[i].name);
+				dirdbStringRelease (dirdbData[i].name);
 				dirdbData[i].name = 0;
 			} else if (!dirdbData[dirdbData[i].parent].name)
 			{
@@ -308,41 +844,42 @@ int dirdbInit(void)
 		}
 	}
 
+	dirdbMdbNodesRebuild ();
+
 	fprintf(stderr, "Done\n");
 	return 1;
-endoffile:
-	fprintf(stderr, "EOF\n");
-	close(f);
-	retval=1;
-	goto unload;
-outofmemory:
-	fprintf(stderr, "out of memory\n");
-	close(f);
-	retval=0;
+
+unmap:
+	if (mapped)
+	{
+		munmap (data, st.st_size);
+	} else {
+		free (data);
+	}
+	return retval;
+
 unload:
 	for (i=0; i<dirdbNum; i++)
 	{
-		if (dirdbData[i].name)
-		{
-			free(dirdbData[i].name);
-			dirdbData[i].name=0;
-		}
+		dirdbData[i].name=0;
 		dirdbData[i].parent = DIRDB_NOPARENT;
+		dirdbData[i].mdb_ref = DIRDB_NO_MDBREF;
+		dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
 		dirdbData[i].next = dirdbFreeChild;
 		dirdbFreeChild = i;
 	}
-	return retval;
+	dirdbStringClear ();
+	dirdbMdbNodesClear ();
+	return retval > 0;
 }
 
 void dirdbClose(void)
 {
-	uint32_t i;
 	if (!dirdbNum)
 		return;
-	for (i=0; i<dirdbNum; i++)
-	{
-		free(dirdbData[i].name);
-	}
+	dirdbPathCacheClear ();
+	dirdbMdbNodesClear ();
+	dirdbStringClear ();
 	free(dirdbData);
 	dirdbData = 0;
 	dirdbNum = 0;
@@ -352,7 +889,7 @@ void dirdbClose(void)
 
 uint32_t dirdbFindAndRef(uint32_t parent, char const *name, enum dirdb_use use)
 {
-	uint32_t i, *prev;
+	uint32_t i, *prev, nameref;
 	struct dirdbEntry *new;
 
 #ifdef DIRDB_DEBUG
@@ -398,11 +935,13 @@ uint32_t dirdbFindAndRef(uint32_t parent, char const *name, enum dirdb_use use)
 		return DIRDB_NOPARENT;
 	}
 
-	for (i = (parent != DIRDB_NOPARENT) ? dirdbData[parent].child : dirdbRootChild; i != DIRDB_NOPARENT; i = dirdbData[i].next)
+	/* names are interned, so if the name is not known at all, there is no need to search, else we can compare references */
+	nameref = dirdbStringFind (name);
+	for (i = (parent != DIRDB_NOPARENT) ? dirdbData[parent].child : dirdbRootChild; nameref && (i != DIRDB_NOPARENT); i = dirdbData[i].next)
 	{
 		assert (dirdbData[i].name);
 		assert (dirdbData[i].parent == parent);
-		if (!strcmp(name, dirdbData[i].name))
+		if (nameref == dirdbData[i].name)
 		{
 			/*fprintf(stderr, " ++ %s (%d p=%d)\n", dirdbData[i].name, i, dirdbData[i].parent);*/
 			dirdbData[i].refcount++;
@@ -460,10 +999,10 @@ uint32_t dirdbFindAndRef(uint32_t parent, char const *name, enum dirdb_use use)
 
 	/* grab a free entry */
 	i = dirdbFreeChild;
-	dirdbData[i].name=strdup(name);
+	dirdbData[i].name=dirdbStringIntern(name, strlen (name));
 	if (!dirdbData[i].name)
 	{
-		fprintf (stderr, "dirdbFindAndRef: strdup() failed\n");
+		fprintf (stderr, "dirdbFindAndRef: dirdbStringIntern() failed\n");
 		return DIRDB_NOPARENT;
 	}
 	dirdbFreeChild = dirdbData[i].next;
@@ -1022,8 +1561,9 @@ void dirdbUnref(uint32_t node, enum dirdb_use use)
 	assert (dirdbData[node].child == DIRDB_NOPARENT);
 	parent = dirdbData[node].parent;
 	dirdbData[node].parent=DIRDB_NOPARENT;
-	free(dirdbData[node].name);
+	dirdbStringRelease(dirdbData[node].name);
 	dirdbData[node].name=0;
+	dirdbPathCacheForget (node);
 
 	dirdbData[node].mdb_ref=DIRDB_NO_MDBREF; /* this should not be needed */
 	dirdbData[node].newmdb_ref=DIRDB_NO_MDBREF; /* this should not be needed */
@@ -1068,7 +1608,7 @@ void dirdbGetName_internalstr(uint32_t node, const char **name)
 		fprintf(stderr, "dirdbGetName_internalstr: invalid node #2\n");
 		return;
 	}
-	*name = dirdbData[node].name;
+	*name = dirdbStringGet (dirdbData[node].name);
 }
 
 extern void dirdbGetName_malloc(uint32_t node, char **name)
@@ -1084,7 +1624,7 @@ extern void dirdbGetName_malloc(uint32_t node, char **name)
 		fprintf(stderr, "dirdbGetName_malloc: invalid node #2\n");
 		return;
 	}
-	*name = strdup (dirdbData[node].name);
+	*name = strdup (dirdbStringGet (dirdbData[node].name));
 	if (!*name)
 	{
 		fprintf (stderr, "dirdbGetName_malloc: strdup() failed\n");
@@ -1092,53 +1632,161 @@ extern void dirdbGetName_malloc(uint32_t node, char **name)
 	}
 }
 
-static void dirdbGetFullname_malloc_R(uint32_t node, char *name, int nobase)
+/* Returns the cache entry with the full path of node, moved to the front, or NULL if out of memory */
+static struct dirdbPathCacheEntry *dirdbPathCacheGet (uint32_t node)
 {
-	if (node == DIRDB_NOPARENT)
+	struct dirdbPathCacheEntry entry;
+	struct dirdbPathCacheEntry *base = 0;
+	uint32_t iter;
+	int i;
+
+	for (i=0; i < DIRDB_PATHCACHE_SIZE; i++)
 	{
-		return;
+		if (dirdbPathCache[i].path && (dirdbPathCache[i].node == node))
+		{
+			entry = dirdbPathCache[i];
+			memmove (dirdbPathCache + 1, dirdbPathCache, i * sizeof (dirdbPathCache[0]));
+			dirdbPathCache[0] = entry;
+			return dirdbPathCache;
+		}
 	}
-	if (dirdbData[node].parent == DIRDB_NOPARENT)
+
+	/* find the nearest ancestor that is cached, and the length of the path below it */
+	entry.node = node;
+	entry.length = 0;
+	for (iter = node; iter != DIRDB_NOPARENT; iter = dirdbData[iter].parent)
 	{
-		if (nobase)
+		for (i=0; i < DIRDB_PATHCACHE_SIZE; i++)
 		{
-			return;
+			if (dirdbPathCache[i].path && (dirdbPathCache[i].node == iter))
+			{
+				base = dirdbPathCache + i;
+				break;
+			}
+		}
+		if (base)
+		{
+			break;
+		}
+		entry.length += strlen (dirdbStringGet (dirdbData[iter].name));
+		if (dirdbData[iter].parent != DIRDB_NOPARENT)
+		{
+			entry.length++;
+		} else {
+			entry.drivelength = strlen (dirdbStringGet (dirdbData[iter].name));
 		}
-	} else {
-		dirdbGetFullname_malloc_R(dirdbData[node].parent, name, nobase);
-		strcat(name, "/");
 	}
-	strcat(name, dirdbData[node].name);
+	if (base)
+	{
+		entry.drivelength = base->drivelength;
+		entry.length += base->length;
+	}
+
+	entry.path = malloc (entry.length + 1);
+	if (!entry.path)
+	{
+		fprintf (stderr, "dirdbGetFullname: malloc() failed\n");
+		return 0;
+	}
+	entry.path[entry.length] = 0;
+
+	/* fill in from the end, until the ancestor is reached */
+	i = entry.length;
+	for (iter = node; (!base) || (iter != base->node); iter = dirdbData[iter].parent)
+	{
+		const char *name = dirdbStringGet (dirdbData[iter].name);
+		int len = strlen (name);
+		i -= len;
+		memcpy (entry.path + i, name, len);
+		if (dirdbData[iter].parent == DIRDB_NOPARENT)
+		{
+			break;
+		}
+		entry.path[--i] = '/';
+	}
+	if (base)
+	{
+		memcpy (entry.path, base->path, base->length);
+	}
+
+	free (dirdbPathCache[DIRDB_PATHCACHE_SIZE - 1].path);
+	memmove (dirdbPathCache + 1, dirdbPathCache, (DIRDB_PATHCACHE_SIZE - 1) * sizeof (dirdbPathCache[0]));
+	dirdbPathCache[0] = entry;
+	return dirdbPathCache;
 }
 
-void dirdbGetFullname_malloc(uint32_t node, char **name, int flags)
+int dirdbGetFullname_buffer(uint32_t node, char *name, int size, int flags)
 {
-	int length = 0;
-	int iter;
+	const char *prefix;
+	const char *leaf;
+	int prefixlen;
+	int leaflen;
+	int length;
 
-	*name=0;
 	if ((node == DIRDB_NOPARENT) || (node >= dirdbNum) || (!dirdbData[node].name))
 	{
-		fprintf(stderr, "dirdbGetFullname_malloc: invalid node\n");
-		return;
+		fprintf(stderr, "dirdbGetFullname: invalid node\n");
+		return -1;
 	}
 
-	for (iter = node; iter != DIRDB_NOPARENT; iter = dirdbData[iter].parent)
-	{
-		if (dirdbData[iter].parent == DIRDB_NOPARENT)
+	leaf = dirdbStringGet (dirdbData[node].name);
+	leaflen = strlen (leaf);
+	if (dirdbData[node].parent == DIRDB_NOPARENT)
+	{ /* the drive itself */
+		prefix = "";
+		prefixlen = 0;
+		if (flags & DIRDB_FULLNAME_NODRIVE)
 		{
-			if (flags & DIRDB_FULLNAME_NODRIVE)
-			{
-				continue;
-			}
-		} else {
-			length++;
+			leaf = "";
+			leaflen = 0;
+		}
+	} else {
+		/* the path of the parent directory is the one worth keeping, it is shared with all the siblings */
+		struct dirdbPathCacheEntry *parent = dirdbPathCacheGet (dirdbData[node].parent);
+		if (!parent)
+		{
+			return -1;
 		}
-		length += strlen (dirdbData[iter].name);
+		prefix = parent->path;
+		prefixlen = parent->length;
+		if (flags & DIRDB_FULLNAME_NODRIVE)
+		{
+			prefix += parent->drivelength;
+			prefixlen -= parent->drivelength;
+		}
+	}
+
+	length = prefixlen + ((dirdbData[node].parent != DIRDB_NOPARENT) ? 1 : 0) + leaflen + ((flags & DIRDB_FULLNAME_ENDSLASH) ? 1 : 0);
+	if (length >= size)
+	{
+		return length;
+	}
+
+	memcpy (name, prefix, prefixlen);
+	if (dirdbData[node].parent != DIRDB_NOPARENT)
+	{
+		name[prefixlen++] = '/';
+	}
+	memcpy (name + prefixlen, leaf, leaflen);
+	if (flags & DIRDB_FULLNAME_ENDSLASH)
+	{
+		name[prefixlen + leaflen++] = '/';
 	}
-	if (flags&DIRDB_FULLNAME_ENDSLASH)
+	name[prefixlen + leaflen] = 0;
+
+	return length;
+}
+
+void dirdbGetFullname_malloc(uint32_t node, char **name, int flags)
+{
+	int length;
+
+	*name=0;
+
+	length = dirdbGetFullname_buffer (node, 0, 0, flags);
+	if (length < 0)
 	{
-		length++;
+		return;
 	}
 
 	*name = malloc(length+1);
@@ -1147,30 +1795,52 @@ void dirdbGetFullname_malloc(uint32_t node, char **name, int flags)
 		fprintf (stderr, "dirdbGetFullname_malloc(): malloc() failed\n");
 		return;
 	}
-	(*name)[0] = 0;
 
-	dirdbGetFullname_malloc_R (node, *name, flags&DIRDB_FULLNAME_NODRIVE);
+	dirdbGetFullname_buffer (node, *name, length + 1, flags);
+}
 
-	if (flags&DIRDB_FULLNAME_ENDSLASH)
-	{
-		strcat(*name, "/");
-	}
 
-	if (strlen(*name) != length)
+struct dirdbFlushBuffer
+{
+	int f;
+	size_t fill;
+	uint8_t data[65536];
+};
+
+static int dirdbFlushWrite (struct dirdbFlushBuffer *buffer, const void *src, size_t len)
+{
+	while (len)
 	{
-		fprintf (stderr, "dirdbGetFullname_malloc: WARNING, length calculation was off. Expected %d, but got %d\n", length, (int)strlen (*name));
+		size_t chunk = sizeof (buffer->data) - buffer->fill;
+		if (chunk > len)
+		{
+			chunk = len;
+		}
+		memcpy (buffer->data + buffer->fill, src, chunk);
+		buffer->fill += chunk;
+		src = (const uint8_t *)src + chunk;
+		len -= chunk;
+
+		if (buffer->fill == sizeof (buffer->data))
+		{
+			if (write(buffer->f, buffer->data, buffer->fill) != buffer->fill)
+			{
+				return -1;
+			}
+			buffer->fill = 0;
+		}
 	}
+	return 0;
 }
 
-
 void dirdbFlush(void)
 {
 	char *path;
-	int f;
+	char *pathtmp;
+	struct dirdbFlushBuffer *buffer;
 	uint32_t i;
 	uint32_t max;
-	uint16_t buf16;
-	uint32_t buf32;
+	uint32_t offset;
 	struct dirdbheader header;
 
 	if (!dirdbDirty)
@@ -1193,62 +1863,100 @@ void dirdbFlush(void)
 	}
 
 	path = malloc(strlen(cfConfigDir)+11+1);
-	if (!path)
+	pathtmp = malloc(strlen(cfConfigDir)+15+1);
+	buffer = malloc(sizeof (*buffer));
+	if (!path || !pathtmp || !buffer)
 	{
 		fprintf(stderr, "dirdbFlush: malloc() failed\n");
+		free (path);
+		free (pathtmp);
+		free (buffer);
 		return;
 	}
 	strcpy(path, cfConfigDir);
 	strcat(path, "CPDIRDB.DAT");
+	strcpy(pathtmp, cfConfigDir);
+	strcat(pathtmp, "CPDIRDB.DAT.tmp");
 
-	if ((f=open(path, O_WRONLY|O_CREAT|O_TRUNC, S_IREAD|S_IWRITE))<0)
+	/* write a new file and rename it into place, so a crash never leaves a half-written database behind */
+	buffer->fill = 0;
+	if ((buffer->f=open(pathtmp, O_WRONLY|O_CREAT|O_TRUNC, S_IREAD|S_IWRITE))<0)
 	{
-		perror("open(cfConfigDir/CPDIRDB.DAT)");
+		perror("open(cfConfigDir/CPDIRDB.DAT.tmp)");
 		free (path);
+		free (pathtmp);
+		free (buffer);
 		return;
 	}
-	free (path);
-	path=0;
 
 	max=0;
 	for (i=0;i<dirdbNum;i++)
 		if (dirdbData[i].name)
 			max=i+1;
 
-	memcpy(header.sig, dirdbsigv2, sizeof(dirdbsigv2));
+	memcpy(header.sig, dirdbsigv3, sizeof(dirdbsigv3));
 	header.entries=uint32_little(max);
 
-	if (write(f, &header, sizeof(header))!=sizeof(header))
+	if (dirdbFlushWrite(buffer, &header, sizeof(header)))
 		goto writeerror;
 
-	for (i=0;i<max;i++)
+	for (i=0, offset=0;i<max;i++)
 	{
-		int len=(dirdbData[i].name?strlen(dirdbData[i].name):0);
-		buf16=uint16_little(len);
-		if (write(f, &buf16, sizeof(uint16_t))!=sizeof(uint16_t))
+		struct dirdbrecordv3 record;
+		if (dirdbData[i].name)
+		{
+			uint16_t len = strlen(dirdbStringGet(dirdbData[i].name));
+			record.parent = uint32_little(dirdbData[i].parent);
+			record.mdb_ref = uint32_little(dirdbData[i].mdb_ref);
+			record.name_offset = uint32_little(offset);
+			record.name_length = uint16_little(len);
+			offset += len + 1;
+		} else {
+			record.parent = uint32_little(DIRDB_NOPARENT);
+			record.mdb_ref = uint32_little(DIRDB_NO_MDBREF);
+			record.name_offset = 0;
+			record.name_length = 0;
+		}
+		record.reserved = 0;
+		if (dirdbFlushWrite(buffer, &record, sizeof(record)))
 			goto writeerror;
-		if (len)
+	}
+
+	for (i=0;i<max;i++)
+	{
+		if (dirdbData[i].name)
 		{
-			buf32=uint32_little(dirdbData[i].parent);
-			if (write(f, &buf32, sizeof(uint32_t))!=sizeof(uint32_t))
-				goto writeerror;
-			buf32=uint32_little(dirdbData[i].mdb_ref);
-			if (write(f, &buf32, sizeof(uint32_t))!=sizeof(uint32_t))
-				goto writeerror;
-#warning remove-me this used to be ADB_REF
-			buf32=0xffffffff; //ADB_REF
-			if (write(f, &buf32, sizeof(uint32_t))!=sizeof(uint32_t))
-				goto writeerror;
-			if (write(f, dirdbData[i].name, len)!=len)
+			const char *name = dirdbStringGet(dirdbData[i].name);
+			if (dirdbFlushWrite(buffer, name, strlen(name) + 1))
 				goto writeerror;
 		}
 	}
-	close(f);
-	dirdbDirty=0;
+
+	if (buffer->fill && (write(buffer->f, buffer->data, buffer->fill) != buffer->fill))
+		goto writeerror;
+
+	if (fsync(buffer->f))
+		goto writeerror;
+
+	close(buffer->f);
+	if (rename(pathtmp, path))
+	{
+		perror("dirdb rename()");
+		unlink(pathtmp);
+	} else {
+		dirdbDirty=0;
+	}
+	free (path);
+	free (pathtmp);
+	free (buffer);
 	return;
 writeerror:
 	perror("dirdb write()");
-	close(f);
+	close(buffer->f);
+	unlink(pathtmp);
+	free (path);
+	free (pathtmp);
+	free (buffer);
 }
 
 uint32_t dirdbGetParentAndRef (uint32_t node, enum dirdb_use use)
@@ -1378,6 +2086,7 @@ static void _dirdbTagRemoveUntaggedAndSubmit(uint32_t node)
 			{
 				dirdbData[i].mdb_ref = dirdbData[i].newmdb_ref;
 				dirdbData[i].newmdb_ref = DIRDB_NO_MDBREF;
+				dirdbMdbNodesAdd (i);
 				/* no need to unref/ref, since we are
 				 * balanced. Since somebody can have
 				 * named a file, the same name
@@ -1456,10 +2165,50 @@ void dirdbTagRemoveUntaggedAndSubmit(void)
 	}
 	tagparentnode=DIRDB_NOPARENT;
 	dirdbDirty=1;
+	dirdbMdbNodesCommit ();
 }
 
 int dirdbGetMdb(uint32_t *dirdbnode, uint32_t *mdb_ref, int *first)
 {
+	uint32_t pos;
+
+	if (dirdbMdbNodesValid)
+	{
+		if (*first)
+		{
+			pos = 0;
+			*first = 0;
+		} else if ((dirdbMdbNodesHint < dirdbMdbNodesCount) && (dirdbMdbNodes[dirdbMdbNodesHint] == *dirdbnode))
+		{
+			pos = dirdbMdbNodesHint + 1;
+		} else { /* the first node after *dirdbnode */
+			uint32_t top = dirdbMdbNodesCount;
+			pos = 0;
+			while (pos < top)
+			{
+				uint32_t mid = pos + (top - pos) / 2;
+				if (dirdbMdbNodes[mid] <= *dirdbnode)
+				{
+					pos = mid + 1;
+				} else {
+					top = mid;
+				}
+			}
+		}
+		for (; pos < dirdbMdbNodesCount; pos++)
+		{
+			uint32_t node = dirdbMdbNodes[pos];
+			if ((dirdbData[node].name)&&(dirdbData[node].mdb_ref!=DIRDB_NO_MDBREF))
+			{
+				dirdbMdbNodesHint = pos;
+				*dirdbnode = node;
+				*mdb_ref=dirdbData[node].mdb_ref;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
 	if (*first)
 	{
 		*dirdbnode=0;
@@ -28,12 +28,14 @@ enum dirdb_use
 
 extern const char dirdbsigv1[60];
 extern const char dirdbsigv2[60];
+extern const char dirdbsigv3[60];
 
 extern void dirdbFlush(void); /* removes all nodes that hasn't been ref'ed yet aswell */
 
 #define DIRDB_FULLNAME_NODRIVE  1 /* without the drive: prefix */
 #define DIRDB_FULLNAME_ENDSLASH 2
 extern void dirdbGetFullname_malloc(uint32_t node, char **name, int flags);
+extern int dirdbGetFullname_buffer(uint32_t node, char *name, int size, int flags); /* returns the length of the path like snprintf(), name is only filled in if it fits. -1 on errors */
 
 extern void dirdbGetName_internalstr(uint32_t node, const char **name); /* gives a pointer that is valid as long as you do not call dirdbUnref(). The buffer MUST NOT be sent to free() */
 extern void dirdbGetName_malloc(uint32_t node, char **name); /* does not allow / in name, but \\ */
@@ -86,7 +88,7 @@ extern void dirdbMakeMdbRef(uint32_t node, uint32_t mdbref);
 extern void dirdbTagCancel(void);
 extern void dirdbTagRemoveUntaggedAndSubmit(void);
 
-/* iterate the internal database of all known songs - medialib: */
+/* iterate the internal database of all known songs - medialib: songs from all sources, in node order */
 extern int dirdbGetMdb(uint32_t *dirdbnode, uint32_t *mdbnode, int *first);
 
 void utf8_XdotY_name (const int X, const int Y, char *shortname, const char *source);
@@ -2,6 +2,8 @@
 
 #define INPUTBUFFERSIZE 128
 #define OUTPUTBUFFERSIZE 64
+#define BZIP2_BLOCKMODE_THRESHOLD 4096
+#define BZIP2_BLOCKS_SCAN_STEP 4096
 
 #include "filesystem-bzip2.c"
 #include "filesystem-dir-mem.h"
@@ -43,6 +45,12 @@ void dirdbGetName_internalstr (uint32_t ref, const char **retval)
 	if (ref == 9) *retval = "test5.txt.bz2.bz2";
 	if (ref == 10) *retval = "test5.txt.bz2";
 	if (ref == 11) *retval = "test5.txt";
+	if (ref == 12) *retval = "test6.txt.bz2";
+	if (ref == 13) *retval = "test6.txt";
+	if (ref == 14) *retval = "test7.txt.bz2";
+	if (ref == 15) *retval = "test7.txt";
+	if (ref == 16) *retval = "test8.txt.bz2";
+	if (ref == 17) *retval = "test8.txt";
 
 }
 
@@ -95,13 +103,36 @@ void register_dirdecompressor (const struct ocpdirdecompressor_t *ofd)
 {
 }
 
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file)
+{
+	return file->open (file);
+}
+
+/* only the block index of test6 is remembered */
+static unsigned char *test_bzix_data;
+static size_t test_bzix_datasize;
+
 int adbMetaAdd (const char *filename, const size_t filesize, const char *SIG, const unsigned char  *data, const size_t  datasize)
 {
+	if (!strcmp (SIG, "BZIX") && (!strcmp (filename, "test6.txt.bz2") || !strcmp (filename, "test8.txt.bz2")))
+	{
+		free (test_bzix_data);
+		test_bzix_data = malloc (datasize);
+		memcpy (test_bzix_data, data, datasize);
+		test_bzix_datasize = datasize;
+	}
 	return 0;
 }
 
 int adbMetaGet (const char *filename, const size_t filesize, const char *SIG,       unsigned char **data,       size_t *datasize)
 {
+	if (!strcmp (SIG, "BZIX") && (!strcmp (filename, "test6.txt.bz2") || !strcmp (filename, "test8.txt.bz2")) && test_bzix_data)
+	{
+		*data = malloc (test_bzix_datasize);
+		memcpy (*data, test_bzix_data, test_bzix_datasize);
+		*datasize = test_bzix_datasize;
+		return 0;
+	}
 	return -1;
 }
 
@@ -418,6 +449,362 @@ int bzip2_test5 (void)
 	return retval;
 }
 
+int bzip2_test6 (void)
+{
+	const uint32_t offsets[] = {0x1ff00, 0x00010, 0x12345, 0x1fffe, 0x08000, 0x0c031};
+	unsigned int plainsize = 0x20000 * 6;
+	char *plain = malloc (plainsize + 1); /* sprintf() terminates the last line */
+	unsigned int dsrcsize = plainsize;
+	char *dsrc = malloc (dsrcsize);
+	int retval = 0;
+	struct ocpdir_t *test_dir;
+	struct ocpfile_t *osrc;
+	struct ocpdir_t *oddst;
+	struct ocpfile_t *odst;
+	struct ocpfilehandle_t *hdst;
+	char dst[6];
+	int i, pass;
+
+	printf ("Testing block-mode, seek and reads using the block index:  ");
+
+	for (i=0; i < 0x20000; i++)
+	{
+		sprintf (plain + i * 6, "%05x\n", i);
+	}
+	/* 100k block size, gives several blocks */
+	BZ2_bzBuffToBuffCompress (dsrc, &dsrcsize, plain, plainsize, 1, 0, 0);
+	free (plain);
+
+	for (pass=0; pass < 2; pass++)
+	{
+		char *dsrc2 = malloc (dsrcsize);
+		memcpy (dsrc2, dsrc, dsrcsize);
+		test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+		osrc = mem_file_open (test_dir, 12, dsrc2, dsrcsize);
+		test_dir->unref (test_dir); test_dir = 0;
+
+		oddst = bzip2_check_steal (osrc, 13);
+		odst = oddst->readdir_file(oddst, 13);
+		hdst = odst->open (odst);
+
+		if (!pass)
+		{ /* the first pass switches to block-mode after a while, and learns the size of all the blocks */
+			for (i=0; i < 0x20000; i++)
+			{
+				if ((hdst->read (hdst, dst, 6) != 6) || (strtol (dst, 0, 16) != i))
+				{
+					printf ("r");
+					retval |= 1;
+					break;
+				}
+			}
+			if (hdst->read (hdst, dst, 6) != 0)
+			{
+				printf ("e");
+				retval |= 1;
+			}
+			if ((((struct bzip2_ocpdir_t *)oddst)->child.blocks_count < 4) ||
+			    (((struct bzip2_ocpdir_t *)oddst)->child.blocks_known != ((struct bzip2_ocpdir_t *)oddst)->child.blocks_count))
+			{
+				printf ("b");
+				retval |= 2;
+			}
+		} else { /* the second pass should have the index loaded from the metadata */
+			if ((((struct bzip2_ocpdir_t *)oddst)->child.blocks_state != 1) || (!odst->filesize_ready (odst)))
+			{
+				printf ("l");
+				retval |= 2;
+			}
+		}
+
+		for (i=0; i < sizeof (offsets) / sizeof (offsets[0]); i++)
+		{
+			char expect[7];
+			sprintf (expect, "%05x\n", offsets[i]);
+			if (hdst->seek_set (hdst, offsets[i] * 6))
+			{
+				printf ("s");
+				retval |= 4;
+			} else if (hdst->read (hdst, dst, 6) != 6)
+			{
+				printf ("r");
+				retval |= 4;
+			} else if (memcmp (dst, expect, 6))
+			{
+				printf ("d");
+				retval |= 8;
+			} else if (!((struct bzip2_ocpfilehandle_t *)hdst)->blockmode)
+			{
+				printf ("m");
+				retval |= 16;
+			} else {
+				printf ("%d", pass * 6 + i + 1);
+			}
+		}
+
+		hdst->unref (hdst); hdst = 0;
+		oddst->unref (oddst); oddst = 0;
+		odst->unref (odst); odst = 0;
+		osrc->unref (osrc); osrc = 0;
+
+		if ((!pass) && (!test_bzix_data))
+		{
+			printf ("x");
+			retval |= 2;
+		}
+	}
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (dsrc);
+	free (test_bzix_data);
+	test_bzix_data = 0;
+
+	return retval;
+}
+
+int bzip2_test7 (void)
+{
+	const uint32_t offsets[] = {0x1ff00, 0x00010, 0x12345, 0x08000};
+	unsigned int plainsize = 0x20000 * 6;
+	char *plain = malloc (plainsize + 1); /* sprintf() terminates the last line */
+	unsigned int dsrcsize = plainsize;
+	char *dsrc = malloc (dsrcsize);
+	int retval = 0;
+	struct ocpdir_t *test_dir;
+	struct ocpfile_t *osrc;
+	struct ocpdir_t *oddst;
+	struct ocpfile_t *odst;
+	struct ocpfilehandle_t *h[2];
+	struct bzip2_ocpfile_t *o;
+	char dst[6];
+	int i, j;
+
+	printf ("Testing that a bad block index makes all handles fall back to sequential decoding:  ");
+
+	for (i=0; i < 0x20000; i++)
+	{
+		sprintf (plain + i * 6, "%05x\n", i);
+	}
+	BZ2_bzBuffToBuffCompress (dsrc, &dsrcsize, plain, plainsize, 1, 0, 0);
+	free (plain);
+
+	test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+	osrc = mem_file_open (test_dir, 14, dsrc, dsrcsize);
+	test_dir->unref (test_dir); test_dir = 0;
+
+	oddst = bzip2_check_steal (osrc, 15);
+	odst = oddst->readdir_file(oddst, 15);
+	o = &((struct bzip2_ocpdir_t *)oddst)->child;
+	h[0] = odst->open (odst);
+	h[1] = odst->open (odst);
+
+	/* the boundaries are searched for a few KB at a time, sequential decoding continues in the meantime */
+	for (j=0; j < 2; j++)
+	{
+		for (i=0; (i < 0x20000) && (!((struct bzip2_ocpfilehandle_t *)h[j])->blockmode); i++)
+		{
+			if ((h[j]->read (h[j], dst, 6) != 6) || (strtol (dst, 0, 16) != i))
+			{
+				printf ("r");
+				retval |= 1;
+				break;
+			}
+		}
+		if (!((struct bzip2_ocpfilehandle_t *)h[j])->blockmode)
+		{
+			printf ("m");
+			retval |= 2;
+		}
+	}
+
+	/* point the last block one bit off, so it fails to decode */
+	if (o->blocks_count > 1)
+	{
+		o->blocks[o->blocks_count - 1].inbit++;
+	}
+
+	for (i=0; i < sizeof (offsets) / sizeof (offsets[0]); i++)
+	{
+		char expect[7];
+		sprintf (expect, "%05x\n", offsets[i]);
+		j = i & 1; /* the first read hits the bad block, the others are on the handle that did not see the failure */
+		if (h[j]->seek_set (h[j], offsets[i] * 6))
+		{
+			printf ("s");
+			retval |= 4;
+		} else if (h[j]->read (h[j], dst, 6) != 6)
+		{
+			printf ("r");
+			retval |= 4;
+		} else if (memcmp (dst, expect, 6))
+		{
+			printf ("d");
+			retval |= 8;
+		} else {
+			printf ("%d", i + 1);
+		}
+	}
+	if ((o->blocks_state != -1) || ((struct bzip2_ocpfilehandle_t *)h[0])->blockmode || ((struct bzip2_ocpfilehandle_t *)h[1])->blockmode)
+	{
+		printf ("x");
+		retval |= 16;
+	}
+
+	h[0]->unref (h[0]);
+	h[1]->unref (h[1]);
+	oddst->unref (oddst);
+	odst->unref (odst);
+	osrc->unref (osrc);
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (test_bzix_data);
+	test_bzix_data = 0;
+
+	return retval;
+}
+
+static uint32_t bzip2_test_bzix_known (void)
+{
+	if ((!test_bzix_data) || (test_bzix_datasize < 9))
+	{
+		return 0;
+	}
+	return test_bzix_data[5] | (test_bzix_data[6] << 8) | (test_bzix_data[7] << 16) | ((uint32_t)test_bzix_data[8] << 24);
+}
+
+int bzip2_test8 (void)
+{
+	unsigned int plainsize = 0x20000 * 6;
+	char *plain = malloc (plainsize + 1); /* sprintf() terminates the last line */
+	unsigned int dsrcsize = plainsize;
+	char *dsrc = malloc (dsrcsize);
+	int retval = 0;
+	struct ocpdir_t *test_dir;
+	struct ocpfile_t *osrc;
+	struct ocpdir_t *oddst;
+	struct ocpfile_t *odst;
+	struct ocpfilehandle_t *hdst;
+	struct bzip2_ocpfile_t *o;
+	char dst[6];
+	uint32_t known = 0;
+	int count = 0;
+	int i, pass;
+
+	printf ("Testing that a partial block index is loaded and extended:  ");
+
+	for (i=0; i < 0x20000; i++)
+	{
+		sprintf (plain + i * 6, "%05x\n", i);
+	}
+	BZ2_bzBuffToBuffCompress (dsrc, &dsrcsize, plain, plainsize, 1, 0, 0);
+	free (plain);
+
+	for (pass=0; pass < 3; pass++)
+	{
+		char *dsrc2 = malloc (dsrcsize);
+		memcpy (dsrc2, dsrc, dsrcsize);
+		test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+		osrc = mem_file_open (test_dir, 16, dsrc2, dsrcsize);
+		test_dir->unref (test_dir); test_dir = 0;
+
+		oddst = bzip2_check_steal (osrc, 17);
+		odst = oddst->readdir_file(oddst, 17);
+		o = &((struct bzip2_ocpdir_t *)oddst)->child;
+		hdst = odst->open (odst);
+
+		if (!pass)
+		{ /* only visit the first blocks, like when a tar archive is only partially listed */
+			for (i=0; i < 0x08000; i++)
+			{
+				if ((hdst->read (hdst, dst, 6) != 6) || (strtol (dst, 0, 16) != i))
+				{
+					printf ("r");
+					retval |= 1;
+					break;
+				}
+			}
+			count = o->blocks_count;
+		} else if (pass == 1)
+		{ /* the partial index is loaded, with the sizes of the blocks that were visited */
+			if ((o->blocks_state != 1) || (o->blocks_count != count) || (o->blocks_known != known) || odst->filesize_ready (odst))
+			{
+				printf ("l");
+				retval |= 2;
+			}
+			for (i=0x1ff00; i < 0x20000; i++)
+			{
+				char expect[7];
+				sprintf (expect, "%05x\n", i);
+				if (((i == 0x1ff00) && hdst->seek_set (hdst, i * 6)) || (hdst->read (hdst, dst, 6) != 6) || memcmp (dst, expect, 6))
+				{
+					printf ("r");
+					retval |= 4;
+					break;
+				}
+			}
+			if (!((struct bzip2_ocpfilehandle_t *)hdst)->blockmode)
+			{
+				printf ("m");
+				retval |= 16;
+			}
+		} else { /* the extended index is complete */
+			if ((o->blocks_state != 1) || (o->blocks_known != count) || (!odst->filesize_ready (odst)) || (odst->filesize (odst) != plainsize))
+			{
+				printf ("c");
+				retval |= 2;
+			}
+		}
+
+		hdst->unref (hdst); hdst = 0;
+		oddst->unref (oddst); oddst = 0;
+		odst->unref (odst); odst = 0;
+		osrc->unref (osrc); osrc = 0;
+
+		if (!pass)
+		{
+			known = bzip2_test_bzix_known ();
+			if ((count < 4) || (!known) || (known >= count))
+			{
+				printf ("p");
+				retval |= 2;
+			}
+		} else if ((pass == 1) && (bzip2_test_bzix_known () != count))
+		{
+			printf ("x");
+			retval |= 2;
+		}
+		if (!retval)
+		{
+			printf ("%d", pass + 1);
+		}
+	}
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (dsrc);
+	free (test_bzix_data);
+	test_bzix_data = 0;
+
+	return retval;
+}
+
 int main(int argc, char *argv[])
 {
 	int retval = 0;
@@ -426,6 +813,9 @@ int main(int argc, char *argv[])
 	retval |= bzip2_test1 ();
 	retval |= bzip2_test3 ();
 	retval |= bzip2_test5 ();
+	retval |= bzip2_test6 ();
+	retval |= bzip2_test7 ();
+	retval |= bzip2_test8 ();
 	printf ("\n");
 
 	return retval;
@@ -19,15 +19,18 @@
  */
 
 #include "config.h"
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <bzlib.h>
 #include "types.h"
 #include "adbmeta.h"
 #include "dirdb.h"
 #include "filesystem.h"
 #include "filesystem-bzip2.h"
+#include "filesystem-spill.h"
 #include "stuff/framelock.h"
 
 #ifndef INPUTBUFFERSIZE
@@ -38,6 +41,21 @@
 # define OUTPUTBUFFERSIZE 65536
 #endif
 
+#ifndef BZIP2_BLOCKMODE_THRESHOLD
+# define BZIP2_BLOCKMODE_THRESHOLD (1024*1024) /* once a handle has read past this point, we scan for the block boundaries and switch to block-mode */
+#endif
+
+#ifndef BZIP2_BLOCKS_SCAN_STEP
+# define BZIP2_BLOCKS_SCAN_STEP (256*1024) /* compressed bytes to search for block boundaries per read, so a large file does not stall the UI */
+#endif
+
+#define BZIP2_WORKERS_MAX 8
+
+#define BZIP2_INDEX_VERSION 1
+
+#define BZIP2_BLOCK_MAGIC 0x314159265359ULL /* BCD of pi, 48 bits, not byte aligned */
+#define BZIP2_EOS_MAGIC   0x177245385090ULL /* BCD of sqrt(pi), 48 bits, not byte aligned */
+
 #if defined(BZIP2_DEBUG) || defined(BZIP2_VERBOSE)
 static int do_bzip2_debug_print=1;
 #endif
@@ -54,6 +72,35 @@ static int do_bzip2_debug_print=1;
 #define VERBOSE_PRINT(...) {}
 #endif
 
+enum bzip2_slot_state_t
+{
+	bzip2_slot_idle,
+	bzip2_slot_queued,
+	bzip2_slot_busy,
+	bzip2_slot_done,
+	bzip2_slot_error
+};
+
+/* one block of the ordered output window. Slot for block N is always slots[N % nslots]. When state is busy, only the worker touches the slot */
+struct bzip2_slot_t
+{
+	int                     block;
+	enum bzip2_slot_state_t state;
+	uint8_t                *input;      /* the block, re-wrapped as a stand-alone bzip2 stream */
+	uint32_t                inputsize;
+	uint8_t                *output;
+	uint32_t                outputsize; /* allocated size */
+	uint32_t                outputfill;
+};
+
+struct bzip2_block_t
+{
+	uint64_t inbit;   /* bit position of the block magic in the compressed file */
+	uint64_t endbit;  /* bit position of the next block magic, or the end-of-stream magic */
+	uint64_t out;     /* position in the uncompressed stream, valid for blocks[0] to blocks[blocks_known] */
+	uint32_t outsize; /* valid for blocks[0] to blocks[blocks_known-1] */
+};
+
 struct bzip2_ocpfilehandle_t
 {
 	struct ocpfilehandle_t head;
@@ -75,6 +122,15 @@ struct bzip2_ocpfilehandle_t
 
 	int need_deinit;
 	int error;
+
+	int                   blockmode; /* data is served from slots, decoded by the workers */
+	int                   nslots;
+	struct bzip2_slot_t  *slots;
+	pthread_mutex_t       mutex;
+	pthread_cond_t        cond;
+	pthread_t             threads[BZIP2_WORKERS_MAX];
+	int                   threadcount;
+	int                   shutdown;
 };
 
 struct bzip2_ocpfile_t /* head->parent always point to a bzip2_ocpdir_t */
@@ -84,6 +140,16 @@ struct bzip2_ocpfile_t /* head->parent always point to a bzip2_ocpdir_t */
 
 	int                   filesize_pending;
 	uint64_t uncompressed_filesize;
+
+	struct bzip2_block_t *blocks;
+	int                   blocks_count;
+	int                   blocks_size;
+	int                   blocks_state; /* 0 = not scanned yet, 1 = ready, -1 = not usable (single block, multiple streams, or failed to decode) */
+	uint64_t              blocks_scanbit;   /* while blocks_state is 0: number of bits searched so far, 0 if not started */
+	uint64_t              blocks_scanshift; /* while blocks_state is 0: the last 48 bits searched */
+	int                   blocks_known; /* uncompressed size is known for this many leading blocks */
+	int                   blocks_loaded; /* have we checked adbMeta yet? */
+	int                   blocks_dirty;  /* blocks_known has grown since the index was stored */
 };
 
 struct bzip2_ocpdir_t
@@ -138,6 +204,718 @@ static int bzip2_ocpfilehandle_compressInit (struct bzip2_ocpfilehandle_t *s)
 	return 0;
 }
 
+static void bzip2_ocpfile_filesize_store (struct bzip2_ocpfile_t *s, struct ocpfilehandle_t *compressedfilehandle, uint64_t filesize)
+{
+	uint8_t buffer[8];
+	const char *filename = 0;
+	uint64_t compressedfile_size = compressedfilehandle->filesize (compressedfilehandle);
+
+	s->filesize_pending = 0;
+	s->uncompressed_filesize = filesize;
+
+	buffer[7] = filesize >> 56;
+	buffer[6] = filesize >> 48;
+	buffer[5] = filesize >> 40;
+	buffer[4] = filesize >> 32;
+	buffer[3] = filesize >> 24;
+	buffer[2] = filesize >> 16;
+	buffer[1] = filesize >> 8;
+	buffer[0] = filesize;
+
+	dirdbGetName_internalstr (compressedfilehandle->dirdb_ref, &filename);
+
+	DEBUG_PRINT ("[BZIP2 filesize_store] adbMetaAdd(%s, %"PRId64", BZIP2, [%02x %02x %02x %02x %02x %02x %02x %02x] => %"PRIu64")\n", filename, compressedfile_size, buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7], filesize);
+	adbMetaAdd (filename, compressedfile_size, "BZIP2", buffer, 8);
+}
+
+static void bzip2_ocpfile_blocks_clear (struct bzip2_ocpfile_t *s)
+{
+	free (s->blocks);
+	s->blocks = 0;
+	s->blocks_count = 0;
+	s->blocks_size = 0;
+	s->blocks_known = 0;
+}
+
+static int bzip2_ocpfile_blocks_append (struct bzip2_ocpfile_t *s, uint64_t inbit)
+{
+	if (s->blocks_count >= s->blocks_size)
+	{
+		struct bzip2_block_t *temp = realloc (s->blocks, (s->blocks_size + 64) * sizeof (s->blocks[0]));
+		if (!temp)
+		{
+			return -1;
+		}
+		s->blocks = temp;
+		s->blocks_size += 64;
+	}
+	s->blocks[s->blocks_count].inbit = inbit;
+	s->blocks[s->blocks_count].endbit = 0;
+	s->blocks[s->blocks_count].out = 0;
+	s->blocks[s->blocks_count].outsize = 0;
+	s->blocks_count++;
+	return 0;
+}
+
+/* Locate the block boundaries in the first stream, BZIP2_BLOCKS_SCAN_STEP bytes at a time. The magics are not byte aligned, so we need
+ * to check at every bit position. Returns 1 if there is more to scan, 0 when all the blocks are found, or -1 if the file can not be indexed.
+ * The magic can in theory appear inside the compressed data. If so, the decoding of that block will fail and we fall back to sequential decoding.
+ */
+static int bzip2_ocpfile_blocks_scan (struct bzip2_ocpfile_t *s, struct ocpfilehandle_t *h)
+{
+	uint8_t buffer[4096];
+	uint64_t oldpos = h->getpos (h);
+	uint64_t shift = s->blocks_scanshift;
+	uint64_t bitpos = s->blocks_scanbit;
+	int remaining = BZIP2_BLOCKS_SCAN_STEP;
+	int done = 0;
+	int retval = 1;
+
+	if (!bitpos)
+	{
+		bzip2_ocpfile_blocks_clear (s);
+		shift = 0;
+		if (h->seek_set (h, 0) < 0)
+		{
+			return -1;
+		}
+		if ((h->read (h, buffer, 4) != 4) ||
+		    (buffer[0] != 'B') || (buffer[1] != 'Z') || (buffer[2] != 'h') || (buffer[3] < '1') || (buffer[3] > '9'))
+		{
+			h->seek_set (h, oldpos);
+			return -1;
+		}
+		bitpos = 32;
+	} else if (h->seek_set (h, bitpos >> 3) < 0)
+	{
+		return -1;
+	}
+
+	while ((!done) && (remaining > 0))
+	{
+		int fill = h->read (h, buffer, (remaining < sizeof (buffer)) ? remaining : sizeof (buffer));
+		int i, j;
+
+		if (fill <= 0)
+		{
+			retval = -1;
+			break;
+		}
+		remaining -= fill;
+		for (i=0; (i < fill) && (!done); i++)
+		{
+			for (j=7; j >= 0; j--)
+			{
+				uint64_t magic;
+
+				shift = (shift << 1) | ((buffer[i] >> j) & 1);
+				bitpos++;
+				magic = shift & 0xffffffffffffULL;
+				if (magic == BZIP2_BLOCK_MAGIC)
+				{
+					if (s->blocks_count)
+					{
+						s->blocks[s->blocks_count - 1].endbit = bitpos - 48;
+					}
+					if (bzip2_ocpfile_blocks_append (s, bitpos - 48))
+					{
+						retval = -1;
+						done = 1;
+						break;
+					}
+				} else if (magic == BZIP2_EOS_MAGIC)
+				{
+					if (s->blocks_count)
+					{
+						s->blocks[s->blocks_count - 1].endbit = bitpos - 48;
+					}
+					retval = 0;
+					done = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	h->seek_set (h, oldpos);
+
+	if (retval > 0)
+	{ /* only whole bytes have been consumed, so bitpos is byte aligned */
+		s->blocks_scanbit = bitpos;
+		s->blocks_scanshift = shift;
+		return 1;
+	}
+	s->blocks_scanbit = 0;
+	s->blocks_scanshift = 0;
+
+	if (retval || (!s->blocks_count) || (s->blocks[0].inbit != 32))
+	{
+		bzip2_ocpfile_blocks_clear (s);
+		return -1;
+	}
+
+	DEBUG_PRINT ("[BZIP2 blocks_scan] found %d blocks\n", s->blocks_count);
+
+	return 0;
+}
+
+/* BZIX metadata: version:8, count:32, known:32, and count * { inbit:64 endbit:64 outsize:32 }, all little-endian. outsize is only valid for the first known blocks */
+static void bzip2_ocpfile_blocks_load (struct bzip2_ocpfile_t *s)
+{
+	unsigned char *metadata = 0;
+	size_t metadatasize = 0;
+	const char *filename = 0;
+	uint32_t count, known, i;
+
+	if (s->blocks_loaded || s->blocks_state || s->blocks_scanbit)
+	{
+		return;
+	}
+	if (!s->compressedfile->filesize_ready (s->compressedfile))
+	{
+		return;
+	}
+	s->blocks_loaded = 1;
+
+	dirdbGetName_internalstr (s->compressedfile->dirdb_ref, &filename);
+
+	if (adbMetaGet (filename, s->compressedfile->filesize (s->compressedfile), "BZIX", &metadata, &metadatasize))
+	{
+		return;
+	}
+
+	if ((metadatasize < 9) || (metadata[0] != BZIP2_INDEX_VERSION))
+	{
+		free (metadata);
+		return;
+	}
+	count = metadata[1] | (metadata[2] << 8) | (metadata[3] << 16) | ((uint32_t)metadata[4] << 24);
+	known = metadata[5] | (metadata[6] << 8) | (metadata[7] << 16) | ((uint32_t)metadata[8] << 24);
+	if ((count < 2) || (known > count) || ((metadatasize - 9) / 20 != count) || ((metadatasize - 9) % 20))
+	{
+		free (metadata);
+		return;
+	}
+
+	for (i=0; i < count; i++)
+	{
+		const unsigned char *m = metadata + 9 + i * 20;
+		uint64_t inbit = 0, endbit = 0;
+		int j;
+
+		for (j=7; j >= 0; j--)
+		{
+			inbit  = (inbit  << 8) | m[j];
+			endbit = (endbit << 8) | m[8 + j];
+		}
+		if ((endbit <= inbit) || (s->blocks_count && (inbit < s->blocks[s->blocks_count - 1].endbit)) || bzip2_ocpfile_blocks_append (s, inbit))
+		{
+			bzip2_ocpfile_blocks_clear (s);
+			free (metadata);
+			return;
+		}
+		s->blocks[i].endbit = endbit;
+		if (i < known)
+		{
+			s->blocks[i].outsize = m[16] | (m[17] << 8) | (m[18] << 16) | ((uint32_t)m[19] << 24);
+		}
+		if (i <= known)
+		{
+			s->blocks[i].out = i ? (s->blocks[i - 1].out + s->blocks[i - 1].outsize) : 0;
+		}
+	}
+	free (metadata);
+
+	s->blocks_known = known;
+	s->blocks_state = 1;
+
+	if (s->filesize_pending && (known == count))
+	{
+		s->filesize_pending = 0;
+		s->uncompressed_filesize = s->blocks[count - 1].out + s->blocks[count - 1].outsize;
+	}
+
+	DEBUG_PRINT ("[BZIP2 blocks_load] %s: %d blocks, %d with known size\n", filename, s->blocks_count, s->blocks_known);
+}
+
+static void bzip2_ocpfile_blocks_save (struct bzip2_ocpfile_t *s, struct ocpfilehandle_t *compressedfilehandle)
+{
+	const char *filename = 0;
+	unsigned char *metadata;
+	size_t metadatasize = 9 + 20 * s->blocks_count;
+	int i, j;
+
+	if (!s->blocks_dirty)
+	{
+		return;
+	}
+	s->blocks_dirty = 0;
+
+	metadata = malloc (metadatasize);
+	if (!metadata)
+	{
+		return;
+	}
+
+	metadata[0] = BZIP2_INDEX_VERSION;
+	metadata[1] = s->blocks_count;
+	metadata[2] = s->blocks_count >> 8;
+	metadata[3] = s->blocks_count >> 16;
+	metadata[4] = s->blocks_count >> 24;
+	metadata[5] = s->blocks_known;
+	metadata[6] = s->blocks_known >> 8;
+	metadata[7] = s->blocks_known >> 16;
+	metadata[8] = s->blocks_known >> 24;
+	for (i=0; i < s->blocks_count; i++)
+	{
+		unsigned char *m = metadata + 9 + i * 20;
+		for (j=0; j < 8; j++)
+		{
+			m[j]     = s->blocks[i].inbit  >> (j * 8);
+			m[8 + j] = s->blocks[i].endbit >> (j * 8);
+		}
+		m[16] = s->blocks[i].outsize; /* zero if not known yet */
+		m[17] = s->blocks[i].outsize >> 8;
+		m[18] = s->blocks[i].outsize >> 16;
+		m[19] = s->blocks[i].outsize >> 24;
+	}
+
+	dirdbGetName_internalstr (compressedfilehandle->dirdb_ref, &filename);
+	DEBUG_PRINT ("[BZIP2 blocks_save] adbMetaAdd(%s, %"PRIu64", BZIX, %d blocks, %d with known size)\n", filename, compressedfilehandle->filesize (compressedfilehandle), s->blocks_count, s->blocks_known);
+	adbMetaAdd (filename, compressedfilehandle->filesize (compressedfilehandle), "BZIX", metadata, metadatasize);
+
+	free (metadata);
+}
+
+static void bzip2_putbits (uint8_t *dst, uint64_t *bitpos, uint64_t value, int count)
+{
+	while (count--)
+	{
+		if ((value >> count) & 1)
+		{
+			dst[*bitpos >> 3] |= 0x80 >> (*bitpos & 7);
+		}
+		(*bitpos)++;
+	}
+}
+
+/* Copy the bits of a single block, and wrap it with a stream header and a end-of-stream trailer so that libbz2 can decode it on its own.
+ * With only one block in the stream, the combined CRC equals the block CRC that follows the block magic.
+ */
+static int bzip2_ocpfilehandle_block_extract (struct bzip2_ocpfilehandle_t *s, int block, uint8_t **data, uint32_t *datasize)
+{
+	const struct bzip2_block_t *b = &s->owner->blocks[block];
+	uint64_t bits = b->endbit - b->inbit;
+	uint32_t srcsize = ((b->endbit + 7) >> 3) - (b->inbit >> 3);
+	int shift = b->inbit & 7;
+	uint8_t *src, *dst;
+	uint64_t bitpos;
+	uint32_t crc;
+	uint32_t i;
+
+	if (bits < 80)
+	{
+		return -1;
+	}
+
+	src = malloc (srcsize);
+	dst = calloc (1, 4 + (bits >> 3) + 1 + 10 + 1);
+	if ((!src) || (!dst))
+	{
+		free (src);
+		free (dst);
+		return -1;
+	}
+
+	if ((s->compressedfilehandle->seek_set (s->compressedfilehandle, b->inbit >> 3) < 0) ||
+	    (s->compressedfilehandle->read (s->compressedfilehandle, src, srcsize) != srcsize))
+	{
+		free (src);
+		free (dst);
+		return -1;
+	}
+
+	dst[0] = 'B';
+	dst[1] = 'Z';
+	dst[2] = 'h';
+	dst[3] = '9'; /* the largest block size, so any block will fit */
+
+	for (i=0; i <= (bits >> 3); i++)
+	{
+		uint8_t v = (i < srcsize) ? (src[i] << shift) : 0; /* a block that starts and ends on a byte boundary has no byte after the last one */
+		if (shift && ((i + 1) < srcsize))
+		{
+			v |= src[i + 1] >> (8 - shift);
+		}
+		dst[4 + i] = v;
+	}
+	if (bits & 7)
+	{
+		dst[4 + (bits >> 3)] &= 0xff00 >> (bits & 7);
+	} else {
+		dst[4 + (bits >> 3)] = 0;
+	}
+	free (src);
+
+	crc = ((uint32_t)dst[10] << 24) | (dst[11] << 16) | (dst[12] << 8) | dst[13];
+
+	bitpos = 32 + bits;
+	bzip2_putbits (dst, &bitpos, BZIP2_EOS_MAGIC, 48);
+	bzip2_putbits (dst, &bitpos, crc, 32);
+
+	*data = dst;
+	*datasize = (bitpos + 7) >> 3;
+
+	return 0;
+}
+
+static int bzip2_slot_decode (struct bzip2_slot_t *slot)
+{
+	bz_stream strm;
+	int ret;
+
+	memset (&strm, 0, sizeof (strm));
+	if (BZ2_bzDecompressInit (&strm, 0 /* no verbosity */, 0 /* do not use the small decompression routine */) != BZ_OK)
+	{
+		return -1;
+	}
+
+	strm.next_in = (char *)slot->input;
+	strm.avail_in = slot->inputsize;
+	slot->outputfill = 0;
+
+	while (1)
+	{
+		if (slot->outputfill == slot->outputsize)
+		{
+			uint32_t newsize = slot->outputsize ? (slot->outputsize * 2) : (1024 * 1024);
+			uint8_t *temp = realloc (slot->output, newsize);
+			if (!temp)
+			{
+				BZ2_bzDecompressEnd (&strm);
+				return -1;
+			}
+			slot->output = temp;
+			slot->outputsize = newsize;
+		}
+		strm.next_out = (char *)slot->output + slot->outputfill;
+		strm.avail_out = slot->outputsize - slot->outputfill;
+
+		ret = BZ2_bzDecompress (&strm);
+		slot->outputfill = slot->outputsize - strm.avail_out;
+
+		if (ret == BZ_STREAM_END)
+		{
+			break;
+		}
+		if ((ret != BZ_OK) || (strm.avail_out && (!strm.avail_in)))
+		{
+			BZ2_bzDecompressEnd (&strm);
+			return -1;
+		}
+	}
+
+	BZ2_bzDecompressEnd (&strm);
+	return 0;
+}
+
+static void *bzip2_worker (void *_s)
+{
+	struct bzip2_ocpfilehandle_t *s = _s;
+
+	pthread_mutex_lock (&s->mutex);
+	while (!s->shutdown)
+	{
+		struct bzip2_slot_t *slot = 0;
+		int i, ret;
+
+		for (i=0; i < s->nslots; i++)
+		{
+			if (s->slots[i].state == bzip2_slot_queued)
+			{
+				if ((!slot) || (s->slots[i].block < slot->block))
+				{
+					slot = &s->slots[i];
+				}
+			}
+		}
+		if (!slot)
+		{
+			pthread_cond_wait (&s->cond, &s->mutex);
+			continue;
+		}
+		slot->state = bzip2_slot_busy;
+		pthread_mutex_unlock (&s->mutex);
+
+		ret = bzip2_slot_decode (slot);
+
+		pthread_mutex_lock (&s->mutex);
+		slot->state = ret ? bzip2_slot_error : bzip2_slot_done;
+		pthread_cond_broadcast (&s->cond);
+	}
+	pthread_mutex_unlock (&s->mutex);
+
+	return 0;
+}
+
+static void bzip2_ocpfilehandle_blockmode_stop (struct bzip2_ocpfilehandle_t *s)
+{
+	int i;
+
+	if (!s->blockmode)
+	{
+		return;
+	}
+
+	pthread_mutex_lock (&s->mutex);
+	s->shutdown = 1;
+	pthread_cond_broadcast (&s->cond);
+	pthread_mutex_unlock (&s->mutex);
+
+	for (i=0; i < s->threadcount; i++)
+	{
+		pthread_join (s->threads[i], NULL);
+	}
+	s->threadcount = 0;
+
+	for (i=0; i < s->nslots; i++)
+	{
+		free (s->slots[i].input);
+		free (s->slots[i].output);
+	}
+	free (s->slots);
+	s->slots = 0;
+	s->nslots = 0;
+
+	pthread_cond_destroy (&s->cond);
+	pthread_mutex_destroy (&s->mutex);
+
+	s->blockmode = 0;
+}
+
+static int bzip2_ocpfilehandle_blockmode_start (struct bzip2_ocpfilehandle_t *s)
+{
+	long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (!s->owner->blocks_state)
+	{
+		int ret = bzip2_ocpfile_blocks_scan (s->owner, s->compressedfilehandle);
+		if (ret > 0)
+		{ /* keep decoding sequentially until the scan is complete */
+			return -1;
+		}
+		if (ret || (s->owner->blocks_count < 2))
+		{ /* a single block gains nothing */
+			bzip2_ocpfile_blocks_clear (s->owner);
+			s->owner->blocks_state = -1;
+		} else {
+			s->owner->blocks_state = 1;
+			s->owner->blocks_dirty = 1; /* the boundaries alone saves a scan next time */
+		}
+	}
+	if (s->owner->blocks_state < 0)
+	{
+		return -1;
+	}
+
+	if (cpus < 1)
+	{
+		cpus = 1;
+	} else if (cpus > BZIP2_WORKERS_MAX)
+	{
+		cpus = BZIP2_WORKERS_MAX;
+	}
+
+	s->nslots = cpus + 1; /* one extra, so the reader can consume a block while all the workers are busy */
+	s->slots = calloc (s->nslots, sizeof (s->slots[0]));
+	if (!s->slots)
+	{
+		s->nslots = 0;
+		return -1;
+	}
+	for (i=0; i < s->nslots; i++)
+	{
+		s->slots[i].block = -1;
+	}
+
+	pthread_mutex_init (&s->mutex, NULL);
+	pthread_cond_init (&s->cond, NULL);
+	s->shutdown = 0;
+	s->threadcount = 0;
+	s->blockmode = 1;
+	for (i=0; i < cpus; i++)
+	{
+		if (pthread_create (&s->threads[s->threadcount], NULL, bzip2_worker, s))
+		{
+			break;
+		}
+		s->threadcount++;
+	}
+	if (!s->threadcount)
+	{
+		bzip2_ocpfilehandle_blockmode_stop (s);
+		return -1;
+	}
+
+	if (s->need_deinit)
+	{
+		BZ2_bzDecompressEnd (&s->strm);
+		s->need_deinit = 0;
+	}
+	s->outputbuffer_fill = 0;
+
+	DEBUG_PRINT ("[BZIP2 blockmode_start] %d workers\n", s->threadcount);
+
+	return 0;
+}
+
+/* queue the block and the read-ahead after it, and wait for the block to be decoded */
+static struct bzip2_slot_t *bzip2_ocpfilehandle_slot_get (struct bzip2_ocpfilehandle_t *s, int block)
+{
+	struct bzip2_slot_t *slot;
+	enum bzip2_slot_state_t state;
+	int i;
+
+	pthread_mutex_lock (&s->mutex);
+	for (i=0; (i < s->nslots) && ((block + i) < s->owner->blocks_count); i++)
+	{
+		int b = block + i;
+		uint8_t *data = 0;
+		uint32_t datasize = 0;
+		int ret;
+
+		slot = &s->slots[b % s->nslots];
+		if (slot->block == b)
+		{
+			continue;
+		}
+		while (slot->state == bzip2_slot_busy)
+		{
+			if (i)
+			{ /* do not stall for read-ahead */
+				break;
+			}
+			pthread_cond_wait (&s->cond, &s->mutex);
+		}
+		if (slot->state == bzip2_slot_busy)
+		{
+			continue;
+		}
+
+		/* the slot is not visible to the workers while idle, so we can fill it without holding the lock */
+		slot->state = bzip2_slot_idle;
+		slot->block = -1;
+		free (slot->input);
+		slot->input = 0;
+		pthread_mutex_unlock (&s->mutex);
+
+		ret = bzip2_ocpfilehandle_block_extract (s, b, &data, &datasize);
+
+		pthread_mutex_lock (&s->mutex);
+		slot->block = b;
+		if (ret)
+		{
+			slot->state = bzip2_slot_error;
+		} else {
+			slot->input = data;
+			slot->inputsize = datasize;
+			slot->state = bzip2_slot_queued;
+			pthread_cond_signal (&s->cond);
+		}
+	}
+
+	slot = &s->slots[block % s->nslots];
+	while ((slot->state == bzip2_slot_queued) || (slot->state == bzip2_slot_busy))
+	{
+		pthread_cond_wait (&s->cond, &s->mutex);
+	}
+	state = slot->state;
+	pthread_mutex_unlock (&s->mutex);
+
+	return (state == bzip2_slot_done) ? slot : 0;
+}
+
+static int bzip2_ocpfilehandle_read_blocks (struct bzip2_ocpfilehandle_t *s, uint8_t *dst, int len, int *failed)
+{
+	struct bzip2_ocpfile_t *o = s->owner;
+	int retval = 0;
+
+	while (len)
+	{
+		struct bzip2_slot_t *slot;
+		int lo = 0, hi = o->blocks_known;
+		int b, copy;
+		uint64_t offset;
+
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (o->blocks[mid].out <= s->pos)
+			{
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo && (s->pos < (o->blocks[lo - 1].out + o->blocks[lo - 1].outsize)))
+		{
+			b = lo - 1;
+		} else {
+			b = o->blocks_known; /* the first block with an unknown size */
+			if (b >= o->blocks_count)
+			{ /* EOF */
+				break;
+			}
+		}
+
+		slot = bzip2_ocpfilehandle_slot_get (s, b);
+		if (!slot)
+		{
+			*failed = 1;
+			return retval;
+		}
+
+		if (b == o->blocks_known)
+		{
+			o->blocks[b].outsize = slot->outputfill;
+			o->blocks_known++;
+			o->blocks_dirty = 1;
+			if (o->blocks_known < o->blocks_count)
+			{
+				o->blocks[b + 1].out = o->blocks[b].out + slot->outputfill;
+			} else {
+				uint64_t filesize = o->blocks[b].out + slot->outputfill;
+				if ((o->filesize_pending) || (o->uncompressed_filesize != filesize))
+				{
+					bzip2_ocpfile_filesize_store (o, s->compressedfilehandle, filesize);
+				}
+				bzip2_ocpfile_blocks_save (o, s->compressedfilehandle);
+			}
+		}
+
+		if (s->pos >= (o->blocks[b].out + o->blocks[b].outsize))
+		{
+			continue;
+		}
+
+		offset = s->pos - o->blocks[b].out;
+		copy = len;
+		if ((uint64_t)copy > (o->blocks[b].outsize - offset))
+		{
+			copy = o->blocks[b].outsize - offset;
+		}
+		memcpy (dst, slot->output + offset, copy);
+		retval += copy;
+		len -= copy;
+		dst += copy;
+		s->pos += copy;
+		s->realpos = s->pos;
+	}
+
+	return retval;
+}
+
 static void bzip2_ocpfilehandle_ref (struct ocpfilehandle_t *_s)
 {
 	struct bzip2_ocpfilehandle_t *s = (struct bzip2_ocpfilehandle_t *)_s;
@@ -155,12 +933,20 @@ static void bzip2_ocpfilehandle_unref (struct ocpfilehandle_t *_s)
 		return;
 	}
 
+	bzip2_ocpfilehandle_blockmode_stop (s);
+
 	if (s->need_deinit)
 	{
 		BZ2_bzDecompressEnd (&s->strm);
 		s->need_deinit = 0;
 	}
 
+	/* a partial index is still useful, for instance when only the first members of a tar archive has been visited */
+	if ((s->owner->blocks_state > 0) && s->compressedfilehandle)
+	{
+		bzip2_ocpfile_blocks_save (s->owner, s->compressedfilehandle);
+	}
+
 	dirdbUnref (s->head.dirdb_ref, dirdb_use_filehandle);
 
 	if (s->compressedfilehandle)
@@ -296,6 +1082,41 @@ static int bzip2_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int
 	int retval = 0;
 	int recall = 0;
 
+	if (s->blockmode && (s->owner->blocks_state < 0))
+	{ /* another handle failed to decode a block and dropped the index */
+		DEBUG_PRINT ("[BZIP2 read] index was dropped, reverting to sequential decoding\n");
+		bzip2_ocpfilehandle_blockmode_stop (s);
+		s->realpos = 0;
+		s->outputbuffer_fill = 0;
+	}
+
+	if ((!s->blockmode) && (s->owner->blocks_state >= 0) &&
+	    ((s->owner->blocks_state > 0) || (s->pos >= BZIP2_BLOCKMODE_THRESHOLD) || (s->realpos >= BZIP2_BLOCKMODE_THRESHOLD)))
+	{
+		bzip2_ocpfilehandle_blockmode_start (s); /* on failure, we stay in sequential mode */
+	}
+
+	if (s->blockmode)
+	{
+		int failed = 0;
+
+		retval = bzip2_ocpfilehandle_read_blocks (s, dst, len, &failed);
+		if (!failed)
+		{
+			return retval;
+		}
+
+		/* a block failed to decode, so the index can not be trusted */
+		DEBUG_PRINT ("[BZIP2 read] block decode failed, reverting to sequential decoding\n");
+		bzip2_ocpfilehandle_blockmode_stop (s);
+		bzip2_ocpfile_blocks_clear (s->owner);
+		s->owner->blocks_state = -1;
+		s->realpos = 0;
+		s->outputbuffer_fill = 0;
+		dst += retval;
+		len -= retval;
+	}
+
 	/* do we need to reverse? */
 	if ((s->pos < s->realpos) || (!s->need_deinit))
 	{
@@ -450,27 +1271,7 @@ static int bzip2_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int
 
 			if ((s->owner->filesize_pending) || (s->owner->uncompressed_filesize != filesize))
 			{
-				uint8_t buffer[8];
-				const char *filename = 0;
-				uint64_t compressedfile_size = s->compressedfilehandle->filesize (s->compressedfilehandle);
-
-
-				s->owner->filesize_pending = 0;
-				s->owner->uncompressed_filesize = filesize;
-
-				buffer[7] = filesize >> 56;
-				buffer[6] = filesize >> 48;
-				buffer[5] = filesize >> 40;
-				buffer[4] = filesize >> 32;
-				buffer[3] = filesize >> 24;
-				buffer[2] = filesize >> 16;
-				buffer[1] = filesize >> 8;
-				buffer[0] = filesize;
-
-				dirdbGetName_internalstr (s->compressedfilehandle->dirdb_ref, &filename);
-
-				DEBUG_PRINT ("[BZIP2 filehandle_read EOF] adbMetaAdd(%s, %"PRId64", BZIP2, [%02x %02x %02x %02x %02x %02x %02x %02x] (%"PRIu64" + %d => %"PRIu64")\n", filename, compressedfile_size, buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7], s->realpos, s->outputbuffer_fill, filesize);
-				adbMetaAdd (filename, compressedfile_size, "BZIP2", buffer, 8);
+				bzip2_ocpfile_filesize_store (s->owner, s->compressedfilehandle, filesize);
 			}
 
 			if (!s->outputbuffer_fill)
@@ -496,6 +1297,17 @@ static int bzip2_ocpfilehandle_filesize_ready (struct ocpfilehandle_t *_s)
 	return !s->owner->filesize_pending;
 }
 
+static int bzip2_ocpfilehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
+{
+	struct bzip2_ocpfilehandle_t *s = (struct bzip2_ocpfilehandle_t *)_s;
+
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{ /* only if the size of every block is known, so a seek decodes a single block */
+		return ((s->owner->blocks_state == 1) && (s->owner->blocks_known == s->owner->blocks_count)) ? 0 : -1;
+	}
+	return -1;
+}
+
 static void bzip2_ocpfile_ref (struct ocpfile_t *s)
 {
 	s->parent->ref (s->parent);
@@ -526,7 +1338,7 @@ static struct ocpfilehandle_t *bzip2_ocpfile_open (struct ocpfile_t *_s)
 	                       bzip2_ocpfilehandle_eof,
 	                       bzip2_ocpfilehandle_error,
 	                       bzip2_ocpfilehandle_read,
-	                       0, /* ioctl */
+	                       bzip2_ocpfilehandle_ioctl,
 	                       bzip2_ocpfilehandle_filesize,
 	                       bzip2_ocpfilehandle_filesize_ready,
 	                       0, /* filename_override */
@@ -535,7 +1347,7 @@ static struct ocpfilehandle_t *bzip2_ocpfile_open (struct ocpfile_t *_s)
 	retval->owner = s;
 	s->head.ref (&s->head);
 
-	retval->compressedfilehandle = s->compressedfile->open (s->compressedfile);
+	retval->compressedfilehandle = spill_filehandle_open (s->compressedfile);
 
 	if (!retval->compressedfilehandle)
 	{
@@ -546,6 +1358,8 @@ static struct ocpfilehandle_t *bzip2_ocpfile_open (struct ocpfile_t *_s)
 
 	retval->head.refcount = 1;
 
+	bzip2_ocpfile_blocks_load (s);
+
 	return &retval->head;
 }
 
@@ -614,7 +1428,7 @@ static uint64_t bzip2_ocpfile_filesize (struct ocpfile_t *_s)
 	}
 
 /* Second, we decompress the wole thing... */
-	h = s->compressedfile->open (s->compressedfile);
+	h = spill_filehandle_open (s->compressedfile);
 	if (!h)
 	{
 		return FILESIZE_ERROR;
@@ -751,6 +1565,8 @@ static void bzip2_dir_unref (struct ocpdir_t *self)
 		s->child.compressedfile = 0;
 	}
 
+	bzip2_ocpfile_blocks_clear (&s->child);
+
 	s->head.parent->unref (s->head.parent);
 	s->head.parent = 0;
 
@@ -0,0 +1,302 @@
+/* unit test for filesystem-charset.c */
+
+#include "filesystem-charset.c"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/* a single adbmeta record is enough for these tests */
+static char          *adbmeta_filename;
+static size_t         adbmeta_filesize;
+static char          *adbmeta_SIG;
+static unsigned char *adbmeta_data;
+static size_t         adbmeta_datasize;
+static int            adbmeta_adds;
+
+static void adbMetaClear(void)
+{
+	free (adbmeta_filename);
+	free (adbmeta_SIG);
+	free (adbmeta_data);
+	adbmeta_filename = 0;
+	adbmeta_filesize = 0;
+	adbmeta_SIG = 0;
+	adbmeta_data = 0;
+	adbmeta_datasize = 0;
+	adbmeta_adds = 0;
+}
+
+int adbMetaAdd (const char *filename, const size_t filesize, const char *SIG, const unsigned char  *data, const size_t  datasize)
+{
+	free (adbmeta_filename);
+	free (adbmeta_SIG);
+	free (adbmeta_data);
+	adbmeta_filename = strdup (filename);
+	adbmeta_filesize = filesize;
+	adbmeta_SIG = strdup (SIG);
+	adbmeta_data = malloc (datasize);
+	memcpy (adbmeta_data, data, datasize);
+	adbmeta_datasize = datasize;
+	adbmeta_adds++;
+
+	return 0;
+}
+
+int adbMetaGet (const char *filename, const size_t filesize, const char *SIG,       unsigned char **data,       size_t *datasize)
+{
+	if ((!adbmeta_filename) || strcmp (filename, adbmeta_filename) || (filesize != adbmeta_filesize) || strcmp (SIG, adbmeta_SIG))
+	{
+		return -1;
+	}
+	*data = malloc (adbmeta_datasize);
+	memcpy (*data, adbmeta_data, adbmeta_datasize);
+	*datasize = adbmeta_datasize;
+	return 0;
+}
+
+/* translates src using iconv directly, skipping invalid input like charset_translate() does */
+static void reference_translate (const char *charset, const char *src, char *dst, size_t dstlen)
+{
+	iconv_t handle = iconv_open ("UTF-8", charset);
+	char *in = (char *)src;
+	size_t inlen = strlen (src);
+
+	while (inlen)
+	{
+		if (iconv (handle, &in, &inlen, &dst, &dstlen) == (size_t)-1)
+		{
+			in++;
+			inlen--;
+		}
+	}
+	*dst = 0;
+	iconv_close (handle);
+}
+
+static int charset_test_cp437 (void)
+{
+	struct charset_translate_t t;
+	char *buffer = 0;
+	int buffersize = 0;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing CP437 table against iconv" ANSI_COLOR_RESET "\n");
+
+	adbMetaClear ();
+	charset_translate_init (&t);
+	charset_translate_prepare (&t, "CP437", "test.zip", 1234, "ZIPNAMES");
+
+	for (i=1; i < 256; i++)
+	{
+		char src[16];
+		char expected[32];
+
+		snprintf (src, sizeof (src), "dir/a%cb", i);
+		if (i == '/')
+		{
+			continue;
+		}
+		reference_translate ("CP437", src + 4, expected, sizeof (expected));
+		charset_translate (&t, src, &buffer, &buffersize);
+		if ((!buffer) || strcmp (buffer, expected))
+		{
+			printf (ANSI_COLOR_RED " 0x%02x gave \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", i, buffer ? buffer : "(NULL)", expected);
+			retval = 1;
+		}
+	}
+	if (t.iconv_handle != (iconv_t)-1)
+	{
+		printf (ANSI_COLOR_RED " iconv was used" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	charset_translate_complete (&t);
+	if (adbmeta_adds)
+	{
+		printf (ANSI_COLOR_RED " CP437 translations were stored in adbmeta" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	free (buffer);
+	return retval;
+}
+
+static int charset_test_utf8 (void)
+{
+	static const char *input[]    = {"plain.mod", "caf\xc3\xa9.mod", "bad\xff.mod", "short\xc3", "overlong\xc0\xaf", "surrogate\xed\xa0\x80"};
+	struct charset_translate_t t;
+	char *buffer = 0;
+	int buffersize = 0;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing UTF-8 names" ANSI_COLOR_RESET "\n");
+
+	adbMetaClear ();
+	charset_translate_init (&t);
+	charset_translate_prepare (&t, "UTF-8", "test.tar", 1234, "TARNAMES");
+
+	for (i=0; i < 2; i++)
+	{
+		charset_translate (&t, input[i], &buffer, &buffersize);
+		if ((!buffer) || strcmp (buffer, input[i]))
+		{
+			printf (ANSI_COLOR_RED " \"%s\" was modified" ANSI_COLOR_RESET "\n", input[i]);
+			retval = 1;
+		}
+	}
+	if (t.iconv_handle != (iconv_t)-1)
+	{
+		printf (ANSI_COLOR_RED " iconv was used for valid UTF-8" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	for (i=2; i < 6; i++)
+	{
+		char expected[64];
+		reference_translate ("UTF-8", input[i], expected, sizeof (expected));
+		charset_translate (&t, input[i], &buffer, &buffersize);
+		if ((!buffer) || strcmp (buffer, expected))
+		{
+			printf (ANSI_COLOR_RED " invalid name %d gave \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", i, buffer ? buffer : "(NULL)", expected);
+			retval = 1;
+		}
+	}
+	charset_translate_complete (&t);
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	free (buffer);
+	return retval;
+}
+
+static int charset_test_cache (void)
+{
+	static const char *input[] = {"readme.txt", "a/b/caf\xe9.mod", "\xc6gir.xm", "x/\xe6\xf8\xe5.s3m", "\xe6\xf8\xe5.s3m"};
+	char expected[5][64];
+	struct charset_translate_t t;
+	char *buffer = 0;
+	int buffersize = 0;
+	int retval = 0;
+	int round;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing cache of iconv translations" ANSI_COLOR_RESET "\n");
+
+	adbMetaClear ();
+	for (i=0; i < 5; i++)
+	{
+		const char *temp = rindex (input[i], '/');
+		reference_translate ("CP1252", temp ? temp + 1 : input[i], expected[i], sizeof (expected[i]));
+	}
+
+	charset_translate_init (&t);
+	for (round = 0; round < 2; round++)
+	{
+		charset_translate_prepare (&t, "CP1252", "test.zip", 1234, "ZIPNAMES");
+		for (i=0; i < 5; i++)
+		{
+			charset_translate (&t, input[i], &buffer, &buffersize);
+			if ((!buffer) || strcmp (buffer, expected[i]))
+			{
+				printf (ANSI_COLOR_RED " round %d, name %d gave \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", round, i, buffer ? buffer : "(NULL)", expected[i]);
+				retval = 1;
+			}
+		}
+		if (round && (t.iconv_handle != (iconv_t)-1))
+		{
+			printf (ANSI_COLOR_RED " iconv was used, even if the names were cached" ANSI_COLOR_RESET "\n");
+			retval = 1;
+		}
+		charset_translate_complete (&t);
+	}
+	if (adbmeta_adds != 1)
+	{
+		printf (ANSI_COLOR_RED " cache was stored %d times, expected once" ANSI_COLOR_RESET "\n", adbmeta_adds);
+		retval = 1;
+	}
+
+	/* the cache does not apply to other charsets, or other archives */
+	charset_translate_prepare (&t, "ISO-8859-2", "test.zip", 1234, "ZIPNAMES");
+	if (t.cache_fill)
+	{
+		printf (ANSI_COLOR_RED " cache was used for the wrong charset" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	charset_translate_complete (&t);
+	charset_translate_prepare (&t, "ISO-8859-2", "test.zip", 1235, "ZIPNAMES");
+	if (t.cache_fill)
+	{
+		printf (ANSI_COLOR_RED " cache was used for the wrong archive" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	charset_translate_complete (&t);
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	free (buffer);
+	adbMetaClear ();
+	return retval;
+}
+
+static int charset_test_not_ascii (void)
+{
+	struct charset_translate_t t;
+	char *buffer = 0;
+	int buffersize = 0;
+	char expected[64];
+	int retval = 0;
+
+	printf (ANSI_COLOR_CYAN "Testing charset that is not ASCII compatible" ANSI_COLOR_RESET "\n");
+
+	adbMetaClear ();
+	charset_translate_init (&t);
+	charset_translate_prepare (&t, "UTF-16LE", "test.zip", 1234, "ZIPNAMES");
+	reference_translate ("UTF-16LE", "abcd", expected, sizeof (expected));
+	charset_translate (&t, "abcd", &buffer, &buffersize);
+	if (t.ascii != 2)
+	{
+		printf (ANSI_COLOR_RED " charset was detected as ASCII compatible" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	if ((!buffer) || strcmp (buffer, expected))
+	{
+		printf (ANSI_COLOR_RED " \"abcd\" gave \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", buffer ? buffer : "(NULL)", expected);
+		retval = 1;
+	}
+	charset_translate_complete (&t);
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	free (buffer);
+	adbMetaClear ();
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	retval |= charset_test_cp437 ();
+	retval |= charset_test_utf8 ();
+	retval |= charset_test_cache ();
+	retval |= charset_test_not_ascii ();
+
+	printf ("\n");
+
+	return retval;
+}
@@ -0,0 +1,564 @@
+/* OpenCP Module Player
+ * copyright (c) 2020-'22 Stian Skjelstad <stian.skjelstad@gmail.com>
+ *
+ * Translation of archive member names into UTF-8, with fast paths for
+ * ASCII and CP437, and a per-archive cache of iconv results in adbmeta.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <iconv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "types.h"
+#include "adbmeta.h"
+#include "filesystem-charset.h"
+
+#ifdef CHARSET_DEBUG
+#define DEBUG_PRINT(...) do { fprintf(stderr, __VA_ARGS__); } while (0)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+#define CHARSET_TRANSLATE_BUILTIN_NONE  0
+#define CHARSET_TRANSLATE_BUILTIN_CP437 1
+#define CHARSET_TRANSLATE_BUILTIN_UTF8  2
+
+struct charset_translate_entry_t
+{
+	uint32_t hash;
+	char *src;
+	char *dst; /* both strings are stored right after the struct */
+};
+
+/* upper half of codepage 437, the lower half is plain ASCII */
+static const uint16_t charset_cp437_upper[128] =
+{
+	0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7, 0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5, // 8x
+	0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9, 0x00ff, 0x00d6, 0x00dc, 0x00a2, 0x00a3, 0x00a5, 0x20a7, 0x0192, // 9x
+	0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba, 0x00bf, 0x2310, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb, // ax
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556, 0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510, // bx
+	0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f, 0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567, // cx
+	0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b, 0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580, // dx
+	0x03b1, 0x00df, 0x0393, 0x03c0, 0x03a3, 0x03c3, 0x00b5, 0x03c4, 0x03a6, 0x0398, 0x03a9, 0x03b4, 0x221e, 0x03c6, 0x03b5, 0x2229, // ex
+	0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248, 0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0  // fx
+};
+
+void charset_translate_init (struct charset_translate_t *self)
+{
+	memset (self, 0, sizeof (*self));
+	self->iconv_handle = (iconv_t)-1;
+}
+
+static uint32_t charset_translate_hash (const char *src)
+{ /* FNV-1a */
+	uint32_t hash = 0x811c9dc5;
+	while (*src)
+	{
+		hash ^= (uint8_t)*(src++);
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static struct charset_translate_entry_t *charset_translate_lookup (struct charset_translate_t *self, const char *src, uint32_t hash)
+{
+	unsigned int i;
+
+	if (!self->cache_size)
+	{
+		return 0;
+	}
+	for (i = hash & (self->cache_size - 1); self->cache[i]; i = (i + 1) & (self->cache_size - 1))
+	{
+		if ((self->cache[i]->hash == hash) && !strcmp (self->cache[i]->src, src))
+		{
+			return self->cache[i];
+		}
+	}
+	return 0;
+}
+
+static void charset_translate_insert (struct charset_translate_t *self, const char *src, const char *dst, uint32_t hash)
+{
+	struct charset_translate_entry_t *entry;
+	size_t srclen = strlen (src) + 1;
+	size_t dstlen = strlen (dst) + 1;
+	unsigned int i;
+
+	if ((self->cache_fill + 1) * 2 > self->cache_size)
+	{ /* keep the table at most half full */
+		unsigned int newsize = self->cache_size ? self->cache_size * 2 : 256;
+		struct charset_translate_entry_t **newcache = calloc (newsize, sizeof (newcache[0]));
+		if (!newcache)
+		{
+			return;
+		}
+		for (i=0; i < self->cache_size; i++)
+		{
+			if (self->cache[i])
+			{
+				unsigned int j;
+				for (j = self->cache[i]->hash & (newsize - 1); newcache[j]; j = (j + 1) & (newsize - 1))
+				{
+				}
+				newcache[j] = self->cache[i];
+			}
+		}
+		free (self->cache);
+		self->cache = newcache;
+		self->cache_size = newsize;
+	}
+
+	entry = malloc (sizeof (*entry) + srclen + dstlen);
+	if (!entry)
+	{
+		return;
+	}
+	entry->hash = hash;
+	entry->src = (char *)(entry + 1);
+	entry->dst = entry->src + srclen;
+	memcpy (entry->src, src, srclen);
+	memcpy (entry->dst, dst, dstlen);
+
+	for (i = hash & (self->cache_size - 1); self->cache[i]; i = (i + 1) & (self->cache_size - 1))
+	{
+	}
+	self->cache[i] = entry;
+	self->cache_fill++;
+}
+
+/* blob: charset\0 ascii-flag {src\0 dst\0}* */
+static void charset_translate_load (struct charset_translate_t *self)
+{
+	unsigned char *data = 0;
+	size_t datasize = 0;
+	size_t pos, charsetlen = strlen (self->charset) + 1;
+
+	if (adbMetaGet (self->meta_filename, self->meta_filesize, self->meta_SIG, &data, &datasize))
+	{
+		return;
+	}
+	if ((datasize < charsetlen + 1) || memcmp (data, self->charset, charsetlen))
+	{ /* cached for an other charset */
+		DEBUG_PRINT ("[CHARSET] %s has no cache for %s\n", self->meta_filename, self->charset);
+		free (data);
+		return;
+	}
+	if (data[charsetlen] <= 2)
+	{
+		self->ascii = data[charsetlen];
+	}
+	pos = charsetlen + 1;
+	while (pos < datasize)
+	{
+		const char *src = (const char *)data + pos;
+		const char *dst;
+		unsigned char *eos = memchr (data + pos, 0, datasize - pos);
+		if (!eos)
+		{
+			break;
+		}
+		pos = eos - data + 1;
+		dst = (const char *)data + pos;
+		eos = memchr (data + pos, 0, datasize - pos);
+		if (!eos)
+		{
+			break;
+		}
+		pos = eos - data + 1;
+		charset_translate_insert (self, src, dst, charset_translate_hash (src));
+	}
+	DEBUG_PRINT ("[CHARSET] %s loaded %u cached names for %s\n", self->meta_filename, self->cache_fill, self->charset);
+	free (data);
+}
+
+static void charset_translate_store (struct charset_translate_t *self)
+{
+	unsigned char *data;
+	size_t datasize, pos;
+	unsigned int i;
+
+	datasize = strlen (self->charset) + 2;
+	for (i=0; i < self->cache_size; i++)
+	{
+		if (self->cache[i])
+		{
+			datasize += strlen (self->cache[i]->src) + strlen (self->cache[i]->dst) + 2;
+		}
+	}
+	data = malloc (datasize);
+	if (!data)
+	{
+		return;
+	}
+	strcpy ((char *)data, self->charset);
+	pos = strlen (self->charset) + 1;
+	data[pos++] = self->ascii;
+	for (i=0; i < self->cache_size; i++)
+	{
+		if (self->cache[i])
+		{
+			strcpy ((char *)data + pos, self->cache[i]->src);
+			pos += strlen (self->cache[i]->src) + 1;
+			strcpy ((char *)data + pos, self->cache[i]->dst);
+			pos += strlen (self->cache[i]->dst) + 1;
+		}
+	}
+	DEBUG_PRINT ("[CHARSET] %s stores %u cached names for %s\n", self->meta_filename, self->cache_fill, self->charset);
+	adbMetaAdd (self->meta_filename, self->meta_filesize, self->meta_SIG, data, datasize);
+	free (data);
+}
+
+void charset_translate_complete (struct charset_translate_t *self)
+{
+	unsigned int i;
+
+	if (self->cache_dirty && self->meta_filename && self->charset)
+	{
+		charset_translate_store (self);
+	}
+	for (i=0; i < self->cache_size; i++)
+	{
+		free (self->cache[i]);
+	}
+	free (self->cache);
+	if (self->iconv_handle != (iconv_t)-1)
+	{
+		iconv_close (self->iconv_handle);
+	}
+	free (self->charset);
+	free (self->meta_filename);
+	charset_translate_init (self);
+}
+
+void charset_translate_prepare (struct charset_translate_t *self, const char *charset, const char *filename, uint64_t filesize, const char *SIG)
+{
+	DEBUG_PRINT ("charset_translate_prepare %s\n", charset);
+
+	charset_translate_complete (self);
+
+	self->charset = strdup (charset);
+	self->meta_filename = filename ? strdup (filename) : 0;
+	self->meta_filesize = filesize;
+	self->meta_SIG = SIG;
+	if (!self->charset)
+	{
+		return;
+	}
+
+	if ((!strcasecmp (charset, "CP437")) || (!strcasecmp (charset, "IBM437")))
+	{
+		self->builtin = CHARSET_TRANSLATE_BUILTIN_CP437;
+		self->ascii = 1;
+	} else if ((!strcasecmp (charset, "UTF-8")) || (!strcasecmp (charset, "UTF8")))
+	{
+		self->builtin = CHARSET_TRANSLATE_BUILTIN_UTF8;
+		self->ascii = 1;
+	}
+
+	if (self->meta_filename && (self->builtin != CHARSET_TRANSLATE_BUILTIN_CP437))
+	{
+		charset_translate_load (self);
+	}
+}
+
+static int charset_translate_reserve (char **buffer, int *buffersize, size_t needed)
+{
+	char *temp;
+
+	if ((size_t)*buffersize >= needed)
+	{
+		return 0;
+	}
+	temp = realloc (*buffer, needed);
+	if (!temp)
+	{
+		fprintf (stderr, "charset_translate: out of memory\n");
+		free (*buffer);
+		*buffer = 0;
+		*buffersize = 0;
+		return -1;
+	}
+	*buffer = temp;
+	*buffersize = needed;
+	return 0;
+}
+
+static void charset_translate_copy (const char *src, size_t srclen, char **buffer, int *buffersize)
+{
+	if (charset_translate_reserve (buffer, buffersize, srclen + 1))
+	{
+		return;
+	}
+	memcpy (*buffer, src, srclen + 1);
+}
+
+static int charset_translate_is_utf8 (const uint8_t *src, size_t srclen)
+{
+	size_t i = 0;
+
+	while (i < srclen)
+	{
+		uint32_t codepoint;
+		int follow, j;
+
+		if (src[i] < 0x80)
+		{
+			i++;
+			continue;
+		} else if ((src[i] & 0xe0) == 0xc0)
+		{
+			codepoint = src[i] & 0x1f;
+			follow = 1;
+		} else if ((src[i] & 0xf0) == 0xe0)
+		{
+			codepoint = src[i] & 0x0f;
+			follow = 2;
+		} else if ((src[i] & 0xf8) == 0xf0)
+		{
+			codepoint = src[i] & 0x07;
+			follow = 3;
+		} else {
+			return 0;
+		}
+		if (i + follow >= srclen)
+		{
+			return 0;
+		}
+		for (j=1; j <= follow; j++)
+		{
+			if ((src[i + j] & 0xc0) != 0x80)
+			{
+				return 0;
+			}
+			codepoint = (codepoint << 6) | (src[i + j] & 0x3f);
+		}
+		if (((follow == 1) && (codepoint < 0x80)) ||
+		    ((follow == 2) && (codepoint < 0x800)) ||
+		    ((follow == 3) && (codepoint < 0x10000)) ||
+		    ((codepoint >= 0xd800) && (codepoint <= 0xdfff)) ||
+		    (codepoint > 0x10ffff))
+		{ /* overlong, surrogate or out of range */
+			return 0;
+		}
+		i += follow + 1;
+	}
+	return 1;
+}
+
+static void charset_translate_cp437 (const uint8_t *src, size_t srclen, char **buffer, int *buffersize)
+{
+	uint8_t *dst;
+
+	if (charset_translate_reserve (buffer, buffersize, srclen * 3 + 1))
+	{
+		return;
+	}
+	dst = (uint8_t *)*buffer;
+	for (; *src; src++)
+	{
+		uint16_t codepoint;
+		if (*src < 0x80)
+		{
+			*(dst++) = *src;
+			continue;
+		}
+		codepoint = charset_cp437_upper[*src - 0x80];
+		if (codepoint < 0x800)
+		{
+			*(dst++) = 0xc0 | (codepoint >> 6);
+			*(dst++) = 0x80 | (codepoint & 0x3f);
+		} else {
+			*(dst++) = 0xe0 | (codepoint >> 12);
+			*(dst++) = 0x80 | ((codepoint >> 6) & 0x3f);
+			*(dst++) = 0x80 | (codepoint & 0x3f);
+		}
+	}
+	*dst = 0;
+}
+
+static int charset_translate_iconv_open (struct charset_translate_t *self)
+{
+	if (!self->iconv_tried)
+	{
+		char *temp = malloc (strlen (self->charset) + 11);
+
+		self->iconv_tried = 1;
+		if (temp)
+		{
+			sprintf (temp, "%s//TRANSLIT", self->charset);
+			self->iconv_handle = iconv_open ("UTF-8", temp);
+			free (temp);
+		}
+		if (self->iconv_handle == (iconv_t)-1)
+		{
+			self->iconv_handle = iconv_open ("UTF-8", self->charset);
+		}
+		if (self->iconv_handle == (iconv_t)-1)
+		{
+			fprintf (stderr, "charset_translate: iconv_open(\"UTF-8\", \"%s\") failed: %s\n", self->charset, strerror (errno));
+		}
+	}
+	return self->iconv_handle == (iconv_t)-1;
+}
+
+static void charset_translate_iconv (struct charset_translate_t *self, const char *_src, size_t srclen, char **buffer, int *buffersize)
+{
+	char *src = (char *)_src;
+	char *dst;
+	size_t dstlen;
+
+	if (charset_translate_reserve (buffer, buffersize, srclen * 4 + 11))
+	{
+		return;
+	}
+	dst = *buffer;
+	dstlen = *buffersize;
+
+	iconv (self->iconv_handle, 0, 0, 0, 0);
+
+	while (srclen)
+	{
+		if (dstlen <= 10)
+		{
+			int oldofs = dst - (*buffer);
+			if (charset_translate_reserve (buffer, buffersize, *buffersize + 32))
+			{
+				return;
+			}
+			dst = *buffer + oldofs;
+			dstlen += 32;
+		}
+
+		if (iconv (self->iconv_handle, &src, &srclen, &dst, &dstlen) == (size_t)-1)
+		{
+			if (errno != E2BIG)
+			{
+				src++;
+				srclen--;
+			}
+		}
+	}
+
+	*dst = 0;
+}
+
+/* checks if all 7bit characters are passed through unmodified, which is not the case for charsets like SHIFT-JIS */
+static void charset_translate_probe_ascii (struct charset_translate_t *self)
+{
+	char probe[128];
+	char *buffer = 0;
+	int buffersize = 0;
+	int i;
+
+	for (i=1; i < 128; i++)
+	{
+		probe[i-1] = i;
+	}
+	probe[127] = 0;
+
+	charset_translate_iconv (self, probe, 127, &buffer, &buffersize);
+	self->ascii = (buffer && !strcmp (buffer, probe)) ? 1 : 2;
+	self->cache_dirty = 1;
+	free (buffer);
+}
+
+void charset_translate (struct charset_translate_t *self, const char *src, char **buffer, int *buffersize)
+{
+	struct charset_translate_entry_t *entry;
+	const char *temp;
+	size_t srclen;
+	uint32_t hash;
+	int is_ascii = 1;
+
+	DEBUG_PRINT ("charset_translate %s =>", src);
+
+	temp = rindex (src, '/');
+	if (temp)
+	{
+		src = temp + 1;
+	}
+	for (temp = src; *temp; temp++)
+	{
+		if (*(uint8_t *)temp & 0x80)
+		{
+			is_ascii = 0;
+		}
+	}
+	srclen = temp - src;
+
+	if ((!self->charset) || (is_ascii && (self->ascii == 1)))
+	{
+		charset_translate_copy (src, srclen, buffer, buffersize);
+		DEBUG_PRINT (" %s (ASCII)\n", *buffer);
+		return;
+	}
+
+	switch (self->builtin)
+	{
+		case CHARSET_TRANSLATE_BUILTIN_CP437:
+			charset_translate_cp437 ((const uint8_t *)src, srclen, buffer, buffersize);
+			DEBUG_PRINT (" %s (CP437)\n", *buffer);
+			return;
+		case CHARSET_TRANSLATE_BUILTIN_UTF8:
+			if (charset_translate_is_utf8 ((const uint8_t *)src, srclen))
+			{
+				charset_translate_copy (src, srclen, buffer, buffersize);
+				DEBUG_PRINT (" %s (UTF-8)\n", *buffer);
+				return;
+			}
+			break;
+	}
+
+	hash = charset_translate_hash (src);
+	entry = charset_translate_lookup (self, src, hash);
+	if (entry)
+	{
+		charset_translate_copy (entry->dst, strlen (entry->dst), buffer, buffersize);
+		DEBUG_PRINT (" %s (cached)\n", *buffer);
+		return;
+	}
+
+	if (charset_translate_iconv_open (self))
+	{
+		charset_translate_copy (src, srclen, buffer, buffersize);
+		return;
+	}
+
+	if (!self->ascii)
+	{
+		charset_translate_probe_ascii (self);
+		if (is_ascii && (self->ascii == 1))
+		{
+			charset_translate_copy (src, srclen, buffer, buffersize);
+			DEBUG_PRINT (" %s (ASCII)\n", *buffer);
+			return;
+		}
+	}
+
+	charset_translate_iconv (self, src, srclen, buffer, buffersize);
+	if (*buffer)
+	{
+		charset_translate_insert (self, src, *buffer, hash);
+		self->cache_dirty = 1;
+	}
+
+	DEBUG_PRINT (" %s\n", *buffer);
+}
@@ -0,0 +1,44 @@
+#ifndef _FILESEL_FILESYSTEM_CHARSET_H
+#define _FILESEL_FILESYSTEM_CHARSET_H 1
+
+#include <iconv.h>
+
+struct charset_translate_entry_t;
+
+/* Translation of archive member names from a legacy charset into UTF-8, shared by the archive backends.
+ *
+ * Pure ASCII names are copied as-is if the charset is ASCII compatible, and CP437 is translated using a static table. Other
+ * names are passed through iconv, and the results are stored per archive in adbmeta, tagged with the charset used. Opening
+ * the same archive with the same charset later on, will then not need iconv at all.
+ */
+struct charset_translate_t
+{
+	char                              *charset;     /* NULL if not prepared */
+	int                                builtin;     /* CHARSET_TRANSLATE_BUILTIN_* */
+	int                                ascii;       /* 0 = unknown, 1 = ASCII compatible, 2 = not ASCII compatible */
+	iconv_t                            iconv_handle;/* (iconv_t)-1 if not opened (yet) */
+	int                                iconv_tried;
+
+	char                              *meta_filename; /* adbmeta key */
+	uint64_t                           meta_filesize;
+	const char                        *meta_SIG;
+
+	struct charset_translate_entry_t **cache;       /* hash table, NULL entries are free */
+	unsigned int                       cache_size;  /* power of two */
+	unsigned int                       cache_fill;
+	int                                cache_dirty; /* new entries that are not stored in adbmeta yet */
+};
+
+/* Must be called once before charset_translate_prepare() is used on a new struct */
+void charset_translate_init (struct charset_translate_t *self);
+
+/* Loads cached translations for charset, stored under (filename, filesize, SIG) in adbmeta. Calling it again, replaces the current charset */
+void charset_translate_prepare (struct charset_translate_t *self, const char *charset, const char *filename, uint64_t filesize, const char *SIG);
+
+/* Translates the last path element of src into *buffer (reallocated as needed). *buffer is NULL on failure */
+void charset_translate (struct charset_translate_t *self, const char *src, char **buffer, int *buffersize);
+
+/* Stores new translations in adbmeta and releases all resources, it is safe to call it multiple times */
+void charset_translate_complete (struct charset_translate_t *self);
+
+#endif
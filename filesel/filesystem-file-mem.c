@@ -178,6 +178,15 @@ static int mem_filehandle_filesize_ready (struct ocpfilehandle_t *_s)
 	return 1;
 }
 
+static int mem_filehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
+{
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{
+		return 0;
+	}
+	return -1;
+}
+
 static struct ocpfilehandle_t *mem_filehandle_open_real (struct mem_ocpfile_t *owner, int dirdb_ref, char *ptr, uint32_t len)
 {
 	struct mem_ocpfilehandle_t *s = calloc (1, sizeof (*s));
@@ -194,7 +203,7 @@ static struct ocpfilehandle_t *mem_filehandle_open_real (struct mem_ocpfile_t *o
 		mem_filehandle_eof,
 		mem_filehandle_error,
 		mem_filehandle_read,
-	        0, /* ioctl */
+		mem_filehandle_ioctl,
 		mem_filehandle_filesize,
 		mem_filehandle_filesize_ready,
 	        0, /* filename_override */
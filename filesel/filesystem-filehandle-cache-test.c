@@ -13,6 +13,9 @@ static void dump_self (struct cache_ocpfilehandle_t *self);
 #include "filesystem-dir-mem.h"
 #include "filesystem-file-mem.h"
 
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
 uint32_t dirdbFindAndRef (uint32_t parent, const char *name, enum dirdb_use use)
 {
 	return 0;
@@ -250,9 +253,100 @@ const static struct task_t chain_of_reads[] = {
 
 int results[chain_of_reads_n];
 
+/* slow parent, like a decompressor. Sequential reads should be served by the read-ahead thread after a few misses */
+static int (*readahead_parent_read)(struct ocpfilehandle_t *, void *, int);
+static int readahead_slow_read (struct ocpfilehandle_t *fh, void *dst, int len)
+{
+	usleep (100);
+	return readahead_parent_read (fh, dst, len);
+}
+
+static int readahead_test (struct ocpdir_t *test_dir)
+{
+	const int size = 26 * 100;
+	char *mem = malloc (size);
+	struct ocpfile_t *f;
+	struct ocpfilehandle_t *fh, *c1;
+	uint64_t hits, misses, misses0;
+	int i, retval = 0;
+
+	for (i=0; i < size; i++)
+	{
+		mem[i] = 'A' + (i % 26);
+	}
+	f = mem_file_open (test_dir, 0, mem, size);
+	fh = f->open (f);
+	readahead_parent_read = fh->read;
+	fh->read = readahead_slow_read;
+
+	/* plain handles never read ahead, their parent might not be safe to use from another thread */
+	c1 = cache_filehandle_open (fh);
+	for (i=0; i < size; i+=2)
+	{
+		char buffer[2];
+		c1->read (c1, buffer, 2);
+	}
+	c1->unref (c1);
+	cache_filehandle_readahead_statistics (&hits, &misses0);
+	if (hits || cache_readahead_thread_running)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "read-ahead: used without cache_filehandle_open_readahead()" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	fh->seek_set (fh, 0);
+
+	c1 = cache_filehandle_open_readahead (fh);
+
+	for (i=0; i < size; i+=2)
+	{
+		char buffer[2];
+		if ((c1->read (c1, buffer, 2) != 2) || (buffer[0] != ('A' + (i % 26))) || (buffer[1] != ('A' + ((i + 1) % 26))))
+		{
+			fprintf (stderr, ANSI_COLOR_RED "read-ahead: wrong data at %d" ANSI_COLOR_RESET "\n", i);
+			retval = 1;
+			break;
+		}
+	}
+	if (!c1->eof (c1))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "read-ahead: EOF not reached" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	cache_filehandle_readahead_statistics (&hits, &misses);
+	misses -= misses0;
+	fprintf (stderr, "read-ahead: %d hits, %d misses\n", (int)hits, (int)misses);
+	if (hits < misses)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "read-ahead: sequential reads are not served from read-ahead" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	/* random access must not break anything */
+	for (i=0; i < 200; i++)
+	{
+		int pos = (i * 977) % (size - 4);
+		char buffer[4];
+		c1->seek_set (c1, pos);
+		if ((c1->read (c1, buffer, 4) != 4) || (buffer[3] != ('A' + ((pos + 3) % 26))))
+		{
+			fprintf (stderr, ANSI_COLOR_RED "read-ahead: wrong data after seek to %d" ANSI_COLOR_RESET "\n", pos);
+			retval = 1;
+			break;
+		}
+	}
+
+	c1->unref (c1);
+	fh->unref (fh);
+	f->unref (f);
+
+	return retval;
+}
+
 int main (int argc, char *argv[])
 {
 	char *mem;
+	int retval = 0;
 	struct ocpfile_t *f;
 	struct ocpfilehandle_t *fh;
 	struct ocpdir_t *test_dir;
@@ -468,7 +562,11 @@ int main (int argc, char *argv[])
 	f->unref (f);
 	fh->unref (fh);
 
+	retval |= readahead_test (test_dir);
+
 	test_dir->unref (test_dir); test_dir = 0;
 
-	return 0;
+	cache_filehandle_done ();
+
+	return retval;
 }
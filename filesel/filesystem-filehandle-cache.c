@@ -19,6 +19,7 @@
  */
 
 #include "config.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_STRING_H
@@ -34,6 +35,13 @@
 
 #define CACHE_LINES 4
 
+#ifndef CACHE_READAHEAD_BUDGET
+# define CACHE_READAHEAD_BUDGET (4*1024*1024) /* shared by all handles */
+#endif
+
+#define CACHE_READAHEAD_BLOCKS 4 /* per handle, each block is CACHE_LINE_SIZE */
+#define CACHE_READAHEAD_TRIGGER 2 /* number of sequential parent reads before we start reading ahead */
+
 #ifdef FILEHANDLE_CACHE_DEBUG
 #define DEBUG_PRINT(...) do { if (do_debug_print) { fprintf(stderr, __VA_ARGS__); } } while (0)
 #define DUMP_SELF(S) do { if (do_debug_print) { dump_self(s); } } while (0)
@@ -50,6 +58,23 @@ struct cache_line_t
 	size_t size;
 };
 
+enum cache_readahead_state_t
+{
+	CACHE_READAHEAD_EMPTY = 0,
+	CACHE_READAHEAD_PENDING = 1, /* waiting for the read-ahead thread */
+	CACHE_READAHEAD_BUSY = 2,    /* read-ahead thread is reading into it */
+	CACHE_READAHEAD_READY = 3
+};
+
+struct cache_readahead_t
+{
+	enum cache_readahead_state_t state;
+	char *data;
+	uint64_t offset;
+	int fill;
+	int eof;
+};
+
 struct cache_ocpfilehandle_t
 {
 	struct ocpfilehandle_t  head;
@@ -69,8 +94,29 @@ struct cache_ocpfilehandle_t
    2 = tail
    3 = post-tail, when trying read past the current known EOF
  */
+
+	int readahead_allowed; /* parent can be used from the read-ahead thread */
+
+	/* everything below is protected by cache_readahead_mutex */
+	int io_busy; /* someone is using parent and handle_pos */
+	uint64_t sequential_next; /* where the next parent read will be, if access is sequential */
+	int sequential_count;
+	uint64_t readahead_next; /* offset of the next block to schedule */
+	struct cache_readahead_t readahead[CACHE_READAHEAD_BLOCKS];
+	struct cache_ocpfilehandle_t *readahead_list_next; /* in cache_readahead_list */
+	int readahead_listed;
 };
 
+static pthread_mutex_t cache_readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_readahead_cond = PTHREAD_COND_INITIALIZER; /* broadcast on every state change */
+static pthread_t cache_readahead_thread;
+static int cache_readahead_thread_running;
+static int cache_readahead_shutdown;
+static struct cache_ocpfilehandle_t *cache_readahead_list; /* handles that have, or have had, blocks scheduled */
+static size_t cache_readahead_memory;
+static uint64_t cache_readahead_hits;
+static uint64_t cache_readahead_misses;
+
 static void cache_filehandle_ref (struct ocpfilehandle_t *_s);
 
 static void cache_filehandle_unref (struct ocpfilehandle_t *_s);
@@ -95,6 +141,316 @@ static int cache_filehandle_filesize_ready (struct ocpfilehandle_t *);
 
 static int cache_filehandle_ioctl (struct ocpfilehandle_t *, const char *cmd, void *ptr);
 
+static const char *cache_filehandle_filename_override (struct ocpfilehandle_t *);
+
+/* parent and handle_pos can be used by both the caller and the read-ahead thread */
+static void cache_io_lock (struct cache_ocpfilehandle_t *s)
+{
+	pthread_mutex_lock (&cache_readahead_mutex);
+	while (s->io_busy)
+	{
+		pthread_cond_wait (&cache_readahead_cond, &cache_readahead_mutex);
+	}
+	s->io_busy = 1;
+	pthread_mutex_unlock (&cache_readahead_mutex);
+}
+
+static void cache_io_unlock (struct cache_ocpfilehandle_t *s)
+{
+	pthread_mutex_lock (&cache_readahead_mutex);
+	s->io_busy = 0;
+	pthread_cond_broadcast (&cache_readahead_cond);
+	pthread_mutex_unlock (&cache_readahead_mutex);
+}
+
+/* caller must hold cache_readahead_mutex, and the block can not be BUSY */
+static void cache_readahead_release (struct cache_readahead_t *block)
+{
+	if (block->data)
+	{
+		free (block->data);
+		block->data = 0;
+		cache_readahead_memory -= CACHE_LINE_SIZE;
+	}
+	block->state = CACHE_READAHEAD_EMPTY;
+	block->fill = 0;
+	block->eof = 0;
+}
+
+static void *cache_readahead_worker (void *user)
+{
+	pthread_mutex_lock (&cache_readahead_mutex);
+	while (!cache_readahead_shutdown)
+	{
+		struct cache_ocpfilehandle_t *iter;
+		struct cache_readahead_t *block = 0;
+		uint64_t offset;
+		int i, res = 0, eof = 1;
+
+		/* find the pending block with the lowest offset in the first handle that is not busy */
+		for (iter = cache_readahead_list; iter; iter = iter->readahead_list_next)
+		{
+			if (iter->io_busy)
+			{
+				continue;
+			}
+			for (i=0; i < CACHE_READAHEAD_BLOCKS; i++)
+			{
+				if ((iter->readahead[i].state == CACHE_READAHEAD_PENDING) && ((!block) || (iter->readahead[i].offset < block->offset)))
+				{
+					block = iter->readahead + i;
+				}
+			}
+			if (block)
+			{
+				break;
+			}
+		}
+
+		if (!block)
+		{
+			pthread_cond_wait (&cache_readahead_cond, &cache_readahead_mutex);
+			continue;
+		}
+
+		block->state = CACHE_READAHEAD_BUSY;
+		iter->io_busy = 1;
+		offset = block->offset;
+		pthread_mutex_unlock (&cache_readahead_mutex);
+
+		DEBUG_PRINT ("READ-AHEAD: POS=%d LEN=%d\n", (int)offset, CACHE_LINE_SIZE);
+
+		if ((iter->handle_pos == offset) || (!iter->parent->seek_set (iter->parent, offset)))
+		{
+			iter->handle_pos = offset;
+			res = iter->parent->read (iter->parent, block->data, CACHE_LINE_SIZE);
+			iter->handle_pos += res;
+			eof = iter->parent->eof (iter->parent);
+		}
+
+		pthread_mutex_lock (&cache_readahead_mutex);
+		block->fill = res;
+		block->eof = eof;
+		block->state = CACHE_READAHEAD_READY;
+		iter->io_busy = 0;
+		pthread_cond_broadcast (&cache_readahead_cond);
+	}
+	pthread_mutex_unlock (&cache_readahead_mutex);
+
+	return 0;
+}
+
+/* caller must hold cache_readahead_mutex */
+static int cache_readahead_start (void)
+{
+	if (!cache_readahead_thread_running)
+	{
+		cache_readahead_shutdown = 0;
+		if (pthread_create (&cache_readahead_thread, 0, cache_readahead_worker, 0))
+		{
+			return 0;
+		}
+		cache_readahead_thread_running = 1;
+	}
+	return 1;
+}
+
+/* Copy out whatever the read-ahead thread has prepared for [pos, pos+len>, waiting for blocks that are already on their way. Returns the number of bytes copied */
+static int cache_readahead_consume (struct cache_ocpfilehandle_t *s, uint64_t pos, char *dst, int len)
+{
+	int retval = 0;
+	int i;
+
+	pthread_mutex_lock (&cache_readahead_mutex);
+again:
+	for (i=0; (i < CACHE_READAHEAD_BLOCKS) && len; i++)
+	{
+		struct cache_readahead_t *block = s->readahead + i;
+		int hitlen;
+
+		if ((block->state == CACHE_READAHEAD_EMPTY) || (pos < block->offset) || (pos >= (block->offset + CACHE_LINE_SIZE)))
+		{
+			continue;
+		}
+		if (block->state != CACHE_READAHEAD_READY)
+		{
+			pthread_cond_wait (&cache_readahead_cond, &cache_readahead_mutex);
+			goto again;
+		}
+		if (pos >= (block->offset + block->fill))
+		{
+			continue;
+		}
+
+		hitlen = block->offset + block->fill - pos;
+		if (hitlen > len)
+		{
+			hitlen = len;
+		}
+
+		DEBUG_PRINT ("READ-AHEAD HIT: POS=%d LEN=%d\n", (int)pos, hitlen);
+
+		memcpy (dst, block->data + (pos - block->offset), hitlen);
+		dst += hitlen;
+		pos += hitlen;
+		len -= hitlen;
+		retval += hitlen;
+
+		if (pos > s->filesize)
+		{ /* should never happen if s->filesize_pending, but does not hurt performing this task */
+			s->filesize = pos;
+		}
+		if (block->eof && (pos == (block->offset + block->fill)))
+		{
+			s->filesize_pending = 0;
+		}
+		goto again;
+	}
+	if (len)
+	{
+		cache_readahead_misses++;
+	} else {
+		cache_readahead_hits++;
+	}
+	pthread_mutex_unlock (&cache_readahead_mutex);
+
+	return retval;
+}
+
+/* Called after each parent read covering [pos, end>. Keeps track of sequential access and schedules blocks ahead of it */
+static void cache_readahead_schedule (struct cache_ocpfilehandle_t *s, uint64_t pos, uint64_t end)
+{
+	int i;
+	int scheduled = 0;
+
+	pthread_mutex_lock (&cache_readahead_mutex);
+
+	if (pos == s->sequential_next)
+	{
+		s->sequential_count++;
+	} else {
+		s->sequential_count = 0;
+		s->readahead_next = 0;
+	}
+	s->sequential_next = end;
+
+	/* drop blocks that have been passed, or that are outside the window */
+	for (i=0; i < CACHE_READAHEAD_BLOCKS; i++)
+	{
+		struct cache_readahead_t *block = s->readahead + i;
+
+		if ((block->state == CACHE_READAHEAD_EMPTY) || (block->state == CACHE_READAHEAD_BUSY))
+		{
+			continue;
+		}
+		if ((s->sequential_count < CACHE_READAHEAD_TRIGGER) ||
+		    ((block->offset + ((block->state == CACHE_READAHEAD_READY) ? block->fill : CACHE_LINE_SIZE)) <= end) ||
+		    (block->offset >= (end + CACHE_READAHEAD_BLOCKS * CACHE_LINE_SIZE)))
+		{
+			cache_readahead_release (block);
+		}
+	}
+
+	if (s->readahead_allowed && (s->sequential_count >= CACHE_READAHEAD_TRIGGER) && s->parent && cache_readahead_start ())
+	{
+		if (s->readahead_next < end)
+		{
+			s->readahead_next = end;
+		}
+		for (i=0; i < CACHE_READAHEAD_BLOCKS; i++)
+		{
+			struct cache_readahead_t *block = s->readahead + i;
+
+			if (block->state != CACHE_READAHEAD_EMPTY)
+			{
+				continue;
+			}
+			if (((!s->filesize_pending) && (s->readahead_next >= s->filesize)) ||
+			     (s->readahead_next >= (end + CACHE_READAHEAD_BLOCKS * CACHE_LINE_SIZE)) ||
+			     ((cache_readahead_memory + CACHE_LINE_SIZE) > CACHE_READAHEAD_BUDGET))
+			{
+				break;
+			}
+			block->data = malloc (CACHE_LINE_SIZE);
+			if (!block->data)
+			{
+				break;
+			}
+			cache_readahead_memory += CACHE_LINE_SIZE;
+			block->offset = s->readahead_next;
+			block->state = CACHE_READAHEAD_PENDING;
+			s->readahead_next += CACHE_LINE_SIZE;
+			scheduled = 1;
+		}
+		if (!s->readahead_listed)
+		{
+			s->readahead_list_next = cache_readahead_list;
+			cache_readahead_list = s;
+			s->readahead_listed = 1;
+		}
+		if (scheduled)
+		{
+			pthread_cond_broadcast (&cache_readahead_cond);
+		}
+	}
+
+	pthread_mutex_unlock (&cache_readahead_mutex);
+}
+
+/* wait for the read-ahead thread to leave us alone, and drop all blocks */
+static void cache_readahead_detach (struct cache_ocpfilehandle_t *s)
+{
+	int i;
+
+	pthread_mutex_lock (&cache_readahead_mutex);
+	for (i=0; i < CACHE_READAHEAD_BLOCKS; i++)
+	{
+		while (s->readahead[i].state == CACHE_READAHEAD_BUSY)
+		{
+			pthread_cond_wait (&cache_readahead_cond, &cache_readahead_mutex);
+		}
+		cache_readahead_release (s->readahead + i);
+	}
+	if (s->readahead_listed)
+	{
+		struct cache_ocpfilehandle_t **prev;
+		for (prev = &cache_readahead_list; *prev; prev = &(*prev)->readahead_list_next)
+		{
+			if (*prev == s)
+			{
+				*prev = s->readahead_list_next;
+				break;
+			}
+		}
+		s->readahead_listed = 0;
+	}
+	pthread_mutex_unlock (&cache_readahead_mutex);
+}
+
+void cache_filehandle_readahead_statistics (uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock (&cache_readahead_mutex);
+	*hits = cache_readahead_hits;
+	*misses = cache_readahead_misses;
+	pthread_mutex_unlock (&cache_readahead_mutex);
+}
+
+void cache_filehandle_done (void)
+{
+	pthread_mutex_lock (&cache_readahead_mutex);
+	if (!cache_readahead_thread_running)
+	{
+		pthread_mutex_unlock (&cache_readahead_mutex);
+		return;
+	}
+	cache_readahead_shutdown = 1;
+	pthread_cond_broadcast (&cache_readahead_cond);
+	pthread_mutex_unlock (&cache_readahead_mutex);
+
+	pthread_join (cache_readahead_thread, 0);
+	cache_readahead_thread_running = 0;
+}
+
 struct ocpfilehandle_t *cache_filehandle_open_pre (struct ocpfile_t *owner, char *headptr, uint32_t headlen, char *tailptr, uint32_t taillen)
 {
 	struct cache_ocpfilehandle_t *retval = calloc (1, sizeof (*retval));
@@ -113,7 +469,7 @@ struct ocpfilehandle_t *cache_filehandle_open_pre (struct ocpfile_t *owner, char
 		cache_filehandle_ioctl,
 		cache_filehandle_filesize,
 		cache_filehandle_filesize_ready,
-	        0, /* filename_override */
+		cache_filehandle_filename_override,
 		owner->dirdb_ref // we do not dirdb_ref()/dirdb_unref(), since we ref the owner instead
 	);
 	retval->owner = owner;
@@ -131,8 +487,7 @@ struct ocpfilehandle_t *cache_filehandle_open_pre (struct ocpfile_t *owner, char
 	return &retval->head;
 }
 
-/* for general cached version, we go directly for an open handle */
-struct ocpfilehandle_t *cache_filehandle_open (struct ocpfilehandle_t *parent)
+static struct ocpfilehandle_t *cache_filehandle_open_common (struct ocpfilehandle_t *parent, int readahead_allowed)
 {
 	struct cache_ocpfilehandle_t *retval = calloc (1, sizeof (*retval));
 	ocpfilehandle_t_fill
@@ -156,6 +511,7 @@ struct ocpfilehandle_t *cache_filehandle_open (struct ocpfilehandle_t *parent)
 
 	retval->parent = parent;
 	retval->parent->ref (retval->parent);
+	retval->readahead_allowed = readahead_allowed;
 	if (parent->filesize_ready (parent))
 	{
 		retval->filesize_pending = 0;
@@ -170,6 +526,17 @@ struct ocpfilehandle_t *cache_filehandle_open (struct ocpfilehandle_t *parent)
 	return &retval->head;
 }
 
+/* for general cached version, we go directly for an open handle */
+struct ocpfilehandle_t *cache_filehandle_open (struct ocpfilehandle_t *parent)
+{
+	return cache_filehandle_open_common (parent, 0);
+}
+
+struct ocpfilehandle_t *cache_filehandle_open_readahead (struct ocpfilehandle_t *parent)
+{
+	return cache_filehandle_open_common (parent, 1);
+}
+
 static void cache_filehandle_ref (struct ocpfilehandle_t *_s)
 {
 	struct cache_ocpfilehandle_t *s = (struct cache_ocpfilehandle_t *)_s;
@@ -188,6 +555,8 @@ static void cache_filehandle_unref (struct ocpfilehandle_t *_s)
 		return;
 	}
 
+	cache_readahead_detach (s);
+
 	for (i=0; i < CACHE_LINES; i++)
 	{
 		free (s->cache_line[i].data);
@@ -214,7 +583,9 @@ static int cache_filehandle_filesize_unpend (struct cache_ocpfilehandle_t *s)
 	uint64_t filesize = FILESIZE_ERROR;
 	if (s->parent)
 	{
+		cache_io_lock (s);
 		filesize = s->parent->filesize (s->parent);
+		cache_io_unlock (s);
 	} else if (s->owner)
 	{
 		filesize = s->owner->filesize (s->owner);
@@ -508,14 +879,28 @@ static void cache_steal_buffers (struct cache_ocpfilehandle_t *s)
 static int cache_filehandle_seek_and_read (struct cache_ocpfilehandle_t *s, uint64_t pos, void *dst, int len)
 {
 	int readresult;
+	int prefetched;
+
+	prefetched = cache_readahead_consume (s, pos, dst, len);
+	if (prefetched == len)
+	{
+		cache_readahead_schedule (s, pos, pos + len);
+		return len;
+	}
+	pos += prefetched;
+	dst = (char *)dst + prefetched;
+	len -= prefetched;
+
+	cache_io_lock (s);
 
 	if (s->handle_pos != pos)
 	{
 		if (s->parent->seek_set (s->parent, pos))
 		{
+			cache_io_unlock (s);
 			s->error = 1;
 			memset (dst, 0, len);
-			return 0;
+			return prefetched;
 		}
 		s->handle_pos = pos;
 	}
@@ -555,7 +940,11 @@ static int cache_filehandle_seek_and_read (struct cache_ocpfilehandle_t *s, uint
 		s->error = s->parent->error (s->parent);
 	}
 
-	return readresult;
+	cache_io_unlock (s);
+
+	cache_readahead_schedule (s, pos - prefetched, pos + readresult);
+
+	return prefetched + readresult;
 }
 
 static int cache_filehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
@@ -585,7 +974,7 @@ static int cache_filehandle_read (struct ocpfilehandle_t *_s, void *dst, int len
 	{
 		if ((s->pos + len) > s->filesize)
 		{
-			len = s->filesize - len;
+			len = s->filesize - s->pos;
 		}
 	}
 
@@ -1006,8 +1395,29 @@ redo_topup:
 static int cache_filehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
 {
 	struct cache_ocpfilehandle_t *s = (struct cache_ocpfilehandle_t *)_s;
+	int retval;
 
-	return s->parent->ioctl (s->parent, cmd, ptr);
+	if (!s->parent)
+	{
+		return -1;
+	}
+
+	cache_io_lock (s);
+	retval = s->parent->ioctl (s->parent, cmd, ptr);
+	cache_io_unlock (s);
+
+	return retval;
+}
+
+static const char *cache_filehandle_filename_override (struct ocpfilehandle_t *_s)
+{
+	struct cache_ocpfilehandle_t *s = (struct cache_ocpfilehandle_t *)_s;
+
+	if (s->parent)
+	{
+		return s->parent->filename_override (s->parent);
+	}
+	return s->owner ? s->owner->filename_override (s->owner) : 0;
 }
 
 static uint64_t cache_filehandle_filesize (struct ocpfilehandle_t * _s)
@@ -13,4 +13,16 @@ struct ocpfilehandle_t *cache_filehandle_open_pre (struct ocpfile_t *owner, char
 /* for general cached version, we go directly for an open handle */
 struct ocpfilehandle_t *cache_filehandle_open (struct ocpfilehandle_t *parent);
 
+/* Same as cache_filehandle_open(), but sequential reads from the parent are detected, and a shared thread will read ahead of
+ * them. The parent is then used from that thread, so it must not share any state with other handles: a plain file opened
+ * for this handle only is fine, files inside archives are not (they read through the archive handle, spill cache and dirdb).
+ * Check with IOCTL_FILEHANDLE_THREAD_SAFE */
+struct ocpfilehandle_t *cache_filehandle_open_readahead (struct ocpfilehandle_t *parent);
+
+/* Counters are in parent reads */
+void cache_filehandle_readahead_statistics (uint64_t *hits, uint64_t *misses);
+
+/* stops the read-ahead thread, all handles must be closed */
+void cache_filehandle_done (void);
+
 #endif
@@ -2,6 +2,7 @@
 
 #define INPUTBUFFERSIZE 128
 #define OUTPUTBUFFERSIZE 64
+#define GZIP_INDEX_SPAN 4096
 
 #include "filesystem-gzip.c"
 #include "filesystem-dir-mem.h"
@@ -42,6 +43,8 @@ void dirdbGetName_internalstr (uint32_t ref, const char **retval)
 	if (ref == 9) *retval = "test5.txt.gz.gz";
 	if (ref == 10) *retval = "test5.txt.gz";
 	if (ref == 11) *retval = "test5.txt";
+	if (ref == 12) *retval = "test6.txt.gz";
+	if (ref == 13) *retval = "test6.txt";
 
 }
 
@@ -94,13 +97,36 @@ void register_dirdecompressor (const struct ocpdirdecompressor_t *ofd)
 {
 }
 
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file)
+{
+	return file->open (file);
+}
+
+/* only the access-point index of test6 is remembered */
+static unsigned char *test_gzix_data;
+static size_t test_gzix_datasize;
+
 int adbMetaAdd (const char *filename, const size_t filesize, const char *SIG, const unsigned char  *data, const size_t  datasize)
 {
+	if (!strcmp (SIG, "GZIX") && !strcmp (filename, "test6.txt.gz"))
+	{
+		free (test_gzix_data);
+		test_gzix_data = malloc (datasize);
+		memcpy (test_gzix_data, data, datasize);
+		test_gzix_datasize = datasize;
+	}
 	return 0;
 }
 
 int adbMetaGet (const char *filename, const size_t filesize, const char *SIG,       unsigned char **data,       size_t *datasize)
 {
+	if (!strcmp (SIG, "GZIX") && !strcmp (filename, "test6.txt.gz") && test_gzix_data)
+	{
+		*data = malloc (test_gzix_datasize);
+		memcpy (*data, test_gzix_data, test_gzix_datasize);
+		*datasize = test_gzix_datasize;
+		return 0;
+	}
 	return -1;
 }
 
@@ -484,6 +510,134 @@ int gzip_test5 (void)
 	return retval;
 }
 
+int gzip_test6 (void)
+{
+	const uint32_t offsets[] = {0x3f00, 0x0010, 0x2345, 0x3ffe, 0x1000, 0x0c31};
+	uint8_t *plain = malloc (0x4000 * 5 + 1); /* sprintf() terminates the last line */
+	uint8_t *dsrc = malloc (0x4000 * 5);
+	uLong dsrcsize;
+	z_stream strm = {0};
+	int retval = 0;
+	struct ocpdir_t *test_dir;
+	struct ocpfile_t *osrc;
+	struct ocpdir_t *oddst;
+	struct ocpfile_t *odst;
+	struct ocpfilehandle_t *hdst;
+	char dst[5];
+	int i, pass;
+
+	printf ("Testing seek and reads using access-points:  ");
+
+	for (i=0; i < 0x4000; i++)
+	{
+		sprintf ((char *)plain + i * 5, "%04x\n", i);
+	}
+
+	/* end a deflate-block every 1000 bytes, so that access-points are available that does not start at byte-boundaries */
+	deflateInit2 (&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 16+MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	strm.next_out = dsrc;
+	strm.avail_out = 0x4000 * 5;
+	for (i=0; i < 0x4000 * 5; i += 1000)
+	{
+		strm.next_in = plain + i;
+		strm.avail_in = ((0x4000 * 5 - i) < 1000) ? (0x4000 * 5 - i) : 1000;
+		deflate (&strm, ((i + 1000) >= 0x4000 * 5) ? Z_FINISH : Z_BLOCK);
+	}
+	dsrcsize = strm.total_out;
+	deflateEnd (&strm);
+	free (plain);
+
+	for (pass=0; pass < 2; pass++)
+	{
+		uint8_t *dsrc2 = malloc (dsrcsize);
+		memcpy (dsrc2, dsrc, dsrcsize);
+		test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+		osrc = mem_file_open (test_dir, 12, (char *)dsrc2, dsrcsize);
+		test_dir->unref (test_dir); test_dir = 0;
+
+		oddst = gzip_check_steal (osrc, 13);
+		odst = oddst->readdir_file(oddst, 13);
+		hdst = odst->open (odst);
+
+		if (!pass)
+		{ /* the first pass builds the index by reading the whole file */
+			for (i=0; i < 0x4000; i++)
+			{
+				if ((hdst->read (hdst, dst, 5) != 5) || (strtol (dst, 0, 16) != i))
+				{
+					printf ("r");
+					retval |= 1;
+					break;
+				}
+			}
+			if (hdst->read (hdst, dst, 5) != 0)
+			{
+				printf ("e");
+				retval |= 1;
+			}
+			if (((struct gzip_ocpdir_t *)oddst)->child.points_count < 4)
+			{
+				printf ("p");
+				retval |= 2;
+			}
+		} else { /* the second pass should have the index loaded from the metadata */
+			if (((struct gzip_ocpdir_t *)oddst)->child.points_count < 4)
+			{
+				printf ("l");
+				retval |= 2;
+			}
+		}
+
+		for (i=0; i < sizeof (offsets) / sizeof (offsets[0]); i++)
+		{
+			char expect[6];
+			sprintf (expect, "%04x\n", offsets[i]);
+			if (hdst->seek_set (hdst, offsets[i] * 5))
+			{
+				printf ("s");
+				retval |= 4;
+			} else if (hdst->read (hdst, dst, 5) != 5)
+			{
+				printf ("r");
+				retval |= 4;
+			} else if (memcmp (dst, expect, 5))
+			{
+				printf ("d");
+				retval |= 8;
+			} else if ((offsets[i] * 5 >= 2 * GZIP_INDEX_SPAN) && (((struct gzip_ocpfilehandle_t *)hdst)->outbase == 0))
+			{ /* did not make use of any access-point */
+				printf ("i");
+				retval |= 16;
+			} else {
+				printf ("%d", pass * 6 + i + 1);
+			}
+		}
+
+		hdst->unref (hdst); hdst = 0;
+		oddst->unref (oddst); oddst = 0;
+		odst->unref (odst); odst = 0;
+		osrc->unref (osrc); osrc = 0;
+
+		if ((!pass) && (!test_gzix_data))
+		{
+			printf ("m");
+			retval |= 2;
+		}
+	}
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (dsrc);
+	free (test_gzix_data);
+	test_gzix_data = 0;
+
+	return retval;
+}
 
 int main(int argc, char *argv[])
 {
@@ -495,6 +649,7 @@ int main(int argc, char *argv[])
 	retval |= gzip_test3 ();
 	retval |= gzip_test4 ();
 	retval |= gzip_test5 ();
+	retval |= gzip_test6 ();
 	printf ("\n");
 
 	return retval;
@@ -28,6 +28,7 @@
 #include "dirdb.h"
 #include "filesystem.h"
 #include "filesystem-gzip.h"
+#include "filesystem-spill.h"
 #include "stuff/framelock.h"
 
 #ifndef INPUTBUFFERSIZE
@@ -38,6 +39,14 @@
 # define OUTPUTBUFFERSIZE 65536
 #endif
 
+#ifndef GZIP_INDEX_SPAN
+# define GZIP_INDEX_SPAN (1024*1024) /* distance between each access-point in the uncompressed stream */
+#endif
+
+#define GZIP_WINDOW_SIZE 32768 /* deflate can reference up to 32KB backwards */
+
+#define GZIP_INDEX_VERSION 1
+
 #define LARGEST_THEORETICALLY_32BIT_SIZE 0x3f80fe // based on TAIL-32bit original size information is wrapping for LARGE objects, and theoretically largest compression ratio is 1032:1 =>  0xffffffff / 1032
 
 #if defined(GZIP2_DEBUG) || defined(GZIP_VERBOSE)
@@ -75,10 +84,23 @@ struct gzip_ocpfilehandle_t
 	uint64_t realpos;
 	uint64_t pos;
 
+	uint64_t inbase;  /* compressed position that matches strm.total_in == 0 */
+	uint64_t outbase; /* uncompressed position that matches strm.total_out == 0 */
+
 	int need_deinit;
 	int error;
 };
 
+/* An access-point makes it possible to resume inflate in the middle of the stream, at the start of a deflate block */
+struct gzip_accesspoint_t
+{
+	uint64_t out;        /* position in the uncompressed stream */
+	uint64_t in;         /* position of the first complete byte in the compressed stream */
+	uint8_t  bits;       /* number of bits from the byte before "in" that are part of the block, 0-7 */
+	uint32_t windowsize; /* size of window */
+	uint8_t *window;     /* the last (up to) 32KB of uncompressed data before "out", stored compressed */
+};
+
 struct gzip_ocpfile_t
 {
 	struct ocpfile_t      head;
@@ -86,6 +108,12 @@ struct gzip_ocpfile_t
 
 	int                   filesize_pending;
 	uint64_t uncompressed_filesize;
+
+	struct gzip_accesspoint_t *points; /* sorted by out */
+	int                        points_count;
+	int                        points_size;
+	int                        points_loaded; /* have we checked adbMeta yet? */
+	int                        points_dirty;  /* new access-points not yet stored in adbMeta */
 };
 
 struct gzip_ocpdir_t
@@ -106,6 +134,8 @@ static int gzip_ocpfilehandle_inflateInit (struct gzip_ocpfilehandle_t *s)
 
 	s->error = 0;
 	s->realpos = 0;
+	s->inbase = 0;
+	s->outbase = 0;
 
 	s->outputbuffer_pos = 0;
 	s->outputbuffer_fill = 0;
@@ -140,6 +170,368 @@ static int gzip_ocpfilehandle_inflateInit (struct gzip_ocpfilehandle_t *s)
 	return 0;
 }
 
+static int gzip_ocpfilehandle_inflateRestore (struct gzip_ocpfilehandle_t *s, const struct gzip_accesspoint_t *p)
+{
+	uint8_t window[GZIP_WINDOW_SIZE];
+	uLongf windowsize = sizeof (window);
+	uint8_t prime = 0;
+	int retval;
+
+	if (s->need_deinit)
+	{
+		inflateEnd (&s->strm);
+		s->need_deinit = 0;
+	}
+
+	s->error = 0;
+	s->realpos = p->out;
+	s->inbase = p->in;
+	s->outbase = p->out;
+
+	s->outputbuffer_pos = 0;
+	s->outputbuffer_fill = 0;
+
+	s->eofhit = 0;
+
+	if (uncompress (window, &windowsize, p->window, p->windowsize) != Z_OK)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	if (s->compressedfilehandle->seek_set (s->compressedfilehandle, p->in - (p->bits ? 1 : 0)) < 0)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	if (p->bits)
+	{
+		if (s->compressedfilehandle->read (s->compressedfilehandle, &prime, 1) != 1)
+		{
+			s->error = 1;
+			return -1;
+		}
+	}
+
+	memset (&s->strm, 0, sizeof (s->strm));
+
+	s->strm.next_in = s->inputbuffer;
+	retval = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
+	if (retval <= 0)
+	{
+		s->error = 1;
+		return -1;
+	}
+	s->strm.avail_in = retval;
+
+	if (inflateInit2(&s->strm, -MAX_WBITS) != Z_OK) /* raw deflate, we are past the GZIP header */
+	{
+		s->error = 1;
+		return -1;
+	}
+	s->need_deinit = 1;
+
+	if (p->bits)
+	{
+		if (inflatePrime (&s->strm, p->bits, prime >> (8 - p->bits)) != Z_OK)
+		{
+			s->error = 1;
+			return -1;
+		}
+	}
+
+	if (inflateSetDictionary (&s->strm, window, windowsize) != Z_OK)
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	DEBUG_PRINT ("[GZIP inflateRestore] out=%"PRIu64" in=%"PRIu64" bits=%d\n", p->out, p->in, p->bits);
+
+	return 0;
+}
+
+/* returns the last access-point at or before pos */
+static const struct gzip_accesspoint_t *gzip_ocpfile_accesspoint_find (struct gzip_ocpfile_t *s, uint64_t pos)
+{
+	int lo = 0, hi = s->points_count;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (s->points[mid].out <= pos)
+		{
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? &s->points[lo - 1] : 0;
+}
+
+/* called when inflate stopped at the end of a deflate block */
+static void gzip_ocpfilehandle_accesspoint_add (struct gzip_ocpfilehandle_t *s)
+{
+	struct gzip_ocpfile_t *o = s->owner;
+	struct gzip_accesspoint_t *p;
+	uint8_t window[GZIP_WINDOW_SIZE];
+	uInt windowsize = sizeof (window);
+	uLongf compressedsize;
+	uint8_t *compressed;
+	uint64_t out = s->outbase + s->strm.total_out;
+
+	if (out < (o->points_count ? o->points[o->points_count - 1].out : 0) + GZIP_INDEX_SPAN)
+	{
+		return;
+	}
+
+	if (inflateGetDictionary (&s->strm, window, &windowsize) != Z_OK)
+	{
+		return;
+	}
+
+	if (o->points_count >= o->points_size)
+	{
+		struct gzip_accesspoint_t *temp = realloc (o->points, (o->points_size + 16) * sizeof (o->points[0]));
+		if (!temp)
+		{
+			return;
+		}
+		o->points = temp;
+		o->points_size += 16;
+	}
+
+	compressedsize = compressBound (windowsize);
+	compressed = malloc (compressedsize);
+	if (!compressed)
+	{
+		return;
+	}
+	if (compress2 (compressed, &compressedsize, window, windowsize, Z_BEST_SPEED) != Z_OK)
+	{
+		free (compressed);
+		return;
+	}
+
+	p = &o->points[o->points_count++];
+	p->out = out;
+	p->in = s->inbase + s->strm.total_in;
+	p->bits = s->strm.data_type & 7;
+	p->windowsize = compressedsize;
+	p->window = compressed;
+	o->points_dirty = 1;
+
+	DEBUG_PRINT ("[GZIP accesspoint_add] out=%"PRIu64" in=%"PRIu64" bits=%d window=%d\n", p->out, p->in, p->bits, (int)compressedsize);
+}
+
+static void gzip_ocpfile_index_clear (struct gzip_ocpfile_t *s)
+{
+	int i;
+	for (i=0; i < s->points_count; i++)
+	{
+		free (s->points[i].window);
+	}
+	free (s->points);
+	s->points = 0;
+	s->points_count = 0;
+	s->points_size = 0;
+	s->points_dirty = 0;
+}
+
+/* GZIX metadata: version:8, count:32, and count * { out:64 in:64 bits:8 windowsize:32 window:windowsize*8 }, all little-endian */
+static void gzip_ocpfile_index_load (struct gzip_ocpfile_t *s)
+{
+	unsigned char *metadata = 0;
+	size_t metadatasize = 0;
+	const char *filename = 0;
+	uint64_t compressedfile_size;
+	size_t offset;
+	uint32_t count, i;
+
+	if (s->points_loaded)
+	{
+		return;
+	}
+	if (!s->compressedfile->filesize_ready (s->compressedfile))
+	{
+		return;
+	}
+	s->points_loaded = 1;
+
+	compressedfile_size = s->compressedfile->filesize (s->compressedfile);
+	dirdbGetName_internalstr (s->compressedfile->dirdb_ref, &filename);
+
+	if (adbMetaGet (filename, compressedfile_size, "GZIX", &metadata, &metadatasize))
+	{
+		return;
+	}
+
+	if ((metadatasize < 5) || (metadata[0] != GZIP_INDEX_VERSION))
+	{
+		free (metadata);
+		return;
+	}
+	count = metadata[1] | (metadata[2] << 8) | (metadata[3] << 16) | ((uint32_t)metadata[4] << 24);
+	offset = 5;
+
+	for (i=0; i < count; i++)
+	{
+		struct gzip_accesspoint_t p;
+		int j;
+
+		if ((metadatasize - offset) < 21)
+		{
+			goto corrupt;
+		}
+		p.out = 0;
+		p.in = 0;
+		for (j=7; j >= 0; j--)
+		{
+			p.out = (p.out << 8) | metadata[offset + j];
+			p.in  = (p.in  << 8) | metadata[offset + 8 + j];
+		}
+		p.bits = metadata[offset + 16];
+		p.windowsize = metadata[offset + 17] | (metadata[offset + 18] << 8) | (metadata[offset + 19] << 16) | ((uint32_t)metadata[offset + 20] << 24);
+		offset += 21;
+		if ((p.bits > 7) || ((metadatasize - offset) < p.windowsize) || (p.in > compressedfile_size) || (s->points_count && (p.out <= s->points[s->points_count - 1].out)))
+		{
+			goto corrupt;
+		}
+		p.window = malloc (p.windowsize ? p.windowsize : 1);
+		if (!p.window)
+		{
+			goto corrupt;
+		}
+		memcpy (p.window, metadata + offset, p.windowsize);
+		offset += p.windowsize;
+
+		if (s->points_count >= s->points_size)
+		{
+			struct gzip_accesspoint_t *temp = realloc (s->points, (s->points_size + 16) * sizeof (s->points[0]));
+			if (!temp)
+			{
+				free (p.window);
+				goto corrupt;
+			}
+			s->points = temp;
+			s->points_size += 16;
+		}
+		s->points[s->points_count++] = p;
+	}
+
+	DEBUG_PRINT ("[GZIP index_load] %s: %d access-points\n", filename, s->points_count);
+
+	free (metadata);
+	return;
+
+corrupt:
+	free (metadata);
+	gzip_ocpfile_index_clear (s);
+}
+
+static void gzip_ocpfile_index_save (struct gzip_ocpfile_t *s, struct ocpfilehandle_t *compressedfilehandle)
+{
+	const char *filename = 0;
+	unsigned char *metadata;
+	size_t metadatasize = 5;
+	size_t offset;
+	int i, j;
+
+	if (!s->points_dirty)
+	{
+		return;
+	}
+	s->points_dirty = 0;
+
+	for (i=0; i < s->points_count; i++)
+	{
+		metadatasize += 21 + s->points[i].windowsize;
+	}
+
+	metadata = malloc (metadatasize);
+	if (!metadata)
+	{
+		return;
+	}
+
+	metadata[0] = GZIP_INDEX_VERSION;
+	metadata[1] = s->points_count;
+	metadata[2] = s->points_count >> 8;
+	metadata[3] = s->points_count >> 16;
+	metadata[4] = s->points_count >> 24;
+	offset = 5;
+	for (i=0; i < s->points_count; i++)
+	{
+		struct gzip_accesspoint_t *p = &s->points[i];
+		for (j=0; j < 8; j++)
+		{
+			metadata[offset + j]     = p->out >> (j * 8);
+			metadata[offset + 8 + j] = p->in  >> (j * 8);
+		}
+		metadata[offset + 16] = p->bits;
+		metadata[offset + 17] = p->windowsize;
+		metadata[offset + 18] = p->windowsize >> 8;
+		metadata[offset + 19] = p->windowsize >> 16;
+		metadata[offset + 20] = p->windowsize >> 24;
+		offset += 21;
+		memcpy (metadata + offset, p->window, p->windowsize);
+		offset += p->windowsize;
+	}
+
+	dirdbGetName_internalstr (compressedfilehandle->dirdb_ref, &filename);
+	DEBUG_PRINT ("[GZIP index_save] adbMetaAdd(%s, %"PRIu64", GZIX, %d access-points)\n", filename, compressedfilehandle->filesize (compressedfilehandle), s->points_count);
+	adbMetaAdd (filename, compressedfilehandle->filesize (compressedfilehandle), "GZIX", metadata, metadatasize);
+
+	free (metadata);
+}
+
+/* Fills the outputbuffer with the next chunk of data. Inflate stops at every deflate block boundary, so access-points can be recorded */
+static int gzip_ocpfilehandle_inflate_more (struct gzip_ocpfilehandle_t *s, int *inputsize)
+{
+	int ret;
+
+	if (!s->strm.avail_in)
+	{
+		s->strm.next_in = s->inputbuffer;
+		s->strm.avail_in = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
+		if (s->compressedfilehandle->error (s->compressedfilehandle))
+		{
+			return -1;
+		}
+	}
+
+	s->strm.next_out = s->outputbuffer;
+	s->strm.avail_out = OUTPUTBUFFERSIZE;
+	s->outputbuffer_pos = s->outputbuffer;
+
+	*inputsize = s->strm.avail_in;
+	ret = inflate (&s->strm, Z_BLOCK);
+
+	switch (ret)
+	{
+		default:
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+			/* should not happen */
+			return -1;
+		case Z_STREAM_END:
+			s->eofhit = 1;
+		case Z_OK:
+			break;
+	}
+	s->outputbuffer_fill = OUTPUTBUFFERSIZE - s->strm.avail_out;
+
+	if ((ret == Z_OK) && (s->strm.data_type & 128) && !(s->strm.data_type & 64))
+	{
+		gzip_ocpfilehandle_accesspoint_add (s);
+	}
+
+	return ret;
+}
+
 static void gzip_ocpfilehandle_ref (struct ocpfilehandle_t *_s)
 {
 	struct gzip_ocpfilehandle_t *s = (struct gzip_ocpfilehandle_t *)_s;
@@ -163,6 +555,12 @@ static void gzip_ocpfilehandle_unref (struct ocpfilehandle_t *_s)
 		s->need_deinit = 0;
 	}
 
+	/* a partial index is still useful, for instance when only the first members of a tar archive has been visited */
+	if (s->compressedfilehandle)
+	{
+		gzip_ocpfile_index_save (s->owner, s->compressedfilehandle);
+	}
+
 	dirdbUnref (s->head.dirdb_ref, dirdb_use_filehandle);
 
 	if (s->compressedfilehandle)
@@ -298,13 +696,20 @@ static int gzip_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int l
 	int retval = 0;
 	int recall = 0;
 
-	/* do we need to reverse? */
-	if ((s->pos < s->realpos) || (!s->need_deinit))
+	/* do we need to reverse, or can an access-point get us closer? */
 	{
-		if (gzip_ocpfilehandle_inflateInit (s))
+		const struct gzip_accesspoint_t *p = gzip_ocpfile_accesspoint_find (s->owner, s->pos);
+
+		if ((s->pos < s->realpos) || (!s->need_deinit) || (p && (p->out > s->realpos)))
 		{
-			s->error = 1;
-			return -1;
+			if ((!p) || gzip_ocpfilehandle_inflateRestore (s, p))
+			{
+				if (gzip_ocpfilehandle_inflateInit (s))
+				{
+					s->error = 1;
+					return -1;
+				}
+			}
 		}
 	}
 
@@ -332,39 +737,12 @@ static int gzip_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int l
 			return -1;
 		}
 
-		if (!s->strm.avail_in)
-		{
-			s->strm.next_in = s->inputbuffer;
-			s->strm.avail_in = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
-			if (s->compressedfilehandle->error (s->compressedfilehandle))
-			{
-				s->error = 1;
-				return -1;
-			}
-		}
-
-		s->strm.next_out = s->outputbuffer;
-		s->strm.avail_out = OUTPUTBUFFERSIZE;
-		s->outputbuffer_pos = s->outputbuffer;
-
-		inputsize = s->strm.avail_in;
-		ret = inflate (&s->strm, Z_NO_FLUSH);
-
-		switch (ret)
+		ret = gzip_ocpfilehandle_inflate_more (s, &inputsize);
+		if (ret < 0)
 		{
-			default:
-			case Z_NEED_DICT:
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				/* should not happen */
-				s->error = 1;
-				return -1;
-			case Z_STREAM_END:
-				s->eofhit = 1;
-			case Z_OK:
-				break;
+			s->error = 1;
+			return -1;
 		}
-		s->outputbuffer_fill = OUTPUTBUFFERSIZE - s->strm.avail_out;
 		if ((s->outputbuffer_fill == 0) && ((ret == Z_STREAM_END) || (inputsize == 0)))
 		{
 			/* should not happen when we are fast-forwarding... */
@@ -407,39 +785,12 @@ static int gzip_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int l
 			break;
 		}
 
-		if (!s->strm.avail_in)
+		ret = gzip_ocpfilehandle_inflate_more (s, &inputsize);
+		if (ret < 0)
 		{
-			s->strm.next_in = s->inputbuffer;
-			s->strm.avail_in = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
-			if (s->compressedfilehandle->error (s->compressedfilehandle))
-			{
-				s->error = 1;
-				return -1;
-			}
-		}
-
-		s->strm.next_out = s->outputbuffer;
-		s->strm.avail_out = OUTPUTBUFFERSIZE;
-		s->outputbuffer_pos = s->outputbuffer;
-
-		inputsize = s->strm.avail_in;
-		ret = inflate (&s->strm, Z_NO_FLUSH);
-
-		switch (ret)
-		{
-			default:
-			case Z_NEED_DICT:
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				/* should not happen */
-				s->error = 1;
-				return -1;
-			case Z_STREAM_END:
-				s->eofhit = 1;
-			case Z_OK:
-				break;
+			s->error = 1;
+			return -1;
 		}
-		s->outputbuffer_fill = OUTPUTBUFFERSIZE - s->strm.avail_out;
 #if 0
 		if (ret == Z_STREAM_END)
 #else
@@ -473,6 +824,8 @@ static int gzip_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int l
 				adbMetaAdd (filename, compressedfile_size, "GZIP", buffer, 8);
 			}
 
+			gzip_ocpfile_index_save (s->owner, s->compressedfilehandle);
+
 			if (!s->outputbuffer_fill)
 			{
 				return retval;
@@ -496,6 +849,22 @@ static int gzip_ocpfilehandle_filesize_ready (struct ocpfilehandle_t *_s)
 	return !s->owner->filesize_pending;
 }
 
+static int gzip_ocpfilehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
+{
+	struct gzip_ocpfilehandle_t *s = (struct gzip_ocpfilehandle_t *)_s;
+	struct gzip_ocpfile_t *o = s->owner;
+
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{ /* only if the access-points reach all the way to the end */
+		if (o->filesize_pending || !o->points_count || ((o->uncompressed_filesize - o->points[o->points_count - 1].out) > GZIP_INDEX_SPAN))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	return -1;
+}
+
 static void gzip_ocpfile_ref (struct ocpfile_t *s)
 {
 	s->parent->ref (s->parent);
@@ -526,7 +895,7 @@ static struct ocpfilehandle_t *gzip_ocpfile_open (struct ocpfile_t *_s)
 	                       gzip_ocpfilehandle_eof,
 	                       gzip_ocpfilehandle_error,
 	                       gzip_ocpfilehandle_read,
-	                       0, /* ioctl */
+	                       gzip_ocpfilehandle_ioctl,
 	                       gzip_ocpfilehandle_filesize,
 	                       gzip_ocpfilehandle_filesize_ready,
 	                       0, /* filename_override */
@@ -535,7 +904,7 @@ static struct ocpfilehandle_t *gzip_ocpfile_open (struct ocpfile_t *_s)
 	retval->owner = s;
 	s->head.ref (&s->head);
 
-	retval->compressedfilehandle = s->compressedfile->open (s->compressedfile);
+	retval->compressedfilehandle = spill_filehandle_open (s->compressedfile);
 
 	if (!retval->compressedfilehandle)
 	{
@@ -546,6 +915,8 @@ static struct ocpfilehandle_t *gzip_ocpfile_open (struct ocpfile_t *_s)
 
 	retval->head.refcount = 1;
 
+	gzip_ocpfile_index_load (s);
+
 	return &retval->head;
 }
 
@@ -618,7 +989,7 @@ static uint64_t gzip_ocpfile_filesize (struct ocpfile_t *_s)
 			goto UseZlib;
 		}
 
-		h = s->compressedfile->open (s->compressedfile);
+		h = spill_filehandle_open (s->compressedfile);
 		if (!h)
 		{
 			return FILESIZE_ERROR;
@@ -671,7 +1042,7 @@ static uint64_t gzip_ocpfile_filesize (struct ocpfile_t *_s)
 UseZlib:
 	if (!h)
 	{
-		h = s->compressedfile->open (s->compressedfile);
+		h = spill_filehandle_open (s->compressedfile);
 		if (!h)
 		{
 			return FILESIZE_ERROR;
@@ -807,6 +1178,8 @@ static void gzip_dir_unref (struct ocpdir_t *self)
 		s->child.compressedfile = 0;
 	}
 
+	gzip_ocpfile_index_clear (&s->child);
+
 	s->head.parent->unref (s->head.parent);
 	s->head.parent = 0;
 
@@ -35,95 +35,31 @@
 #include "pfilesel.h"
 #include "stuff/compat.h"
 
-static void path_detect_unix_windows (const char *path, int *unix_n, int *windows_n)
+/* paths are given as fileN=path */
+static char *pls_line_path (char *line)
 {
-	if (  ( ((path[0] >= 'a') && (path[0] <= 'z')) ||
-	        ((path[0] >= 'A') && (path[0] <= 'Z')) ) &&
-	      (path[1] == ':') &&
-	      (path[2] == '\\')  )
+	char *s2;
+
+	/* do we have a fileN= syntax? */
+	if (strncasecmp(line, "file", 4))
 	{
-		(*windows_n) += 10;
-		(*unix_n) -= 10;
+		return 0;
 	}
-	while (*path)
+	if (!(s2=index(line, '=')))
 	{
-		if ((*path) == '/')
-		{
-			(*unix_n)++;
-		} else if ((*path) == '\\')
-		{
-			(*windows_n)++;
-		}
-		path++;
-	}
-}
-
-static int get_pls_dirdb_flags (char *buftail, int buftail_n)
-{
-	int unix_n = 0;
-	int windows_n = 0;
-
-	while (buftail_n > 0)
-	{
-		char *s1, *s2;
-		/* find new-line */
-		s1=memchr(buftail, '\n', buftail_n);
-		s2=memchr(buftail, '\r', buftail_n);
-		if (!s1)
-		{
-			if (!s2)
-			{
-				break;
-			}
-			s1=s2;
-		} else if (s2)
-		{
-			if (s2<s1)
-			{
-				s1=s2;
-			}
-		}
-		*s1=0; /* and terminate the line */
-
-		/* do we have a fileN= syntax? */
-		if (strncasecmp(buftail, "file", 4))
-		{
-			goto newline;
-		}
-		if (!(s2=index(buftail, '=')))
-		{
-			goto newline;
-		}
-		/* skip the =, and check that the line has a length */
-		if (!*(++s2))
-		{
-			goto newline;
-		}
-
-		path_detect_unix_windows (s2, &unix_n, &windows_n);
-newline:
-		*s1 = '\n';
-		buftail_n-=(s1-buftail)+1;
-		buftail=s1+1;
+		return 0;
 	}
-
-	if (unix_n >= windows_n)
+	/* skip the =, and check that the line has a length */
+	if (!*(++s2))
 	{
-		return DIRDB_RESOLVE_DRIVE | DIRDB_RESOLVE_TILDE_HOME | DIRDB_RESOLVE_TILDE_USER;
-	} else {
-		return DIRDB_RESOLVE_DRIVE | DIRDB_RESOLVE_WINDOWS_SLASH;
+		return 0;
 	}
+	return s2;
 }
 
 struct ocpdir_t *pls_check (const struct ocpdirdecompressor_t *self, struct ocpfile_t *file, const char *filetype)
 {
-	char *buftail;
-	int buftail_n;
 	struct playlist_instance_t *iter;
-	struct ocpfilehandle_t *fd = 0;
-	char *readbuffer = 0;
-	uint64_t filesize;
-	int flags;
 
 	if (strcasecmp (filetype, ".pls"))
 	{
@@ -143,89 +79,11 @@ struct ocpdir_t *pls_check (const struct ocpdirdecompressor_t *self, struct ocpf
 	iter = playlist_instance_allocate (file->parent, file->dirdb_ref);
 	if (!iter)
 	{
-		goto out;
-	}
-
-	fd = file->open (file);
-	if (!fd)
-	{
-		goto out;
-	}
-	filesize = fd->filesize (fd);
-	if (filesize > 1024*1024)
-	{
-		fprintf (stderr, "PLS file too big\n!");
-		goto out;
-	}
-	if (!filesize)
-	{
-		fprintf (stderr, "PLS file too small\n");
-		goto out;
-	}
-	readbuffer = malloc (filesize);
-	if (fd->read (fd, readbuffer, filesize) != filesize)
-	{
-		fprintf (stderr, "PLS file failed to read\n");
-		goto out;
-	}
-	fd->unref (fd);
-	fd = 0;
-
-	buftail=readbuffer;
-	buftail_n=filesize;
-
-	flags = get_pls_dirdb_flags (buftail, buftail_n);
-
-	while (buftail_n > 0)
-	{
-		char *s1, *s2;
-		/* find new-line */
-		s1=memchr(buftail, '\n', buftail_n);
-		s2=memchr(buftail, '\r', buftail_n);
-		if (!s1)
-		{
-			if (!s2)
-			{
-				break;
-			}
-			s1=s2;
-		} else if (s2)
-		{
-			if (s2<s1)
-			{
-				s1=s2;
-			}
-		}
-		*s1=0; /* and terminate the line */
-
-		/* do we have a fileN= syntax? */
-		if (strncasecmp(buftail, "file", 4))
-		{
-			goto newline;
-		}
-		if (!(s2=index(buftail, '=')))
-		{
-			goto newline;
-		}
-		/* skip the =, and check that the line has a length */
-		if (!*(++s2))
-			goto newline;
-
-		playlist_add_string (iter, strdup (s2), flags);
-newline:
-		buftail_n-=(s1-buftail)+1;
-		buftail=s1+1;
+		return 0;
 	}
-out:
 
-	free (readbuffer);
-	readbuffer = 0;
-
-	if (fd)
-	{
-		fd->unref (fd);
-		fd = 0;
-	}
+	/* the file is parsed while the playlist is iterated */
+	playlist_instance_set_source (iter, file, pls_line_path);
 
 	return &iter->head;
 }
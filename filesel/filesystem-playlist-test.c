@@ -0,0 +1,463 @@
+/* unit test for filesystem-playlist.c, filesystem-playlist-m3u.c and filesystem-playlist-pls.c */
+
+#include "filesystem-playlist.c"
+#include "filesystem-playlist-m3u.c"
+#include "filesystem-playlist-pls.c"
+#include "filesystem-file-mem.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/* a minimal dirdb, node 0 is the directory that contains the playlists */
+struct test_node_t
+{
+	uint32_t parent;
+	char *name;
+	int refcount;
+};
+static struct test_node_t *nodes;
+static int nodes_count;
+static int nodes_size;
+static int dirdb_failures;
+static int last_resolve_flags;
+
+uint32_t dirdbRef (uint32_t ref, enum dirdb_use use)
+{
+	if ((ref >= (uint32_t)nodes_count) || (!nodes[ref].refcount))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbRef (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return ref;
+	}
+	nodes[ref].refcount++;
+	return ref;
+}
+
+void dirdbUnref (uint32_t ref, enum dirdb_use use)
+{
+	if ((ref >= (uint32_t)nodes_count) || (!nodes[ref].refcount))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbUnref (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return;
+	}
+	if ((!--nodes[ref].refcount) && (nodes[ref].parent != DIRDB_NOPARENT))
+	{ /* like dirdb, children keep a reference to their parent. Dead nodes are never found again */
+		uint32_t parent = nodes[ref].parent;
+		nodes[ref].parent = DIRDB_CLEAR - 1;
+		dirdbUnref (parent, use);
+	}
+}
+
+static uint32_t test_node_find_and_ref (uint32_t parent, const char *name, int len)
+{
+	int i;
+	for (i=0; i < nodes_count; i++)
+	{
+		if ((nodes[i].parent == parent) && (!strncmp (nodes[i].name, name, len)) && (!nodes[i].name[len]))
+		{
+			nodes[i].refcount++;
+			return i;
+		}
+	}
+	if (nodes_count == nodes_size)
+	{
+		nodes_size += 256;
+		nodes = realloc (nodes, nodes_size * sizeof (nodes[0]));
+	}
+	nodes[nodes_count].parent = parent;
+	nodes[nodes_count].name = strndup (name, len);
+	nodes[nodes_count].refcount = 1;
+	nodes[parent].refcount++;
+	return nodes_count++;
+}
+
+uint32_t dirdbResolvePathWithBaseAndRef (uint32_t base, const char *name, const int flags, enum dirdb_use use)
+{
+	char separator = (flags & DIRDB_RESOLVE_WINDOWS_SLASH) ? '\\' : '/';
+	uint32_t iter = base;
+
+	last_resolve_flags = flags;
+	dirdbRef (iter, use);
+	while (*name)
+	{
+		const char *next = strchr (name, separator);
+		int len = next ? next - name : (int)strlen (name);
+		if (len)
+		{
+			uint32_t child = test_node_find_and_ref (iter, name, len);
+			dirdbUnref (iter, use);
+			iter = child;
+		}
+		name += len;
+		if (*name)
+		{
+			name++;
+		}
+	}
+	return iter;
+}
+
+uint32_t dirdbGetParentAndRef (uint32_t node, enum dirdb_use use)
+{
+	if ((node >= (uint32_t)nodes_count) || (nodes[node].parent >= DIRDB_CLEAR - 1))
+	{
+		return DIRDB_CLEAR;
+	}
+	return dirdbRef (nodes[node].parent, use);
+}
+
+struct ocpdir_t *ocpdir_t_fill_default_readdir_dir  (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_dir called?\n");
+	_exit(1);
+}
+
+struct ocpfile_t *ocpdir_t_fill_default_readdir_file (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_file called?\n");
+	_exit(1);
+}
+
+const char *ocpfile_t_fill_default_filename_override (struct ocpfile_t *file)
+{
+	return 0;
+}
+
+int ocpfilehandle_t_fill_default_ioctl (struct ocpfilehandle_t *s, const char *cmd, void *ptr)
+{
+	return -1;
+}
+
+const char *ocpfilehandle_t_fill_default_filename_override (struct ocpfilehandle_t *fh)
+{
+	return 0;
+}
+
+void register_dirdecompressor (const struct ocpdirdecompressor_t *e)
+{
+}
+
+/* directories resolved by the playlist, every file in them exists unless the directory is called "missing" */
+static int resolved_dirs;
+static int test_dirs_alive;
+static int test_parent_refs;
+
+static void test_parent_ref (struct ocpdir_t *d)
+{
+	test_parent_refs++;
+}
+
+static void test_parent_unref (struct ocpdir_t *d)
+{
+	test_parent_refs--;
+}
+
+static void test_dir_ref (struct ocpdir_t *d)
+{
+	d->refcount++;
+}
+
+static void test_dir_unref (struct ocpdir_t *d)
+{
+	if (!--d->refcount)
+	{
+		dirdbUnref (d->dirdb_ref, dirdb_use_dir);
+		free (d);
+		test_dirs_alive--;
+	}
+}
+
+static struct ocpfile_t *test_dir_readdir_file (struct ocpdir_t *d, uint32_t dirdb_ref)
+{
+	return mem_file_open (d, dirdb_ref, malloc (1), 1);
+}
+
+int filesystem_resolve_dirdb_dir (uint32_t ref, struct dmDrive **drive, struct ocpdir_t **dir)
+{
+	struct ocpdir_t *d;
+
+	resolved_dirs++;
+	*dir = 0;
+	if (!strcmp (nodes[ref].name, "missing"))
+	{
+		return -1;
+	}
+	d = calloc (1, sizeof (*d));
+	d->ref = test_dir_ref;
+	d->unref = test_dir_unref;
+	d->readdir_file = test_dir_readdir_file;
+	d->dirdb_ref = dirdbRef (ref, dirdb_use_dir);
+	d->refcount = 1;
+	test_dirs_alive++;
+	*dir = d;
+	return 0;
+}
+
+static struct ocpfile_t **received;
+static int received_count;
+static int received_while_parsing;
+static struct playlist_instance_t *current_instance;
+
+static void test_callback_file (void *token, struct ocpfile_t *file)
+{
+	received = realloc (received, (received_count + 1) * sizeof (received[0]));
+	file->ref (file);
+	received[received_count++] = file;
+	if (current_instance->source)
+	{
+		received_while_parsing++;
+	}
+}
+
+static void test_received_clear (void)
+{
+	int i;
+	for (i=0; i < received_count; i++)
+	{
+		received[i]->unref (received[i]);
+	}
+	free (received);
+	received = 0;
+	received_count = 0;
+	received_while_parsing = 0;
+}
+
+static struct ocpdir_t *test_playlist_dir;
+
+static struct ocpdir_t *test_open (struct ocpdir_t *(*check)(const struct ocpdirdecompressor_t *, struct ocpfile_t *, const char *), const char *name, const char *filetype, char *data, int len)
+{
+	uint32_t ref = test_node_find_and_ref (0, name, strlen (name));
+	struct ocpfile_t *file = mem_file_open (test_playlist_dir, ref, data, len);
+	struct ocpdir_t *retval;
+
+	dirdbUnref (ref, dirdb_use_file);
+	retval = check (0, file, filetype);
+	file->unref (file);
+	return retval;
+}
+
+static int test_iterate (struct ocpdir_t *dir)
+{
+	ocpdirhandle_pt h = dir->readdir_start (dir, test_callback_file, 0, 0);
+	int iterations = 0;
+
+	current_instance = (struct playlist_instance_t *)dir;
+	while (dir->readdir_iterate (h))
+	{
+		iterations++;
+	}
+	dir->readdir_cancel (h);
+	return iterations;
+}
+
+static const char *test_name (struct ocpfile_t *file)
+{
+	return nodes[file->dirdb_ref].name;
+}
+
+static int playlist_test_m3u (void)
+{
+	const int dirs = 50, perdir = 100;
+	int size = dirs * perdir * 64 + 80000;
+	char *data = malloc (size);
+	int len = 0;
+	int retval = 0;
+	int i;
+	struct ocpdir_t *dir;
+
+	printf (ANSI_COLOR_CYAN "Testing streaming of a large M3U playlist" ANSI_COLOR_RESET "\n");
+
+	len += sprintf (data + len, "#EXTM3U\r\n");
+	for (i=0; i < dirs * perdir; i++)
+	{
+		if (i == 2000)
+		{ /* a comment that is larger than a read chunk */
+			data[len++] = '#';
+			memset (data + len, 'x', 70000);
+			len += 70000;
+			data[len++] = '\n';
+		}
+		len += sprintf (data + len, "#EXTINF:123,Song %d\r\n", i);
+		len += sprintf (data + len, "dir%d/song%d.mod%s", i / perdir, i, (i == dirs * perdir - 1) ? "" : "\r\n");
+	}
+	dir = test_open (m3u_check, "test.m3u", ".m3u", data, len);
+	if (!dir)
+	{
+		printf (ANSI_COLOR_RED " m3u_check() failed" ANSI_COLOR_RESET "\n");
+		return 1;
+	}
+
+	resolved_dirs = 0;
+	test_iterate (dir);
+
+	if (received_count != dirs * perdir)
+	{
+		printf (ANSI_COLOR_RED " got %d files, expected %d" ANSI_COLOR_RESET "\n", received_count, dirs * perdir);
+		retval = 1;
+	} else {
+		for (i=0; i < received_count; i++)
+		{
+			char expected[32];
+			snprintf (expected, sizeof (expected), "song%d.mod", i);
+			if (strcmp (test_name (received[i]), expected))
+			{
+				printf (ANSI_COLOR_RED " file %d is %s, expected %s" ANSI_COLOR_RESET "\n", i, test_name (received[i]), expected);
+				retval = 1;
+				break;
+			}
+		}
+	}
+	if (resolved_dirs != dirs)
+	{
+		printf (ANSI_COLOR_RED " %d directories were resolved, expected %d" ANSI_COLOR_RESET "\n", resolved_dirs, dirs);
+		retval = 1;
+	}
+	if (!received_while_parsing)
+	{
+		printf (ANSI_COLOR_RED " no files were given before the whole playlist was parsed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	if (last_resolve_flags & DIRDB_RESOLVE_WINDOWS_SLASH)
+	{
+		printf (ANSI_COLOR_RED " unix paths were detected as windows paths" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	/* a second iteration gives the same files, without parsing again */
+	i = received_count;
+	test_received_clear ();
+	resolved_dirs = 0;
+	test_iterate (dir);
+	if ((received_count != i) || resolved_dirs)
+	{
+		printf (ANSI_COLOR_RED " second iteration gave %d files and resolved %d directories" ANSI_COLOR_RESET "\n", received_count, resolved_dirs);
+		retval = 1;
+	}
+
+	test_received_clear ();
+	dir->unref (dir);
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+static int playlist_test_pls (void)
+{
+	static const char text[] =
+		"[playlist]\n"
+		"NumberOfEntries=4\n"
+		"File1=C:\\Music\\a.mod\n"
+		"Title1=A\n"
+		"File2=C:\\Music\\b.mod\n"
+		"File3=missing\\c.mod\n"
+		"File4=C:\\Music\\d.mod\n";
+	static const char *expected[] = {"a.mod", "b.mod", "d.mod"};
+	char *data = strdup (text);
+	struct ocpdir_t *dir;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing PLS playlist with windows paths" ANSI_COLOR_RESET "\n");
+
+	dir = test_open (pls_check, "test.pls", ".pls", data, strlen (data));
+	if (!dir)
+	{
+		printf (ANSI_COLOR_RED " pls_check() failed" ANSI_COLOR_RESET "\n");
+		return 1;
+	}
+
+	resolved_dirs = 0;
+	test_iterate (dir);
+
+	if (!(last_resolve_flags & DIRDB_RESOLVE_WINDOWS_SLASH))
+	{
+		printf (ANSI_COLOR_RED " windows paths were not detected" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	if (received_count != 3)
+	{
+		printf (ANSI_COLOR_RED " got %d files, expected 3" ANSI_COLOR_RESET "\n", received_count);
+		retval = 1;
+	} else {
+		for (i=0; i < 3; i++)
+		{
+			if (strcmp (test_name (received[i]), expected[i]))
+			{
+				printf (ANSI_COLOR_RED " file %d is %s, expected %s" ANSI_COLOR_RESET "\n", i, test_name (received[i]), expected[i]);
+				retval = 1;
+			}
+		}
+	}
+	if (resolved_dirs != 3)
+	{
+		printf (ANSI_COLOR_RED " %d directories were resolved, expected 3" ANSI_COLOR_RESET "\n", resolved_dirs);
+		retval = 1;
+	}
+
+	test_received_clear ();
+	dir->unref (dir);
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+	int i;
+
+	nodes_size = 256;
+	nodes = calloc (nodes_size, sizeof (nodes[0]));
+	nodes[0].parent = DIRDB_NOPARENT;
+	nodes[0].name = strdup ("music");
+	nodes[0].refcount = 1;
+	nodes_count = 1;
+
+	test_playlist_dir = calloc (1, sizeof (*test_playlist_dir));
+	test_playlist_dir->ref = test_parent_ref;
+	test_playlist_dir->unref = test_parent_unref;
+	test_playlist_dir->dirdb_ref = 0;
+
+	retval |= playlist_test_m3u ();
+	retval |= playlist_test_pls ();
+
+	if (test_dirs_alive || test_parent_refs)
+	{
+		printf (ANSI_COLOR_RED "directories are not clean, %d resolved directories alive and %d references to the parent left" ANSI_COLOR_RESET "\n", test_dirs_alive, test_parent_refs);
+		retval = 1;
+	}
+	for (i=1; i < nodes_count; i++)
+	{
+		if (nodes[i].refcount)
+		{
+			printf (ANSI_COLOR_RED "dirdb node %d (%s) is not clean" ANSI_COLOR_RESET "\n", i, nodes[i].name);
+			retval = 1;
+		}
+	}
+	if (dirdb_failures)
+	{
+		printf (ANSI_COLOR_RED "dirdb problems detected" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	for (i=0; i < nodes_count; i++)
+	{
+		free (nodes[i].name);
+	}
+	free (nodes);
+	free (test_playlist_dir);
+	printf ("\n");
+
+	return retval;
+}
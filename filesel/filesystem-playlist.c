@@ -43,9 +43,84 @@ struct playlist_instance_dir_search_t
 	int skiplen;
 };
 
+#define PLAYLIST_READ_CHUNK    65536 /* bytes read from the playlist file per iteration */
+#define PLAYLIST_RESOLVE_BATCH 32    /* entries resolved per iteration */
+
+static void playlist_resolve_parent_clear (struct playlist_instance_t *self)
+{
+	if (self->resolve_parent_dir)
+	{
+		self->resolve_parent_dir->unref (self->resolve_parent_dir);
+		self->resolve_parent_dir = 0;
+	}
+	if (self->resolve_parent_ref != DIRDB_CLEAR)
+	{
+		dirdbUnref (self->resolve_parent_ref, dirdb_use_dir);
+		self->resolve_parent_ref = DIRDB_CLEAR;
+	}
+}
+
+/* same as filesystem_resolve_dirdb_file(), but the parent directory is kept for the next entry */
+static struct ocpfile_t *playlist_resolve_file (struct playlist_instance_t *self, uint32_t dirdb_ref)
+{
+	uint32_t parent_ref = dirdbGetParentAndRef (dirdb_ref, dirdb_use_dir);
+
+	if (parent_ref == DIRDB_CLEAR)
+	{
+		return 0;
+	}
+
+	if (parent_ref == self->resolve_parent_ref)
+	{
+		dirdbUnref (parent_ref, dirdb_use_dir);
+	} else {
+		playlist_resolve_parent_clear (self);
+		self->resolve_parent_ref = parent_ref; /* also remember directories that failed to resolve */
+		filesystem_resolve_dirdb_dir (parent_ref, 0, &self->resolve_parent_dir);
+	}
+
+	if (!self->resolve_parent_dir)
+	{
+		return 0;
+	}
+	return self->resolve_parent_dir->readdir_file (self->resolve_parent_dir, dirdb_ref);
+}
+
 void playlist_dir_resolve_strings (struct playlist_instance_t *self)
 {
-	uint32_t dirdb_ref;
+	int batch;
+
+	for (batch = 0; (batch < PLAYLIST_RESOLVE_BATCH) && (self->string_pos < self->string_count); batch++)
+	{
+		uint32_t dirdb_ref = dirdbResolvePathWithBaseAndRef (self->head.parent->dirdb_ref, self->string_data[self->string_pos].string, self->string_data[self->string_pos].flags, dirdb_use_dir);
+		if (dirdb_ref != DIRDB_NOPARENT)
+		{
+			struct ocpfile_t *file = playlist_resolve_file (self, dirdb_ref);
+			dirdbUnref (dirdb_ref, dirdb_use_dir);
+
+			if (file)
+			{
+				/* can we fit more files? */
+				if (self->ocpfile_count >= self->ocpfile_size)
+				{
+					struct ocpfile_t **re;
+					self->ocpfile_size += 64;
+					re = realloc (self->ocpfile_data, sizeof (struct ocpfile_t *) * self->ocpfile_size);
+					if (!re)
+					{
+						fprintf (stderr, "playlist_dir_resolve_strings: out of memory!\n");
+						self->ocpfile_size -= 64;
+						file->unref (file);
+						return;
+					}
+					self->ocpfile_data = re;
+				}
+				/* add file reference to our list */
+				self->ocpfile_data[self->ocpfile_count++] = file;
+			}
+		}
+		self->string_pos++;
+	}
 
 	/* are we done, if so clear the string TODO list */
 	if (self->string_pos >= self->string_count)
@@ -57,37 +132,197 @@ void playlist_dir_resolve_strings (struct playlist_instance_t *self)
 		}
 		self->string_count = 0;
 		self->string_pos = 0;
-		return;
+
+		if (!self->source)
+		{
+			playlist_resolve_parent_clear (self);
+		}
+	}
+}
+
+static void path_detect_unix_windows (const char *path, int *unix_n, int *windows_n)
+{
+	if (  ( ((path[0] >= 'a') && (path[0] <= 'z')) ||
+	        ((path[0] >= 'A') && (path[0] <= 'Z')) ) &&
+	      (path[1] == ':') &&
+	      (path[2] == '\\')  )
+	{
+		(*windows_n) += 10;
+		(*unix_n) -= 10;
+	}
+	while (*path)
+	{
+		if ((*path) == '/')
+		{
+			(*unix_n)++;
+		} else if ((*path) == '\\')
+		{
+			(*windows_n)++;
+		}
+		path++;
 	}
+}
 
-	dirdb_ref = dirdbResolvePathWithBaseAndRef (self->head.parent->dirdb_ref, self->string_data[self->string_pos].string, self->string_data[self->string_pos].flags, dirdb_use_dir);
-	if (dirdb_ref != DIRDB_NOPARENT)
+static void playlist_source_done (struct playlist_instance_t *self)
+{
+	if (self->source_handle)
+	{
+		self->source_handle->unref (self->source_handle);
+		self->source_handle = 0;
+	}
+	if (self->source)
 	{
-		struct ocpfile_t *file = 0;
-		filesystem_resolve_dirdb_file (dirdb_ref, 0, &file);
-		dirdbUnref (dirdb_ref, dirdb_use_dir);
+		self->source->unref (self->source);
+		self->source = 0;
+	}
+	free (self->source_buffer);
+	self->source_buffer = 0;
+	self->source_fill = 0;
+	self->source_size = 0;
+}
 
-		if (file)
+/* Calls line() for every complete line in buffer, with the line zero-terminated. Returns the number of bytes consumed. If final is
+ * set, the text after the last line-break is also a line.
+ */
+static int playlist_source_lines (struct playlist_instance_t *self, char *buffer, int length, int final, void (*line)(struct playlist_instance_t *self, char *line, void *token), void *token)
+{
+	char *buftail = buffer;
+	int buftail_n = length;
+
+	while (buftail_n > 0)
+	{
+		char *s1, *s2;
+		/* find new-line */
+		s1=memchr(buftail, '\n', buftail_n);
+		s2=memchr(buftail, '\r', buftail_n);
+		if (!s1)
 		{
-			/* can we fit more files? */
-			if (self->ocpfile_count >= self->ocpfile_size)
+			if (!s2)
 			{
-				struct ocpfile_t **re;
-				self->ocpfile_size += 64;
-				re = realloc (self->ocpfile_data, sizeof (struct ocpfile_t *) * self->ocpfile_size);
-				if (!re)
-				{
-					fprintf (stderr, "playlist_dir_resolve_strings: out of memory!\n");
-					self->ocpfile_size -= 64;
-					return;
+				if (final)
+				{ /* the buffer has room for a terminator */
+					buftail[buftail_n] = 0;
+					line (self, buftail, token);
+					buftail += buftail_n;
+					buftail_n = 0;
 				}
-				self->ocpfile_data = re;
+				break;
+			}
+			s1=s2;
+		} else if (s2)
+		{
+			if (s2<s1)
+			{
+				s1=s2;
 			}
-			/* add file reference to our list */
-			self->ocpfile_data[self->ocpfile_count++] = file;
 		}
+		*s1=0; /* and terminate the line */
+		line (self, buftail, token);
+		*s1 = '\n'; /* the buffer is parsed twice for the first chunk */
+		buftail_n-=(s1-buftail)+1;
+		buftail=s1+1;
+	}
+
+	return buftail - buffer;
+}
+
+static void playlist_source_detect_line (struct playlist_instance_t *self, char *line, void *token)
+{
+	int *n = token;
+	char *path = self->source_line_path (line);
+	if (path)
+	{
+		path_detect_unix_windows (path, &n[0], &n[1]);
 	}
-	self->string_pos++;
+}
+
+static void playlist_source_add_line (struct playlist_instance_t *self, char *line, void *token)
+{
+	char *path = self->source_line_path (line);
+	if (path)
+	{
+		playlist_add_string (self, strdup (path), self->source_flags);
+	}
+}
+
+/* read and parse the next chunk of the playlist file */
+static void playlist_source_parse (struct playlist_instance_t *self)
+{
+	int result;
+	int used;
+
+	if (!self->source_handle)
+	{
+		self->source_handle = self->source->open (self->source);
+		if (!self->source_handle)
+		{
+			playlist_source_done (self);
+			return;
+		}
+	}
+
+	if ((self->source_size - self->source_fill) < (PLAYLIST_READ_CHUNK + 1))
+	{ /* room for a chunk, plus a terminator for an unterminated last line */
+		char *temp = realloc (self->source_buffer, self->source_fill + PLAYLIST_READ_CHUNK + 1);
+		if (!temp)
+		{
+			fprintf (stderr, "playlist_source_parse: out of memory!\n");
+			playlist_source_done (self);
+			return;
+		}
+		self->source_buffer = temp;
+		self->source_size = self->source_fill + PLAYLIST_READ_CHUNK + 1;
+	}
+
+	result = self->source_handle->read (self->source_handle, self->source_buffer + self->source_fill, PLAYLIST_READ_CHUNK);
+	if (result > 0)
+	{
+		self->source_fill += result;
+	}
+
+	if (!self->source_flags)
+	{ /* guess the path style from the first chunk */
+		int n[2] = {0, 0}; /* unix, windows */
+		playlist_source_lines (self, self->source_buffer, self->source_fill, result <= 0, playlist_source_detect_line, n);
+		if (n[0] >= n[1])
+		{
+			self->source_flags = DIRDB_RESOLVE_DRIVE | DIRDB_RESOLVE_TILDE_HOME | DIRDB_RESOLVE_TILDE_USER;
+		} else {
+			self->source_flags = DIRDB_RESOLVE_DRIVE | DIRDB_RESOLVE_WINDOWS_SLASH;
+		}
+	}
+
+	used = playlist_source_lines (self, self->source_buffer, self->source_fill, result <= 0, playlist_source_add_line, 0);
+	memmove (self->source_buffer, self->source_buffer + used, self->source_fill - used);
+	self->source_fill -= used;
+
+	if (result <= 0)
+	{
+		playlist_source_done (self);
+	}
+}
+
+void playlist_instance_set_source (struct playlist_instance_t *self, struct ocpfile_t *file, char *(*line_path)(char *line))
+{
+	file->ref (file);
+	self->source = file;
+	self->source_line_path = line_path;
+}
+
+/* returns zero when the whole playlist has been parsed and resolved */
+static int playlist_dir_resolve_step (struct playlist_instance_t *self)
+{
+	if (self->string_count)
+	{
+		playlist_dir_resolve_strings (self);
+		return 1;
+	}
+	if (self->source)
+	{
+		playlist_source_parse (self);
+		return 1;
+	}
+	return 0;
 }
 
 static void playlist_dir_ref (struct ocpdir_t *_self)
@@ -122,6 +357,8 @@ static void playlist_dir_unref (struct ocpdir_t *_self)
 		self->ocpfile_data[i]->unref (self->ocpfile_data[i]);
 	}
 	free (self->ocpfile_data);
+	playlist_source_done (self);
+	playlist_resolve_parent_clear (self);
 
 	dirdbUnref (self->head.dirdb_ref, dirdb_use_dir);
 
@@ -188,18 +425,14 @@ static int playlist_dir_readdir_iterate (ocpdirhandle_pt p)
 {
 	struct playlist_dir_readdir_handle_t *handle = p;
 
-	if (handle->owner->string_count)
+	/* files are handed out as soon as they are resolved */
+	if (handle->nextfile < handle->owner->ocpfile_count)
 	{
-		playlist_dir_resolve_strings (handle->owner);
+		handle->callback_file (handle->token, handle->owner->ocpfile_data[handle->nextfile]);
+		handle->nextfile++;
 		return 1;
 	}
-	if (handle->nextfile >= handle->owner->ocpfile_count)
-	{
-		return 0;
-	}
-	handle->callback_file (handle->token, handle->owner->ocpfile_data[handle->nextfile]);
-	handle->nextfile++;
-	return 1;
+	return playlist_dir_resolve_step (handle->owner);
 }
 
 static struct ocpdir_t *playlist_dir_readdir_dir (struct ocpdir_t *_self, uint32_t dirdb_ref)
@@ -212,10 +445,8 @@ static struct ocpfile_t *playlist_dir_readdir_file (struct ocpdir_t *_self, uint
 	struct playlist_instance_t *self = (struct playlist_instance_t *)_self;
 	int i;
 
-	if (self->string_count)
+	while (playlist_dir_resolve_step (self))
 	{
-		playlist_dir_resolve_strings (self);
-		return 0;
 	}
 
 	for (i = 0; i < self->ocpfile_count; i++)
@@ -284,6 +515,8 @@ struct playlist_instance_t *playlist_instance_allocate (struct ocpdir_t *parent,
 		parent->ref (parent);
 	}
 
+	retval->resolve_parent_ref = DIRDB_CLEAR;
+
 	retval->next = playlist_root;
 	playlist_root = retval;
 
@@ -24,6 +24,19 @@ struct playlist_instance_t
 	struct ocpfile_t **ocpfile_data;
 	int ocpfile_count;
 	int ocpfile_size;
+
+	/* the playlist file is parsed while the playlist is iterated, source is cleared when the whole file has been parsed */
+	struct ocpfile_t *source;
+	struct ocpfilehandle_t *source_handle;
+	char *(*source_line_path)(char *line); /* returns the path in the given line, or NULL if the line has none */
+	char *source_buffer;
+	int source_fill;
+	int source_size;
+	int source_flags; /* DIRDB_RESOLVE_* flags, detected from the first chunk of the file */
+
+	/* consecutive entries usually share the parent directory, so the last one is kept resolved */
+	uint32_t resolve_parent_ref;
+	struct ocpdir_t *resolve_parent_dir;
 };
 
 extern struct playlist_instance_t *playlist_root;
@@ -33,5 +46,8 @@ struct playlist_instance_t *playlist_instance_allocate (struct ocpdir_t *parent,
 /* steals the string */
 void playlist_add_string (struct playlist_instance_t *self, char *string, const int flags);
 
+/* file will be read and parsed line by line while the playlist is iterated, line_path() returns the path of each line or NULL */
+void playlist_instance_set_source (struct playlist_instance_t *self, struct ocpfile_t *file, char *(*line_path)(char *line));
+
 
 #endif
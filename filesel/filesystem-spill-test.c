@@ -0,0 +1,410 @@
+/* unit test for filesystem-spill.c */
+
+char *cfTempDir = "/tmp/";
+
+#include "filesystem-spill.c"
+#include <unistd.h>
+#include "filesystem-dir-mem.h"
+#include "filesystem-file-mem.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/* node 0 is the archive, the rest are members */
+static int dirdb_count[4];
+static int dirdb_failures;
+
+uint32_t dirdbRef (uint32_t ref, enum dirdb_use use)
+{
+	if ((ref >= 4) || (!dirdb_count[ref]))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbRef (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return ref;
+	}
+	dirdb_count[ref]++;
+	return ref;
+}
+
+void dirdbUnref (uint32_t ref, enum dirdb_use use)
+{
+	if ((ref >= 4) || (!dirdb_count[ref]))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbUnref (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return;
+	}
+	dirdb_count[ref]--;
+}
+
+uint32_t dirdbFindAndRef (uint32_t parent, const char *name, enum dirdb_use use)
+{
+	dirdb_count[0]++;
+	return 0;
+}
+
+struct ocpdir_t *ocpdir_t_fill_default_readdir_dir  (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_dir called?\n");
+	_exit(1);
+}
+
+struct ocpfile_t *ocpdir_t_fill_default_readdir_file (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_file called?\n");
+	_exit(1);
+}
+
+const char *ocpfile_t_fill_default_filename_override (struct ocpfile_t *file)
+{
+	return 0;
+}
+
+int ocpfilehandle_t_fill_default_ioctl (struct ocpfilehandle_t *s, const char *cmd, void *ptr)
+{
+	return -1;
+}
+
+const char *ocpfilehandle_t_fill_default_filename_override (struct ocpfilehandle_t *fh)
+{
+	return 0;
+}
+
+/* counts how many times the member is opened, and how much is read from it - that is the work a decompressor would have done */
+static struct ocpfilehandle_t *(*source_open_real)(struct ocpfile_t *);
+static int (*source_read_real)(struct ocpfilehandle_t *, void *, int);
+static int source_opens;
+static int source_bytes;
+
+static int source_read (struct ocpfilehandle_t *h, void *dst, int len)
+{
+	int res = source_read_real (h, dst, len);
+	if (res > 0)
+	{
+		source_bytes += res;
+	}
+	return res;
+}
+
+static struct ocpfilehandle_t *source_open (struct ocpfile_t *file)
+{
+	struct ocpfilehandle_t *h = source_open_real (file);
+	if (h)
+	{
+		source_opens++;
+		source_read_real = h->read;
+		h->read = source_read;
+	}
+	return h;
+}
+
+static struct ocpfile_t *test_member (struct ocpdir_t *parent, uint32_t dirdb_ref, uint32_t size)
+{
+	struct ocpfile_t *file;
+	char *data = malloc (size);
+	uint32_t i;
+
+	for (i=0; i < size; i++)
+	{
+		data[i] = (i * 7) ^ (i >> 8);
+	}
+	dirdb_count[dirdb_ref]++;
+	file = mem_file_open (parent, dirdb_ref, data, size);
+	dirdb_count[dirdb_ref]--;
+	source_open_real = file->open;
+	file->open = source_open;
+	return file;
+}
+
+static int test_verify (struct ocpfilehandle_t *h, uint64_t pos, int len)
+{
+	char *buffer = malloc (len);
+	int i, res;
+
+	if (h->seek_set (h, pos))
+	{
+		printf (ANSI_COLOR_RED "seek_set (0x%lx) failed" ANSI_COLOR_RESET "\n", (unsigned long)pos);
+		free (buffer);
+		return 1;
+	}
+	res = h->read (h, buffer, len);
+	if (res != len)
+	{
+		printf (ANSI_COLOR_RED "read (0x%lx, %d) returned %d" ANSI_COLOR_RESET "\n", (unsigned long)pos, len, res);
+		free (buffer);
+		return 1;
+	}
+	for (i=0; i < len; i++)
+	{
+		if (buffer[i] != (char)(((pos + i) * 7) ^ ((pos + i) >> 8)))
+		{
+			printf (ANSI_COLOR_RED "data mismatch at 0x%lx" ANSI_COLOR_RESET "\n", (unsigned long)(pos + i));
+			free (buffer);
+			return 1;
+		}
+	}
+	free (buffer);
+	return 0;
+}
+
+/* memory_budget, expect_memory: which storage the entry should end up in */
+static int spill_test_storage (const char *name, uint64_t memory_budget, uint64_t disk_budget, int expect_memory)
+{
+	struct ocpdir_mem_t *dir;
+	struct ocpfile_t *file;
+	struct ocpfilehandle_t *h;
+	int retval = 0;
+
+	printf (ANSI_COLOR_BLUE "Spill into %s" ANSI_COLOR_RESET "\n", name);
+
+	filesystem_spill_init (memory_budget, disk_budget);
+	source_opens = source_bytes = 0;
+
+	dir = ocpdir_mem_alloc (0, "test.tar");
+	ocpdir_mem_getdir_t (dir)->is_archive = 1;
+	file = test_member (ocpdir_mem_getdir_t (dir), 1, 200000);
+
+	h = spill_filehandle_open (file);
+	if (!h)
+	{
+		printf (ANSI_COLOR_RED "spill_filehandle_open() failed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+		goto out;
+	}
+	if (h->read != spill_filehandle_read)
+	{
+		printf (ANSI_COLOR_RED "member was not opened through the cache" ANSI_COLOR_RESET "\n");
+		retval = 1;
+		h->unref (h);
+		goto out;
+	}
+	if (!!spill_head->mem != expect_memory)
+	{
+		printf (ANSI_COLOR_RED "data stored in the wrong place" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	retval |= test_verify (h, 1000, 100);
+	retval |= test_verify (h, 150000, 30000);
+	retval |= test_verify (h, 10, 50000);
+	if (source_bytes > 180000 + SPILL_CHUNK_SIZE)
+	{
+		printf (ANSI_COLOR_RED "seeking backwards caused the source to be read again (%d bytes)" ANSI_COLOR_RESET "\n", source_bytes);
+		retval = 1;
+	}
+	h->unref (h);
+
+	/* partial data survives close, and the source is resumed */
+	h = spill_filehandle_open (file);
+	retval |= test_verify (h, 199000, 1000);
+	retval |= test_verify (h, 0, 200000);
+	if (h->read (h, (char[1]){0}, 1) != 0)
+	{
+		printf (ANSI_COLOR_RED "read past EOF returned data" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	h->unref (h);
+
+	/* complete data, the source should not be touched again */
+	h = spill_filehandle_open (file);
+	retval |= test_verify (h, 0, 200000);
+	h->unref (h);
+
+	if ((source_opens != 2) || (source_bytes != 200000))
+	{
+		printf (ANSI_COLOR_RED "source opened %d times, %d bytes read, expected 2 and 200000" ANSI_COLOR_RESET "\n", source_opens, source_bytes);
+		retval = 1;
+	}
+
+out:
+	file->unref (file);
+	filesystem_spill_done ();
+	if (spill_head || spill_memory_used || spill_disk_used)
+	{
+		printf (ANSI_COLOR_RED "cache not empty after filesystem_spill_done()" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	ocpdir_mem_getdir_t (dir)->unref (ocpdir_mem_getdir_t (dir));
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+static int spill_test_ranges (void)
+{
+	struct ocpdir_mem_t *dir;
+	struct ocpfile_t *file;
+	struct ocpfilehandle_t *h;
+	int retval = 0;
+
+	printf (ANSI_COLOR_BLUE "Seeking ahead only reads the part that is needed" ANSI_COLOR_RESET "\n");
+
+	filesystem_spill_init (4*1024*1024, 0);
+	source_opens = source_bytes = 0;
+
+	dir = ocpdir_mem_alloc (0, "test.tar.gz");
+	ocpdir_mem_getdir_t (dir)->is_archive = 1;
+	file = test_member (ocpdir_mem_getdir_t (dir), 1, 400000);
+
+	h = spill_filehandle_open (file);
+	retval |= test_verify (h, 300000, 1000);
+	if (source_bytes > SPILL_CHUNK_SIZE)
+	{
+		printf (ANSI_COLOR_RED "data in front of the seek target was read from the source (%d bytes)" ANSI_COLOR_RESET "\n", source_bytes);
+		retval = 1;
+	}
+	retval |= test_verify (h, 100000, 1000);
+	retval |= test_verify (h, 299000, 2000); /* spans a gap and an existing range */
+	if (spill_head->complete)
+	{
+		printf (ANSI_COLOR_RED "entry marked complete too early" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	retval |= test_verify (h, 0, 400000);
+	h->unref (h);
+
+	if ((!spill_head->complete) || (spill_head->ranges_count != 1) || (source_opens != 1) || (source_bytes != 400000))
+	{
+		printf (ANSI_COLOR_RED "complete=%d ranges=%d, source opened %d times, %d bytes read, expected 1 range, 1 open and 400000 bytes" ANSI_COLOR_RESET "\n", spill_head->complete, spill_head->ranges_count, source_opens, source_bytes);
+		retval = 1;
+	}
+
+	file->unref (file);
+	filesystem_spill_done ();
+	ocpdir_mem_getdir_t (dir)->unref (ocpdir_mem_getdir_t (dir));
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+static int spill_test_bypass (void)
+{
+	struct ocpdir_mem_t *dir;
+	struct ocpfile_t *file;
+	struct ocpfilehandle_t *h;
+	int retval = 0;
+
+	printf (ANSI_COLOR_BLUE "Files outside archives are not cached" ANSI_COLOR_RESET "\n");
+
+	filesystem_spill_init (1024*1024, 1024*1024);
+
+	dir = ocpdir_mem_alloc (0, "plain");
+	file = test_member (ocpdir_mem_getdir_t (dir), 1, 1000);
+
+	h = spill_filehandle_open (file);
+	if (h->read == spill_filehandle_read)
+	{
+		printf (ANSI_COLOR_RED "plain file was opened through the cache" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	retval |= test_verify (h, 0, 1000);
+	h->unref (h);
+	file->unref (file);
+
+	filesystem_spill_done ();
+	ocpdir_mem_getdir_t (dir)->unref (ocpdir_mem_getdir_t (dir));
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+static int spill_test_evict (void)
+{
+	struct ocpdir_mem_t *dir;
+	struct ocpfile_t *file1, *file2, *file3;
+	struct ocpfilehandle_t *h1, *h2, *h3;
+	int retval = 0;
+
+	printf (ANSI_COLOR_BLUE "Least recently used entries are evicted, entries in use are not" ANSI_COLOR_RESET "\n");
+
+	filesystem_spill_init (0, 250000);
+
+	dir = ocpdir_mem_alloc (0, "test.zip");
+	ocpdir_mem_getdir_t (dir)->is_archive = 1;
+	file1 = test_member (ocpdir_mem_getdir_t (dir), 1, 100000);
+	file2 = test_member (ocpdir_mem_getdir_t (dir), 2, 100000);
+	file3 = test_member (ocpdir_mem_getdir_t (dir), 3, 100000);
+
+	h1 = spill_filehandle_open (file1);
+	retval |= test_verify (h1, 0, 100000);
+	h1->unref (h1);
+
+	h2 = spill_filehandle_open (file2); /* keep this one open */
+	retval |= test_verify (h2, 0, 100000);
+
+	h3 = spill_filehandle_open (file3); /* file1 has to go */
+	retval |= test_verify (h3, 0, 100000);
+
+	if ((h1 = spill_filehandle_open (file1))->read == spill_filehandle_read)
+	{ /* neither file2 nor file3 can be evicted, so this must bypass the cache */
+		printf (ANSI_COLOR_RED "budget exceeded" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	retval |= test_verify (h1, 0, 100000);
+	h1->unref (h1);
+
+	if ((spill_head->dirdb_ref != 3) || (spill_tail->dirdb_ref != 2) || (spill_disk_used != 200000))
+	{
+		printf (ANSI_COLOR_RED "unexpected cache content" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	h2->unref (h2);
+	h3->unref (h3);
+	file1->unref (file1);
+	file2->unref (file2);
+	file3->unref (file3);
+
+	filesystem_spill_done ();
+	ocpdir_mem_getdir_t (dir)->unref (ocpdir_mem_getdir_t (dir));
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN "OK" ANSI_COLOR_RESET "\n");
+	}
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+	int i;
+
+	printf ( ANSI_COLOR_CYAN "Testing spill cache" ANSI_COLOR_RESET "\n");
+	retval |= spill_test_storage ("memory", 1024*1024, 0, 1);
+	retval |= spill_test_storage ("temporary file", 1024, 1024*1024, 0);
+	retval |= spill_test_ranges ();
+	retval |= spill_test_bypass ();
+	retval |= spill_test_evict ();
+
+	for (i=0; i < 4; i++)
+	{
+		if (dirdb_count[i])
+		{
+			printf (ANSI_COLOR_RED "dirdb node %d is not clean" ANSI_COLOR_RESET "\n", i);
+			retval = 1;
+		}
+	}
+	if (dirdb_failures)
+	{
+		printf (ANSI_COLOR_RED "dirdb problems detected" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+	printf ("\n");
+
+	return retval;
+}
@@ -0,0 +1,675 @@
+/* OpenCP Module Player
+ * copyright (c) 2020-'22 Stian Skjelstad <stian.skjelstad@gmail.com>
+ *
+ * Spill cache for files nested inside archives: keeps a decompressed copy
+ * in memory or in a temporary file, so it can be seeked and re-opened
+ * without decompressing the outer layers again.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "types.h"
+#include "boot/psetting.h"
+#include "dirdb.h"
+#include "filesystem.h"
+#include "filesystem-spill.h"
+
+#ifndef SPILL_CHUNK_SIZE
+# define SPILL_CHUNK_SIZE 65536 /* how much we pull from the source at a time */
+#endif
+
+#ifdef SPILL_DEBUG
+#define DEBUG_PRINT(...) do { fprintf(stderr, __VA_ARGS__); } while (0)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+struct spill_range_t
+{
+	uint64_t start;
+	uint64_t end;
+};
+
+struct spill_entry_t
+{
+	struct spill_entry_t *prev; /* more recently used */
+	struct spill_entry_t *next; /* less recently used */
+
+	uint32_t dirdb_ref;
+	uint64_t announced; /* filesize as announced by the archive, used for lookups and accounting */
+	uint64_t filesize;  /* same as announced, unless the data ends earlier */
+	struct spill_range_t *ranges; /* data that is available, sorted, ranges never touch each other */
+	int ranges_count;
+	int ranges_size;
+	int complete;      /* ranges cover [0, filesize> */
+	int refcount;      /* number of open spill_ocpfilehandle_t */
+
+	char *mem;         /* either mem or fd is in use */
+	int fd;
+
+	struct ocpfilehandle_t *source; /* only kept open while incomplete and in use */
+	uint64_t sourcepos;
+};
+
+struct spill_ocpfilehandle_t
+{
+	struct ocpfilehandle_t  head;
+	struct ocpfile_t       *owner;
+	struct spill_entry_t   *entry;
+
+	uint64_t pos;
+	int error;
+};
+
+static struct spill_entry_t *spill_head; /* most recently used */
+static struct spill_entry_t *spill_tail; /* least recently used */
+
+static uint64_t spill_memory_budget;
+static uint64_t spill_memory_used;
+static uint64_t spill_disk_budget;
+static uint64_t spill_disk_used;
+
+static void spill_entry_unlink (struct spill_entry_t *entry)
+{
+	if (entry->prev)
+	{
+		entry->prev->next = entry->next;
+	} else {
+		spill_head = entry->next;
+	}
+	if (entry->next)
+	{
+		entry->next->prev = entry->prev;
+	} else {
+		spill_tail = entry->prev;
+	}
+	entry->prev = 0;
+	entry->next = 0;
+}
+
+static void spill_entry_link_head (struct spill_entry_t *entry)
+{
+	entry->prev = 0;
+	entry->next = spill_head;
+	if (spill_head)
+	{
+		spill_head->prev = entry;
+	} else {
+		spill_tail = entry;
+	}
+	spill_head = entry;
+}
+
+static void spill_entry_free (struct spill_entry_t *entry)
+{
+	DEBUG_PRINT ("[SPILL] dropping dirdb_ref=%u filesize=%lu\n", entry->dirdb_ref, (unsigned long)entry->filesize);
+
+	spill_entry_unlink (entry);
+	if (entry->source)
+	{
+		entry->source->unref (entry->source);
+		entry->source = 0;
+	}
+	if (entry->mem)
+	{
+		spill_memory_used -= entry->announced;
+		free (entry->mem);
+	} else {
+		spill_disk_used -= entry->announced;
+		close (entry->fd);
+	}
+	free (entry->ranges);
+	dirdbUnref (entry->dirdb_ref, dirdb_use_filehandle);
+	free (entry);
+}
+
+/* drop least recently used entries that are not in use, until size bytes fits within the budget. Returns non-zero if it does not fit */
+static int spill_evict (int memory, uint64_t size)
+{
+	struct spill_entry_t *iter, *prev;
+	uint64_t *used = memory ? &spill_memory_used : &spill_disk_used;
+	uint64_t budget = memory ? spill_memory_budget : spill_disk_budget;
+
+	for (iter = spill_tail; iter && ((*used + size) > budget); iter = prev)
+	{
+		prev = iter->prev;
+		if (iter->refcount || ((!!iter->mem) != memory))
+		{
+			continue;
+		}
+		spill_entry_free (iter);
+	}
+	return (*used + size) > budget;
+}
+
+static int spill_tempfile (void)
+{
+	const char *dir = cfTempDir ? cfTempDir : "/tmp/";
+	size_t len = strlen (dir);
+	char *path = malloc (len + 1 + 17 + 1);
+	int fd;
+
+	if (!path)
+	{
+		return -1;
+	}
+	sprintf (path, "%s%socp-spill-XXXXXX", dir, (len && (dir[len - 1] == '/')) ? "" : "/");
+	fd = mkstemp (path);
+	if (fd < 0)
+	{
+		fprintf (stderr, "[SPILL] mkstemp(\"%s\") failed: %s\n", path, strerror (errno));
+	} else {
+		unlink (path); /* the file lives until we close it */
+	}
+	free (path);
+	return fd;
+}
+
+static struct spill_entry_t *spill_entry_new (struct ocpfile_t *file, uint64_t filesize)
+{
+	struct spill_entry_t *entry;
+	int memory = (filesize <= (spill_memory_budget / 4)) && (!spill_evict (1, filesize)); /* large files would flush the entire memory budget */
+
+	if ((!memory) && spill_evict (0, filesize))
+	{
+		return 0;
+	}
+
+	entry = calloc (1, sizeof (*entry));
+	if (!entry)
+	{
+		return 0;
+	}
+	entry->fd = -1;
+	if (memory)
+	{
+		entry->mem = malloc (filesize);
+		if (!entry->mem)
+		{
+			free (entry);
+			return 0;
+		}
+		spill_memory_used += filesize;
+	} else {
+		entry->fd = spill_tempfile ();
+		if (entry->fd < 0)
+		{
+			free (entry);
+			return 0;
+		}
+		spill_disk_used += filesize;
+	}
+	entry->dirdb_ref = dirdbRef (file->dirdb_ref, dirdb_use_filehandle);
+	entry->announced = filesize;
+	entry->filesize = filesize;
+
+	DEBUG_PRINT ("[SPILL] new dirdb_ref=%u filesize=%lu in %s\n", entry->dirdb_ref, (unsigned long)filesize, memory ? "memory" : "tempfile");
+
+	spill_entry_link_head (entry);
+	return entry;
+}
+
+/* returns the first range that ends after pos */
+static int spill_range_find (struct spill_entry_t *entry, uint64_t pos)
+{
+	int lo = 0, hi = entry->ranges_count;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (entry->ranges[mid].end <= pos)
+		{
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* [start, end> does not overlap any existing range */
+static int spill_range_add (struct spill_entry_t *entry, uint64_t start, uint64_t end)
+{
+	int i = spill_range_find (entry, start);
+
+	if (i && (entry->ranges[i - 1].end == start))
+	{ /* extends the previous range, the common case when reading sequentially */
+		entry->ranges[i - 1].end = end;
+		if ((i < entry->ranges_count) && (entry->ranges[i].start == end))
+		{
+			entry->ranges[i - 1].end = entry->ranges[i].end;
+			memmove (entry->ranges + i, entry->ranges + i + 1, (entry->ranges_count - i - 1) * sizeof (entry->ranges[0]));
+			entry->ranges_count--;
+		}
+		return 0;
+	}
+	if ((i < entry->ranges_count) && (entry->ranges[i].start == end))
+	{
+		entry->ranges[i].start = start;
+		return 0;
+	}
+
+	if (entry->ranges_count == entry->ranges_size)
+	{
+		int newsize = entry->ranges_size ? (entry->ranges_size * 2) : 4;
+		struct spill_range_t *temp = realloc (entry->ranges, newsize * sizeof (entry->ranges[0]));
+		if (!temp)
+		{
+			return -1;
+		}
+		entry->ranges = temp;
+		entry->ranges_size = newsize;
+	}
+	memmove (entry->ranges + i + 1, entry->ranges + i, (entry->ranges_count - i) * sizeof (entry->ranges[0]));
+	entry->ranges[i].start = start;
+	entry->ranges[i].end = end;
+	entry->ranges_count++;
+	return 0;
+}
+
+/* Pull data from the source until [pos, target> is available, or the source ends. Only the missing parts are read, and the
+ * source is seeked to them, so a decompressor can resume from its nearest access-point instead of decoding all the data in front.
+ */
+static int spill_entry_fill (struct spill_entry_t *entry, struct ocpfile_t *owner, uint64_t pos, uint64_t target)
+{
+	char *buffer = 0;
+	int retval = 0;
+
+	while ((!entry->complete) && (pos < target) && (pos < entry->filesize))
+	{
+		int i = spill_range_find (entry, pos);
+		uint64_t limit = entry->filesize;
+		int chunk = SPILL_CHUNK_SIZE;
+		int res;
+
+		if (i < entry->ranges_count)
+		{
+			if (entry->ranges[i].start <= pos)
+			{ /* already available */
+				pos = entry->ranges[i].end;
+				continue;
+			}
+			limit = entry->ranges[i].start;
+		}
+		if (chunk > (limit - pos))
+		{
+			chunk = limit - pos;
+		}
+
+		if (!entry->source)
+		{
+			entry->source = owner->open (owner);
+			if (!entry->source)
+			{
+				retval = -1;
+				break;
+			}
+			entry->sourcepos = 0;
+		}
+		if (entry->sourcepos != pos)
+		{
+			if (entry->source->seek_set (entry->source, pos))
+			{
+				entry->source->unref (entry->source);
+				entry->source = 0;
+				retval = -1;
+				break;
+			}
+			entry->sourcepos = pos;
+		}
+
+		if (entry->mem)
+		{
+			res = entry->source->read (entry->source, entry->mem + pos, chunk);
+		} else {
+			if (!buffer)
+			{
+				buffer = malloc (SPILL_CHUNK_SIZE);
+				if (!buffer)
+				{
+					retval = -1;
+					break;
+				}
+			}
+			res = entry->source->read (entry->source, buffer, chunk);
+			if ((res > 0) && (pwrite (entry->fd, buffer, res, pos) != res))
+			{
+				fprintf (stderr, "[SPILL] pwrite() failed: %s\n", strerror (errno));
+				retval = -1;
+				break;
+			}
+		}
+		if (res < 0)
+		{
+			retval = -1;
+			break;
+		}
+		entry->sourcepos += res;
+		if (res && spill_range_add (entry, pos, pos + res))
+		{
+			retval = -1;
+			break;
+		}
+		pos += res;
+		if (res < chunk)
+		{ /* archive announced more data than it could deliver */
+			entry->filesize = pos;
+		}
+		if ((entry->ranges_count == 1) && (!entry->ranges[0].start) && (entry->ranges[0].end >= entry->filesize))
+		{
+			entry->complete = 1;
+		}
+	}
+
+	if (entry->complete && entry->source)
+	{
+		entry->source->unref (entry->source);
+		entry->source = 0;
+	}
+
+	free (buffer);
+	return retval;
+}
+
+static void spill_filehandle_ref (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+	s->head.refcount++;
+}
+
+static void spill_filehandle_unref (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	s->head.refcount--;
+	if (s->head.refcount)
+	{
+		return;
+	}
+
+	s->entry->refcount--;
+	if ((!s->entry->refcount) && s->entry->source)
+	{ /* a later open can fill in the rest */
+		s->entry->source->unref (s->entry->source);
+		s->entry->source = 0;
+	}
+	if ((!spill_memory_budget) && (!spill_disk_budget) && (!s->entry->refcount))
+	{ /* filesystem_spill_done() has been called while we were open */
+		spill_entry_free (s->entry);
+	}
+	s->entry = 0;
+
+	dirdbUnref (s->head.dirdb_ref, dirdb_use_filehandle);
+	s->owner->unref (s->owner);
+	s->owner = 0;
+	free (s);
+}
+
+static int spill_filehandle_seek_set (struct ocpfilehandle_t *_s, int64_t pos)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	if (pos < 0) return -1;
+	if (pos > (int64_t)s->entry->filesize) return -1;
+
+	s->pos = pos;
+	s->error = 0;
+
+	return 0;
+}
+
+static int spill_filehandle_seek_cur (struct ocpfilehandle_t *_s, int64_t pos)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	if (pos <= 0)
+	{
+		if (pos == INT64_MIN) return -1; /* we never have files this size */
+		if ((-pos) > s->pos) return -1;
+		s->pos += pos;
+	} else {
+		/* check for overflow */
+		if ((int64_t)(pos + s->pos) < 0) return -1;
+		if ((pos + s->pos) > s->entry->filesize) return -1;
+		s->pos += pos;
+	}
+
+	s->error = 0;
+	return 0;
+}
+
+static int spill_filehandle_seek_end (struct ocpfilehandle_t *_s, int64_t pos)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	if (pos > 0) return -1;
+	if (pos == INT64_MIN) return -1; /* we never have files this size */
+	if (pos < -(int64_t)(s->entry->filesize)) return -1;
+
+	s->pos = s->entry->filesize + pos;
+	s->error = 0;
+
+	return 0;
+}
+
+static uint64_t spill_filehandle_getpos (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	return s->pos;
+}
+
+static int spill_filehandle_eof (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	if (s->error)
+	{
+		return -1;
+	}
+	return s->pos >= s->entry->filesize;
+}
+
+static int spill_filehandle_error (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	return s->error;
+}
+
+static int spill_filehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+	struct spill_entry_t *entry = s->entry;
+	int retval = 0;
+	int i;
+
+	if (len < 0)
+	{
+		return -1;
+	}
+
+	if (spill_entry_fill (entry, s->owner, s->pos, s->pos + len))
+	{
+		s->error = 1;
+	}
+
+	i = spill_range_find (entry, s->pos);
+	if ((i < entry->ranges_count) && (entry->ranges[i].start <= s->pos))
+	{
+		retval = len;
+		if (retval > (entry->ranges[i].end - s->pos))
+		{
+			retval = entry->ranges[i].end - s->pos;
+		}
+		if (entry->mem)
+		{
+			memcpy (dst, entry->mem + s->pos, retval);
+		} else {
+			int done = 0;
+			while (done < retval)
+			{
+				ssize_t res = pread (entry->fd, (char *)dst + done, retval - done, s->pos + done);
+				if (res <= 0)
+				{
+					if ((res < 0) && (errno == EINTR))
+					{
+						continue;
+					}
+					fprintf (stderr, "[SPILL] pread() failed: %s\n", res ? strerror (errno) : "unexpected EOF");
+					s->error = 1;
+					break;
+				}
+				done += res;
+			}
+			retval = done;
+		}
+		s->pos += retval;
+	}
+
+	return retval;
+}
+
+static uint64_t spill_filehandle_filesize (struct ocpfilehandle_t *_s)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	return s->entry->filesize;
+}
+
+static int spill_filehandle_filesize_ready (struct ocpfilehandle_t *_s)
+{
+	return 1;
+}
+
+static int spill_filehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
+{
+	struct spill_ocpfilehandle_t *s = (struct spill_ocpfilehandle_t *)_s;
+
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{ /* the missing parts are read from the source */
+		if (s->entry->complete)
+		{
+			return 0;
+		}
+		return s->entry->source ? s->entry->source->ioctl (s->entry->source, cmd, ptr) : -1;
+	}
+	return -1;
+}
+
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file)
+{
+	struct spill_entry_t *entry;
+	struct spill_ocpfilehandle_t *s;
+	uint64_t filesize;
+
+	if ((!spill_memory_budget) && (!spill_disk_budget))
+	{
+		return file->open (file);
+	}
+
+	/* plain files can be seeked for free, and if the size is not known yet we could end up decompressing twice */
+	if ((!file->parent) || (!file->parent->is_archive) || (!file->filesize_ready (file)))
+	{
+		return file->open (file);
+	}
+	filesize = file->filesize (file);
+	if ((filesize == FILESIZE_STREAM) || (filesize == FILESIZE_ERROR) || (!filesize) || (filesize > (uint64_t)SIZE_MAX))
+	{
+		return file->open (file);
+	}
+
+	for (entry = spill_head; entry; entry = entry->next)
+	{
+		if ((entry->dirdb_ref == (uint32_t)file->dirdb_ref) && (entry->announced == filesize))
+		{
+			break;
+		}
+	}
+
+	if (entry)
+	{
+		DEBUG_PRINT ("[SPILL] hit dirdb_ref=%u ranges=%d complete=%d\n", entry->dirdb_ref, entry->ranges_count, entry->complete);
+		spill_entry_unlink (entry);
+		spill_entry_link_head (entry);
+	} else {
+		entry = spill_entry_new (file, filesize);
+		if (!entry)
+		{
+			return file->open (file);
+		}
+	}
+
+	s = calloc (1, sizeof (*s));
+	if (!s)
+	{
+		return file->open (file);
+	}
+
+	ocpfilehandle_t_fill
+	(
+		&s->head,
+		spill_filehandle_ref,
+		spill_filehandle_unref,
+		spill_filehandle_seek_set,
+		spill_filehandle_seek_cur,
+		spill_filehandle_seek_end,
+		spill_filehandle_getpos,
+		spill_filehandle_eof,
+		spill_filehandle_error,
+		spill_filehandle_read,
+		spill_filehandle_ioctl,
+		spill_filehandle_filesize,
+		spill_filehandle_filesize_ready,
+		0, /* filename_override */
+		dirdbRef (file->dirdb_ref, dirdb_use_filehandle)
+	);
+	s->head.refcount = 1;
+	s->owner = file;
+	file->ref (file);
+	s->entry = entry;
+	entry->refcount++;
+
+	return &s->head;
+}
+
+void filesystem_spill_init (uint64_t memory_budget, uint64_t disk_budget)
+{
+	spill_memory_budget = memory_budget;
+	spill_disk_budget = disk_budget;
+}
+
+void filesystem_spill_done (void)
+{
+	struct spill_entry_t *iter, *next;
+
+	spill_memory_budget = 0;
+	spill_disk_budget = 0;
+
+	for (iter = spill_head; iter; iter = next)
+	{
+		next = iter->next;
+		if (!iter->refcount)
+		{
+			spill_entry_free (iter);
+		}
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _FILESEL_FILESYSTEM_SPILL_H
+#define _FILESEL_FILESYSTEM_SPILL_H 1
+
+struct ocpfile_t;
+struct ocpfilehandle_t;
+
+/* Spill cache for files that live inside archives. The first time such a file is opened through spill_filehandle_open(), the
+ * data is copied into memory (small files) or an unlinked temporary file in cfTempDir (larger files) while it is being read.
+ * Only the parts that are read are copied, the source is seeked to the parts that are missing, so decompressors with an index of
+ * access-points do not have to decode everything in front of them. Later seeks and re-opens are served from the copy, so nested
+ * archives do not need to be decompressed over and over again.
+ *
+ * Entries are identified by dirdb_ref and filesize, and least recently used entries are dropped when the budgets are exceeded.
+ */
+
+/* budgets are in bytes, 0 disables the corresponding storage */
+void filesystem_spill_init (uint64_t memory_budget, uint64_t disk_budget);
+
+void filesystem_spill_done (void);
+
+/* Opens file through the spill cache if it is an archive member, or if the cache is full/disabled, using file->open() directly */
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file);
+
+#endif
@@ -2132,6 +2132,11 @@ void register_dirdecompressor(const struct ocpdirdecompressor_t *odd)
 {
 }
 
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file)
+{
+	return file->open (file);
+}
+
 static char          *adbmeta_filename;
 static size_t         adbmeta_filesize;
 static char          *adbmeta_SIG;
@@ -2169,7 +2174,7 @@ int adbMetaGet (const char *filename, const size_t filesize, const char *SIG,
 	{
 		return -1;
 	}
-	if ((!strcmp (filename, adbmeta_filename)) && (filesize == adbmeta_filesize))
+	if ((!strcmp (filename, adbmeta_filename)) && (filesize == adbmeta_filesize) && (!strcmp (SIG, adbmeta_SIG)))
 	{
 		*data = malloc (adbmeta_filesize);
 		memcpy (*data, adbmeta_data, adbmeta_datasize);
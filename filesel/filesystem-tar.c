@@ -21,14 +21,15 @@
 #include "config.h"
 #include <assert.h>
 #include <errno.h>
-#include <iconv.h>
 #include <stdlib.h>
 #include <string.h>
 #include "types.h"
 #include "adbmeta.h"
 #include "dirdb.h"
 #include "filesystem.h"
+#include "filesystem-charset.h"
 #include "filesystem-tar.h"
+#include "filesystem-spill.h"
 
 #if defined(TAR_DEBUG) || defined(TAR_VERBOSE)
 static int do_tar_debug_print=1;
@@ -99,7 +100,7 @@ struct tar_instance_t
 	struct ocpfile_t            *archive_file;
 	struct ocpfilehandle_t      *archive_filehandle;
 
-	iconv_t                     *iconv_handle;
+	struct charset_translate_t   translate;
 	char                        *charset_override;  /* either NULL, or an override string */
 
 	int                          refcount;
@@ -137,6 +138,7 @@ static uint64_t tar_filehandle_getpos (struct ocpfilehandle_t *);
 static int tar_filehandle_eof (struct ocpfilehandle_t *);
 static int tar_filehandle_error (struct ocpfilehandle_t *);
 static int tar_filehandle_read (struct ocpfilehandle_t *, void *dst, int len);
+static int tar_filehandle_ioctl (struct ocpfilehandle_t *, const char *cmd, void *ptr);
 static uint64_t tar_filehandle_filesize (struct ocpfilehandle_t *);
 static int tar_filehandle_filesize_ready (struct ocpfilehandle_t *);
 
@@ -294,7 +296,7 @@ static void tar_io_ref (struct tar_instance_t *self)
 	DEBUG_PRINT ( " tar_io_ref (old count = %d)\n", self->iorefcount);
 	if (!self->iorefcount)
 	{
-		self->archive_filehandle = self->archive_file->open (self->archive_file);
+		self->archive_filehandle = spill_filehandle_open (self->archive_file);
 	}
 	self->iorefcount++;
 }
@@ -583,7 +585,7 @@ struct ocpdir_t *tar_check (const struct ocpdirdecompressor_t *self, struct ocpf
 	iter->archive_file = file;
 
 	iter->next = tar_root;
-	iter->iconv_handle = (iconv_t *)-1;
+	charset_translate_init (&iter->translate);
 	tar_root = iter;
 
 	if (iter->archive_file->filesize_ready (iter->archive_file))
@@ -1063,6 +1065,18 @@ static int tar_filehandle_read (struct ocpfilehandle_t *_self, void *dst, int le
 	return retval;
 }
 
+static int tar_filehandle_ioctl (struct ocpfilehandle_t *_self, const char *cmd, void *ptr)
+{
+	struct tar_instance_filehandle_t *self = (struct tar_instance_filehandle_t *)_self;
+	struct ocpfilehandle_t *filehandle = self->file->owner->archive_filehandle;
+
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{ /* members are stored as-is, so this depends on the archive itself */
+		return filehandle ? filehandle->ioctl (filehandle, cmd, ptr) : -1;
+	}
+	return -1;
+}
+
 static void tar_file_ref (struct ocpfile_t *_self)
 {
 	struct tar_instance_file_t *self = (struct tar_instance_file_t *)_self;
@@ -1104,7 +1118,7 @@ static struct ocpfilehandle_t *tar_file_open (struct ocpfile_t *_self)
 	                       tar_filehandle_eof,
 	                       tar_filehandle_error,
 	                       tar_filehandle_read,
-	                       0, /* ioctl */
+	                       tar_filehandle_ioctl,
 	                       tar_filehandle_filesize,
 	                       tar_filehandle_filesize_ready,
 	                       0, /* filename_override */
@@ -1259,122 +1273,24 @@ static const char *tar_get_byuser_string (struct ocpdir_t *_self)
 
 static void tar_translate_prepare (struct tar_instance_t *self)
 {
-	const char *target;
-	char *temp;
-	target = self->charset_override ? self->charset_override : "UTF-8";
+	const char *filename = 0;
 
 	DEBUG_PRINT ("tar_translate_prepare %s\n", self->charset_override ? self->charset_override : "(NULL) UTF-8");
 
-	if (self->iconv_handle != (iconv_t)-1)
-	{
-		iconv_close (self->iconv_handle);
-		self->iconv_handle = (iconv_t)-1;
-	}
-
-	temp = malloc (strlen (target) + 11);
-	if (temp)
-	{
-		sprintf (temp, "%s//TRANSLIT", target);
-		self->iconv_handle = iconv_open ("UTF-8", temp);
-		free (temp);
-		temp = 0;
-	}
-	if (self->iconv_handle == (iconv_t)-1)
-	{
-		self->iconv_handle = iconv_open ("UTF-8", target);
-	}
+	dirdbGetName_internalstr (self->archive_file->dirdb_ref, &filename);
+	charset_translate_prepare (&self->translate, self->charset_override ? self->charset_override : "UTF-8", filename, self->archive_file->filesize (self->archive_file), "TARNAMES");
 }
 
 static void tar_translate_complete (struct tar_instance_t *self)
 {
 	DEBUG_PRINT ("tar_translate_complete\n");
 
-	if (self->iconv_handle != (iconv_t)-1)
-	{
-		iconv_close (self->iconv_handle);
-		self->iconv_handle = (iconv_t)-1;
-	}
+	charset_translate_complete (&self->translate);
 }
 
 static void tar_translate (struct tar_instance_t *self, char *src, char **buffer, int *buffersize)
 {
-	char *temp;
-	size_t srclen;
-
-	char *dst = *buffer;
-	size_t dstlen = *buffersize;
-
-	DEBUG_PRINT ("tar_translate %s =>", src);
-
-	temp = rindex (src, '/');
-	if (temp)
-	{
-		src = temp + 1;
-	}
-	srclen = strlen (src);
-
-	if (!self->iconv_handle)
-	{
-		*buffer = strdup (src);
-		*buffersize = *buffer ? strlen (*buffer) : 0;
-		return;
-	}
-
-	iconv (self->iconv_handle, 0, 0, 0, 0);
-
-	while (srclen)
-	{
-		if (dstlen <= 10)
-		{
-			int oldofs = dst - (*buffer);
-			*buffersize += 32;
-			char *temp = realloc (*buffer, *buffersize);
-			if (!temp)
-			{
-				*buffersize -= 32;
-				fprintf (stderr, "tar_translate: out of memory\n");
-				free (*buffer);
-				*buffer = 0;
-				*buffersize = 0;
-				return;
-			}
-			*buffer = temp;
-			dst = temp + oldofs;
-			dstlen += 32;
-		}
-
-		if (iconv (self->iconv_handle, &src, &srclen, &dst, &dstlen) == (size_t)-1)
-		{
-			if (errno != E2BIG)
-			{
-				src++;
-				srclen--;
-			}
-		}
-	}
-
-	if (dstlen <= 10)
-	{
-		int oldofs = dst - (*buffer);
-		*buffersize += 32;
-		char *temp = realloc (*buffer, *buffersize);
-		if (!temp)
-		{
-			*buffersize -= 32;
-			fprintf (stderr, "tar_translate: out of memory\n");
-			free (*buffer);
-			*buffer = 0;
-			*buffersize = 0;
-			return;
-		}
-		*buffer = temp;
-		dst = temp + oldofs;
-		dstlen += 32;
-	}
-
-	*dst = 0;
-
-	DEBUG_PRINT ("%s\n", *buffer);
+	charset_translate (&self->translate, src, buffer, buffersize);
 }
 
 
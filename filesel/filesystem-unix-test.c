@@ -0,0 +1,530 @@
+/* unit test for filesystem-unix.c */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* stat() of this entry fails, as if the file was removed right after readdir() */
+static const char *test_fstatat_fail;
+static int test_fstatat (int dirfd, const char *pathname, struct stat *statbuf, int flags)
+{
+	if (test_fstatat_fail && !strcmp (pathname, test_fstatat_fail))
+	{
+		errno = ENOENT;
+		return -1;
+	}
+	return fstatat (dirfd, pathname, statbuf, flags);
+}
+#define fstatat test_fstatat
+
+#include "filesystem-unix.c"
+
+#undef fstatat
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define TEST_FILES 2000
+
+char *cfConfigDir;
+
+/* a minimal dirdb, node 0 is the temporary directory, using its full path as name */
+struct test_node_t
+{
+	uint32_t parent;
+	char *name;
+	int refcount;
+};
+static struct test_node_t *nodes;
+static int nodes_count;
+static int nodes_size;
+static int dirdb_failures;
+
+uint32_t dirdbRef (uint32_t ref, enum dirdb_use use)
+{
+	if ((ref >= (uint32_t)nodes_count) || (!nodes[ref].refcount))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbRef (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return ref;
+	}
+	nodes[ref].refcount++;
+	return ref;
+}
+
+void dirdbUnref (uint32_t ref, enum dirdb_use use)
+{
+	if (ref == DIRDB_NOPARENT)
+	{
+		return;
+	}
+	if ((ref >= (uint32_t)nodes_count) || (!nodes[ref].refcount))
+	{
+		dirdb_failures++;
+		printf (ANSI_COLOR_RED "dirdbUnref (%d) called on an invalid/inactive node" ANSI_COLOR_RESET "\n", ref);
+		return;
+	}
+	nodes[ref].refcount--;
+}
+
+uint32_t dirdbFindAndRef (uint32_t parent, const char *name, enum dirdb_use use)
+{
+	int i;
+	for (i=0; i < nodes_count; i++)
+	{
+		if ((nodes[i].parent == parent) && (!strcmp (nodes[i].name, name)))
+		{
+			nodes[i].refcount++;
+			return i;
+		}
+	}
+	if (nodes_count == nodes_size)
+	{
+		nodes_size += 256;
+		nodes = realloc (nodes, nodes_size * sizeof (nodes[0]));
+	}
+	nodes[nodes_count].parent = parent;
+	nodes[nodes_count].name = strdup (name);
+	nodes[nodes_count].refcount = 1;
+	return nodes_count++;
+}
+
+void dirdbGetFullname_malloc (uint32_t ref, char **retval, int flags)
+{
+	const char *name = nodes[ref].name;
+	char *parent = 0;
+
+	if (nodes[ref].parent != DIRDB_NOPARENT)
+	{
+		dirdbGetFullname_malloc (nodes[ref].parent, &parent, 0);
+	}
+	*retval = malloc ((parent ? strlen (parent) : 0) + strlen (name) + 3);
+	sprintf (*retval, "%s%s%s%s", parent ? parent : "", parent ? "/" : "", name, (flags & DIRDB_FULLNAME_ENDSLASH) ? "/" : "");
+	free (parent);
+}
+
+int dirdbGetFullname_buffer (uint32_t ref, char *name, int size, int flags)
+{
+	char *temp;
+	int length;
+
+	dirdbGetFullname_malloc (ref, &temp, flags);
+	length = strlen (temp);
+	if (length < size)
+	{
+		strcpy (name, temp);
+	}
+	free (temp);
+	return length;
+}
+
+uint32_t dirdbResolvePathWithBaseAndRef (uint32_t base, const char *name, const int flags, enum dirdb_use use)
+{
+	return DIRDB_NOPARENT;
+}
+
+struct dmDrive *RegisterDrive(const char *dmDrive, struct ocpdir_t *basedir, struct ocpdir_t *cwd)
+{
+	return 0;
+}
+
+int filesystem_resolve_dirdb_dir (uint32_t ref, struct dmDrive **drive, struct ocpdir_t **dir)
+{
+	return -1;
+}
+
+char *getcwd_malloc (void)
+{
+	return 0;
+}
+
+struct ocpdir_t *ocpdir_t_fill_default_readdir_dir  (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	return 0;
+}
+
+struct ocpfile_t *ocpdir_t_fill_default_readdir_file (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	return 0;
+}
+
+const char *ocpfile_t_fill_default_filename_override (struct ocpfile_t *file)
+{
+	return 0;
+}
+
+int ocpfilehandle_t_fill_default_ioctl (struct ocpfilehandle_t *s, const char *cmd, void *ptr)
+{
+	return -1;
+}
+
+const char *ocpfilehandle_t_fill_default_filename_override (struct ocpfilehandle_t *fh)
+{
+	return 0;
+}
+
+static char test_path[64];
+
+static int test_setup (void)
+{
+	char path[128];
+	int i;
+
+	snprintf (test_path, sizeof (test_path), "/tmp/ocp-unix-test-XXXXXX");
+	if (!mkdtemp (test_path))
+	{
+		printf (ANSI_COLOR_RED "mkdtemp() failed" ANSI_COLOR_RESET "\n");
+		return 1;
+	}
+	for (i=0; i < TEST_FILES; i++)
+	{ /* file i is i bytes long */
+		int fd;
+		snprintf (path, sizeof (path), "%s/file%04d.mod", test_path, i);
+		fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ((fd < 0) || ftruncate (fd, i))
+		{
+			printf (ANSI_COLOR_RED "failed to create %s" ANSI_COLOR_RESET "\n", path);
+			return 1;
+		}
+		close (fd);
+	}
+	snprintf (path, sizeof (path), "%s/subdir", test_path);
+	mkdir (path, 0755);
+	snprintf (path, sizeof (path), "%s/link-to-file", test_path);
+	if (symlink ("file0100.mod", path)) return 1;
+	snprintf (path, sizeof (path), "%s/link-to-dir", test_path);
+	if (symlink ("subdir", path)) return 1;
+	snprintf (path, sizeof (path), "%s/link-dangling", test_path);
+	if (symlink ("does-not-exist", path)) return 1;
+	snprintf (path, sizeof (path), "%s/fifo", test_path);
+	mkfifo (path, 0644);
+
+	nodes_count = 0;
+	dirdbFindAndRef (DIRDB_NOPARENT, test_path, dirdb_use_dir);
+	return 0;
+}
+
+static void test_cleanup (void)
+{
+	char path[128];
+	int i;
+
+	for (i=0; i < TEST_FILES; i++)
+	{
+		snprintf (path, sizeof (path), "%s/file%04d.mod", test_path, i);
+		unlink (path);
+	}
+	snprintf (path, sizeof (path), "%s/link-to-file", test_path);   unlink (path);
+	snprintf (path, sizeof (path), "%s/link-to-dir", test_path);    unlink (path);
+	snprintf (path, sizeof (path), "%s/link-dangling", test_path);  unlink (path);
+	snprintf (path, sizeof (path), "%s/fifo", test_path);           unlink (path);
+	snprintf (path, sizeof (path), "%s/subdir", test_path);         rmdir (path);
+	rmdir (test_path);
+
+	for (i=0; i < nodes_count; i++)
+	{
+		free (nodes[i].name);
+	}
+	free (nodes);
+	nodes = 0;
+	nodes_count = 0;
+	nodes_size = 0;
+}
+
+static int test_dirdb_balanced (void)
+{
+	int retval = 0;
+	int i;
+	for (i=1; i < nodes_count; i++)
+	{
+		if (nodes[i].refcount)
+		{
+			printf (ANSI_COLOR_RED " \"%s\" still has %d references" ANSI_COLOR_RESET "\n", nodes[i].name, nodes[i].refcount);
+			retval = 1;
+		}
+	}
+	return retval;
+}
+
+static struct ocpfile_t *test_files[TEST_FILES + 1];
+static int test_files_count;
+static int test_dirs_count;
+static int test_dirs_unexpected;
+
+static void test_callback_file (void *token, struct ocpfile_t *file)
+{
+	if (test_files_count > TEST_FILES)
+	{
+		printf (ANSI_COLOR_RED " too many files" ANSI_COLOR_RESET "\n");
+		return;
+	}
+	file->ref (file);
+	test_files[test_files_count++] = file;
+}
+
+static void test_callback_dir (void *token, struct ocpdir_t *dir)
+{
+	if (strcmp (nodes[dir->dirdb_ref].name, "subdir") && strcmp (nodes[dir->dirdb_ref].name, "link-to-dir"))
+	{
+		printf (ANSI_COLOR_RED " unexpected directory \"%s\"" ANSI_COLOR_RESET "\n", nodes[dir->dirdb_ref].name);
+		test_dirs_unexpected++;
+	}
+	test_dirs_count++;
+}
+
+/* checks the size of every file that has been reported, and releases them */
+static int test_verify_files (void)
+{
+	int retval = 0;
+	int i;
+
+	for (i=0; i < test_files_count; i++)
+	{
+		struct ocpfile_t *f = test_files[i];
+		const char *name = nodes[f->dirdb_ref].name;
+		uint64_t expected;
+		int n;
+
+		if (!strcmp (name, "link-to-file"))
+		{
+			expected = 100;
+		} else if (sscanf (name, "file%d.mod", &n) == 1)
+		{
+			expected = n;
+		} else {
+			printf (ANSI_COLOR_RED " unexpected file \"%s\"" ANSI_COLOR_RESET "\n", name);
+			retval = 1;
+			expected = 0;
+		}
+		if (f->filesize (f) != expected)
+		{
+			printf (ANSI_COLOR_RED " \"%s\" has size %" PRIu64 ", expected %" PRIu64 ANSI_COLOR_RESET "\n", name, f->filesize (f), expected);
+			retval = 1;
+		}
+		if (!f->filesize_ready (f))
+		{
+			printf (ANSI_COLOR_RED " \"%s\" size is not ready after filesize()" ANSI_COLOR_RESET "\n", name);
+			retval = 1;
+		}
+		f->unref (f);
+	}
+	test_files_count = 0;
+	return retval;
+}
+
+static int unix_test_readdir (void)
+{
+	struct ocpdir_t *dir;
+	ocpdirhandle_pt h;
+	int retval = 0;
+
+	printf (ANSI_COLOR_CYAN "Testing directory with %d files, symlinks and special files" ANSI_COLOR_RESET "\n", TEST_FILES);
+
+	if (test_setup ())
+	{
+		return 1;
+	}
+
+	test_files_count = 0;
+	test_dirs_count = 0;
+	test_dirs_unexpected = 0;
+
+	dir = unix_dir_steal (0, 0);
+	h = dir->readdir_start (dir, test_callback_file, test_callback_dir, 0);
+	if (!h)
+	{
+		printf (ANSI_COLOR_RED " readdir_start() failed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	} else {
+		while (dir->readdir_iterate (h))
+		{
+		}
+		dir->readdir_cancel (h);
+	}
+
+	if (test_files_count != TEST_FILES + 1)
+	{
+		printf (ANSI_COLOR_RED " got %d files, expected %d" ANSI_COLOR_RESET "\n", test_files_count, TEST_FILES + 1);
+		retval = 1;
+	}
+	if ((test_dirs_count != 2) || test_dirs_unexpected)
+	{
+		printf (ANSI_COLOR_RED " got %d directories, expected 2" ANSI_COLOR_RESET "\n", test_dirs_count);
+		retval = 1;
+	}
+
+	/* sizes are queried after the directory handle is gone */
+	retval |= test_verify_files ();
+	dir->unref (dir);
+
+	retval |= test_dirdb_balanced ();
+	if (dirdb_failures)
+	{
+		retval = 1;
+	}
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	test_cleanup ();
+	return retval;
+}
+
+static int unix_test_cancel (void)
+{
+	struct ocpdir_t *dir;
+	ocpdirhandle_pt h;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing cancel while entries are read ahead" ANSI_COLOR_RESET "\n");
+
+	if (test_setup ())
+	{
+		return 1;
+	}
+
+	test_files_count = 0;
+	test_dirs_count = 0;
+	test_dirs_unexpected = 0;
+
+	dir = unix_dir_steal (0, 0);
+	h = dir->readdir_start (dir, test_callback_file, test_callback_dir, 0);
+	if (!h)
+	{
+		printf (ANSI_COLOR_RED " readdir_start() failed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	} else {
+		for (i=0; i < 10; i++)
+		{
+			dir->readdir_iterate (h);
+		}
+		dir->readdir_cancel (h);
+	}
+
+	if ((test_files_count + test_dirs_count) < 5)
+	{
+		printf (ANSI_COLOR_RED " only got %d entries" ANSI_COLOR_RESET "\n", test_files_count + test_dirs_count);
+		retval = 1;
+	}
+	retval |= test_verify_files ();
+	dir->unref (dir);
+
+	retval |= test_dirdb_balanced ();
+	if (dirdb_failures)
+	{
+		retval = 1;
+	}
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	test_cleanup ();
+	return retval;
+}
+
+static int unix_test_stat_failure (void)
+{
+	struct ocpdir_t *dir;
+	ocpdirhandle_pt h;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing file that fails stat() after readdir()" ANSI_COLOR_RESET "\n");
+
+	if (test_setup ())
+	{
+		return 1;
+	}
+
+	test_files_count = 0;
+	test_dirs_count = 0;
+	test_dirs_unexpected = 0;
+	test_fstatat_fail = "file0007.mod";
+
+	dir = unix_dir_steal (0, 0);
+	h = dir->readdir_start (dir, test_callback_file, test_callback_dir, 0);
+	if (!h)
+	{
+		printf (ANSI_COLOR_RED " readdir_start() failed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	} else {
+		while (dir->readdir_iterate (h))
+		{
+		}
+		dir->readdir_cancel (h);
+	}
+
+	/* the file is either skipped, or reported with FILESIZE_ERROR if it was handed out before stat() completed */
+	for (i=0; i < test_files_count; i++)
+	{
+		struct ocpfile_t *f = test_files[i];
+		if (!strcmp (nodes[f->dirdb_ref].name, test_fstatat_fail))
+		{
+			struct ocpfilehandle_t *fh;
+			if (f->filesize (f) != FILESIZE_ERROR)
+			{
+				printf (ANSI_COLOR_RED " \"%s\" has size %" PRIu64 ", expected FILESIZE_ERROR" ANSI_COLOR_RESET "\n", test_fstatat_fail, f->filesize (f));
+				retval = 1;
+			}
+			if ((fh = f->open (f)))
+			{
+				printf (ANSI_COLOR_RED " \"%s\" could be opened" ANSI_COLOR_RESET "\n", test_fstatat_fail);
+				fh->unref (fh);
+				retval = 1;
+			}
+			f->unref (f);
+			test_files[i] = test_files[--test_files_count];
+			break;
+		}
+	}
+	if (test_files_count != TEST_FILES)
+	{
+		printf (ANSI_COLOR_RED " got %d other files, expected %d" ANSI_COLOR_RESET "\n", test_files_count, TEST_FILES);
+		retval = 1;
+	}
+	test_fstatat_fail = 0;
+
+	retval |= test_verify_files ();
+	dir->unref (dir);
+
+	retval |= test_dirdb_balanced ();
+	if (dirdb_failures)
+	{
+		retval = 1;
+	}
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	test_cleanup ();
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	retval |= unix_test_readdir ();
+	retval |= unix_test_cancel ();
+	retval |= unix_test_stat_failure ();
+
+	filesystem_unix_done ();
+
+	printf ("\n");
+
+	return retval;
+}
@@ -22,6 +22,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +41,24 @@ struct dmDrive *dmFILE;
 
 uint32_t cfConfigDir_dirdbref = DIRDB_NOPARENT;
 
+#define UNIX_STAT_THREADS 4 /* number of stat() calls that can be in flight at the same time */
+#define UNIX_READDIR_AHEAD 64 /* number of directory entries read ahead of the callbacks */
+
+/* stat() of a directory entry, performed by the worker pool relative to the file descriptor of the directory */
+struct unix_stat_job_t
+{
+	struct unix_stat_job_t *next; /* in unix_stat_queue */
+	int refcount;                 /* only touched by the main thread */
+	int regular;                  /* d_type says this is a regular file, so only the size is unknown */
+	int done;                     /* protected by unix_stat_mutex */
+	int result;                   /* 0 on success */
+	mode_t mode;
+	uint64_t size;
+	int dirfd;
+	int *outstanding;             /* in the directory handle that submitted the job, protected by unix_stat_mutex */
+	char *name;
+};
+
 struct unix_ocpdirhandle_t
 {
 	struct unix_ocpdir_t *owner;
@@ -49,6 +68,13 @@ struct unix_ocpdirhandle_t
 	void (*callback_file)(void *token, struct ocpfile_t *);
 	void (*callback_dir)(void *token, struct ocpdir_t *);
 	void *token;
+
+	/* entries that have been read, but not yet given to the callbacks, in directory order */
+	struct unix_stat_job_t *ahead[UNIX_READDIR_AHEAD];
+	int ahead_head;
+	int ahead_fill;
+	int eof;
+	int outstanding; /* submitted jobs that are not done yet, the directory must stay open until this reaches zero */
 };
 
 struct unix_ocpdir_t
@@ -73,8 +99,17 @@ struct unix_ocpfile_t
 	struct ocpfile_t head;
 
 	uint64_t filesize;
+	struct unix_stat_job_t *pending; /* filesize is not known until this job is done */
 };
 
+static pthread_mutex_t unix_stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unix_stat_cond = PTHREAD_COND_INITIALIZER; /* broadcast on every state change */
+static pthread_t unix_stat_threads[UNIX_STAT_THREADS];
+static int unix_stat_threads_running;
+static int unix_stat_shutdown;
+static struct unix_stat_job_t *unix_stat_queue;
+static struct unix_stat_job_t **unix_stat_queue_tail = &unix_stat_queue;
+
 static void unix_dir_ref (struct ocpdir_t *_s);
 
 static void unix_dir_unref (struct ocpdir_t *_s);
@@ -124,10 +159,167 @@ static uint64_t unix_filehandle_filesize (struct ocpfilehandle_t *);
 
 static int unix_filehandle_filesize_ready (struct ocpfilehandle_t *);
 
+static int unix_filehandle_ioctl (struct ocpfilehandle_t *, const char *cmd, void *ptr);
+
 static struct ocpdir_t *unix_dir_steal (struct ocpdir_t *parent, const uint32_t dirdb_node);
 
 static struct ocpfile_t *unix_file_steal (struct ocpdir_t *parent, const uint32_t dirdb_node, uint64_t filesize);
 
+static void unix_stat_run (struct unix_stat_job_t *job)
+{
+	struct stat st;
+
+	job->result = fstatat (job->dirfd, job->name, &st, AT_SYMLINK_NOFOLLOW);
+	if ((!job->result) && S_ISLNK(st.st_mode))
+	{
+		job->result = fstatat (job->dirfd, job->name, &st, 0);
+	}
+	if (!job->result)
+	{
+		job->mode = st.st_mode;
+		job->size = st.st_size;
+	}
+}
+
+static void *unix_stat_worker (void *user)
+{
+	pthread_mutex_lock (&unix_stat_mutex);
+	while (1)
+	{
+		struct unix_stat_job_t *job;
+
+		if (!unix_stat_queue)
+		{
+			if (unix_stat_shutdown)
+			{
+				break;
+			}
+			pthread_cond_wait (&unix_stat_cond, &unix_stat_mutex);
+			continue;
+		}
+		job = unix_stat_queue;
+		unix_stat_queue = job->next;
+		if (!unix_stat_queue)
+		{
+			unix_stat_queue_tail = &unix_stat_queue;
+		}
+		pthread_mutex_unlock (&unix_stat_mutex);
+
+		unix_stat_run (job);
+
+		pthread_mutex_lock (&unix_stat_mutex);
+		job->done = 1;
+		(*job->outstanding)--;
+		pthread_cond_broadcast (&unix_stat_cond);
+	}
+	pthread_mutex_unlock (&unix_stat_mutex);
+
+	return 0;
+}
+
+/* caller must hold unix_stat_mutex. Returns the number of worker threads available */
+static int unix_stat_start (void)
+{
+	if (!unix_stat_threads_running)
+	{
+		unix_stat_shutdown = 0;
+		while (unix_stat_threads_running < UNIX_STAT_THREADS)
+		{
+			if (pthread_create (&unix_stat_threads[unix_stat_threads_running], 0, unix_stat_worker, 0))
+			{
+				break;
+			}
+			unix_stat_threads_running++;
+		}
+	}
+	return unix_stat_threads_running;
+}
+
+static struct unix_stat_job_t *unix_stat_job_new (struct unix_ocpdirhandle_t *h, const char *name)
+{
+	struct unix_stat_job_t *job = calloc (1, sizeof (*job));
+	if (!job)
+	{
+		fprintf (stderr, "[filesystem unix readdir_iterate] malloc() failed #1\n");
+		return 0;
+	}
+	job->name = strdup (name);
+	if (!job->name)
+	{
+		fprintf (stderr, "[filesystem unix readdir_iterate] strdup() failed\n");
+		free (job);
+		return 0;
+	}
+	job->refcount = 1;
+	job->dirfd = dirfd (h->dir);
+	job->outstanding = &h->outstanding;
+	return job;
+}
+
+static void unix_stat_job_unref (struct unix_stat_job_t *job)
+{
+	job->refcount--;
+	if (!job->refcount)
+	{
+		free (job->name);
+		free (job);
+	}
+}
+
+/* caller must hold unix_stat_mutex */
+static void unix_stat_submit (struct unix_stat_job_t *job)
+{
+	if (!unix_stat_start ())
+	{ /* no threads, perform the stat() right away */
+		unix_stat_run (job);
+		job->done = 1;
+		return;
+	}
+	(*job->outstanding)++;
+	job->next = 0;
+	*unix_stat_queue_tail = job;
+	unix_stat_queue_tail = &job->next;
+	pthread_cond_broadcast (&unix_stat_cond);
+}
+
+static void unix_stat_wait (struct unix_stat_job_t *job)
+{
+	pthread_mutex_lock (&unix_stat_mutex);
+	while (!job->done)
+	{
+		pthread_cond_wait (&unix_stat_cond, &unix_stat_mutex);
+	}
+	pthread_mutex_unlock (&unix_stat_mutex);
+}
+
+#define UNIX_PATH_BUFFER 1024
+
+/* Gives the path of dirdb_ref inside buffer (UNIX_PATH_BUFFER bytes), or a malloc()ed string if it does not fit. Release it with unix_path_free() */
+static char *unix_path_get (uint32_t dirdb_ref, char *buffer, int flags)
+{
+	char *retval;
+	int length = dirdbGetFullname_buffer (dirdb_ref, buffer, UNIX_PATH_BUFFER, flags);
+
+	if (length < 0)
+	{
+		return 0;
+	}
+	if (length < UNIX_PATH_BUFFER)
+	{
+		return buffer;
+	}
+	dirdbGetFullname_malloc (dirdb_ref, &retval, flags);
+	return retval;
+}
+
+static void unix_path_free (char *path, char *buffer)
+{
+	if (path != buffer)
+	{
+		free (path);
+	}
+}
+
 static void unix_dir_ref (struct ocpdir_t *_s)
 {
 	struct unix_ocpdir_t *s = (struct unix_ocpdir_t *)_s;
@@ -173,7 +365,7 @@ static ocpdirhandle_pt unix_dir_readdir_start (struct ocpdir_t *_s,
 		return 0;
 	}
 
-	retval = malloc (sizeof (*retval));
+	retval = calloc (1, sizeof (*retval));
 	if (!retval)
 	{
 		fprintf (stderr, "[filesystem unix readdir_start] malloc() failed #1\n");
@@ -205,110 +397,189 @@ static void unix_dir_readdir_cancel (ocpdirhandle_pt _h)
 	struct unix_ocpdirhandle_t *h = _h;
 	struct unix_ocpdir_t *s = h->owner;
 
+	/* jobs already handed out to files can still be queued, and they need the directory to stay open */
+	pthread_mutex_lock (&unix_stat_mutex);
+	while (h->outstanding)
+	{
+		pthread_cond_wait (&unix_stat_cond, &unix_stat_mutex);
+	}
+	pthread_mutex_unlock (&unix_stat_mutex);
+
+	while (h->ahead_fill)
+	{
+		unix_stat_job_unref (h->ahead[h->ahead_head]);
+		h->ahead_head = (h->ahead_head + 1) % UNIX_READDIR_AHEAD;
+		h->ahead_fill--;
+	}
+
 	closedir (h->dir); h->dir = 0;
 	free (h);
 
 	s->head.unref (&s->head);
 }
 
-static int unix_dir_readdir_iterate (ocpdirhandle_pt _h)
+/* reads directory entries ahead of the callbacks, so their stat() calls can be performed in parallel */
+static void unix_dir_readdir_ahead (struct unix_ocpdirhandle_t *h)
 {
-	struct unix_ocpdirhandle_t *h = _h;
-	struct unix_ocpdir_t *s = h->owner;
-	struct dirent *de;
+	int first = h->ahead_fill;
+	int i;
 
-again:
-	de=readdir (h->dir);
-	if (!de)
+	/* readdir() is performed without holding unix_stat_mutex, so other directories do not have to wait for it */
+	while ((!h->eof) && (h->ahead_fill < UNIX_READDIR_AHEAD))
 	{
-		return 0;
-	}
+		struct unix_stat_job_t *job;
+		struct dirent *de;
 
-	if (!(strcmp (de->d_name, ".") && strcmp (de->d_name, "..")))
-	{
-		goto again;
-	}
+		de=readdir (h->dir);
+		if (!de)
+		{
+			h->eof = 1;
+			break;
+		}
+
+		if (!(strcmp (de->d_name, ".") && strcmp (de->d_name, "..")))
+		{
+			continue;
+		}
 
 #ifdef HAVE_STRUCT_DIRENT_D_TYPE
-	if (de->d_type==DT_DIR)
-	{
-		struct ocpdir_t *n = unix_dir_steal (&s->head, dirdbFindAndRef (s->head.dirdb_ref, de->d_name, dirdb_use_dir));
-		h->callback_dir (h->token, n);
-		n->unref (n);
-		return 1;
-	} else if ((de->d_type==DT_REG)||(de->d_type==DT_LNK)||(de->d_type==DT_UNKNOWN))
+		if ((de->d_type!=DT_DIR)&&(de->d_type!=DT_REG)&&(de->d_type!=DT_LNK)&&(de->d_type!=DT_UNKNOWN))
+		{ /* devices, sockets, fifos... */
+			continue;
+		}
 #endif
-	{
-		struct stat st;
-		struct stat lst;
-		uint32_t dirdb_ref = dirdbFindAndRef (s->head.dirdb_ref, de->d_name, dirdb_use_dir);
-		char *path;
-
-		dirdbGetFullname_malloc (dirdb_ref, &path, DIRDB_FULLNAME_NODRIVE);
 
-		if (lstat (path, &lst))
+		job = unix_stat_job_new (h, de->d_name);
+		if (!job)
 		{
-			free (path);
-			dirdbUnref (dirdb_ref, dirdb_use_dir);
-			return 1;
+			break;
 		}
 
-		if (S_ISLNK(lst.st_mode))
-		{
-			if (stat (path, &st))
-			{
-				free (path);
-				dirdbUnref (dirdb_ref, dirdb_use_dir);
-				return 1;
-			}
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+		if (de->d_type==DT_DIR)
+		{ /* the kernel already told us everything we need */
+			job->mode = S_IFDIR;
+			job->done = 1;
 		} else {
-			memcpy (&st, &lst, sizeof (st));
+			job->regular = (de->d_type==DT_REG);
 		}
+#endif
 
-		free (path);
+		h->ahead[(h->ahead_head + h->ahead_fill) % UNIX_READDIR_AHEAD] = job;
+		h->ahead_fill++;
+	}
 
-		if (S_ISDIR(st.st_mode))
+	if (first == h->ahead_fill)
+	{
+		return;
+	}
+	pthread_mutex_lock (&unix_stat_mutex);
+	for (i = first; i < h->ahead_fill; i++)
+	{
+		struct unix_stat_job_t *job = h->ahead[(h->ahead_head + i) % UNIX_READDIR_AHEAD];
+		if (!job->done)
 		{
-			struct ocpdir_t *n = unix_dir_steal (&s->head, dirdb_ref);
-			h->callback_dir (h->token, n);
-			n->unref (n);
+			unix_stat_submit (job);
+		}
+	}
+	pthread_mutex_unlock (&unix_stat_mutex);
+}
+
+static int unix_dir_readdir_iterate (ocpdirhandle_pt _h)
+{
+	struct unix_ocpdirhandle_t *h = _h;
+	struct unix_ocpdir_t *s = h->owner;
+	struct unix_stat_job_t *job;
+	uint32_t dirdb_ref;
+
+	unix_dir_readdir_ahead (h);
+	if (!h->ahead_fill)
+	{
+		return 0;
+	}
+	job = h->ahead[h->ahead_head];
+	h->ahead_head = (h->ahead_head + 1) % UNIX_READDIR_AHEAD;
+	h->ahead_fill--;
+
+	if (job->regular)
+	{ /* the size is filled in by the time someone asks for it */
+		struct unix_ocpfile_t *n;
+		int failed;
+
+		pthread_mutex_lock (&unix_stat_mutex);
+		failed = job->done && job->result;
+		pthread_mutex_unlock (&unix_stat_mutex);
+		if (failed)
+		{ /* file is already gone, or we are not allowed to look at it */
+			unix_stat_job_unref (job);
 			return 1;
 		}
 
-		if (S_ISREG(st.st_mode))
+		n = (struct unix_ocpfile_t *)unix_file_steal (&s->head, dirdbFindAndRef (s->head.dirdb_ref, job->name, dirdb_use_file), 0);
+		if (!n)
 		{
-			struct ocpfile_t *n = unix_file_steal (&s->head, dirdbRef (dirdb_ref, dirdb_use_file), st.st_size);
-			dirdbUnref (dirdb_ref, dirdb_use_dir);
-			h->callback_file (h->token, n);
-			n->unref (n);
+			unix_stat_job_unref (job);
 			return 1;
 		}
+		n->pending = job;
+		h->callback_file (h->token, &n->head);
+		n->head.unref (&n->head);
+		return 1;
+	}
 
-		dirdbUnref (dirdb_ref, dirdb_use_dir);
+	/* symlinks and unknown types can be either files or directories */
+	unix_stat_wait (job);
+	if (job->result)
+	{
+		unix_stat_job_unref (job);
+		return 1;
+	}
+
+	dirdb_ref = dirdbFindAndRef (s->head.dirdb_ref, job->name, dirdb_use_dir);
+
+	if (S_ISDIR(job->mode))
+	{
+		struct ocpdir_t *n = unix_dir_steal (&s->head, dirdb_ref);
+		unix_stat_job_unref (job);
+		h->callback_dir (h->token, n);
+		n->unref (n);
+		return 1;
+	}
 
+	if (S_ISREG(job->mode))
+	{
+		struct ocpfile_t *n = unix_file_steal (&s->head, dirdbRef (dirdb_ref, dirdb_use_file), job->size);
+		dirdbUnref (dirdb_ref, dirdb_use_dir);
+		unix_stat_job_unref (job);
+		h->callback_file (h->token, n);
+		n->unref (n);
 		return 1;
 	}
 
-	return 0;
+	dirdbUnref (dirdb_ref, dirdb_use_dir);
+	unix_stat_job_unref (job);
+
+	return 1;
 }
 
 static struct ocpdir_t *unix_dir_readdir_dir (struct ocpdir_t *_s, uint32_t dirdb_ref)
 {
 	struct unix_ocpdir_t *s = (struct unix_ocpdir_t *)_s;
+	char buffer[UNIX_PATH_BUFFER];
 	char *path;
 	struct stat st;
 	struct stat lst;
 
-	dirdbGetFullname_malloc (dirdb_ref, &path, DIRDB_FULLNAME_NODRIVE|DIRDB_FULLNAME_ENDSLASH);
+	path = unix_path_get (dirdb_ref, buffer, DIRDB_FULLNAME_NODRIVE|DIRDB_FULLNAME_ENDSLASH);
 	if (!path)
 	{
-		fprintf (stderr, "[filesystem unix readdir_dir]: dirdbGetFullname_malloc () failed\n");
+		fprintf (stderr, "[filesystem unix readdir_dir]: unix_path_get () failed\n");
 		return 0;
 	}
 
 	if (lstat (path, &lst))
 	{
-		free (path);
+		unix_path_free (path, buffer);
 		return 0;
 	}
 
@@ -316,14 +587,14 @@ static struct ocpdir_t *unix_dir_readdir_dir (struct ocpdir_t *_s, uint32_t dird
 	{
 		if (stat (path, &st))
 		{
-			free (path);
+			unix_path_free (path, buffer);
 			return 0;
 		}
 	} else {
 		memcpy (&st, &lst, sizeof (st));
 	}
 
-	free (path);
+	unix_path_free (path, buffer);
 
 	if (S_ISDIR(st.st_mode))
 	{
@@ -337,22 +608,23 @@ static struct ocpdir_t *unix_dir_readdir_dir (struct ocpdir_t *_s, uint32_t dird
 static struct ocpfile_t *unix_dir_readdir_file (struct ocpdir_t *_s, uint32_t dirdb_ref)
 {
 	struct unix_ocpdir_t *s = (struct unix_ocpdir_t *)_s;
+	char buffer[UNIX_PATH_BUFFER];
 	char *path;
 	struct stat st;
 	struct stat lst;
 
-	dirdbGetFullname_malloc (dirdb_ref, &path, DIRDB_FULLNAME_NODRIVE);
+	path = unix_path_get (dirdb_ref, buffer, DIRDB_FULLNAME_NODRIVE);
 	//fprintf (stderr, "   unix_dir_readdir_file \"%s\"\n", path);
 	if (!path)
 	{
-		fprintf (stderr, "[filesystem unix readdir_file]: dirdbGetFullname_malloc () failed\n");
+		fprintf (stderr, "[filesystem unix readdir_file]: unix_path_get () failed\n");
 		return 0;
 	}
 
 	if (lstat (path, &lst))
 	{
 		//fprintf (stderr, "   lstat() failed\n");
-		free (path);
+		unix_path_free (path, buffer);
 		return 0;
 	}
 
@@ -361,14 +633,14 @@ static struct ocpfile_t *unix_dir_readdir_file (struct ocpdir_t *_s, uint32_t di
 		if (stat (path, &st))
 		{
 			//fprintf (stderr, "   stat() failed\n");
-			free (path);
+			unix_path_free (path, buffer);
 			return 0;
 		}
 	} else {
 		memcpy (&st, &lst, sizeof (st));
 	}
 
-	free (path);
+	unix_path_free (path, buffer);
 
 	if (S_ISREG(st.st_mode))
 	{
@@ -391,6 +663,12 @@ static void unix_file_unref (struct ocpfile_t *_s)
 	s->head.refcount--;
 	if (!s->head.refcount)
 	{
+		if (s->pending)
+		{
+			unix_stat_wait (s->pending);
+			unix_stat_job_unref (s->pending);
+			s->pending = 0;
+		}
 		dirdbUnref (s->head.dirdb_ref, dirdb_use_file);
 		s->head.parent->unref (s->head.parent);
 		s->head.parent = 0;
@@ -401,18 +679,28 @@ static void unix_file_unref (struct ocpfile_t *_s)
 static struct ocpfilehandle_t *unix_file_open (struct ocpfile_t *_s)
 {
 	struct unix_ocpfile_t *s = (struct unix_ocpfile_t *)_s;
+	char buffer[UNIX_PATH_BUFFER];
 	char *path;
 	int fd;
 	struct unix_ocpfilehandle_t *r;
 
-	dirdbGetFullname_malloc (s->head.dirdb_ref, &path, DIRDB_FULLNAME_NODRIVE);
+	if (unix_file_filesize (&s->head) == FILESIZE_ERROR) /* the filehandle uses s->filesize directly */
+	{
+		return 0;
+	}
+
+	path = unix_path_get (s->head.dirdb_ref, buffer, DIRDB_FULLNAME_NODRIVE);
+	if (!path)
+	{
+		return 0;
+	}
 
 	fd = open (path, O_RDONLY);
 	if (fd < 0)
 	{
 		//fprintf (stderr, "[filesystem] unable to open \"%s\": %s\n", path, strerror (errno));
 	}
-	free (path);
+	unix_path_free (path, buffer);
 	if (fd < 0)
 	{
 		return 0;
@@ -440,7 +728,7 @@ static struct ocpfilehandle_t *unix_file_open (struct ocpfile_t *_s)
 		unix_filehandle_eof,
 		unix_filehandle_error,
 		unix_filehandle_read,
-	        0, /* ioctl */
+		unix_filehandle_ioctl,
 		unix_filehandle_filesize,
 		unix_filehandle_filesize_ready,
 	        0, /* filename_override */
@@ -454,12 +742,33 @@ static uint64_t unix_file_filesize (struct ocpfile_t *_s)
 {
 	struct unix_ocpfile_t *s = (struct unix_ocpfile_t *)_s;
 
+	if (s->pending)
+	{
+		unix_stat_wait (s->pending);
+		/* the entry was handed out before stat() completed, so a failure can only be reported here */
+		s->filesize = s->pending->result ? FILESIZE_ERROR : s->pending->size;
+		unix_stat_job_unref (s->pending);
+		s->pending = 0;
+	}
+
 	return s->filesize;
 }
 
 static int unix_file_filesize_ready (struct ocpfile_t *_s)
 {
-	return 1;
+	struct unix_ocpfile_t *s = (struct unix_ocpfile_t *)_s;
+	int retval;
+
+	if (!s->pending)
+	{
+		return 1;
+	}
+
+	pthread_mutex_lock (&unix_stat_mutex);
+	retval = s->pending->done;
+	pthread_mutex_unlock (&unix_stat_mutex);
+
+	return retval;
 }
 
 static void unix_filehandle_ref (struct ocpfilehandle_t *_s)
@@ -623,6 +932,19 @@ static int unix_filehandle_filesize_ready (struct ocpfilehandle_t *_s)
 	return 1;
 }
 
+static int unix_filehandle_ioctl (struct ocpfilehandle_t *_s, const char *cmd, void *ptr)
+{
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{
+		return 0;
+	}
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_THREAD_SAFE))
+	{ /* only the file descriptor, and the size that was resolved when opened */
+		return 0;
+	}
+	return -1;
+}
+
 // steals the dirdb reference
 static struct ocpdir_t *unix_dir_steal (struct ocpdir_t *parent, const uint32_t dirdb_node)
 {
@@ -735,6 +1057,18 @@ void filesystem_unix_init (void)
 
 void filesystem_unix_done (void)
 {
+	int i;
+
+	pthread_mutex_lock (&unix_stat_mutex);
+	unix_stat_shutdown = 1;
+	pthread_cond_broadcast (&unix_stat_cond);
+	pthread_mutex_unlock (&unix_stat_mutex);
+	for (i=0; i < unix_stat_threads_running; i++)
+	{
+		pthread_join (unix_stat_threads[i], 0);
+	}
+	unix_stat_threads_running = 0;
+
 	dirdbUnref (cfConfigDir_dirdbref, dirdb_use_dir);
 	cfConfigDir_dirdbref = DIRDB_NOPARENT;
 }
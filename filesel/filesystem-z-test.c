@@ -0,0 +1,443 @@
+/* unit test for filesystem-z.c */
+
+#define INPUTBUFFERSIZE 128
+#define Z_INDEX_SPAN 4096
+
+#include "filesystem-z.c"
+#include "filesystem-dir-mem.h"
+#include "filesystem-file-mem.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+void preemptive_framelock (void)
+{
+}
+
+uint32_t dirdbRef (uint32_t ref, enum dirdb_use use)
+{
+	return ref;
+}
+
+void dirdbUnref (uint32_t ref, enum dirdb_use use)
+{
+}
+
+void dirdbGetName_internalstr (uint32_t ref, const char **retval)
+{
+	*retval = 0;
+	if (ref == 1) *retval = "test1.txt.Z";
+	if (ref == 2) *retval = "test1.txt";
+	if (ref == 3) *retval = "test2.txt.Z";
+	if (ref == 4) *retval = "test2.txt";
+}
+
+void dirdbGetName_malloc (uint32_t ref, char **retval)
+{
+	const char *temp = 0;
+	dirdbGetName_internalstr (ref, &temp);
+	if (!temp)
+	{
+		*retval = 0;
+		return;
+	}
+	*retval = strdup (temp);
+}
+
+uint32_t dirdbFindAndRef (uint32_t parent, const char *name, enum dirdb_use use)
+{
+	if ((parent == 1) && (!strcmp (name, "test1.txt"))) return 2;
+	return 0;
+}
+
+struct ocpdir_t *ocpdir_t_fill_default_readdir_dir  (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_dir called?\n");
+	_exit(1);
+}
+
+struct ocpfile_t *ocpdir_t_fill_default_readdir_file (struct ocpdir_t *_self, uint32_t dirdb_ref)
+{
+	fprintf (stderr, "Dummy symbol ocpdir_t_fill_default_readdir_file called?\n");
+	_exit(1);
+}
+
+const char *ocpfile_t_fill_default_filename_override (struct ocpfile_t *file)
+{
+	return 0;
+}
+
+int ocpfilehandle_t_fill_default_ioctl (struct ocpfilehandle_t *s, const char *cmd, void *ptr)
+{
+	return -1;
+}
+
+const char *ocpfilehandle_t_fill_default_filename_override (struct ocpfilehandle_t *fh)
+{
+	return 0;
+}
+
+void register_dirdecompressor (const struct ocpdirdecompressor_t *ofd)
+{
+}
+
+struct ocpfilehandle_t *spill_filehandle_open (struct ocpfile_t *file)
+{
+	return file->open (file);
+}
+
+/* only the access-point index of test2 is remembered */
+static unsigned char *test_zix_data;
+static size_t test_zix_datasize;
+
+int adbMetaAdd (const char *filename, const size_t filesize, const char *SIG, const unsigned char  *data, const size_t  datasize)
+{
+	if (!strcmp (SIG, "ZIX") && !strcmp (filename, "test2.txt.Z"))
+	{
+		free (test_zix_data);
+		test_zix_data = malloc (datasize);
+		memcpy (test_zix_data, data, datasize);
+		test_zix_datasize = datasize;
+	}
+	return 0;
+}
+
+int adbMetaGet (const char *filename, const size_t filesize, const char *SIG,       unsigned char **data,       size_t *datasize)
+{
+	if (!strcmp (SIG, "ZIX") && !strcmp (filename, "test2.txt.Z") && test_zix_data)
+	{
+		*data = malloc (test_zix_datasize);
+		memcpy (*data, test_zix_data, test_zix_datasize);
+		*datasize = test_zix_datasize;
+		return 0;
+	}
+	return -1;
+}
+
+/* Minimal compress(1) compatible encoder, so the test data can be made on the fly. Each time the dictionary is full,
+ * it is started over with a CLEAR code. Codes are written in groups of 8, and the group is padded when the code width
+ * changes, like compress(1) does.
+ */
+struct Z_test_encoder_t
+{
+	uint8_t *dst;
+	size_t   dstlen;
+	uint8_t  group[16];
+	int      offset; /* in bits */
+	int      n_bits;
+	int      max_bits;
+	int32_t  maxcode;
+	int32_t  free_ent;
+	int32_t  keys[1 << 18]; /* hash of prefix-code << 8 | character */
+	uint16_t codes[1 << 18];
+};
+
+static void Z_test_output (struct Z_test_encoder_t *e, int32_t code, int clear)
+{
+	int i;
+
+	for (i=0; i < e->n_bits; i++)
+	{
+		if (code & (1 << i))
+		{
+			e->group[(e->offset + i) >> 3] |= 1 << ((e->offset + i) & 7);
+		}
+	}
+	e->offset += e->n_bits;
+	if (e->offset == (e->n_bits << 3))
+	{
+		memcpy (e->dst + e->dstlen, e->group, e->n_bits);
+		e->dstlen += e->n_bits;
+		memset (e->group, 0, sizeof (e->group));
+		e->offset = 0;
+	}
+	if ((e->free_ent > e->maxcode) || clear)
+	{ /* the rest of the code-group is padding */
+		if (e->offset)
+		{
+			memcpy (e->dst + e->dstlen, e->group, e->n_bits);
+			e->dstlen += e->n_bits;
+			memset (e->group, 0, sizeof (e->group));
+			e->offset = 0;
+		}
+		if (clear)
+		{
+			e->n_bits = 9;
+		} else {
+			e->n_bits++;
+		}
+		e->maxcode = (e->n_bits == e->max_bits) ? (1 << e->max_bits) : ((1 << e->n_bits) - 1);
+	}
+}
+
+/* dst must be big enough for the worst case, returns the number of bytes written */
+static size_t Z_test_compress (const uint8_t *src, size_t srclen, uint8_t *dst, int max_bits)
+{
+	struct Z_test_encoder_t *e = calloc (1, sizeof (*e));
+	int32_t ent = src[0];
+	size_t i, retval;
+
+	e->dst = dst;
+	e->dst[0] = 0x1f;
+	e->dst[1] = 0x9d;
+	e->dst[2] = BLOCK_MODE | max_bits;
+	e->dstlen = 3;
+	e->n_bits = 9;
+	e->max_bits = max_bits;
+	e->maxcode = 511;
+	e->free_ent = FIRST;
+	memset (e->keys, 0xff, sizeof (e->keys));
+
+	for (i=1; i < srclen; i++)
+	{
+		int32_t key = (ent << 8) | src[i];
+		uint32_t h = ((uint32_t)key * 2654435761u) >> 14;
+
+		while ((e->keys[h] >= 0) && (e->keys[h] != key))
+		{
+			h = (h + 1) & ((1 << 18) - 1);
+		}
+		if (e->keys[h] == key)
+		{
+			ent = e->codes[h];
+			continue;
+		}
+		Z_test_output (e, ent, 0);
+		ent = src[i];
+		if (e->free_ent < (1 << max_bits))
+		{
+			e->keys[h] = key;
+			e->codes[h] = e->free_ent++;
+		} else {
+			Z_test_output (e, CLEAR, 1);
+			e->free_ent = FIRST;
+			memset (e->keys, 0xff, sizeof (e->keys));
+		}
+	}
+	Z_test_output (e, ent, 0);
+	if (e->offset)
+	{
+		memcpy (e->dst + e->dstlen, e->group, (e->offset + 7) >> 3);
+		e->dstlen += (e->offset + 7) >> 3;
+	}
+	retval = e->dstlen;
+	free (e);
+	return retval;
+}
+
+/* 0x4000 lines of "%04x\n" */
+static uint8_t *Z_test_plain (void)
+{
+	uint8_t *plain = malloc (0x4000 * 5 + 1); /* sprintf() terminates the last line */
+	int i;
+
+	for (i=0; i < 0x4000; i++)
+	{
+		sprintf ((char *)plain + i * 5, "%04x\n", i);
+	}
+	return plain;
+}
+
+int Z_test1 (void)
+{
+	const int bits[] = {12, 16};
+	uint8_t *plain = Z_test_plain ();
+	char dst[1000];
+	int retval = 0;
+	int i;
+
+	printf ("Testing linear decompression, 12 and 16 bits codes:  ");
+
+	for (i=0; i < sizeof (bits) / sizeof (bits[0]); i++)
+	{
+		uint8_t *dsrc = malloc (0x4000 * 10);
+		size_t dsrcsize = Z_test_compress (plain, 0x4000 * 5, dsrc, bits[i]);
+		struct ocpdir_t *test_dir;
+		struct ocpfile_t *osrc;
+		struct ocpdir_t *oddst;
+		struct ocpfile_t *odst;
+		struct ocpfilehandle_t *hdst;
+		int pos = 0;
+
+		test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+		osrc = mem_file_open (test_dir, 1, (char *)dsrc, dsrcsize);
+		test_dir->unref (test_dir); test_dir = 0;
+
+		oddst = Z_check_steal (osrc, 2);
+		odst = oddst->readdir_file(oddst, 2);
+		hdst = odst->open (odst);
+
+		while (1)
+		{
+			int fill = hdst->read (hdst, dst, sizeof (dst));
+			if (fill <= 0)
+			{
+				break;
+			}
+			if (((pos + fill) > 0x4000 * 5) || memcmp (dst, plain + pos, fill))
+			{
+				printf ("d");
+				retval |= 2;
+				break;
+			}
+			pos += fill;
+		}
+		if (pos != 0x4000 * 5)
+		{
+			printf ("s");
+			retval |= 1;
+		} else {
+			printf ("%d", i + 1);
+		}
+
+		hdst->unref (hdst); hdst = 0;
+		oddst->unref (oddst); oddst = 0;
+		odst->unref (odst); odst = 0;
+		osrc->unref (osrc); osrc = 0;
+	}
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (plain);
+
+	return retval;
+}
+
+int Z_test2 (void)
+{
+	const uint32_t offsets[] = {0x3f00, 0x0010, 0x2345, 0x3ffe, 0x1000, 0x0c31};
+	uint8_t *plain = Z_test_plain ();
+	uint8_t *dsrc = malloc (0x4000 * 10);
+	size_t dsrcsize;
+	int retval = 0;
+	struct ocpdir_t *test_dir;
+	struct ocpfile_t *osrc;
+	struct ocpdir_t *oddst;
+	struct ocpfile_t *odst;
+	struct ocpfilehandle_t *hdst;
+	char dst[5];
+	int i, pass;
+
+	printf ("Testing seek and reads using CLEAR code access-points:  ");
+
+	/* 10 bits codes fill the dictionary fast, so there is a CLEAR code every few hundred bytes */
+	dsrcsize = Z_test_compress (plain, 0x4000 * 5, dsrc, 10);
+	free (plain);
+
+	for (pass=0; pass < 2; pass++)
+	{
+		uint8_t *dsrc2 = malloc (dsrcsize);
+		memcpy (dsrc2, dsrc, dsrcsize);
+		test_dir = ocpdir_mem_getdir_t(ocpdir_mem_alloc (0, "test:"));
+		osrc = mem_file_open (test_dir, 3, (char *)dsrc2, dsrcsize);
+		test_dir->unref (test_dir); test_dir = 0;
+
+		oddst = Z_check_steal (osrc, 4);
+		odst = oddst->readdir_file(oddst, 4);
+		hdst = odst->open (odst);
+
+		if (!pass)
+		{ /* the first pass builds the index by reading the whole file */
+			for (i=0; i < 0x4000; i++)
+			{
+				if ((hdst->read (hdst, dst, 5) != 5) || (strtol (dst, 0, 16) != i))
+				{
+					printf ("r");
+					retval |= 1;
+					break;
+				}
+			}
+			if (hdst->read (hdst, dst, 5) != 0)
+			{
+				printf ("e");
+				retval |= 1;
+			}
+			if (((struct Z_ocpdir_t *)oddst)->child.points_count < 4)
+			{
+				printf ("p");
+				retval |= 2;
+			}
+		} else { /* the second pass should have the index loaded from the metadata */
+			if (((struct Z_ocpdir_t *)oddst)->child.points_count < 4)
+			{
+				printf ("l");
+				retval |= 2;
+			}
+		}
+
+		for (i=0; i < sizeof (offsets) / sizeof (offsets[0]); i++)
+		{
+			char expect[6];
+			sprintf (expect, "%04x\n", offsets[i]);
+			if (hdst->seek_set (hdst, offsets[i] * 5))
+			{
+				printf ("s");
+				retval |= 4;
+				continue;
+			}
+			/* a zero length read only positions the decoder, at an access-point or at the start */
+			hdst->read (hdst, dst, 0);
+			if ((offsets[i] * 5 >= 2 * Z_INDEX_SPAN) && (((struct Z_ocpfilehandle_t *)hdst)->realpos == 0))
+			{ /* did not make use of any access-point */
+				printf ("i");
+				retval |= 16;
+			} else if (hdst->read (hdst, dst, 5) != 5)
+			{
+				printf ("r");
+				retval |= 4;
+			} else if (memcmp (dst, expect, 5))
+			{
+				printf ("d");
+				retval |= 8;
+			} else {
+				printf ("%d", pass * 6 + i + 1);
+			}
+		}
+
+		hdst->unref (hdst); hdst = 0;
+		oddst->unref (oddst); oddst = 0;
+		odst->unref (odst); odst = 0;
+		osrc->unref (osrc); osrc = 0;
+
+		if ((!pass) && (!test_zix_data))
+		{
+			printf ("m");
+			retval |= 2;
+		}
+	}
+
+	if (retval)
+	{
+		printf (ANSI_COLOR_RED " Failed" ANSI_COLOR_RESET "\n");
+	} else {
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	free (dsrc);
+	free (test_zix_data);
+	test_zix_data = 0;
+
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	printf ( ANSI_COLOR_CYAN "Testing Z" ANSI_COLOR_RESET "\n");
+	retval |= Z_test1 ();
+	retval |= Z_test2 ();
+	printf ("\n");
+
+	return retval;
+}
@@ -27,6 +27,7 @@
 #include "dirdb.h"
 #include "filesystem.h"
 #include "filesystem-z.h"
+#include "filesystem-spill.h"
 #include "stuff/framelock.h"
 
 #ifndef INPUTBUFFERSIZE
@@ -49,6 +50,12 @@ static int do_Z_debug_print=1;
 #define VERBOSE_PRINT(...) {}
 #endif
 
+#ifndef Z_INDEX_SPAN
+# define Z_INDEX_SPAN (1024*1024) /* minimum distance between each access-point in the uncompressed stream */
+#endif
+
+#define Z_INDEX_VERSION 1
+
 #include "z-unlzw.c"
 
 struct Z_ocpfilehandle_t
@@ -60,9 +67,11 @@ struct Z_ocpfilehandle_t
 	uint8_t inputbuffer[INPUTBUFFERSIZE];
 	uint8_t *input_next;
 	int      input_len;
+	uint64_t input_offset; /* position of inputbuffer[0] in the compressed file */
 
 	struct lzw_handle_t handle;
 	int initialized;
+	int flushed; /* the compressed file has ended, and the last (partial) code-group has been handed to the decoder */
 
 	struct Z_ocpfile_t *owner;
 
@@ -72,6 +81,13 @@ struct Z_ocpfilehandle_t
 	int error;
 };
 
+/* LZW restarts with an empty dictionary after each CLEAR code, so a position in each stream is all that is needed to resume from there */
+struct Z_accesspoint_t
+{
+	uint64_t out; /* position in the uncompressed stream */
+	uint64_t in;  /* position of the first code-group after CLEAR in the compressed stream */
+};
+
 struct Z_ocpfile_t /* head->parent always point to a Z_ocpdir_t */
 {
 	struct ocpfile_t      head;
@@ -79,6 +95,12 @@ struct Z_ocpfile_t /* head->parent always point to a Z_ocpdir_t */
 
 	int                   filesize_pending;
 	uint64_t uncompressed_filesize;
+
+	struct Z_accesspoint_t *points; /* sorted by out */
+	int                     points_count;
+	int                     points_size;
+	int                     points_loaded; /* have we checked adbMeta yet? */
+	int                     points_dirty;  /* new access-points not yet stored in adbMeta */
 };
 
 struct Z_ocpdir_t
@@ -94,6 +116,7 @@ static int Z_ocpfilehandle_compressInit (struct Z_ocpfilehandle_t *s)
 	unlzw_init (&s->handle);
 
 	s->initialized = 1;
+	s->flushed = 0;
 
 	s->error = 0;
 	s->realpos = 0;
@@ -112,6 +135,7 @@ static int Z_ocpfilehandle_compressInit (struct Z_ocpfilehandle_t *s)
 	}
 	s->input_next = s->inputbuffer;
 	s->input_len = retval;
+	s->input_offset = 0;
 
 	if (s->input_len <= 2)
 	{
@@ -129,6 +153,221 @@ static int Z_ocpfilehandle_compressInit (struct Z_ocpfilehandle_t *s)
 	return 0;
 }
 
+static int Z_ocpfilehandle_restore (struct Z_ocpfilehandle_t *s, const struct Z_accesspoint_t *p)
+{
+	uint8_t header[3];
+	int retval;
+
+	s->initialized = 0;
+	s->flushed = 0;
+	s->error = 0;
+
+	if ((s->compressedfilehandle->seek_set (s->compressedfilehandle, 0) < 0) ||
+	    (s->compressedfilehandle->read (s->compressedfilehandle, header, 3) != 3) ||
+	    memcmp (header, LZW_MAGIC, 2))
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	if (unlzw_resume_after_clear (&s->handle, header[2]))
+	{
+		s->error = 1;
+		return -1;
+	}
+
+	if (s->compressedfilehandle->seek_set (s->compressedfilehandle, p->in) < 0)
+	{
+		s->error = 1;
+		return -1;
+	}
+	retval = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
+	if (retval <= 0)
+	{
+		s->error = 1;
+		return -1;
+	}
+	s->input_next = s->inputbuffer;
+	s->input_len = retval;
+	s->input_offset = p->in;
+
+	s->realpos = p->out;
+	s->initialized = 1;
+
+	DEBUG_PRINT ("[Z restore] out=%"PRIu64" in=%"PRIu64"\n", p->out, p->in);
+
+	return 0;
+}
+
+/* returns the last access-point at or before pos */
+static const struct Z_accesspoint_t *Z_ocpfile_accesspoint_find (struct Z_ocpfile_t *s, uint64_t pos)
+{
+	int lo = 0, hi = s->points_count;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (s->points[mid].out <= pos)
+		{
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? &s->points[lo - 1] : 0;
+}
+
+/* called when the decoder has just digested a CLEAR code */
+static void Z_ocpfilehandle_accesspoint_add (struct Z_ocpfilehandle_t *s)
+{
+	struct Z_ocpfile_t *o = s->owner;
+	uint64_t in = s->input_offset + (s->input_next - s->inputbuffer);
+
+	if (s->realpos < (o->points_count ? o->points[o->points_count - 1].out : 0) + Z_INDEX_SPAN)
+	{
+		return;
+	}
+
+	if (o->points_count >= o->points_size)
+	{
+		struct Z_accesspoint_t *temp = realloc (o->points, (o->points_size + 64) * sizeof (o->points[0]));
+		if (!temp)
+		{
+			return;
+		}
+		o->points = temp;
+		o->points_size += 64;
+	}
+	o->points[o->points_count].out = s->realpos;
+	o->points[o->points_count].in = in;
+	o->points_count++;
+	o->points_dirty = 1;
+
+	DEBUG_PRINT ("[Z accesspoint_add] out=%"PRIu64" in=%"PRIu64"\n", s->realpos, in);
+}
+
+static void Z_ocpfile_index_clear (struct Z_ocpfile_t *s)
+{
+	free (s->points);
+	s->points = 0;
+	s->points_count = 0;
+	s->points_size = 0;
+	s->points_dirty = 0;
+}
+
+/* ZIX metadata: version:8, count:32, and count * { out:64 in:64 }, all little-endian */
+static void Z_ocpfile_index_load (struct Z_ocpfile_t *s)
+{
+	unsigned char *metadata = 0;
+	size_t metadatasize = 0;
+	const char *filename = 0;
+	uint32_t count, i;
+
+	if (s->points_loaded)
+	{
+		return;
+	}
+	if (!s->compressedfile->filesize_ready (s->compressedfile))
+	{
+		return;
+	}
+	s->points_loaded = 1;
+
+	dirdbGetName_internalstr (s->compressedfile->dirdb_ref, &filename);
+
+	if (adbMetaGet (filename, s->compressedfile->filesize (s->compressedfile), "ZIX", &metadata, &metadatasize))
+	{
+		return;
+	}
+
+	if ((metadatasize < 5) || (metadata[0] != Z_INDEX_VERSION))
+	{
+		free (metadata);
+		return;
+	}
+	count = metadata[1] | (metadata[2] << 8) | (metadata[3] << 16) | ((uint32_t)metadata[4] << 24);
+	if ((!count) || ((metadatasize - 5) / 16 != count) || ((metadatasize - 5) % 16))
+	{
+		free (metadata);
+		return;
+	}
+
+	s->points = malloc (count * sizeof (s->points[0]));
+	if (!s->points)
+	{
+		free (metadata);
+		return;
+	}
+	s->points_size = count;
+
+	for (i=0; i < count; i++)
+	{
+		const unsigned char *m = metadata + 5 + i * 16;
+		uint64_t out = 0, in = 0;
+		int j;
+
+		for (j=7; j >= 0; j--)
+		{
+			out = (out << 8) | m[j];
+			in  = (in  << 8) | m[8 + j];
+		}
+		if (i && (out <= s->points[i - 1].out))
+		{
+			Z_ocpfile_index_clear (s);
+			free (metadata);
+			return;
+		}
+		s->points[i].out = out;
+		s->points[i].in = in;
+		s->points_count++;
+	}
+	free (metadata);
+
+	DEBUG_PRINT ("[Z index_load] %s: %d access-points\n", filename, s->points_count);
+}
+
+static void Z_ocpfile_index_save (struct Z_ocpfile_t *s, struct ocpfilehandle_t *compressedfilehandle)
+{
+	const char *filename = 0;
+	unsigned char *metadata;
+	size_t metadatasize = 5 + 16 * s->points_count;
+	int i, j;
+
+	if (!s->points_dirty)
+	{
+		return;
+	}
+	s->points_dirty = 0;
+
+	metadata = malloc (metadatasize);
+	if (!metadata)
+	{
+		return;
+	}
+
+	metadata[0] = Z_INDEX_VERSION;
+	metadata[1] = s->points_count;
+	metadata[2] = s->points_count >> 8;
+	metadata[3] = s->points_count >> 16;
+	metadata[4] = s->points_count >> 24;
+	for (i=0; i < s->points_count; i++)
+	{
+		unsigned char *m = metadata + 5 + i * 16;
+		for (j=0; j < 8; j++)
+		{
+			m[j]     = s->points[i].out >> (j * 8);
+			m[8 + j] = s->points[i].in  >> (j * 8);
+		}
+	}
+
+	dirdbGetName_internalstr (compressedfilehandle->dirdb_ref, &filename);
+	DEBUG_PRINT ("[Z index_save] adbMetaAdd(%s, %"PRIu64", ZIX, %d access-points)\n", filename, compressedfilehandle->filesize (compressedfilehandle), s->points_count);
+	adbMetaAdd (filename, compressedfilehandle->filesize (compressedfilehandle), "ZIX", metadata, metadatasize);
+
+	free (metadata);
+}
+
 static void Z_ocpfilehandle_ref (struct ocpfilehandle_t *_s)
 {
 	struct Z_ocpfilehandle_t *s = (struct Z_ocpfilehandle_t *)_s;
@@ -150,6 +389,9 @@ static void Z_ocpfilehandle_unref (struct ocpfilehandle_t *_s)
 
 	if (s->compressedfilehandle)
 	{
+		/* a partial index is still useful, for instance when only the first members of a tar archive has been visited */
+		Z_ocpfile_index_save (s->owner, s->compressedfilehandle);
+
 		s->compressedfilehandle->unref (s->compressedfilehandle);
 		s->compressedfilehandle = 0;
 	}
@@ -281,15 +523,21 @@ static int Z_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
 	int retval = 0;
 	int recall = 0;
 	int eofhit = 0;
-	int eofhit2 = 0;
 
-	/* do we need to reverse? */
-	if ((s->pos < s->realpos) || (!s->initialized))
+	/* do we need to reverse, or can an access-point get us closer? */
 	{
-		if (Z_ocpfilehandle_compressInit (s))
+		const struct Z_accesspoint_t *p = Z_ocpfile_accesspoint_find (s->owner, s->pos);
+
+		if ((s->pos < s->realpos) || (!s->initialized) || (p && (p->out > s->realpos)))
 		{
-			s->error = 1;
-			return -1;
+			if ((!p) || Z_ocpfilehandle_restore (s, p))
+			{
+				if (Z_ocpfilehandle_compressInit (s))
+				{
+					s->error = 1;
+					return -1;
+				}
+			}
 		}
 	}
 
@@ -338,10 +586,20 @@ static int Z_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
 		{
 			continue;
 		}
-		eofhit2 = eofhit;
+		if (s->handle.cleared)
+		{
+			s->handle.cleared = 0;
+			Z_ocpfilehandle_accesspoint_add (s);
+		}
 
 		if (!s->input_len)
 		{
+			if (s->flushed)
+			{
+				eofhit = 1;
+				break;
+			}
+			s->input_offset = s->compressedfilehandle->getpos (s->compressedfilehandle);
 			s->input_next = s->inputbuffer;
 			s->input_len = s->compressedfilehandle->read (s->compressedfilehandle, s->inputbuffer, INPUTBUFFERSIZE);
 			if (s->compressedfilehandle->error (s->compressedfilehandle))
@@ -350,24 +608,20 @@ static int Z_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
 				return -1;
 			}
 			if (!s->input_len)
-			{
-				eofhit = 1;
-				break;
+			{ /* the last code-group is usually not complete, digest what is left of it, only once */
+				unlzw_flush (&s->handle);
+				s->flushed = 1;
+				continue;
 			}
 		}
 
-		if (eofhit)
+		ret = unlzw_feed (&s->handle, *s->input_next);
+		s->input_next++;
+		s->input_len--;
+		if (ret < 0)
 		{
-			unlzw_flush (&s->handle);
-		} else {
-			ret = unlzw_feed (&s->handle, *s->input_next);
-			s->input_next++;
-			s->input_len--;
-			if (ret < 0)
-			{
-				s->error = 1;
-				return -1;
-			}
+			s->error = 1;
+			return -1;
 		}
 
 		if (!recall) /* yield ? */
@@ -378,7 +632,7 @@ static int Z_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
 		recall--;
 	}
 
-	if (eofhit && eofhit2 && (s->handle.bufferfill < s->handle.n_bits))
+	if (eofhit && (s->handle.bufferfill < s->handle.n_bits))
 	{
 		uint64_t filesize = s->realpos;
 
@@ -405,6 +659,8 @@ static int Z_ocpfilehandle_read (struct ocpfilehandle_t *_s, void *dst, int len)
 			DEBUG_PRINT ("[Z filehandle_read EOF] adbMetaAdd(%s, %"PRId64", Z, [%02x %02x %02x %02x %02x %02x %02x %02x] %"PRIu64"\n", filename, compressedfile_size, buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7], filesize);
 			adbMetaAdd (filename, compressedfile_size, "Z", buffer, 8);
 		}
+
+		Z_ocpfile_index_save (s->owner, s->compressedfilehandle);
 	}
 
 	return retval;
@@ -462,7 +718,7 @@ static struct ocpfilehandle_t *Z_ocpfile_open (struct ocpfile_t *_s)
 	retval->owner = s;
 	s->head.ref (&s->head);
 
-	retval->compressedfilehandle = s->compressedfile->open (s->compressedfile);
+	retval->compressedfilehandle = spill_filehandle_open (s->compressedfile);
 
 	if (!retval->compressedfilehandle)
 	{
@@ -473,6 +729,8 @@ static struct ocpfilehandle_t *Z_ocpfile_open (struct ocpfile_t *_s)
 
 	retval->head.refcount = 1;
 
+	Z_ocpfile_index_load (s);
+
 	return &retval->head;
 }
 
@@ -544,7 +802,7 @@ static uint64_t Z_ocpfile_filesize (struct ocpfile_t *_s)
 	}
 
 /* Second, we decompress the wole thing... */
-	h = s->compressedfile->open (s->compressedfile);
+	h = spill_filehandle_open (s->compressedfile);
 	if (!h)
 	{
 		return FILESIZE_ERROR;
@@ -688,6 +946,8 @@ static void Z_dir_unref (struct ocpdir_t *self)
 		s->child.compressedfile = 0;
 	}
 
+	Z_ocpfile_index_clear (&s->child);
+
 	s->head.parent->unref (s->head.parent);
 	s->head.parent = 0;
 
@@ -22,14 +22,15 @@
 #include "config.h"
 #include <assert.h>
 #include <errno.h>
-#include <iconv.h>
 #include <stdlib.h>
 #include <string.h>
 #include "types.h"
 #include "adbmeta.h"
 #include "dirdb.h"
 #include "filesystem.h"
+#include "filesystem-charset.h"
 #include "filesystem-zip.h"
+#include "filesystem-spill.h"
 
 #if defined(ZIP_DEBUG) || defined(ZIP_VERBOSE)
 static int do_zip_debug_print=1;
@@ -138,7 +139,7 @@ struct zip_instance_t
 	struct ocpfile_t            *archive_file;
 	struct ocpfilehandle_t      *archive_filehandle;
 
-	iconv_t                     *iconv_handle;
+	struct charset_translate_t   translate;
 	char                        *charset_override;  /* either NULL, or an override string */
 
 	int                          refcount;
@@ -494,7 +495,7 @@ static int zip_ensure_disk (struct zip_instance_t *self, uint32_t Disk)
 			self->archive_filehandle->unref (self->archive_filehandle);
 			self->archive_filehandle = 0;
 		}
-		self->archive_filehandle = self->DiskReference[Disk]->open (self->DiskReference[Disk]);
+		self->archive_filehandle = spill_filehandle_open (self->DiskReference[Disk]);
 		self->Number_of_this_disk = Disk;
 	}
 
@@ -831,7 +832,7 @@ static int zip_scan (struct zip_instance_t *self)
 
 	/* we should not have done ANY I/O until this point */
 	assert (!self->archive_filehandle);
-	self->archive_filehandle = self->archive_file->open (self->archive_file);
+	self->archive_filehandle = spill_filehandle_open (self->archive_file);
 	if (!self->archive_filehandle)
 	{
 		free (buffer);
@@ -1112,7 +1113,7 @@ static struct ocpdir_t *zip_check (const struct ocpdirdecompressor_t *self, stru
 	iter->Number_of_this_disk = UINT32_MAX;
 
 	iter->next = zip_root;
-	iter->iconv_handle = (iconv_t *)-1;
+	charset_translate_init (&iter->translate);
 	zip_root = iter;
 
 	/* filesize_ready() logic we ignore, since we must seek to the end of the file */
@@ -1887,17 +1888,37 @@ static int zip_filehandle_read_inflate (struct ocpfilehandle_t *_self, void *dst
 			}
 			continue;
 		}
-		DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate digest\n");
+		if ((self->curpos == self->filepos) && (len >= ZIP_INFLATE_DIRECT_MINIMUM))
+		{ /* large read, no need to go via out_buffer */
+			DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate digest_direct %d\n", len);
 
-		res = zip_inflate_digest (self->inflate_io);
-		DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate res=%d out_buffer_fill=%d\n", (int)res, (int)self->inflate_io->out_buffer_fill);
-		if (res < 0)
-		{
-			self->error = 1;
-			return -1;
-		} else if (res > 0)
-		{
-			continue;
+			res = zip_inflate_digest_direct (self->inflate_io, dst, len);
+			if (res < 0)
+			{
+				self->error = 1;
+				return -1;
+			} else if (res > 0)
+			{
+				len -= res;
+				dst = (uint8_t *)dst + res;
+				self->curpos += res;
+				self->filepos += res;
+				retval += res;
+				continue;
+			}
+		} else {
+			DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate digest\n");
+
+			res = zip_inflate_digest (self->inflate_io);
+			DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate res=%d out_buffer_fill=%d\n", (int)res, (int)self->inflate_io->out_buffer_fill);
+			if (res < 0)
+			{
+				self->error = 1;
+				return -1;
+			} else if (res > 0)
+			{
+				continue;
+			}
 		}
 
 		if (!self->in_buffer_fill)
@@ -1911,7 +1932,7 @@ static int zip_filehandle_read_inflate (struct ocpfilehandle_t *_self, void *dst
 
 		DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate feed in_buffer_fill=%d\n", (int)self->in_buffer_fill);
 		res = zip_inflate_feed (self->inflate_io, self->in_buffer_readnext, self->in_buffer_fill);
-		self->in_buffer_fill = 0; /* all the buffers has been given to the beast */
+		self->in_buffer_fill = 0; /* all the buffers has been given to the beast, digest will consume it */
 		if (res < 0)
 		{
 			DEBUG_PRINT ("[ZIP] zip_filehandle_read_inflate feed FAILED\n");
@@ -2351,122 +2372,24 @@ static const char *zip_get_byuser_string (struct ocpdir_t *_self)
 
 static void zip_translate_prepare (struct zip_instance_t *self)
 {
-	const char *target;
-	char *temp;
-	target = self->charset_override ? self->charset_override : "CP437";
+	const char *filename = 0;
 
 	DEBUG_PRINT ("zip_translate_prepare %s\n", self->charset_override ? self->charset_override : "(NULL) CP437");
 
-	if (self->iconv_handle != (iconv_t)-1)
-	{
-		iconv_close (self->iconv_handle);
-		self->iconv_handle = (iconv_t)-1;
-	}
-
-	temp = malloc (strlen (target) + 11);
-	if (temp)
-	{
-		sprintf (temp, "%s//TRANSLIT", target);
-		self->iconv_handle = iconv_open ("UTF-8", temp);
-		free (temp);
-		temp = 0;
-	}
-	if (self->iconv_handle == (iconv_t)-1)
-	{
-		self->iconv_handle = iconv_open ("UTF-8", target);
-	}
+	dirdbGetName_internalstr (self->archive_file->dirdb_ref, &filename);
+	charset_translate_prepare (&self->translate, self->charset_override ? self->charset_override : "CP437", filename, self->archive_file->filesize (self->archive_file), "ZIPNAMES");
 }
 
 static void zip_translate_complete (struct zip_instance_t *self)
 {
 	DEBUG_PRINT ("zip_translate_complete\n");
 
-	if (self->iconv_handle != (iconv_t)-1)
-	{
-		iconv_close (self->iconv_handle);
-		self->iconv_handle = (iconv_t)-1;
-	}
+	charset_translate_complete (&self->translate);
 }
 
 static void zip_translate (struct zip_instance_t *self, char *src, char **buffer, int *buffersize)
 {
-	char *temp;
-	size_t srclen;
-
-	char *dst = *buffer;
-	size_t dstlen = *buffersize;
-
-	DEBUG_PRINT ("zip_translate %s =>", src);
-
-	temp = rindex (src, '/');
-	if (temp)
-	{
-		src = temp + 1;
-	}
-	srclen = strlen (src);
-
-	if (!self->iconv_handle)
-	{
-		*buffer = strdup (src);
-		*buffersize = *buffer ? strlen (*buffer) : 0;
-		return;
-	}
-
-	iconv (self->iconv_handle, 0, 0, 0, 0);
-
-	while (srclen)
-	{
-		if (dstlen <= 10)
-		{
-			int oldofs = dst - (*buffer);
-			*buffersize += 32;
-			char *temp = realloc (*buffer, *buffersize);
-			if (!temp)
-			{
-				*buffersize -= 32;
-				fprintf (stderr, "zip_translate: out of memory\n");
-				free (*buffer);
-				*buffer = 0;
-				*buffersize = 0;
-				return;
-			}
-			*buffer = temp;
-			dst = temp + oldofs;
-			dstlen += 32;
-		}
-
-		if (iconv (self->iconv_handle, &src, &srclen, &dst, &dstlen) == (size_t)-1)
-		{
-			if (errno != E2BIG)
-			{
-				src++;
-				srclen--;
-			}
-		}
-	}
-
-	if (dstlen <= 10)
-	{
-		int oldofs = dst - (*buffer);
-		*buffersize += 32;
-		char *temp = realloc (*buffer, *buffersize);
-		if (!temp)
-		{
-			*buffersize -= 32;
-			fprintf (stderr, "zip_translate: out of memory\n");
-			free (*buffer);
-			*buffer = 0;
-			*buffersize = 0;
-			return;
-		}
-		*buffer = temp;
-		dst = temp + oldofs;
-		dstlen += 32;
-	}
-
-	*dst = 0;
-
-	DEBUG_PRINT ("%s\n", *buffer);
+	charset_translate (&self->translate, src, buffer, buffersize);
 }
 
 
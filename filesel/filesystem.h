@@ -143,6 +143,8 @@ struct ocpfilehandle_t
 	int (*read)(struct ocpfilehandle_t *, void *dst, int len); /* returns 0 or the number of bytes read - short reads only happens if EOF or error is hit! */
 
 	int (*ioctl)(struct ocpfilehandle_t *, const char *cmd, void *ptr);
+#define IOCTL_FILEHANDLE_RANDOM_ACCESS "FILEHANDLE_RANDOM_ACCESS" /* returns 0 if any position can be reached without decoding the data in front of it, ptr is not used */
+#define IOCTL_FILEHANDLE_THREAD_SAFE "FILEHANDLE_THREAD_SAFE" /* returns 0 if the handle shares no state with other handles, so one other thread may use it, ptr is not used */
 
 // can be FILESIZE_STREAM
 	uint64_t (*filesize)(struct ocpfilehandle_t *); // can be FILESIZE_STREAM
@@ -52,9 +52,19 @@ static int fsReadInfo(struct moduleinfostruct *m, struct ocpfilehandle_t *fp, co
 		strcpy(m->title, "openCP dirdb/medialib: db v1");
 	if (!memcmp(buf, dirdbsigv2, sizeof(dirdbsigv2)))
 		strcpy(m->title, "openCP dirdb/medialib: db v2");
+	if (!memcmp(buf, dirdbsigv3, sizeof(dirdbsigv3)))
+		strcpy(m->title, "openCP dirdb/medialib: db v3");
 	if (!memcmp(buf, "Cubic Player MusicBrainz Data Base\x1B\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 64))
 		strcpy(m->title, "openCP MusicBrainz Data Base");
 	return 0;
 }
 
-struct mdbreadinforegstruct fsReadInfoReg = {"DataBases", fsReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig fsReadInfoSigs[] =
+{
+	{0, 15, "CPArchiveCache\x1b"},
+	{0, 15, "OCPArchiveMeta\x1b"},
+	{0, 13, "Cubic Player "}, /* mdb, dirdb and musicbrainz */
+	{0, 0}
+};
+
+struct mdbreadinforegstruct fsReadInfoReg = {"DataBases", fsReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(fsReadInfoSigs, 0)};
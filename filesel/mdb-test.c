@@ -4,8 +4,21 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+/* the real system calls, for tests that needs a real file */
+static int real_open (const char *pathname, int flags, mode_t mode) { return open (pathname, flags, mode); }
+static int real_close (int fd) { return close (fd); }
+static ssize_t real_read (int fd, void *buf, size_t size) { return read (fd, buf, size); }
+static off_t real_lseek (int fd, off_t offset, int whence) { return lseek (fd, offset, whence); }
+static ssize_t real_pwrite (int fd, const void *buf, size_t size, off_t offset) { return pwrite (fd, buf, size, offset); }
+static int real_posix_fallocate (int fd, off_t offset, off_t len) { return posix_fallocate (fd, offset, len); }
+static void *real_mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset) { return mmap (addr, length, prot, flags, fd, offset); }
+static int real_munmap (void *addr, size_t length) { return munmap (addr, length); }
+static int real_msync (void *addr, size_t length, int flags) { return msync (addr, length, flags); }
+
 #ifdef read
 # undef read
 #endif
@@ -24,12 +37,32 @@
 #ifdef flock
 # undef flock
 #endif
+#ifdef pwrite
+# undef pwrite
+#endif
+#ifdef posix_fallocate
+# undef posix_fallocate
+#endif
+#ifdef mmap
+# undef mmap
+#endif
+#ifdef munmap
+# undef munmap
+#endif
+#ifdef msync
+# undef msync
+#endif
 #define read mdb_test_read
 #define write mdb_test_write
 #define open mdb_test_open
 #define close mdb_test_close
 #define lseek mdb_test_lseek
 #define flock mdb_test_flock
+#define pwrite mdb_test_pwrite
+#define posix_fallocate mdb_test_posix_fallocate
+#define mmap mdb_test_mmap
+#define munmap mdb_test_munmap
+#define msync mdb_test_msync
 
 static ssize_t mdb_test_read (int fd, void *buf, size_t size);
 static ssize_t mdb_test_write (int fd, void *buf, size_t size);
@@ -37,6 +70,11 @@ static int mdb_test_open(const char *pathname, int flags, ...);
 static off_t mdb_test_lseek (int fd, off_t offset, int whence);
 static int mdb_test_close (int fd); 
 static int mdb_test_flock (int fd, int operation);
+static ssize_t mdb_test_pwrite (int fd, const void *buf, size_t size, off_t offset);
+static int mdb_test_posix_fallocate (int fd, off_t offset, off_t len);
+static void *mdb_test_mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+static int mdb_test_munmap (void *addr, size_t length);
+static int mdb_test_msync (void *addr, size_t length, int flags);
 
 #include "mdb.c"
 #include "../stuff/compat.c"
@@ -50,6 +88,11 @@ static int (*mdb_test_open_hook) (const char *pathname, int flags, mode_t mode)
 static off_t (*mdb_test_lseek_hook) (int fd, off_t offset, int whence) = 0;
 static int (*mdb_test_close_hook) (int fd) = 0;
 static int (*mdb_test_flock_hook) (int fd, int operation) = 0;
+static ssize_t (*mdb_test_pwrite_hook) (int fd, const void *buf, size_t size, off_t offset) = 0;
+static int (*mdb_test_posix_fallocate_hook) (int fd, off_t offset, off_t len) = 0;
+static void *(*mdb_test_mmap_hook) (void *addr, size_t length, int prot, int flags, int fd, off_t offset) = 0;
+static int (*mdb_test_munmap_hook) (void *addr, size_t length) = 0;
+static int (*mdb_test_msync_hook) (void *addr, size_t length, int flags) = 0;
 
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
@@ -112,12 +155,53 @@ static int mdb_test_flock (int fd, int operation)
 	_exit(1);
 }
 
+static ssize_t mdb_test_pwrite (int fd, const void *buf, size_t size, off_t offset)
+{
+	if (mdb_test_pwrite_hook) return mdb_test_pwrite_hook (fd, buf, size, offset);
+	/* tests without a pwrite hook, emulate it using the lseek and write hooks */
+	if (mdb_test_lseek (fd, offset, SEEK_SET) != offset)
+	{
+		return -1;
+	}
+	return mdb_test_write (fd, (void *)buf, size);
+}
+
+static int mdb_test_posix_fallocate (int fd, off_t offset, off_t len)
+{
+	if (mdb_test_posix_fallocate_hook) return mdb_test_posix_fallocate_hook (fd, offset, len);
+	fprintf (stderr, ANSI_COLOR_RED "Unexepected posix_fallocate() call\n" ANSI_COLOR_RESET);
+	_exit(1);
+}
+
+static void *mdb_test_mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	if (mdb_test_mmap_hook) return mdb_test_mmap_hook (addr, length, prot, flags, fd, offset);
+	/* the virtual devices used by most tests can not be mapped, mdb.c should fall back to malloc() */
+	errno = ENODEV;
+	return MAP_FAILED;
+}
+
+static int mdb_test_munmap (void *addr, size_t length)
+{
+	if (mdb_test_munmap_hook) return mdb_test_munmap_hook (addr, length);
+	fprintf (stderr, ANSI_COLOR_RED "Unexepected munmap() call\n" ANSI_COLOR_RESET);
+	_exit(1);
+}
+
+static int mdb_test_msync (void *addr, size_t length, int flags)
+{
+	if (mdb_test_msync_hook) return mdb_test_msync_hook (addr, length, flags);
+	fprintf (stderr, ANSI_COLOR_RED "Unexepected msync() call\n" ANSI_COLOR_RESET);
+	_exit(1);
+}
+
 void dirdbGetName_internalstr(uint32_t ref, const char **name)
 {
 	switch (ref)
 	{
 		default: *name = 0;           return;
 		case 1:  *name = "test1.mod"; return;
+		case 2:  *name = "test2.HSC"; return;
 	}
 }
 
@@ -157,11 +241,53 @@ int mdb_basic_sizeof (void)
 		offsetof (struct modinfoentry, mie.general.size),
 		(offsetof (struct modinfoentry, mie.general.size) == 8) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
 
-	retval |= (offsetof (struct modinfoentry, mie.general.reserved) != 52);
-	fprintf (stderr, "offsetof(struct modinfoentry.mie.general.reserved) == 52: %ld %s\n" ANSI_COLOR_RESET,
+	retval |= (offsetof (struct modinfoentry, mie.general.fingerprint) != 52);
+	fprintf (stderr, "offsetof(struct modinfoentry.mie.general.fingerprint) == 52: %ld %s\n" ANSI_COLOR_RESET,
+		offsetof (struct modinfoentry, mie.general.fingerprint),
+		(offsetof (struct modinfoentry, mie.general.fingerprint) == 52) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
+
+	retval |= (offsetof (struct modinfoentry, mie.general.reserved) != 60);
+	fprintf (stderr, "offsetof(struct modinfoentry.mie.general.reserved) == 60: %ld %s\n" ANSI_COLOR_RESET,
 		offsetof (struct modinfoentry, mie.general.reserved),
-		(offsetof (struct modinfoentry, mie.general.reserved) == 52) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
+		(offsetof (struct modinfoentry, mie.general.reserved) == 60) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
+
+	return retval;
+}
 
+static int mdb_test_freelist_has (uint32_t start, uint32_t length)
+{
+	int i;
+	uint32_t j;
+	for (i=0; i < MDB_FREE_BUCKETS; i++)
+	{
+		for (j=0; j < mdbFreeLists[i].count; j++)
+		{
+			struct mdbFreeExtent_t *e = &mdbFreeLists[i].data[(mdbFreeLists[i].head + j) % mdbFreeLists[i].size];
+			if ((e->start == start) && (e->length == length))
+			{
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static uint32_t mdb_test_freelist_lowest (void)
+{
+	uint32_t retval = UINT32_MAX;
+	int i;
+	uint32_t j;
+	for (i=0; i < MDB_FREE_BUCKETS; i++)
+	{
+		for (j=0; j < mdbFreeLists[i].count; j++)
+		{
+			struct mdbFreeExtent_t *e = &mdbFreeLists[i].data[(mdbFreeLists[i].head + j) % mdbFreeLists[i].size];
+			if (e->start < retval)
+			{
+				retval = e->start;
+			}
+		}
+	}
 	return retval;
 }
 
@@ -169,7 +295,6 @@ void mdb_basic_mdbNew_prepare (void)
 {
 	mdbDataSize = 19;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbData[1].mie.general.record_flags = MDB_USED;
 	mdbData[1].mie.general.filename_hash[0] = 0x01;
@@ -193,12 +318,15 @@ void mdb_basic_mdbNew_prepare (void)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbNew_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 }
 
 int mdb_basic_mdbNew (void)
@@ -320,10 +448,10 @@ int mdb_basic_mdbNew (void)
 		 (mdbDirtyMap[1] != (0x01 | 0x04 | 0x08 | 0x10 | 0x40 | 0x80)) ||
 		 (mdbDirtyMap[2] != (0x01 | 0x02))) ? ANSI_COLOR_RED "Wrong" : ANSI_COLOR_GREEN "OK");
 
-	retval |= (mdbDataNextFree != 3);
-	fprintf (stderr, "mdbDataNextFree == 3 (only mdbNew(1) moves it unless Next == returnvalue): %"PRIu32" %s\n" ANSI_COLOR_RESET,
-		mdbDataNextFree,
-		(mdbDataNextFree == 3) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
+	retval |= (mdbFreeRecords != 1) || !mdb_test_freelist_has (18, 1);
+	fprintf (stderr, "mdbFreeRecords == 1 (the remainder of the split at 18): %"PRIu32" %s\n" ANSI_COLOR_RESET,
+		mdbFreeRecords,
+		((mdbFreeRecords == 1) && mdb_test_freelist_has (18, 1)) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "FAILED");
 
 	mdb_basic_mdbNew_finalize ();
 
@@ -336,7 +464,6 @@ void mdb_heap1_mdbNew_prepare (int test, int freeN)
 
 	mdbDataSize = 24;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	for (i = 1; i < mdbDataSize - freeN; i++)
 	{
@@ -351,12 +478,15 @@ void mdb_heap1_mdbNew_prepare (int test, int freeN)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_heap1_mdbNew_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 }
 
 int mdb_heap1_mdbNew (int test)
@@ -436,7 +566,6 @@ void mdb_basic_mdbFree_prepare (void)
 {
 	mdbDataSize = 16;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbDirty = 1;
 	mdbDirtyMapSize = 64;
@@ -445,12 +574,15 @@ void mdb_basic_mdbFree_prepare (void)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbFree_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 }
 
 int mdb_basic_mdbFree (void)
@@ -502,25 +634,25 @@ int mdb_basic_mdbFree (void)
 	mdbNew (1);
 	r = mdbNew (1);
 	mdbFree (r, 1);
-	retval |= (mdbDataNextFree != r);
-	fprintf (stderr, "mdbFree(1) moves back Next if after: %s\n" ANSI_COLOR_RESET, (mdbDataNextFree == r) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= !mdb_test_freelist_has (r, 1);
+	fprintf (stderr, "mdbFree(1) adds the record to the free lists: %s\n" ANSI_COLOR_RESET, mdb_test_freelist_has (r, 1) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
 	mdb_basic_mdbFree_finalize ();
 
 	mdb_basic_mdbFree_prepare ();
 	mdbNew(4);
 	r = mdbNew (1);
-	mdbDataNextFree = 2;
 	mdbFree (r, 1);
-	retval |= (mdbDataNextFree != 2);
-	fprintf (stderr, "mdbFree(1) does not touch Next if before: %s\n" ANSI_COLOR_RESET, (mdbDataNextFree == 2) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	e = mdbNew (1);
+	retval |= (e != r);
+	fprintf (stderr, "mdbFree(1) record is reused by the next mdbNew(1): %s\n" ANSI_COLOR_RESET, (e == r) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
 	mdb_basic_mdbFree_finalize ();
 
 	mdb_basic_mdbFree_prepare ();
 	mdbNew(1);
 	r = mdbNew (2);
 	mdbFree (r, 2);
-	retval |= (mdbDataNextFree != r);
-	fprintf (stderr, "mdbFree(2) moves back Next if after: %s\n" ANSI_COLOR_RESET, (mdbDataNextFree == r) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= !mdb_test_freelist_has (r, 2);
+	fprintf (stderr, "mdbFree(2) adds the extent to the free lists: %s\n" ANSI_COLOR_RESET, mdb_test_freelist_has (r, 2) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
 	mdb_basic_mdbFree_finalize ();
 
 	return retval;
@@ -530,7 +662,6 @@ void mdb_basic_mdbGetModuleReference_prepare (void)
 {
 	mdbDataSize = 256;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbDirty = 0;
 	mdbDirtyMapSize = 256;
@@ -539,13 +670,26 @@ void mdb_basic_mdbGetModuleReference_prepare (void)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFingerprintIndexData = 0;
+	mdbFingerprintIndexCount = 0;
+	mdbFingerprintIndexSize = 0;
+
+	mdbSharedStrings = 0;
+	mdbSharedStringsCount = 0;
+	mdbSharedStringsSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbGetModuleReference_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 	free (mdbSearchIndexData);
+	free (mdbFingerprintIndexData);
+	free (mdbSharedStrings);
 }
 
 int mdb_basic_mdbGetModuleReference (void)
@@ -591,31 +735,28 @@ int mdb_basic_mdbGetModuleReference (void)
 	fprintf (stderr, " => %d duplicates - %s\n" ANSI_COLOR_RESET, r, r ? ANSI_COLOR_RED "Failed" : ANSI_COLOR_GREEN "OK");
 
 	r = 0;
-	fprintf (stderr, "mdbSearchIndexData is in incrementing order:\n");
-	for (i = 0; i < mdbSearchIndexCount; i++)
-	{
-		fprintf (stderr, "  %8" PRIu64 " 0x%02x%02x%02x%02x%02x%02x%02x\n",
-			mdbData[mdbSearchIndexData[i]].mie.general.size,
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[0],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[1],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[2],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[3],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[4],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[5],
-			mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[6]);
-		if (i)
+	fprintf (stderr, "mdbSearchIndexData contains all entries:\n");
+	if (mdbSearchIndexCount != 10)
+	{
+		fprintf (stderr, "  mdbSearchIndexCount %"PRIu32" != 10\n", mdbSearchIndexCount);
+		r++;
+	}
+	for (i = 0; i < 10; i++)
+	{
+		uint32_t *slot = mdbSearchIndexLocate (mdbData[ref[i]].mie.general.size, mdbData[ref[i]].mie.general.filename_hash);
+		fprintf (stderr, "  %8" PRIu64 " 0x%02x%02x%02x%02x%02x%02x%02x => slot %d\n",
+			mdbData[ref[i]].mie.general.size,
+			mdbData[ref[i]].mie.general.filename_hash[0],
+			mdbData[ref[i]].mie.general.filename_hash[1],
+			mdbData[ref[i]].mie.general.filename_hash[2],
+			mdbData[ref[i]].mie.general.filename_hash[3],
+			mdbData[ref[i]].mie.general.filename_hash[4],
+			mdbData[ref[i]].mie.general.filename_hash[5],
+			mdbData[ref[i]].mie.general.filename_hash[6],
+			(int)(slot - mdbSearchIndexData));
+		if (*slot != ref[i])
 		{
-			if (mdbData[mdbSearchIndexData[i-1]].mie.general.size > mdbData[mdbSearchIndexData[i]].mie.general.size)
-			{
-				r++;
-			} else if (mdbData[mdbSearchIndexData[i-1]].mie.general.size == mdbData[mdbSearchIndexData[i]].mie.general.size)
-			{
-				int temp = memcmp (mdbData[mdbSearchIndexData[i-1]].mie.general.filename_hash, mdbData[mdbSearchIndexData[i]].mie.general.filename_hash, 7);
-				if (temp >= 0)
-				{
-					r++;
-				}
-			 }
+			r++;
 		}
 	}
 	retval |= r;
@@ -626,11 +767,61 @@ int mdb_basic_mdbGetModuleReference (void)
 	return retval;
 }
 
+int mdb_benchmark_mdbGetModuleReference (void)
+{
+	int retval = 0;
+	const uint32_t count = 200000;
+	uint32_t i, r = 0;
+	struct timespec t1, t2, t3;
+	char name[32];
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mdbGetModuleReference benchmark\n" ANSI_COLOR_RESET);
+
+	mdb_basic_mdbGetModuleReference_prepare();
+
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < count; i++)
+	{
+		snprintf (name, sizeof (name), "song%"PRIu32".mod", i);
+		if (mdbGetModuleReference (name, 1000 + (i % 1000)) == UINT32_MAX)
+		{
+			r++;
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t2);
+	for (i = 0; i < count; i++)
+	{
+		snprintf (name, sizeof (name), "song%"PRIu32".mod", i);
+		if (mdbGetModuleReference (name, 1000 + (i % 1000)) == UINT32_MAX)
+		{
+			r++;
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t3);
+
+	fprintf (stderr, "%"PRIu32" new entries: %.3fs, %"PRIu32" lookups: %.3fs\n", count,
+		(double)(t2.tv_sec - t1.tv_sec) + (double)(t2.tv_nsec - t1.tv_nsec) / 1000000000.0,
+		count,
+		(double)(t3.tv_sec - t2.tv_sec) + (double)(t3.tv_nsec - t2.tv_nsec) / 1000000000.0);
+
+	fprintf (stderr, "mdbSearchIndexCount: ");
+	if (r || (mdbSearchIndexCount != count) || (mdbFreeRecords != (mdbDataSize - 1 - count)))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "%"PRIu32" entries, %"PRIu32" failures, lookups created new entries?\n" ANSI_COLOR_RESET, mdbSearchIndexCount, r);
+		retval |= 1;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
+	}
+
+	mdb_basic_mdbGetModuleReference_finalize ();
+
+	return retval;
+}
+
 void mdb_basic_mdbWriteString_prepare (void)
 {
 	mdbDataSize = 256;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbData[0].mie.string.flags = MDB_USED;
 	memset (mdbData[0].mie.string.data, '_', 63);
@@ -660,12 +851,15 @@ void mdb_basic_mdbWriteString_prepare (void)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbWriteString_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 }
 
 int mdb_basic_mdbWriteString (void)
@@ -872,17 +1066,19 @@ void mdb_basic_mdbGetString_prepare (void)
 {
 	mdbDataSize = 256;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbGetString_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 }
 
 int mdb_basic_mdbGetString (void)
@@ -986,7 +1182,6 @@ void mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo_prepare (void)
 {
 	mdbDataSize = 64;
 	mdbData = calloc (64, mdbDataSize);
-	mdbDataNextFree = 1;
 
 	mdbDirty = 1;
 	mdbDirtyMapSize = 64;
@@ -995,12 +1190,15 @@ void mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo_prepare (void)
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+
+	mdbFreeListBuild ();
 }
 
 void mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 	free (mdbSearchIndexData);
 }
 
@@ -1049,9 +1247,9 @@ int mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo (void)
 		fprintf (stderr, ANSI_COLOR_RED " [mdbWriteModuleInfo() failed]");
 		e++;
 	}
-	if (mdbDataNextFree != 2)
+	if (mdbFreeRecords != (mdbDataSize - 2))
 	{
-		fprintf (stderr, ANSI_COLOR_RED " [mdbDataNextFree => %"PRIu32" != 2]", mdbDataNextFree);
+		fprintf (stderr, ANSI_COLOR_RED " [mdbFreeRecords => %"PRIu32" != mdbDataSize - 2]", mdbFreeRecords);
 		e++;
 	}
 	if (!mdbGetModuleInfo (&dst, r))
@@ -1080,9 +1278,9 @@ int mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo (void)
 		fprintf (stderr, ANSI_COLOR_RED " [mdbWriteModuleInfo() failed]");
 		e++;
 	}
-	if (mdbDataNextFree != 8)
+	if (mdbFreeRecords != (mdbDataSize - 8))
 	{
-		fprintf (stderr, ANSI_COLOR_RED " [mdbDataNextFree => %"PRIu32" != 8]", mdbDataNextFree);
+		fprintf (stderr, ANSI_COLOR_RED " [mdbFreeRecords => %"PRIu32" != mdbDataSize - 8]", mdbFreeRecords);
 		e++;
 	}
 	if (!mdbGetModuleInfo (&dst, r))
@@ -1113,9 +1311,9 @@ int mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo (void)
 	}
 #if 0
 	Memory will have a hole at position 6, since there are an odd-number of strings, so this test can not be used
-	if (mdbDataNextFree != 12)
+	if (mdbFreeRecords != (mdbDataSize - 12))
 	{
-		fprintf (stderr, ANSI_COLOR_RED " [mdbDataNextFree => %"PRIu32" != 12]", mdbDataNextFree);
+		fprintf (stderr, ANSI_COLOR_RED " [mdbFreeRecords => %"PRIu32" != mdbDataSize - 12]", mdbFreeRecords);
 		e++;
 	}
 #endif
@@ -1154,9 +1352,9 @@ int mdb_basic_mdbWriteModuleInfo_mdbGetModuleInfo (void)
 	}
 #if 0
 	Memory will likely be somewhat fragmented
-	if (mdbDataNextFree != 7)
+	if (mdbFreeRecords != (mdbDataSize - 7))
 	{
-		fprintf (stderr, ANSI_COLOR_RED " [mdbDataNextFree => %"PRIu32" != 7]", mdbDataNextFree);
+		fprintf (stderr, ANSI_COLOR_RED " [mdbFreeRecords => %"PRIu32" != mdbDataSize - 7]", mdbFreeRecords);
 		e++;
 	}
 #endif
@@ -1328,7 +1526,8 @@ void mdb_basic_mdbInit_prepare (void)
 {
 	mdbDataSize = 0;
 	mdbData = 0;
-	mdbDataNextFree = 0;
+
+	mdbFreeListClear ();
 
 	mdbDirty = 0;
 	mdbDirtyMapSize = 0;
@@ -1352,6 +1551,7 @@ void mdb_basic_mdbInit_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 	free (mdbSearchIndexData);
 
 	mdb_test_read_hook = 0;
@@ -1381,10 +1581,10 @@ int mdb_basic_mdbInit (void)
 		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
 	}
 
-	fprintf (stderr, "mdbDataNextFree: ");
-	if (mdbDataNextFree < 25)
+	fprintf (stderr, "mdbFreeLists: ");
+	if (mdb_test_freelist_lowest () < 25)
 	{
-		fprintf (stderr, ANSI_COLOR_RED " => %"PRIu32" < 25)\n" ANSI_COLOR_RESET, mdbDataNextFree);
+		fprintf (stderr, ANSI_COLOR_RED " => first free record %"PRIu32" < 25)\n" ANSI_COLOR_RESET, mdb_test_freelist_lowest ());
 		retval |= 1;
 	} else {
 		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
@@ -1406,13 +1606,12 @@ int mdb_basic_mdbInit (void)
 	{
 		fprintf (stderr, ANSI_COLOR_RED "mdbSearchIndexCount => %d >= 4\n" ANSI_COLOR_RESET, (int)mdbSearchIndexCount);
 		retval |= 1;
-	} else if ((mdbSearchIndexData[0] != 22) || (mdbSearchIndexData[1] != 15) || (mdbSearchIndexData[2] != 8) || (mdbSearchIndexData[3] != 1))
+	} else if ((*mdbSearchIndexLocate (mdbData[22].mie.general.size, mdbData[22].mie.general.filename_hash) != 22) ||
+	           (*mdbSearchIndexLocate (mdbData[15].mie.general.size, mdbData[15].mie.general.filename_hash) != 15) ||
+	           (*mdbSearchIndexLocate (mdbData[8].mie.general.size, mdbData[8].mie.general.filename_hash) != 8) ||
+	           (*mdbSearchIndexLocate (mdbData[1].mie.general.size, mdbData[1].mie.general.filename_hash) != 1))
 	{
-		fprintf (stderr, ANSI_COLOR_RED "mdbSearchIndexData[] => 22, 15, 8, 1 != %d %d %d %d\n" ANSI_COLOR_RESET,
-			(int)mdbSearchIndexData[0],
-			(int)mdbSearchIndexData[1],
-			(int)mdbSearchIndexData[2],
-			(int)mdbSearchIndexData[3]);
+		fprintf (stderr, ANSI_COLOR_RED "mdbSearchIndexData does not locate entries 22, 15, 8 and 1\n" ANSI_COLOR_RESET);
 		retval |= 1;
 	} else {
 		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
@@ -1594,7 +1793,8 @@ void mdb_basic_mdbUpdate_prepare (void)
 {
 	mdbDataSize = 0;
 	mdbData = 0;
-	mdbDataNextFree = 0;
+
+	mdbFreeListClear ();
 
 	mdbDirty = 0;
 	mdbDirtyMapSize = 0;
@@ -1623,6 +1823,7 @@ void mdb_basic_mdbUpdate_finalize (void)
 {
 	free (mdbData);
 	free (mdbDirtyMap);
+	mdbFreeListClear ();
 	free (mdbSearchIndexData);
 
 	mdb_test_read_hook = 0;
@@ -1730,6 +1931,616 @@ int mdb_basic_mdbUpdate (void)
 	return retval;
 }
 
+char mdb_mapped_mdbUpdate_path[64];
+int mdb_mapped_mdbUpdate_msync_calls;
+int mdb_mapped_mdbUpdate_pwrite_calls;
+
+int mdb_mapped_mdbUpdate_open (const char *pathname, int flags, mode_t mode)
+{
+	return real_open (mdb_mapped_mdbUpdate_path, flags, mode);
+}
+
+int mdb_mapped_mdbUpdate_flock (int fd, int operation)
+{
+	return 0;
+}
+
+ssize_t mdb_mapped_mdbUpdate_write (int fd, void *buf, size_t size)
+{
+	fprintf (stderr, ANSI_COLOR_RED " [write() used in mapped mode]" ANSI_COLOR_RESET);
+	return -1;
+}
+
+ssize_t mdb_mapped_mdbUpdate_pwrite (int fd, const void *buf, size_t size, off_t offset)
+{
+	mdb_mapped_mdbUpdate_pwrite_calls++;
+	return real_pwrite (fd, buf, size, offset);
+}
+
+int mdb_mapped_mdbUpdate_msync (void *addr, size_t length, int flags)
+{
+	mdb_mapped_mdbUpdate_msync_calls++;
+	return real_msync (addr, length, flags);
+}
+
+int mdb_mapped_mdbUpdate_prepare (void)
+{
+	int fd;
+
+	mdbData = 0;
+	mdbDataSize = 0;
+	mdbFreeListClear ();
+	mdbDirtyMapSize = 0;
+	mdbDirtyMap = 0;
+	mdbSearchIndexData = 0;
+	mdbSearchIndexCount = 0;
+	mdbSearchIndexSize = 0;
+
+	strcpy (mdb_mapped_mdbUpdate_path, "/tmp/mdb-test-XXXXXX");
+	fd = mkstemp (mdb_mapped_mdbUpdate_path);
+	if (fd < 0)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mkstemp() failed: %s\n" ANSI_COLOR_RESET, strerror (errno));
+		return -1;
+	}
+	if (real_pwrite (fd, mdb_basic_mdbInit_src, sizeof (mdb_basic_mdbInit_src), 0) != sizeof (mdb_basic_mdbInit_src))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "pwrite() failed: %s\n" ANSI_COLOR_RESET, strerror (errno));
+		real_close (fd);
+		return -1;
+	}
+	real_close (fd);
+
+	mdb_mapped_mdbUpdate_msync_calls = 0;
+	mdb_mapped_mdbUpdate_pwrite_calls = 0;
+
+	mdb_test_read_hook = real_read;
+	mdb_test_write_hook = mdb_mapped_mdbUpdate_write;
+	mdb_test_open_hook = mdb_mapped_mdbUpdate_open;
+	mdb_test_lseek_hook = real_lseek;
+	mdb_test_close_hook = real_close;
+	mdb_test_flock_hook = mdb_mapped_mdbUpdate_flock;
+	mdb_test_pwrite_hook = mdb_mapped_mdbUpdate_pwrite;
+	mdb_test_posix_fallocate_hook = real_posix_fallocate;
+	mdb_test_mmap_hook = real_mmap;
+	mdb_test_munmap_hook = real_munmap;
+	mdb_test_msync_hook = mdb_mapped_mdbUpdate_msync;
+
+	return 0;
+}
+
+void mdb_mapped_mdbUpdate_finalize (void)
+{
+	unlink (mdb_mapped_mdbUpdate_path);
+
+	mdb_test_read_hook = 0;
+	mdb_test_write_hook = 0;
+	mdb_test_open_hook = 0;
+	mdb_test_lseek_hook = 0;
+	mdb_test_close_hook = 0;
+	mdb_test_flock_hook = 0;
+	mdb_test_pwrite_hook = 0;
+	mdb_test_posix_fallocate_hook = 0;
+	mdb_test_mmap_hook = 0;
+	mdb_test_munmap_hook = 0;
+	mdb_test_msync_hook = 0;
+}
+
+int mdb_mapped_mdbUpdate (void)
+{
+	int retval = 0;
+	int i;
+	uint32_t first = UINT32_MAX, ref;
+	const int count = 40000;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mapped file, grow and commit to disk\n" ANSI_COLOR_RESET);
+
+	if (mdb_mapped_mdbUpdate_prepare ())
+	{
+		return 1;
+	}
+
+	if (!mdbInit())
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mdbInit() failed...\n" ANSI_COLOR_RESET);
+		mdb_mapped_mdbUpdate_finalize ();
+		return 1;
+	}
+
+	fprintf (stderr, "file is mapped: ");
+	if (!mdbMapped)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "no\n" ANSI_COLOR_RESET);
+		retval |= 1;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
+	}
+
+	fprintf (stderr, "adding %d entries: ", count);
+	for (i=0; i < count; i++)
+	{
+		ref = mdbGetModuleReference ("mapped.mod", 100000 + i);
+		if (ref == UINT32_MAX)
+		{
+			fprintf (stderr, ANSI_COLOR_RED "mdbGetModuleReference() failed\n" ANSI_COLOR_RESET);
+			retval |= 1;
+			break;
+		}
+		if (!i)
+		{
+			first = ref;
+		}
+	}
+	if (i == count)
+	{
+		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
+	}
+
+	fprintf (stderr, "mdbUpdate: ");
+	mdbUpdate();
+	if (mdb_mapped_mdbUpdate_pwrite_calls)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "pwrite() used %d times in mapped mode\n" ANSI_COLOR_RESET, mdb_mapped_mdbUpdate_pwrite_calls);
+		retval |= 1;
+	} else if (mdb_mapped_mdbUpdate_msync_calls > 2)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "msync() called %d times, dirty ranges are not coalesced\n" ANSI_COLOR_RESET, mdb_mapped_mdbUpdate_msync_calls);
+		retval |= 1;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "OK (%d msync calls)\n" ANSI_COLOR_RESET, mdb_mapped_mdbUpdate_msync_calls);
+	}
+
+	mdbClose ();
+
+	fprintf (stderr, "reopen and locate entries: ");
+	if (!mdbInit())
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mdbInit() failed...\n" ANSI_COLOR_RESET);
+		mdb_mapped_mdbUpdate_finalize ();
+		return 1;
+	}
+	if ((mdbGetModuleReference ("mapped.mod", 100000) != first) ||
+	    (mdbGetModuleReference ("mapped.mod", 100000 + count - 1) != first + count - 1))
+	{
+		fprintf (stderr, ANSI_COLOR_RED "entries not found at the expected location\n" ANSI_COLOR_RESET);
+		retval |= 1;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
+	}
+	mdbClose ();
+
+	mdb_mapped_mdbUpdate_finalize ();
+
+	return retval;
+}
+
+static int mdb_mapped_diskfull_posix_fallocate (int fd, off_t offset, off_t len)
+{
+	return ENOSPC;
+}
+
+static int mdb_mapped_unsupported_posix_fallocate (int fd, off_t offset, off_t len)
+{
+	return EOPNOTSUPP;
+}
+
+int mdb_mapped_mdbNew_diskfull (void)
+{
+	int retval = 0;
+	int i;
+	uint32_t first = UINT32_MAX, ref = 0;
+	uint32_t mapsize;
+	struct stat st;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mapped file, growing it on a full disk\n" ANSI_COLOR_RESET);
+
+	if (mdb_mapped_mdbUpdate_prepare ())
+	{
+		return 1;
+	}
+
+	if (!mdbInit())
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mdbInit() failed...\n" ANSI_COLOR_RESET);
+		mdb_mapped_mdbUpdate_finalize ();
+		return 1;
+	}
+	first = mdbGetModuleReference ("full.mod", 100000);
+	mdb_test_posix_fallocate_hook = mdb_mapped_diskfull_posix_fallocate;
+	mapsize = mdbMapSize;
+
+	for (i=1; i < 40000; i++)
+	{
+		ref = mdbGetModuleReference ("full.mod", 100000 + i);
+		if (ref == UINT32_MAX)
+		{
+			break;
+		}
+	}
+	fprintf (stderr, "mdbGetModuleReference() fails once the mapping is full: %d %s\n" ANSI_COLOR_RESET, i, ((ref == UINT32_MAX) && (mdbMapSize == mapsize) && mdbMapped) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (ref != UINT32_MAX) || (mdbMapSize != mapsize) || !mdbMapped;
+
+	fprintf (stderr, "existing entries are intact: %s\n" ANSI_COLOR_RESET, ((first != UINT32_MAX) && (mdbGetModuleReference ("full.mod", 100000) == first)) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (first == UINT32_MAX) || (mdbGetModuleReference ("full.mod", 100000) != first);
+
+	mdb_test_posix_fallocate_hook = mdb_mapped_unsupported_posix_fallocate;
+	mdb_mapped_mdbUpdate_pwrite_calls = 0;
+	ref = mdbGetModuleReference ("full.mod", 100000 + i);
+	fstat (mdbFd, &st);
+	fprintf (stderr, "without posix_fallocate() zeroes are written: %d %s\n" ANSI_COLOR_RESET, mdb_mapped_mdbUpdate_pwrite_calls, ((ref != UINT32_MAX) && (mdbMapSize > mapsize) && mdb_mapped_mdbUpdate_pwrite_calls && (st.st_size == (off_t)mdbMapSize * 64)) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (ref == UINT32_MAX) || (mdbMapSize <= mapsize) || (!mdb_mapped_mdbUpdate_pwrite_calls) || (st.st_size != (off_t)mdbMapSize * 64);
+
+	mdbClose ();
+	mdb_mapped_mdbUpdate_finalize ();
+
+	return retval;
+}
+
+static const char *mdb_dispatch_data;
+static int mdb_dispatch_called[4];
+
+static int mdb_dispatch_seek_set (struct ocpfilehandle_t *f, int64_t pos)
+{
+	return 0;
+}
+
+static int mdb_dispatch_read (struct ocpfilehandle_t *f, void *dst, int len)
+{
+	int l = strlen (mdb_dispatch_data);
+	if (l > len)
+	{
+		l = len;
+	}
+	memcpy (dst, mdb_dispatch_data, l);
+	return l;
+}
+
+static int mdb_dispatch_ReadInfo0 (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len) { mdb_dispatch_called[0]++; return 0; }
+static int mdb_dispatch_ReadInfo1 (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len) { mdb_dispatch_called[1]++; return 0; }
+static int mdb_dispatch_ReadInfo2 (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len) { mdb_dispatch_called[2]++; return 0; }
+static int mdb_dispatch_ReadInfo3 (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len) { mdb_dispatch_called[3]++; return 0; }
+
+int mdb_basic_mdbCompactData (void)
+{
+	int retval = 0, e = 0;
+	struct modinfoentry *dst;
+	uint32_t size = 0;
+	int i;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mdbCompactData\n" ANSI_COLOR_RESET);
+
+	mdbDataSize = 32;
+	mdbData = calloc (64, mdbDataSize);
+
+	for (i=1; i < 10; i+=4)
+	{
+		mdbData[i].mie.general.record_flags = MDB_USED;
+		mdbData[i].mie.general.filename_hash[0] = i;
+		mdbData[i].mie.general.title_ref = UINT32_MAX;
+		mdbData[i].mie.general.composer_ref = UINT32_MAX;
+		mdbData[i].mie.general.artist_ref = UINT32_MAX;
+		mdbData[i].mie.general.style_ref = UINT32_MAX;
+		mdbData[i].mie.general.comment_ref = UINT32_MAX;
+		mdbData[i].mie.general.album_ref = UINT32_MAX;
+	}
+	mdbData[1].mie.general.title_ref = 20;
+	mdbData[20].mie.string.flags = MDB_USED | MDB_STRING_TERMINATION;
+	strcpy ((char *)mdbData[20].mie.string.data, "title");
+	mdbData[1].mie.general.comment_ref = 25;
+	mdbData[25].mie.string.flags = MDB_USED | MDB_STRING_MORE;
+	memset (mdbData[25].mie.string.data, 'c', 63);
+	mdbData[26].mie.string.flags = MDB_USED | MDB_STRING_TERMINATION;
+	strcpy ((char *)mdbData[26].mie.string.data, "omment");
+	mdbData[5].mie.general.artist_ref = 30;
+	mdbData[30].mie.string.flags = MDB_USED | MDB_STRING_TERMINATION;
+	strcpy ((char *)mdbData[30].mie.string.data, "artist");
+	mdbData[9].mie.general.artist_ref = 30; /* shared */
+	mdbData[28].mie.string.flags = MDB_USED | MDB_STRING_TERMINATION; /* orphan */
+	strcpy ((char *)mdbData[28].mie.string.data, "lost");
+
+	fprintf (stderr, "Initial map [HU...U...U.......... S....SS.S.S.]\n");
+
+	dst = mdbCompactData (&size);
+	if (!dst)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "mdbCompactData() failed\n" ANSI_COLOR_RESET);
+		free (mdbData);
+		return 1;
+	}
+
+	fprintf (stderr, "new size == 10: %"PRIu32, size);
+	if (size != 10)
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [wrong size]");
+		e++;
+	}
+	if ((dst[1].mie.general.record_flags != MDB_USED) || (dst[1].mie.general.filename_hash[0] != 1) ||
+	    (dst[5].mie.general.record_flags != MDB_USED) || (dst[5].mie.general.filename_hash[0] != 5) ||
+	    (dst[9].mie.general.record_flags != MDB_USED) || (dst[9].mie.general.filename_hash[0] != 9))
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [file entries moved]");
+		e++;
+	}
+	if ((dst[1].mie.general.title_ref != 2) || strcmp ((char *)dst[2].mie.string.data, "title"))
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [title not at 2]");
+		e++;
+	}
+	if ((dst[1].mie.general.comment_ref != 3) || (dst[3].mie.string.flags != (MDB_USED | MDB_STRING_MORE)) || strcmp ((char *)dst[4].mie.string.data, "omment"))
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [comment not at 3-4]");
+		e++;
+	}
+	if ((dst[5].mie.general.artist_ref != 6) || strcmp ((char *)dst[6].mie.string.data, "artist"))
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [artist not at 6]");
+		e++;
+	}
+	if (dst[9].mie.general.artist_ref != 6)
+	{
+		fprintf (stderr, ANSI_COLOR_RED " [shared artist not at 6]");
+		e++;
+	}
+	for (i=10; i < 32; i++)
+	{
+		if (dst[i].mie.general.record_flags)
+		{
+			fprintf (stderr, ANSI_COLOR_RED " [record %d is not free]", i);
+			e++;
+		}
+	}
+	retval |= e;
+	fprintf (stderr, "%s\n" ANSI_COLOR_RESET, e ? "" : ANSI_COLOR_GREEN " OK");
+
+	free (dst);
+	free (mdbData);
+	mdbData = 0;
+	mdbDataSize = 0;
+
+	return retval;
+}
+
+int mdb_basic_mdbReadInfo_dispatch (void)
+{
+	static const struct mdbreadinfosig sigs1[] = {{0, 4, "ABCD"}, {0, 0}};
+	static const struct mdbreadinfosig sigs2[] = {{4, 4, "xY\0Z", "\xdf\xff\x00\xff"}, {0, 0}};
+	static const char * const exts3[] = {".hsc", 0};
+	struct mdbreadinforegstruct r0 = {"test0", mdb_dispatch_ReadInfo0, 0 MDBREADINFOREGSTRUCT_TAIL};
+	struct mdbreadinforegstruct r1 = {"test1", mdb_dispatch_ReadInfo1, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(sigs1, 0)};
+	struct mdbreadinforegstruct r2 = {"test2", mdb_dispatch_ReadInfo2, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(sigs2, 0)};
+	struct mdbreadinforegstruct r3 = {"test3", mdb_dispatch_ReadInfo3, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(0, exts3)};
+	struct ocpfilehandle_t fh;
+	struct moduleinfostruct m;
+	const struct
+	{
+		const char *data;
+		int dirdb_ref;
+		int expect[4];
+	} testcases[] =
+	{
+		{"ABCD.....",  1, {1, 1, 0, 0}},
+		{"ABC......",  1, {1, 0, 0, 0}},
+		{"....XYqZ..", 1, {1, 0, 1, 0}},
+		{"....xYqZ..", 1, {1, 0, 1, 0}},
+		{"....xyqZ..", 1, {1, 0, 0, 0}},
+		{"....xYq",    1, {1, 0, 0, 0}},
+		{"ABCDXYqZ..", 2, {1, 1, 1, 1}},
+		{"..........", 2, {1, 0, 0, 1}},
+	};
+	int retval = 0;
+	int i, j;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mdbReadInfo dispatch by signature and extension\n" ANSI_COLOR_RESET);
+
+	memset (&fh, 0, sizeof (fh));
+	fh.seek_set = mdb_dispatch_seek_set;
+	fh.read = mdb_dispatch_read;
+
+	mdbRegisterReadInfo (&r0);
+	mdbRegisterReadInfo (&r1);
+	mdbRegisterReadInfo (&r2);
+	mdbRegisterReadInfo (&r3);
+
+	for (i=0; i < sizeof (testcases) / sizeof (testcases[0]); i++)
+	{
+		int r = 0;
+
+		memset (mdb_dispatch_called, 0, sizeof (mdb_dispatch_called));
+		memset (&m, 0, sizeof (m));
+		mdb_dispatch_data = testcases[i].data;
+		fh.dirdb_ref = testcases[i].dirdb_ref;
+		mdbReadInfo (&m, &fh);
+
+		fprintf (stderr, "\"%s\" (dirdb_ref=%d):", testcases[i].data, testcases[i].dirdb_ref);
+		for (j=0; j < 4; j++)
+		{
+			fprintf (stderr, " %d", mdb_dispatch_called[j]);
+			r |= mdb_dispatch_called[j] != testcases[i].expect[j];
+		}
+		fprintf (stderr, " %s\n" ANSI_COLOR_RESET, r ? ANSI_COLOR_RED "Failed" : ANSI_COLOR_GREEN "OK");
+		retval |= r;
+	}
+
+	mdbUnregisterReadInfo (&r3);
+	mdbUnregisterReadInfo (&r2);
+	mdbUnregisterReadInfo (&r1);
+	mdbUnregisterReadInfo (&r0);
+
+	fprintf (stderr, "mdbReadInfoPlugins == 0 after unregister: ");
+	if (mdbReadInfoPlugins || mdbReadInfoCandidate)
+	{
+		fprintf (stderr, ANSI_COLOR_RED "Failed\n" ANSI_COLOR_RESET);
+		retval |= 1;
+	} else {
+		fprintf (stderr, ANSI_COLOR_GREEN "OK\n" ANSI_COLOR_RESET);
+	}
+
+	return retval;
+}
+
+#define MDB_SCAN_FILESIZE 10000
+static char mdb_scan_data[MDB_SCAN_FILESIZE];
+static int64_t mdb_scan_pos;
+static int64_t mdb_scan_maxpos;
+static int mdb_scan_random_access;
+static int mdb_scan_probes;
+static int mdb_scan_badhead;
+
+static int mdb_scan_seek_set (struct ocpfilehandle_t *f, int64_t pos)
+{
+	if ((pos < 0) || (pos > MDB_SCAN_FILESIZE))
+	{
+		return -1;
+	}
+	mdb_scan_pos = pos;
+	return 0;
+}
+
+static int mdb_scan_read (struct ocpfilehandle_t *f, void *dst, int len)
+{
+	if (len > (MDB_SCAN_FILESIZE - mdb_scan_pos))
+	{
+		len = MDB_SCAN_FILESIZE - mdb_scan_pos;
+	}
+	memcpy (dst, mdb_scan_data + mdb_scan_pos, len);
+	mdb_scan_pos += len;
+	if (mdb_scan_pos > mdb_scan_maxpos)
+	{
+		mdb_scan_maxpos = mdb_scan_pos;
+	}
+	return len;
+}
+
+static int mdb_scan_ioctl (struct ocpfilehandle_t *f, const char *cmd, void *ptr)
+{
+	if (!strcmp (cmd, IOCTL_FILEHANDLE_RANDOM_ACCESS))
+	{
+		return mdb_scan_random_access ? 0 : -1;
+	}
+	return -1;
+}
+
+static void mdb_scan_handle_unref (struct ocpfilehandle_t *f)
+{
+}
+
+static struct ocpfilehandle_t *mdb_scan_open (struct ocpfile_t *file)
+{
+	static struct ocpfilehandle_t fh;
+
+	memset (&fh, 0, sizeof (fh));
+	fh.seek_set = mdb_scan_seek_set;
+	fh.read = mdb_scan_read;
+	fh.ioctl = mdb_scan_ioctl;
+	fh.unref = mdb_scan_handle_unref;
+	fh.dirdb_ref = 1;
+	mdb_scan_pos = 0;
+	return &fh;
+}
+
+static int mdb_scan_ReadInfo (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len)
+{
+	mdb_scan_probes++;
+	if ((len != MDB_SCANBUF_SIZE) || memcmp (buf, mdb_scan_data, len) || (mdb_scan_pos != len))
+	{
+		mdb_scan_badhead++;
+	}
+	m->modtype.integer.i = MODULETYPE("TST");
+	snprintf (m->title, sizeof (m->title), "probe %d", mdb_scan_probes);
+	return 1;
+}
+
+int mdb_basic_mdbScan_fingerprint (void)
+{
+	struct mdbreadinforegstruct r = {"testscan", mdb_scan_ReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+	struct ocpfile_t file;
+	struct moduleinfostruct m;
+	uint32_t ref[6];
+	int retval = 0;
+	int i;
+
+	fprintf (stderr, ANSI_COLOR_CYAN "MDB mdbScan reuses information from files with identical content\n" ANSI_COLOR_RESET);
+
+	mdb_basic_mdbGetModuleReference_prepare();
+	mdbRegisterReadInfo (&r);
+	mdb_scan_random_access = 1;
+	mdb_scan_badhead = 0;
+
+	memset (&file, 0, sizeof (file));
+	file.open = mdb_scan_open;
+
+	for (i=0; i < MDB_SCAN_FILESIZE; i++)
+	{
+		mdb_scan_data[i] = i * 7;
+	}
+
+	ref[0] = mdbGetModuleReference ("a.mod", MDB_SCAN_FILESIZE);
+	ref[1] = mdbGetModuleReference ("b.mod", MDB_SCAN_FILESIZE);
+	ref[2] = mdbGetModuleReference ("c.mod", MDB_SCAN_FILESIZE);
+	ref[3] = mdbGetModuleReference ("d.mod", MDB_SCAN_FILESIZE);
+
+	mdbScan (&file, ref[0]);
+	fprintf (stderr, "first file is probed: %d %s\n" ANSI_COLOR_RESET, mdb_scan_probes, (mdb_scan_probes == 1) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= mdb_scan_probes != 1;
+
+	mdbScan (&file, ref[1]);
+	mdbGetModuleInfo (&m, ref[1]);
+	fprintf (stderr, "copy with a different name is not probed: %d \"%s\" %s\n" ANSI_COLOR_RESET, mdb_scan_probes, m.title, ((mdb_scan_probes == 1) && !strcmp (m.title, "probe 1")) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (mdb_scan_probes != 1) || strcmp (m.title, "probe 1");
+
+	fprintf (stderr, "copy shares the strings: 0x%08"PRIx32" 0x%08"PRIx32" %s\n" ANSI_COLOR_RESET, mdbData[ref[0]].mie.general.title_ref, mdbData[ref[1]].mie.general.title_ref, (mdbData[ref[0]].mie.general.title_ref == mdbData[ref[1]].mie.general.title_ref) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= mdbData[ref[0]].mie.general.title_ref != mdbData[ref[1]].mie.general.title_ref;
+
+	mdbGetModuleInfo (&m, ref[1]);
+	mdbWriteModuleInfo (ref[1], &m);
+	fprintf (stderr, "writing the same strings back keeps them shared: %s\n" ANSI_COLOR_RESET, (mdbData[ref[0]].mie.general.title_ref == mdbData[ref[1]].mie.general.title_ref) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= mdbData[ref[0]].mie.general.title_ref != mdbData[ref[1]].mie.general.title_ref;
+
+	strcpy (m.title, "edited");
+	mdbWriteModuleInfo (ref[1], &m);
+	mdbGetModuleInfo (&m, ref[1]);
+	{
+		struct moduleinfostruct m0;
+		mdbGetModuleInfo (&m0, ref[0]);
+		fprintf (stderr, "editing the copy leaves the original alone: \"%s\" \"%s\" %s\n" ANSI_COLOR_RESET, m0.title, m.title, (!strcmp (m0.title, "probe 1") && !strcmp (m.title, "edited")) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+		retval |= strcmp (m0.title, "probe 1") || strcmp (m.title, "edited");
+	}
+	fprintf (stderr, "the string is no longer shared: %d %s\n" ANSI_COLOR_RESET, (int)mdbSharedStringsCount, mdbSharedStringsCount ? ANSI_COLOR_RED "Failed" : ANSI_COLOR_GREEN "OK");
+	retval |= mdbSharedStringsCount != 0;
+
+	mdb_scan_data[MDB_SCAN_FILESIZE - 1]++;
+	mdbScan (&file, ref[2]);
+	mdbGetModuleInfo (&m, ref[2]);
+	fprintf (stderr, "file with a different tail is probed: %d \"%s\" %s\n" ANSI_COLOR_RESET, mdb_scan_probes, m.title, ((mdb_scan_probes == 2) && !strcmp (m.title, "probe 2")) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (mdb_scan_probes != 2) || strcmp (m.title, "probe 2");
+
+	/* entries that are unscanned later on, are not used as a source */
+	mdbData[ref[0]].mie.general.modtype.integer.i = 0;
+	mdb_scan_data[MDB_SCAN_FILESIZE - 1]--;
+	mdbScan (&file, ref[3]);
+	fprintf (stderr, "stale index entry is not used: %d %s\n" ANSI_COLOR_RESET, mdb_scan_probes, (mdb_scan_probes == 3) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= mdb_scan_probes != 3;
+
+	/* handles where seeking is expensive, are only fingerprinted by their head */
+	mdb_scan_random_access = 0;
+	mdb_scan_data[0]++;
+	ref[4] = mdbGetModuleReference ("e.mod", MDB_SCAN_FILESIZE);
+	ref[5] = mdbGetModuleReference ("f.mod", MDB_SCAN_FILESIZE);
+	mdb_scan_maxpos = 0;
+	mdbScan (&file, ref[4]);
+	mdbScan (&file, ref[5]);
+	fprintf (stderr, "no random access, only the head is read: %d %d %s\n" ANSI_COLOR_RESET, mdb_scan_probes, (int)mdb_scan_maxpos, ((mdb_scan_probes == 4) && (mdb_scan_maxpos == MDB_SCANBUF_SIZE)) ? ANSI_COLOR_GREEN "OK" : ANSI_COLOR_RED "Failed");
+	retval |= (mdb_scan_probes != 4) || (mdb_scan_maxpos != MDB_SCANBUF_SIZE);
+
+	fprintf (stderr, "plugins get the head, and the file positioned after it: %d %s\n" ANSI_COLOR_RESET, mdb_scan_badhead, mdb_scan_badhead ? ANSI_COLOR_RED "Failed" : ANSI_COLOR_GREEN "OK");
+	retval |= mdb_scan_badhead != 0;
+
+	mdbUnregisterReadInfo (&r);
+	mdb_basic_mdbGetModuleReference_finalize();
+
+	return retval;
+}
+
 int main (int argc, char *argv[])
 {
 	int retval = 0;
@@ -1748,6 +2559,8 @@ int main (int argc, char *argv[])
 
 	retval |= mdb_basic_mdbGetModuleReference ();
 
+	retval |= mdb_benchmark_mdbGetModuleReference ();
+
 	retval |= mdb_basic_mdbWriteString ();
 
 	retval |= mdb_basic_mdbGetString ();
@@ -1758,5 +2571,15 @@ int main (int argc, char *argv[])
 
 	retval |= mdb_basic_mdbUpdate();
 
+	retval |= mdb_mapped_mdbUpdate();
+
+	retval |= mdb_mapped_mdbNew_diskfull();
+
+	retval |= mdb_basic_mdbCompactData();
+
+	retval |= mdb_basic_mdbReadInfo_dispatch();
+
+	retval |= mdb_basic_mdbScan_fingerprint();
+
 	return retval;
 }
@@ -25,12 +25,14 @@
 
 #include "config.h"
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -76,7 +78,8 @@ struct modinfoentry
 			uint32_t style_ref;        /* 40 */
 			uint32_t comment_ref;      /* 44 */
 			uint32_t album_ref;        /* 48 */
-			uint8_t reserved[12];      /* 52-63*/
+			uint64_t fingerprint;      /* 52, content fingerprint, 0 if not known */
+			uint8_t reserved[4];       /* 60-63*/
 		} general;
 		struct __attribute__((packed))
 		{
@@ -97,16 +100,41 @@ const char mdbsigv2[60] = "Cubic Player Module Information Data Base II\x1B\x00\
 #else
 const char mdbsigv2[60] = "Cubic Player Module Information Data Base II\x1B\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01";
 #endif
-/* future mmap
-static void  *mdbRawData;
-static size_t mdbRawMapSize;
-*/
-
 static int mdbFd = -1;
 
+/* If possible, mdbData is a shared mapping of CPMODNFO.DAT. The file is grown in
+ * bigger steps than mdbDataSize with mdbFileGrow() and mapped again. Else mdbData is a
+ * malloc() copy, and dirty records are written back with pwrite().
+ *
+ * Records beyond mdbDataSize are zero, and not counted in the header, so older
+ * versions can still load the file.
+ */
+static int                  mdbMapped;
+static uint32_t             mdbMapSize; /* number of records that fit in the current mapping */
+#define MDB_MAP_GROW 16384              /* minimum growth of the mapping, in records (1MB) */
+
 static struct modinfoentry *mdbData;
 static uint32_t             mdbDataSize;
-static uint32_t             mdbDataNextFree;
+
+/* Unused records are tracked as extents, in FIFO queues bucketed by length. The last bucket holds all extents of
+ * length MDB_FREE_BUCKETS-1 or more. Extents are not merged when freed, mdbCompact() takes care of fragmentation.
+ */
+#define MDB_FREE_BUCKETS 16
+struct mdbFreeExtent_t
+{
+	uint32_t start;
+	uint32_t length;
+};
+static struct mdbFreeList_t
+{
+	struct mdbFreeExtent_t *data; /* ring buffer */
+	uint32_t                head;
+	uint32_t                count;
+	uint32_t                size;
+} mdbFreeLists[MDB_FREE_BUCKETS];
+static uint32_t             mdbFreeRecords; /* total length of all extents */
+
+#define MDB_COMPACT_MIN 4096 /* do not bother compacting databases smaller than this many records */
 
 static uint8_t              mdbDirty;
 static uint8_t             *mdbDirtyMap;
@@ -114,9 +142,34 @@ static unsigned int         mdbDirtyMapSize;  /* should be >= mdbDataSize */
 
        uint8_t              mdbCleanSlate; /* media-db needs to know that we used to be previous version database before we hashed filenames */
 
-static uint32_t            *mdbSearchIndexData;  /* lookup sorted index */
-static uint32_t             mdbSearchIndexCount; /* Number of entries in sorted index */
-static uint32_t             mdbSearchIndexSize;  /* Allocated size in sorted index */
+/* Lookup of file entries, open-addressing hash table with linear probing, keyed on (size, filename_hash).
+ * Each slot holds a mdb_ref, 0 is an empty slot since entry #0 is the header. Entries are never removed.
+ */
+static uint32_t            *mdbSearchIndexData;  /* lookup hash table */
+static uint32_t             mdbSearchIndexCount; /* Number of entries in the hash table */
+static uint32_t             mdbSearchIndexSize;  /* Number of slots in the hash table, power of two */
+
+/* Lookup of scanned file entries by content, same layout as mdbSearchIndex but keyed on (size, fingerprint). It lets
+ * copies of the same file with a different name take the information from an entry that is already scanned, instead
+ * of probing the file again. Slots are validated on lookup, since entries can be rescanned.
+ */
+#define MDB_FINGERPRINT_TAIL 4096 /* the fingerprint covers the size, the head read by mdbReadInfo and the last bytes of the file */
+static uint32_t            *mdbFingerprintIndexData;
+static uint32_t             mdbFingerprintIndexCount;
+static uint32_t             mdbFingerprintIndexSize;
+
+/* Strings that are referenced by more than one file entry, sorted by ref. An entry that has the same content as an
+ * already scanned entry shares its strings (see mdbScan), so a shared string is never changed or freed in place,
+ * mdbWriteString() writes a new one instead. Built by mdbInit() from the file entries, not stored.
+ */
+struct mdbSharedString_t
+{
+	uint32_t ref;
+	uint32_t count; /* number of file entries that use it, always 2 or more */
+};
+static struct mdbSharedString_t *mdbSharedStrings;
+static uint32_t                  mdbSharedStringsCount;
+static uint32_t                  mdbSharedStringsSize;
 
 int mdbGetModuleType (uint32_t mdb_ref, struct moduletype *dst)
 {
@@ -148,6 +201,234 @@ int mdbInfoIsAvailable (uint32_t mdb_ref)
 /* This thing will end up with a register of all valid pre-interprators for modules and friends
  */
 static struct mdbreadinforegstruct *mdbReadInfos=NULL;
+
+/* Dispatch tables, so that mdbReadInfo() only needs to call the ReadInfo of the plugins that can match a given file.
+ * Signatures are grouped by the absolute file offset of their first byte that has all bits significant, and looked up
+ * by the value of that byte. Extensions are hashed by the text after their last dot.
+ */
+struct mdbReadInfoSigNode_t
+{
+	const struct mdbreadinfosig *sig;
+	unsigned int plugin; /* index in the mdbReadInfos list */
+	struct mdbReadInfoSigNode_t *next;
+};
+
+struct mdbReadInfoOffset_t
+{
+	unsigned int offset;
+	struct mdbReadInfoSigNode_t *bucket[256];
+};
+
+struct mdbReadInfoExtNode_t
+{
+	const char *ext;
+	unsigned int plugin;
+	struct mdbReadInfoExtNode_t *next;
+};
+
+#define MDB_READINFO_EXT_BUCKETS 64
+
+static int                           mdbReadInfoDispatchDirty = 1;
+static unsigned int                  mdbReadInfoPlugins;  /* number of entries in mdbReadInfos */
+static char                         *mdbReadInfoCandidate; /* one per plugin */
+static struct mdbReadInfoOffset_t   *mdbReadInfoOffsets;
+static unsigned int                  mdbReadInfoOffsetsCount;
+static struct mdbReadInfoSigNode_t  *mdbReadInfoSigWild; /* signatures without a fully significant byte */
+static struct mdbReadInfoSigNode_t  *mdbReadInfoSigNodes;
+static struct mdbReadInfoExtNode_t  *mdbReadInfoExtBuckets[MDB_READINFO_EXT_BUCKETS];
+static struct mdbReadInfoExtNode_t  *mdbReadInfoExtNodes;
+
+static void mdbReadInfoDispatchClear (void)
+{
+	free (mdbReadInfoCandidate);
+	free (mdbReadInfoOffsets);
+	free (mdbReadInfoSigNodes);
+	free (mdbReadInfoExtNodes);
+	mdbReadInfoCandidate = 0;
+	mdbReadInfoOffsets = 0;
+	mdbReadInfoOffsetsCount = 0;
+	mdbReadInfoSigWild = 0;
+	mdbReadInfoSigNodes = 0;
+	mdbReadInfoExtNodes = 0;
+	memset (mdbReadInfoExtBuckets, 0, sizeof (mdbReadInfoExtBuckets));
+	mdbReadInfoPlugins = 0;
+	mdbReadInfoDispatchDirty = 1;
+}
+
+static unsigned int mdbReadInfoExtHash (const char *ext)
+{
+	unsigned int retval = 0;
+	for (; *ext; ext++)
+	{
+		retval = retval * 31 + toupper ((unsigned char)*ext);
+	}
+	return retval % MDB_READINFO_EXT_BUCKETS;
+}
+
+static int mdbReadInfoSigKey (const struct mdbreadinfosig *sig)
+{
+	int i;
+	for (i=0; i < sig->length; i++)
+	{
+		if ((!sig->mask) || ((uint8_t)sig->mask[i] == 0xff))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void mdbReadInfoDispatchBuild (void)
+{
+	struct mdbreadinforegstruct *rinfos;
+	const struct mdbreadinfosig *sig;
+	unsigned int signodes = 0, extnodes = 0, i, j;
+
+	mdbReadInfoDispatchClear ();
+
+	for (rinfos=mdbReadInfos; rinfos; rinfos=rinfos->next)
+	{
+		mdbReadInfoPlugins++;
+		for (sig = rinfos->Signatures; sig && sig->length; sig++)
+		{
+			signodes++;
+		}
+		for (i = 0; rinfos->Extensions && rinfos->Extensions[i]; i++)
+		{
+			extnodes++;
+		}
+	}
+
+	mdbReadInfoCandidate = calloc (mdbReadInfoPlugins + 1, 1);
+	mdbReadInfoSigNodes = calloc (signodes + 1, sizeof (mdbReadInfoSigNodes[0]));
+	mdbReadInfoOffsets = calloc (signodes + 1, sizeof (mdbReadInfoOffsets[0]));
+	mdbReadInfoExtNodes = calloc (extnodes + 1, sizeof (mdbReadInfoExtNodes[0]));
+	if ((!mdbReadInfoCandidate) || (!mdbReadInfoSigNodes) || (!mdbReadInfoOffsets) || (!mdbReadInfoExtNodes))
+	{
+		fprintf (stderr, "mdbReadInfoDispatchBuild: malloc() failed, all plugins will be probed\n");
+		mdbReadInfoDispatchClear ();
+		mdbReadInfoDispatchDirty = 0;
+		return;
+	}
+
+	signodes = 0;
+	extnodes = 0;
+	for (i=0, rinfos=mdbReadInfos; rinfos; i++, rinfos=rinfos->next)
+	{
+		for (sig = rinfos->Signatures; sig && sig->length; sig++)
+		{
+			struct mdbReadInfoSigNode_t *node = mdbReadInfoSigNodes + signodes++;
+			int key = mdbReadInfoSigKey (sig);
+
+			node->sig = sig;
+			node->plugin = i;
+			if (key < 0)
+			{
+				node->next = mdbReadInfoSigWild;
+				mdbReadInfoSigWild = node;
+				continue;
+			}
+			for (j=0; j < mdbReadInfoOffsetsCount; j++)
+			{
+				if (mdbReadInfoOffsets[j].offset == sig->offset + key)
+				{
+					break;
+				}
+			}
+			if (j == mdbReadInfoOffsetsCount)
+			{
+				mdbReadInfoOffsets[j].offset = sig->offset + key;
+				mdbReadInfoOffsetsCount++;
+			}
+			node->next = mdbReadInfoOffsets[j].bucket[(uint8_t)sig->bytes[key]];
+			mdbReadInfoOffsets[j].bucket[(uint8_t)sig->bytes[key]] = node;
+		}
+		for (j = 0; rinfos->Extensions && rinfos->Extensions[j]; j++)
+		{
+			struct mdbReadInfoExtNode_t *node = mdbReadInfoExtNodes + extnodes++;
+			const char *tail = strrchr (rinfos->Extensions[j], '.');
+			unsigned int hash = mdbReadInfoExtHash (tail ? tail + 1 : rinfos->Extensions[j]);
+
+			node->ext = rinfos->Extensions[j];
+			node->plugin = i;
+			node->next = mdbReadInfoExtBuckets[hash];
+			mdbReadInfoExtBuckets[hash] = node;
+		}
+	}
+
+	mdbReadInfoDispatchDirty = 0;
+}
+
+static int mdbReadInfoSigMatch (const struct mdbreadinfosig *sig, const char *buf, size_t len)
+{
+	int i;
+
+	if ((sig->offset + sig->length) > len)
+	{
+		return 0;
+	}
+	for (i=0; i < sig->length; i++)
+	{
+		uint8_t mask = sig->mask ? (uint8_t)sig->mask[i] : 0xff;
+		if (((uint8_t)buf[sig->offset + i] ^ (uint8_t)sig->bytes[i]) & mask)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* flag all plugins in mdbReadInfoCandidate[] that has a signature or extension matching the file */
+static void mdbReadInfoDispatch (const char *filename, const char *buf, size_t len)
+{
+	struct mdbReadInfoSigNode_t *signode;
+	unsigned int i;
+
+	memset (mdbReadInfoCandidate, 0, mdbReadInfoPlugins);
+
+	for (i=0; i < mdbReadInfoOffsetsCount; i++)
+	{
+		if (mdbReadInfoOffsets[i].offset >= len)
+		{
+			continue;
+		}
+		for (signode = mdbReadInfoOffsets[i].bucket[(uint8_t)buf[mdbReadInfoOffsets[i].offset]]; signode; signode = signode->next)
+		{
+			if ((!mdbReadInfoCandidate[signode->plugin]) && mdbReadInfoSigMatch (signode->sig, buf, len))
+			{
+				mdbReadInfoCandidate[signode->plugin] = 1;
+			}
+		}
+	}
+	for (signode = mdbReadInfoSigWild; signode; signode = signode->next)
+	{
+		if ((!mdbReadInfoCandidate[signode->plugin]) && mdbReadInfoSigMatch (signode->sig, buf, len))
+		{
+			mdbReadInfoCandidate[signode->plugin] = 1;
+		}
+	}
+
+	if (filename)
+	{
+		const char *tail = strrchr (filename, '.');
+		struct mdbReadInfoExtNode_t *extnode;
+		size_t filenamelen = strlen (filename);
+
+		if (!tail)
+		{
+			return;
+		}
+		for (extnode = mdbReadInfoExtBuckets[mdbReadInfoExtHash (tail + 1)]; extnode; extnode = extnode->next)
+		{
+			size_t extlen = strlen (extnode->ext);
+			if ((extlen <= filenamelen) && (!strcasecmp (filename + filenamelen - extlen, extnode->ext)))
+			{
+				mdbReadInfoCandidate[extnode->plugin] = 1;
+			}
+		}
+	}
+}
+
 void mdbRegisterReadInfo (struct mdbreadinforegstruct *r)
 {
 	DEBUG_PRINT ("mdbRegisterReadInfo(%s)\n", r->name);
@@ -158,6 +439,7 @@ void mdbRegisterReadInfo (struct mdbreadinforegstruct *r)
 	{
 		r->Event(mdbEvInit);
 	}
+	mdbReadInfoDispatchDirty = 1;
 }
 
 void mdbUnregisterReadInfo (struct mdbreadinforegstruct *r)
@@ -171,6 +453,12 @@ void mdbUnregisterReadInfo (struct mdbreadinforegstruct *r)
 			DEBUG_PRINT ("mdbUnregisterReadInfo(%s)\n", r->name);
 
 			*prev = (*prev)->next;
+			if (mdbReadInfos)
+			{
+				mdbReadInfoDispatchDirty = 1;
+			} else {
+				mdbReadInfoDispatchClear ();
+			}
 			return;
 		}
 		prev = &(*prev)->next;
@@ -179,55 +467,269 @@ void mdbUnregisterReadInfo (struct mdbreadinforegstruct *r)
 	DEBUG_PRINT ("mdbUnregisterReadInfo(%s) # WARNING, unable to find entry\n", r->name);
 }
 
+static struct mdbwritenotifyregstruct *mdbWriteNotifies=NULL;
+void mdbRegisterWriteNotify (struct mdbwritenotifyregstruct *r)
+{
+	r->next=mdbWriteNotifies;
+	mdbWriteNotifies=r;
+}
+
+void mdbUnregisterWriteNotify (struct mdbwritenotifyregstruct *r)
+{
+	struct mdbwritenotifyregstruct **prev = &mdbWriteNotifies;
+
+	while (*prev)
+	{
+		if (*prev == r)
+		{
+			*prev = (*prev)->next;
+			return;
+		}
+		prev = &(*prev)->next;
+	}
+}
+
+#define MDB_SCANBUF_SIZE 1084
+
+/* reads the head of the file into mdbScanBuf, returns -1 on failure */
+static int mdbReadHead (struct ocpfilehandle_t *f, char *mdbScanBuf)
+{
+	if (f->seek_set (f, 0) < 0)
+	{
+		return -1;
+	}
+	memset (mdbScanBuf, 0, MDB_SCANBUF_SIZE);
+	return f->read (f, mdbScanBuf, MDB_SCANBUF_SIZE);
+}
+
+/* mdbScanBuf contains the head of the file, and f is positioned right after it */
+static int mdbReadInfoHead (struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *mdbScanBuf, int maxl)
+{
+	struct mdbreadinforegstruct *rinfos;
+	const char *path = 0;
+	unsigned int i;
+
+	dirdbGetName_internalstr (f->dirdb_ref, &path);
+	DEBUG_PRINT ("   mdbReadInfo(%s %p %d)\n", path, mdbScanBuf, maxl);
+
+	if (mdbReadInfoDispatchDirty)
+	{
+		mdbReadInfoDispatchBuild ();
+	}
+	if (mdbReadInfoCandidate)
+	{
+		mdbReadInfoDispatch (path, mdbScanBuf, maxl > 0 ? maxl : 0);
+	}
+
+	/* plugins without signatures or extensions are always probed, they might do more I/O */
+	for (i=0, rinfos=mdbReadInfos; rinfos; i++, rinfos=rinfos->next)
+	{
+		if (!rinfos->ReadInfo)
+		{
+			continue;
+		}
+		if (mdbReadInfoCandidate && (rinfos->Signatures || rinfos->Extensions) && !mdbReadInfoCandidate[i])
+		{
+			continue;
+		}
+		if (rinfos->ReadInfo(m, f, mdbScanBuf, maxl))
+		{
+			return 1;
+		}
+	}
+
+	return m->modtype.integer.i != 0;
+}
+
 /* detect file infomation using 'plugins' */
 int mdbReadInfo (struct moduleinfostruct *m, struct ocpfilehandle_t *f)
 {
-	char mdbScanBuf[1084];
-	struct mdbreadinforegstruct *rinfos;
+	char mdbScanBuf[MDB_SCANBUF_SIZE];
 	int maxl;
 
 	DEBUG_PRINT ("mdbReadInfo(f=%p)\n", f);
 
-	if (f->seek_set (f, 0) < 0)
+	if ((maxl = mdbReadHead (f, mdbScanBuf)) < 0)
 	{
 		return 1;
 	}
-	memset (mdbScanBuf, 0, sizeof (mdbScanBuf));
-	maxl = f->read (f, mdbScanBuf, sizeof (mdbScanBuf));
+	return mdbReadInfoHead (m, f, mdbScanBuf, maxl);
+}
+
+static void mdbFreeListPush (uint32_t start, uint32_t length)
+{
+	struct mdbFreeList_t *l = &mdbFreeLists[(length < MDB_FREE_BUCKETS) ? length : (MDB_FREE_BUCKETS - 1)];
 
+	if (!length)
 	{
-		const char *path;
-		dirdbGetName_internalstr (f->dirdb_ref, &path);
-		DEBUG_PRINT ("   mdbReadInfo(%s %p %d)\n", path, mdbScanBuf, maxl);
+		return;
 	}
+	if (l->count == l->size)
+	{
+		uint32_t newsize = l->size ? (l->size * 2) : 64;
+		struct mdbFreeExtent_t *t = realloc (l->data, newsize * sizeof (l->data[0]));
+		if (!t)
+		{ /* the extent is lost until next mdbInit() */
+			DEBUG_PRINT ("mdbFreeListPush() realloc() failed\n");
+			return;
+		}
+		/* unwrap the ring buffer, so the new space comes after the tail */
+		memcpy (t + l->size, t, l->head * sizeof (t[0]));
+		memmove (t, t + l->head, l->size * sizeof (t[0]));
+		l->data = t;
+		l->head = 0;
+		l->size = newsize;
+	}
+	l->data[(l->head + l->count) % l->size].start = start;
+	l->data[(l->head + l->count) % l->size].length = length;
+	l->count++;
+	mdbFreeRecords += length;
+}
 
-	/* slow version that also allows more I/O */
-	for (rinfos=mdbReadInfos; rinfos; rinfos=rinfos->next)
-		if (rinfos->ReadInfo)
-			if (rinfos->ReadInfo(m, f, mdbScanBuf, maxl))
-				return 1;
-
-	return m->modtype.integer.i != 0;
+/* Unit test available */
+static void mdbFreeListClear (void)
+{
+	int i;
+	for (i=0; i < MDB_FREE_BUCKETS; i++)
+	{
+		free (mdbFreeLists[i].data);
+	}
+	memset (mdbFreeLists, 0, sizeof (mdbFreeLists));
+	mdbFreeRecords = 0;
 }
 
 /* Unit test available */
-static uint32_t mdbNew (int size)
+static void mdbFreeListBuild (void)
 {
-	uint32_t i, j;
+	uint32_t i, first = 0;
+
+	mdbFreeListClear ();
+
+	for (i=1; i < mdbDataSize; i++) /* entry #0 is the header */
+	{
+		if (mdbData[i].mie.general.record_flags & MDB_USED)
+		{
+			if (first)
+			{
+				mdbFreeListPush (first, i - first);
+				first = 0;
+			}
+		} else if (!first)
+		{
+			first = i;
+		}
+	}
+	if (first)
+	{
+		mdbFreeListPush (first, mdbDataSize - first);
+	}
+}
+
+/* take the first extent that can hold size records, from the smallest bucket that has one */
+static uint32_t mdbFreeListTake (int size)
+{
+	struct mdbFreeExtent_t e;
+	struct mdbFreeList_t *l;
+	int b;
 
-	for (i=mdbDataNextFree; i+size <= mdbDataSize; i++)
+	for (b = size; b < (MDB_FREE_BUCKETS - 1); b++)
 	{
-		for (j=0; j < size; j++)
+		if (mdbFreeLists[b].count)
 		{
-			if (mdbData[i+j].mie.general.record_flags & MDB_USED)
+			break;
+		}
+	}
+	l = &mdbFreeLists[b];
+	if (!l->count)
+	{
+		return UINT32_MAX;
+	}
+	if (l->data[l->head].length < size)
+	{ /* only possible in the last bucket, and only if size >= MDB_FREE_BUCKETS-1 */
+		uint32_t i;
+		for (i=1; i < l->count; i++)
+		{
+			if (l->data[(l->head + i) % l->size].length >= size)
 			{
 				break;
 			}
 		}
-		if (j == size)
+		if (i == l->count)
+		{
+			return UINT32_MAX;
+		}
+		e = l->data[(l->head + i) % l->size];
+		l->data[(l->head + i) % l->size] = l->data[l->head];
+		l->data[l->head] = e;
+	}
+	e = l->data[l->head];
+	l->head = (l->head + 1) % l->size;
+	l->count--;
+	mdbFreeRecords -= e.length;
+
+	mdbFreeListPush (e.start + size, e.length - size);
+
+	return e.start;
+}
+
+/* Allocates the disk space of CPMODNFO.DAT from record oldsize up to newsize. A sparse file, as made by ftruncate(),
+ * would only fail when the mapping is written to, with SIGBUS if the disk is full. Returns non-zero on error, errno
+ * is set.
+ */
+static int mdbFileGrow (uint32_t oldsize, uint32_t newsize)
+{
+	off_t pos = (off_t)oldsize * sizeof (mdbData[0]);
+	off_t end = (off_t)newsize * sizeof (mdbData[0]);
+	char zero[4096];
+
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+	{
+		int res = posix_fallocate (mdbFd, pos, end - pos);
+		if (!res)
+		{
+			return 0;
+		}
+		if ((res != EOPNOTSUPP) && (res != EINVAL) && (res != ENOSYS))
+		{
+			errno = res;
+			return -1;
+		}
+		DEBUG_PRINT ("mdbFileGrow() posix_fallocate() is not supported: %s\n", strerror (res));
+	}
+#endif
+
+	/* fallback, write the zeroes ourself */
+	memset (zero, 0, sizeof (zero));
+	while (pos < end)
+	{
+		ssize_t res = pwrite (mdbFd, zero, ((end - pos) > (off_t)sizeof (zero)) ? sizeof (zero) : (size_t)(end - pos), pos);
+		if (res < 0)
+		{
+			if ((errno == EINTR) || (errno == EAGAIN))
+			{
+				continue;
+			}
+			return -1;
+		}
+		if (!res)
 		{
-			goto ready;
+			errno = ENOSPC;
+			return -1;
 		}
+		pos += res;
+	}
+	return 0;
+}
+
+/* Unit test available */
+static uint32_t mdbNew (int size)
+{
+	uint32_t i, j;
+
+	i = mdbFreeListTake (size);
+	if (i != UINT32_MAX)
+	{
+		goto ready;
 	}
 
 	{
@@ -257,19 +759,48 @@ static uint32_t mdbNew (int size)
 		}
 
 		/* grow mdbData, in GROW chunks */
-		t=realloc(mdbData, N * sizeof(mdbData[0]));
-		if (!t)
+		if (mdbMapped)
 		{
-			DEBUG_PRINT ("mdbNew() realloc(mdbData) failed\n");
-			return UINT32_MAX;
+			if (N > mdbMapSize)
+			{
+				uint32_t newMapSize = mdbMapSize + mdbMapSize / 2;
+				if (newMapSize < (mdbMapSize + MDB_MAP_GROW))
+				{
+					newMapSize = mdbMapSize + MDB_MAP_GROW;
+				}
+				if (mdbFileGrow (mdbMapSize, newMapSize))
+				{
+					fprintf (stderr, "mdbNew: failed to grow CPMODNFO.DAT: %s\n", strerror (errno));
+					return UINT32_MAX;
+				}
+				/* map the new size before releasing the old mapping, so we never loose the data on failure */
+				t = mmap (0, (size_t)newMapSize * sizeof(mdbData[0]), PROT_READ | PROT_WRITE, MAP_SHARED, mdbFd, 0);
+				if (t == MAP_FAILED)
+				{
+					DEBUG_PRINT ("mdbNew() mmap() failed: %s\n", strerror (errno));
+					return UINT32_MAX;
+				}
+				munmap (mdbData, (size_t)mdbMapSize * sizeof(mdbData[0]));
+				mdbData = (struct modinfoentry *)t;
+				mdbMapSize = newMapSize;
+			}
+		} else {
+			t=realloc(mdbData, N * sizeof(mdbData[0]));
+			if (!t)
+			{
+				DEBUG_PRINT ("mdbNew() realloc(mdbData) failed\n");
+				return UINT32_MAX;
+			}
+			mdbData=(struct modinfoentry *)t;
 		}
-		mdbData=(struct modinfoentry *)t;
 		bzero(mdbData + mdbDataSize, (N - mdbDataSize) * sizeof(mdbData[0]));
-		mdbDataSize = N;
-		for (j=i; j<mdbDataSize; j++) /* all appended entries are dirty */
+		for (j=mdbDataSize; j<N; j++) /* all appended entries are dirty */
 		{
 			mdbDirtyMap[j>>3] |= 1 << (j & 0x07);
 		}
+		i = mdbDataSize ? mdbDataSize : 1; /* entry #0 is the header */
+		mdbDataSize = N;
+		mdbFreeListPush (i + size, N - i - size);
 	}
 ready:
 	for (j = 0; j < size; j++)
@@ -281,11 +812,6 @@ ready:
 
 	DEBUG_PRINT("mdbNew(size=%d) => 0x%08" PRIx32 "\n", size, i);
 
-	if ((size == 1)||(mdbDataNextFree == i))
-	{
-		mdbDataNextFree = i + size; /* it might not be free, but it is atleast not before this */
-	}
-
 	return i;
 }
 
@@ -305,9 +831,152 @@ static void mdbFree (uint32_t ref, int size)
 		mdbDirtyMap[(ref + j)>>3] |= 1 << ((ref + j) & 0x07);
 	}
 
-	if (ref < mdbDataNextFree)
+	mdbFreeListPush (ref, size);
+}
+
+/* returns the position of the first shared string with a ref that is not below ref */
+static uint32_t mdbSharedStringFind (uint32_t ref)
+{
+	uint32_t lo = 0, hi = mdbSharedStringsCount;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (mdbSharedStrings[mid].ref < ref)
+		{
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* one more file entry uses the string at ref, that was already used by at least one entry. Returns non-zero on error */
+static int mdbSharedStringRef (uint32_t ref)
+{
+	uint32_t i = mdbSharedStringFind (ref);
+
+	if ((i < mdbSharedStringsCount) && (mdbSharedStrings[i].ref == ref))
+	{
+		mdbSharedStrings[i].count++;
+		return 0;
+	}
+	if (mdbSharedStringsCount == mdbSharedStringsSize)
+	{
+		uint32_t newsize = mdbSharedStringsSize ? (mdbSharedStringsSize * 2) : 64;
+		struct mdbSharedString_t *temp = realloc (mdbSharedStrings, newsize * sizeof (mdbSharedStrings[0]));
+		if (!temp)
+		{
+			return -1;
+		}
+		mdbSharedStrings = temp;
+		mdbSharedStringsSize = newsize;
+	}
+	memmove (mdbSharedStrings + i + 1, mdbSharedStrings + i, (mdbSharedStringsCount - i) * sizeof (mdbSharedStrings[0]));
+	mdbSharedStrings[i].ref = ref;
+	mdbSharedStrings[i].count = 2;
+	mdbSharedStringsCount++;
+	return 0;
+}
+
+/* a file entry stops using the string at ref. Returns non-zero if other entries still use it */
+static int mdbSharedStringUnref (uint32_t ref)
+{
+	uint32_t i = mdbSharedStringFind (ref);
+
+	if ((i >= mdbSharedStringsCount) || (mdbSharedStrings[i].ref != ref))
+	{
+		return 0;
+	}
+	if (--mdbSharedStrings[i].count < 2)
+	{
+		memmove (mdbSharedStrings + i, mdbSharedStrings + i + 1, (mdbSharedStringsCount - i - 1) * sizeof (mdbSharedStrings[0]));
+		mdbSharedStringsCount--;
+	}
+	return 1;
+}
+
+/* finds the strings that more than one file entry refers to. Returns non-zero on error */
+static int mdbSharedStringsBuild (void)
+{
+	uint8_t *seen = calloc ((mdbDataSize + 7) / 8, 1);
+	uint32_t i;
+	int j;
+
+	if (!seen)
+	{
+		return -1;
+	}
+	for (i=1; i < mdbDataSize; i++)
+	{
+		uint32_t refs[6];
+
+		if (mdbData[i].mie.general.record_flags != MDB_USED)
+		{
+			continue;
+		}
+		refs[0] = mdbData[i].mie.general.title_ref;
+		refs[1] = mdbData[i].mie.general.composer_ref;
+		refs[2] = mdbData[i].mie.general.artist_ref;
+		refs[3] = mdbData[i].mie.general.style_ref;
+		refs[4] = mdbData[i].mie.general.comment_ref;
+		refs[5] = mdbData[i].mie.general.album_ref;
+		for (j=0; j < 6; j++)
+		{
+			if ((refs[j] == 0) || (refs[j] >= mdbDataSize))
+			{
+				continue;
+			}
+			if (!(seen[refs[j] >> 3] & (1 << (refs[j] & 0x07))))
+			{
+				seen[refs[j] >> 3] |= 1 << (refs[j] & 0x07);
+				continue;
+			}
+			if (mdbSharedStringRef (refs[j]))
+			{
+				free (seen);
+				return -1;
+			}
+		}
+	}
+	free (seen);
+	return 0;
+}
+
+static int mdbStringEquals (uint32_t ref, const char *string)
+{
+	int len = strlen (string);
+
+	while (1)
 	{
-		mdbDataNextFree = ref;
+		int l = (len > 63) ? 63 : len;
+		uint8_t flags;
+
+		if ((ref == 0) || (ref >= mdbDataSize))
+		{
+			return 0;
+		}
+		flags = mdbData[ref].mie.general.record_flags & MDB_STRING_MORE;
+		if ((flags != MDB_STRING_MORE) && (flags != MDB_STRING_TERMINATION))
+		{
+			return 0;
+		}
+		if (memcmp (mdbData[ref].mie.string.data, string, l) || ((l < 63) && mdbData[ref].mie.string.data[l]))
+		{
+			return 0;
+		}
+		string += l;
+		len -= l;
+		if (flags == MDB_STRING_TERMINATION)
+		{
+			return !len;
+		}
+		if (!len)
+		{
+			return 0;
+		}
+		ref++;
 	}
 }
 
@@ -316,6 +985,17 @@ static int mdbWriteString (char *string, uint32_t *ref)
 {
 	int oldlen = 0;
 	int newlen = (strlen (string) + 62) / 63; /* no need to zero-terminate if we end at a boundary */
+	if (((*ref) < mdbDataSize) && ((*ref) != 0) && mdbSharedStringsCount)
+	{
+		if (mdbStringEquals (*ref, string))
+		{ /* keep sharing it */
+			return 0;
+		}
+		if (mdbSharedStringUnref (*ref))
+		{ /* other entries still use the old string */
+			*ref = 0;
+		}
+	}
 	if (((*ref) < mdbDataSize) && ((*ref) != 0))
 	{
 		while (1)
@@ -398,25 +1078,221 @@ int mdbWriteModuleInfo (uint32_t mdb_ref, struct moduleinfostruct *m)
 	if (!m->modtype.string.c[1]) m->modtype.string.c[2] = 0;
 	if (!m->modtype.string.c[2]) m->modtype.string.c[3] = 0;
 
-	/* first transfer all the direct entries */
-	mdbData[mdb_ref].mie.general.modtype = m->modtype;
-	mdbData[mdb_ref].mie.general.module_flags = m->flags;
-	mdbData[mdb_ref].mie.general.channels = m->channels;
-	mdbData[mdb_ref].mie.general.playtime = m->playtime;
-	mdbData[mdb_ref].mie.general.date = m->date;
+	/* first transfer all the direct entries */
+	mdbData[mdb_ref].mie.general.modtype = m->modtype;
+	mdbData[mdb_ref].mie.general.module_flags = m->flags;
+	mdbData[mdb_ref].mie.general.channels = m->channels;
+	mdbData[mdb_ref].mie.general.playtime = m->playtime;
+	mdbData[mdb_ref].mie.general.date = m->date;
+
+	/* mdbData might move while inside mdbWriteString due to mdbNew() */
+	temp = mdbData[mdb_ref].mie.general.title_ref;    retval |= mdbWriteString (m->title,    &temp); mdbData[mdb_ref].mie.general.title_ref    = temp;
+	temp = mdbData[mdb_ref].mie.general.composer_ref; retval |= mdbWriteString (m->composer, &temp); mdbData[mdb_ref].mie.general.composer_ref = temp;
+	temp = mdbData[mdb_ref].mie.general.artist_ref;   retval |= mdbWriteString (m->artist,   &temp); mdbData[mdb_ref].mie.general.artist_ref   = temp;
+	temp = mdbData[mdb_ref].mie.general.style_ref;    retval |= mdbWriteString (m->style,    &temp); mdbData[mdb_ref].mie.general.style_ref    = temp;
+	temp = mdbData[mdb_ref].mie.general.comment_ref;  retval |= mdbWriteString (m->comment,  &temp); mdbData[mdb_ref].mie.general.comment_ref  = temp;
+	temp = mdbData[mdb_ref].mie.general.album_ref;    retval |= mdbWriteString (m->album,    &temp); mdbData[mdb_ref].mie.general.album_ref    = temp;
+
+	mdbDirty=1;
+	mdbDirtyMap[mdb_ref>>3] |= 1 << (mdb_ref & 0x07);
+
+	{
+		struct mdbwritenotifyregstruct *n;
+		for (n = mdbWriteNotifies; n; n = n->next)
+		{
+			n->Notify (mdb_ref);
+		}
+	}
+
+	return !retval;
+}
+
+/* Makes mdb_ref describe the same module as twin, using the strings of twin instead of copies of them.
+ * returns zero on error */
+static int mdbShareModuleInfo (uint32_t mdb_ref, uint32_t twin)
+{
+	uint32_t *dst[6];
+	uint32_t src[6];
+	int retval = 0;
+	int i;
+
+	DEBUG_PRINT("mdbShareModuleInfo(0x%"PRIx32", 0x%"PRIx32")\n", mdb_ref, twin);
+
+	assert (mdb_ref > 0);
+	assert (mdb_ref < mdbDataSize);
+	assert (mdbData[mdb_ref].mie.general.record_flags == MDB_USED);
+	assert (twin > 0);
+	assert (twin < mdbDataSize);
+	assert (mdbData[twin].mie.general.record_flags == MDB_USED);
+
+	mdbData[mdb_ref].mie.general.modtype = mdbData[twin].mie.general.modtype;
+	mdbData[mdb_ref].mie.general.module_flags = mdbData[twin].mie.general.module_flags;
+	mdbData[mdb_ref].mie.general.channels = mdbData[twin].mie.general.channels;
+	mdbData[mdb_ref].mie.general.playtime = mdbData[twin].mie.general.playtime;
+	mdbData[mdb_ref].mie.general.date = mdbData[twin].mie.general.date;
+
+	/* release the strings of mdb_ref first, mdbData does not move while freeing */
+	dst[0] = &mdbData[mdb_ref].mie.general.title_ref;
+	dst[1] = &mdbData[mdb_ref].mie.general.composer_ref;
+	dst[2] = &mdbData[mdb_ref].mie.general.artist_ref;
+	dst[3] = &mdbData[mdb_ref].mie.general.style_ref;
+	dst[4] = &mdbData[mdb_ref].mie.general.comment_ref;
+	dst[5] = &mdbData[mdb_ref].mie.general.album_ref;
+	src[0] = mdbData[twin].mie.general.title_ref;
+	src[1] = mdbData[twin].mie.general.composer_ref;
+	src[2] = mdbData[twin].mie.general.artist_ref;
+	src[3] = mdbData[twin].mie.general.style_ref;
+	src[4] = mdbData[twin].mie.general.comment_ref;
+	src[5] = mdbData[twin].mie.general.album_ref;
+	for (i=0; i < 6; i++)
+	{
+		mdbWriteString ("", dst[i]);
+		*dst[i] = src[i];
+		if ((src[i] != 0) && (src[i] < mdbDataSize))
+		{
+			retval |= mdbSharedStringRef (src[i]);
+		}
+	}
+
+	mdbDirty=1;
+	mdbDirtyMap[mdb_ref>>3] |= 1 << (mdb_ref & 0x07);
+
+	{
+		struct mdbwritenotifyregstruct *n;
+		for (n = mdbWriteNotifies; n; n = n->next)
+		{
+			n->Notify (mdb_ref);
+		}
+	}
+
+	return !retval;
+}
+
+/* FNV-1a over the size, the head and (if seeking is cheap) the tail of the file, returns 0 if the file could not be read.
+ * f must be positioned right after the head, and is left there */
+static uint64_t mdbFingerprint (struct ocpfilehandle_t *f, uint64_t size, const char *head, int headlen)
+{
+	uint8_t tail[MDB_FINGERPRINT_TAIL];
+	uint64_t h = 14695981039346656037ull;
+	int i;
+
+	if ((headlen < 0) || ((uint64_t)headlen != ((size < MDB_SCANBUF_SIZE) ? size : MDB_SCANBUF_SIZE)))
+	{
+		return 0;
+	}
+
+	for (i=0; i < 8; i++)
+	{
+		h ^= (uint8_t)(size >> (i * 8));
+		h *= 1099511628211ull;
+	}
+	for (i=0; i < headlen; i++)
+	{
+		h ^= (uint8_t)head[i];
+		h *= 1099511628211ull;
+	}
+
+	if (size > headlen)
+	{
+		if (f->ioctl (f, IOCTL_FILEHANDLE_RANDOM_ACCESS, 0))
+		{ /* reaching the tail would decode the entire file (gzip, members of compressed archives, etc.), use the head only */
+			h ^= 'H';
+			h *= 1099511628211ull;
+		} else {
+			uint64_t pos = ((size - headlen) > MDB_FINGERPRINT_TAIL) ? (size - MDB_FINGERPRINT_TAIL) : (uint64_t)headlen;
+			int len = size - pos;
+
+			if ((f->seek_set (f, pos) < 0) || (f->read (f, tail, len) != len) || (f->seek_set (f, headlen) < 0))
+			{
+				return 0;
+			}
+			for (i=0; i < len; i++)
+			{
+				h ^= tail[i];
+				h *= 1099511628211ull;
+			}
+		}
+	}
+
+	return h ? h : 1;
+}
+
+/* returns the slot that either contains an entry with the given key, or the empty slot where it should be inserted */
+static uint32_t *mdbFingerprintIndexLocate (uint64_t size, uint64_t fingerprint)
+{
+	uint32_t mask = mdbFingerprintIndexSize - 1;
+	uint32_t i = (uint32_t)(fingerprint ^ (fingerprint >> 32) ^ size) & mask;
+
+	while (mdbFingerprintIndexData[i])
+	{
+		struct modinfoentry *m = &mdbData[mdbFingerprintIndexData[i]];
+		if ((m->mie.general.size == size) && (m->mie.general.fingerprint == fingerprint))
+		{
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return mdbFingerprintIndexData + i;
+}
+
+/* newsize must be a power of two, and large enough to keep the load below 3/4 */
+static int mdbFingerprintIndexResize (uint32_t newsize)
+{
+	uint32_t *olddata = mdbFingerprintIndexData;
+	uint32_t oldsize = mdbFingerprintIndexSize;
+	uint32_t i;
+
+	mdbFingerprintIndexData = calloc (newsize, sizeof (*mdbFingerprintIndexData));
+	if (!mdbFingerprintIndexData)
+	{
+		mdbFingerprintIndexData = olddata;
+		return -1;
+	}
+	mdbFingerprintIndexSize = newsize;
+
+	for (i=0; i < oldsize; i++)
+	{
+		if (olddata[i])
+		{
+			struct modinfoentry *m = &mdbData[olddata[i]];
+			*mdbFingerprintIndexLocate (m->mie.general.size, m->mie.general.fingerprint) = olddata[i];
+		}
+	}
+	free (olddata);
+	return 0;
+}
+
+static void mdbFingerprintIndexAdd (uint32_t mdb_ref)
+{
+	uint32_t *slot;
 
-	/* mdbData might move while inside mdbWriteString due to mdbNew() */
-	temp = mdbData[mdb_ref].mie.general.title_ref;    retval |= mdbWriteString (m->title,    &temp); mdbData[mdb_ref].mie.general.title_ref    = temp;
-	temp = mdbData[mdb_ref].mie.general.composer_ref; retval |= mdbWriteString (m->composer, &temp); mdbData[mdb_ref].mie.general.composer_ref = temp;
-	temp = mdbData[mdb_ref].mie.general.artist_ref;   retval |= mdbWriteString (m->artist,   &temp); mdbData[mdb_ref].mie.general.artist_ref   = temp;
-	temp = mdbData[mdb_ref].mie.general.style_ref;    retval |= mdbWriteString (m->style,    &temp); mdbData[mdb_ref].mie.general.style_ref    = temp;
-	temp = mdbData[mdb_ref].mie.general.comment_ref;  retval |= mdbWriteString (m->comment,  &temp); mdbData[mdb_ref].mie.general.comment_ref  = temp;
-	temp = mdbData[mdb_ref].mie.general.album_ref;    retval |= mdbWriteString (m->album,    &temp); mdbData[mdb_ref].mie.general.album_ref    = temp;
+	if (((mdbFingerprintIndexCount + 1) > (mdbFingerprintIndexSize / 4 * 3)) && mdbFingerprintIndexResize (mdbFingerprintIndexSize ? (mdbFingerprintIndexSize << 1) : 64))
+	{
+		return;
+	}
+	slot = mdbFingerprintIndexLocate (mdbData[mdb_ref].mie.general.size, mdbData[mdb_ref].mie.general.fingerprint);
+	if (!*slot)
+	{
+		mdbFingerprintIndexCount++;
+	}
+	*slot = mdb_ref;
+}
 
-	mdbDirty=1;
-	mdbDirtyMap[mdb_ref>>3] |= 1 << (mdb_ref & 0x07);
+/* returns a scanned entry with the same content, or 0 */
+static uint32_t mdbFingerprintIndexFind (uint64_t size, uint64_t fingerprint)
+{
+	uint32_t ref;
 
-	return !retval;
+	if (!mdbFingerprintIndexSize)
+	{
+		return 0;
+	}
+	ref = *mdbFingerprintIndexLocate (size, fingerprint);
+	if ((!ref) || (mdbData[ref].mie.general.record_flags != MDB_USED) || (!mdbInfoIsAvailable (ref)))
+	{
+		return 0;
+	}
+	return ref;
 }
 
 void mdbScan (struct ocpfile_t *file, uint32_t mdb_ref)
@@ -439,31 +1315,325 @@ void mdbScan (struct ocpfile_t *file, uint32_t mdb_ref)
 	{
 		struct moduleinfostruct mdbEditBuf;
 		struct ocpfilehandle_t *f;
+		char mdbScanBuf[MDB_SCANBUF_SIZE];
+		int maxl;
+		uint64_t size = mdbData[mdb_ref].mie.general.size;
+		uint64_t fingerprint;
+		uint32_t twin = 0;
+
 		if (!(f=file->open(file)))
 		{
 			return;
 		}
-		mdbGetModuleInfo(&mdbEditBuf, mdb_ref);
-		mdbReadInfo(&mdbEditBuf, f);
-		f->unref (f);
-		mdbWriteModuleInfo(mdb_ref, &mdbEditBuf);
+		maxl = mdbReadHead (f, mdbScanBuf);
+		fingerprint = mdbFingerprint (f, size, mdbScanBuf, maxl);
+		if (fingerprint)
+		{
+			twin = mdbFingerprintIndexFind (size, fingerprint);
+		}
+		if (twin)
+		{ /* the same file has been scanned under a different name */
+			DEBUG_PRINT ("mdbScan: 0x%08"PRIx32" has the same content as 0x%08"PRIx32"\n", mdb_ref, twin);
+			f->unref (f);
+			mdbShareModuleInfo (mdb_ref, twin);
+		} else {
+			mdbGetModuleInfo(&mdbEditBuf, mdb_ref);
+			if (maxl >= 0)
+			{
+				mdbReadInfoHead(&mdbEditBuf, f, mdbScanBuf, maxl);
+			}
+			f->unref (f);
+			mdbWriteModuleInfo(mdb_ref, &mdbEditBuf);
+		}
+
+		mdbData[mdb_ref].mie.general.fingerprint = fingerprint;
+		if (fingerprint && (!twin) && mdbInfoIsAvailable (mdb_ref))
+		{
+			mdbFingerprintIndexAdd (mdb_ref);
+		}
+	}
+}
+
+static uint32_t mdbSearchIndexHash (uint64_t size, const uint8_t *filename_hash)
+{ /* FNV-1a */
+	uint32_t h = 2166136261u;
+	int i;
+	for (i=0; i < 8; i++)
+	{
+		h ^= (uint8_t)(size >> (i * 8));
+		h *= 16777619u;
+	}
+	for (i=0; i < 7; i++)
+	{
+		h ^= filename_hash[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* returns the slot that either contains the given key, or the empty slot where it should be inserted */
+static uint32_t *mdbSearchIndexLocate (uint64_t size, const uint8_t *filename_hash)
+{
+	uint32_t mask = mdbSearchIndexSize - 1;
+	uint32_t i = mdbSearchIndexHash (size, filename_hash) & mask;
+
+	while (mdbSearchIndexData[i])
+	{
+		struct modinfoentry *m = &mdbData[mdbSearchIndexData[i]];
+		if ((m->mie.general.size == size) && !memcmp (m->mie.general.filename_hash, filename_hash, 7))
+		{
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return mdbSearchIndexData + i;
+}
+
+/* newsize must be a power of two, and large enough to keep the load below 3/4 */
+static int mdbSearchIndexResize (uint32_t newsize)
+{
+	uint32_t *olddata = mdbSearchIndexData;
+	uint32_t oldsize = mdbSearchIndexSize;
+	uint32_t i;
+
+	mdbSearchIndexData = calloc (newsize, sizeof (*mdbSearchIndexData));
+	if (!mdbSearchIndexData)
+	{
+		mdbSearchIndexData = olddata;
+		return -1;
+	}
+	mdbSearchIndexSize = newsize;
+
+	for (i=0; i < oldsize; i++)
+	{
+		if (olddata[i])
+		{
+			struct modinfoentry *m = &mdbData[olddata[i]];
+			*mdbSearchIndexLocate (m->mie.general.size, m->mie.general.filename_hash) = olddata[i];
+		}
+	}
+	free (olddata);
+	return 0;
+}
+
+/* Unit test available
+ *
+ * Returns a new copy of mdbData, where all strings are moved down into the lowest holes. File entries are referred
+ * to by dirdb and medialib, so they keep their position. Strings that no file entry refers to are dropped, and
+ * strings that several file entries share are moved once and stay shared.
+ */
+static struct modinfoentry *mdbCompactData (uint32_t *newsize)
+{
+	struct modinfoentry *dst;
+	uint32_t *moved; /* new position of each string that has been moved, indexed by the old position */
+	uint32_t cursor[GROW + 1]; /* for each string length, no hole big enough exists before this */
+	uint32_t last = 0;
+	uint32_t i;
+	int j;
+
+	dst = calloc (mdbDataSize, sizeof (dst[0]));
+	if (!dst)
+	{
+		return 0;
+	}
+	moved = calloc (mdbDataSize, sizeof (moved[0]));
+	if (!moved)
+	{
+		free (dst);
+		return 0;
+	}
+	dst[0] = mdbData[0];
+
+	for (i=1; i < mdbDataSize; i++)
+	{
+		if (mdbData[i].mie.general.record_flags == MDB_USED)
+		{
+			dst[i] = mdbData[i];
+			last = i;
+		}
+	}
+	for (j=1; j <= GROW; j++)
+	{
+		cursor[j] = 1;
+	}
+
+	for (i=1; i < mdbDataSize; i++)
+	{
+		uint32_t *refs[6];
+
+		if (dst[i].mie.general.record_flags != MDB_USED)
+		{
+			continue;
+		}
+		refs[0] = &dst[i].mie.general.title_ref;
+		refs[1] = &dst[i].mie.general.composer_ref;
+		refs[2] = &dst[i].mie.general.artist_ref;
+		refs[3] = &dst[i].mie.general.style_ref;
+		refs[4] = &dst[i].mie.general.comment_ref;
+		refs[5] = &dst[i].mie.general.album_ref;
+
+		for (j=0; j < 6; j++)
+		{
+			uint32_t ref = *refs[j];
+			uint32_t len = 0;
+			uint32_t pos, k;
+
+			if ((ref == 0) || (ref >= mdbDataSize))
+			{
+				continue;
+			}
+			if (moved[ref])
+			{
+				*refs[j] = moved[ref];
+				continue;
+			}
+			while (1)
+			{
+				uint8_t flags;
+				if (((ref + len) >= mdbDataSize) || (len >= GROW))
+				{
+					len = 0;
+					break;
+				}
+				flags = mdbData[ref + len].mie.general.record_flags;
+				if (!(flags & MDB_USED))
+				{
+					len = 0;
+					break;
+				}
+				if ((flags & MDB_STRING_MORE) == MDB_STRING_MORE)
+				{
+					len++;
+					continue;
+				}
+				if ((flags & MDB_STRING_MORE) == MDB_STRING_TERMINATION)
+				{
+					len++;
+				} else {
+					len = 0;
+				}
+				break;
+			}
+			if (!len)
+			{ /* broken string */
+				*refs[j] = UINT32_MAX;
+				continue;
+			}
+
+			for (pos = cursor[len]; (pos + len) <= mdbDataSize; pos++)
+			{
+				for (k=0; k < len; k++)
+				{
+					if (dst[pos + k].mie.general.record_flags)
+					{
+						break;
+					}
+				}
+				if (k == len)
+				{
+					break;
+				}
+				pos += k;
+			}
+			if ((pos + len) > mdbDataSize)
+			{ /* only possible if broken strings overlap each other */
+				free (moved);
+				free (dst);
+				return 0;
+			}
+			cursor[len] = pos + len;
+			memcpy (dst + pos, mdbData + ref, len * sizeof (dst[0]));
+			*refs[j] = pos;
+			moved[ref] = pos;
+			if ((pos + len - 1) > last)
+			{
+				last = pos + len - 1;
+			}
+		}
 	}
+
+	free (moved);
+	*newsize = last + 1;
+	return dst;
 }
 
-static int miecmp (const void *a, const void *b)
+/* Rewrites CPMODNFO.DAT without the holes. The new file is written next to the old one and renamed into place, so
+ * the database is never left half-written.
+ */
+static int mdbCompact (const char *path)
 {
-	struct modinfoentry *c=&mdbData[*(uint32_t *)a];
-	struct modinfoentry *d=&mdbData[*(uint32_t *)b];
-	if (c->mie.general.size==d->mie.general.size)
+	struct modinfoentry *data;
+	struct mdbheader *header;
+	uint32_t size = 0;
+	char *newpath;
+	int fd;
+
+	data = mdbCompactData (&size);
+	if (!data)
+	{
+		fprintf (stderr, "mdbCompact: failed to compact data\n");
+		return -1;
+	}
+	header = (struct mdbheader *)data;
+	memcpy (header->sig, mdbsigv2, sizeof(mdbsigv2));
+	header->entries = size;
+
+	newpath = malloc (strlen (path) + 5);
+	if (!newpath)
+	{
+		free (data);
+		return -1;
+	}
+	sprintf (newpath, "%s.new", path);
+
+	if ((fd = open (newpath, O_RDWR | O_CREAT | O_TRUNC, S_IREAD|S_IWRITE)) < 0)
 	{
-		return memcmp(c->mie.general.filename_hash, d->mie.general.filename_hash, sizeof (c->mie.general.filename_hash));
+		fprintf (stderr, "mdbCompact: open(%s): %s\n", newpath, strerror (errno));
+		free (newpath);
+		free (data);
+		return -1;
 	}
-	if (c->mie.general.size < d->mie.general.size)
+	if (flock (fd, LOCK_EX | LOCK_NB) ||
+	    (write (fd, data, (size_t)size * sizeof (data[0])) != (ssize_t)((size_t)size * sizeof (data[0]))) ||
+	    fsync (fd) ||
+	    rename (newpath, path))
 	{
+		fprintf (stderr, "mdbCompact: failed to write %s: %s\n", newpath, strerror (errno));
+		close (fd);
+		unlink (newpath);
+		free (newpath);
+		free (data);
 		return -1;
+	}
+	free (newpath);
+
+	fprintf (stderr, "compacted %"PRIu32" records into %"PRIu32" .. ", mdbDataSize, size);
+
+	close (mdbFd);
+	mdbFd = fd;
+
+	if (mdbMapped)
+	{
+		void *t;
+		munmap (mdbData, (size_t)mdbMapSize * sizeof(*mdbData));
+		t = mmap (0, (size_t)size * sizeof(*mdbData), PROT_READ | PROT_WRITE, MAP_SHARED, mdbFd, 0);
+		if (t != MAP_FAILED)
+		{
+			mdbData = (struct modinfoentry *)t;
+			mdbMapSize = size;
+			free (data);
+		} else {
+			mdbData = data;
+			mdbMapped = 0;
+			mdbMapSize = 0;
+		}
 	} else {
-		return 1;
+		free (mdbData);
+		mdbData = data;
 	}
+	mdbDataSize = size;
+
+	return 0;
 }
 
 /* Unit test is available */
@@ -476,7 +1646,7 @@ int mdbInit (void)
 
 	mdbData = 0;
 	mdbDataSize = 0;
-	mdbDataNextFree = 0;
+	mdbFreeListClear ();
 
 	mdbDirty = 0;
 	mdbDirtyMap = 0;
@@ -488,6 +1658,10 @@ int mdbInit (void)
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
 
+	mdbFingerprintIndexData = 0;
+	mdbFingerprintIndexCount = 0;
+	mdbFingerprintIndexSize = 0;
+
 	makepath_malloc (&path, 0, cfConfigDir, "CPMODNFO.DAT", 0);
 	fprintf(stderr, "Loading %s .. ", path);
 
@@ -503,7 +1677,6 @@ int mdbInit (void)
 		retval = 0; /* fatal error */
 		goto errorout;
 	}
-	free (path); path = 0;
 
 	if (flock (mdbFd, LOCK_EX | LOCK_NB))
 	{
@@ -537,19 +1710,60 @@ int mdbInit (void)
 		goto errorout;
 	}
 
-	mdbData = malloc(sizeof(struct modinfoentry) * mdbDataSize);
-	if (!mdbData)
+	/* Only map the file if we are allowed to write to it, all changes to the mapping ends up in the file */
+	if (fsWriteModInfo)
 	{
-		fprintf (stderr, "malloc() failed\n");
-		goto errorout;
+		off_t filesize = lseek (mdbFd, 0, SEEK_END);
+		if (filesize >= ((off_t)mdbDataSize * sizeof(*mdbData)))
+		{
+			void *t;
+			mdbMapSize = filesize / sizeof(*mdbData);
+			t = mmap (0, (size_t)mdbMapSize * sizeof(*mdbData), PROT_READ | PROT_WRITE, MAP_SHARED, mdbFd, 0);
+			if (t != MAP_FAILED)
+			{
+				mdbData = (struct modinfoentry *)t;
+				mdbMapped = 1;
+			} else {
+				mdbMapSize = 0;
+			}
+		}
 	}
-	memcpy (mdbData, &header, 64);
 
-	if (read(mdbFd, &mdbData[1], (mdbDataSize-1)*sizeof(*mdbData))!=(signed)((mdbDataSize-1)*sizeof(*mdbData)))
+	if (!mdbMapped)
 	{
-		fprintf(stderr, "Failed to read records\n");
-		goto errorout;
+		lseek (mdbFd, sizeof(header), SEEK_SET);
+
+		mdbData = malloc(sizeof(struct modinfoentry) * mdbDataSize);
+		if (!mdbData)
+		{
+			fprintf (stderr, "malloc() failed\n");
+			goto errorout;
+		}
+		memcpy (mdbData, &header, 64);
+
+		if (read(mdbFd, &mdbData[1], (mdbDataSize-1)*sizeof(*mdbData))!=(signed)((mdbDataSize-1)*sizeof(*mdbData)))
+		{
+			fprintf(stderr, "Failed to read records\n");
+			goto errorout;
+		}
+	}
+
+	if (fsWriteModInfo && (mdbDataSize >= MDB_COMPACT_MIN))
+	{
+		uint32_t unused = 0;
+		for (i=1; i<mdbDataSize; i++)
+		{
+			if (!mdbData[i].mie.general.record_flags)
+			{
+				unused++;
+			}
+		}
+		if ((unused * 2) > mdbDataSize)
+		{
+			mdbCompact (path);
+		}
 	}
+	free (path); path = 0;
 
 	mdbDirtyMapSize = (mdbDataSize + 255) & ~255;
 	mdbDirtyMap = calloc (mdbDirtyMapSize / 8, 1);
@@ -559,16 +1773,7 @@ int mdbInit (void)
 		goto errorout;
 	}
 
-	mdbDataNextFree = mdbDataSize;
-	for (i=0; i<mdbDataSize; i++)
-	{
-		if (!mdbData[i].mie.general.record_flags)
-		{
-			mdbDataNextFree = i;
-			break;
-		}
-	}
-
+	mdbFreeListBuild ();
 
 	for (i=0; i<mdbDataSize; i++)
 	{
@@ -580,9 +1785,12 @@ int mdbInit (void)
 	}
 	if (mdbSearchIndexCount)
 	{
-		mdbSearchIndexSize = (mdbSearchIndexCount + 31) & ~31;
-		mdbSearchIndexCount = 0;
-		mdbSearchIndexData = malloc(sizeof(uint32_t)*mdbSearchIndexSize);
+		mdbSearchIndexSize = 64;
+		while ((mdbSearchIndexSize / 4 * 3) <= mdbSearchIndexCount)
+		{
+			mdbSearchIndexSize <<= 1;
+		}
+		mdbSearchIndexData = calloc(mdbSearchIndexSize, sizeof(uint32_t));
 		if (!mdbSearchIndexData)
 		{
 			fprintf (stderr, "Failed to allocated mdbSearchIndex\n");
@@ -592,27 +1800,32 @@ int mdbInit (void)
 		{
 			if (mdbData[i].mie.general.record_flags==MDB_USED)
 			{
-				mdbSearchIndexData[mdbSearchIndexCount++] = i;
+				uint32_t *slot = mdbSearchIndexLocate (mdbData[i].mie.general.size, mdbData[i].mie.general.filename_hash);
+				if (*slot)
+				{ /* duplicate key, first entry wins as it would have with the old sorted index */
+					DEBUG_PRINT("0x%08"PRIx32" is a duplicate of 0x%08"PRIx32"\n", i, *slot);
+					mdbSearchIndexCount--;
+					continue;
+				}
+				*slot = i;
 			}
 		}
+	}
 
-		qsort(mdbSearchIndexData, mdbSearchIndexCount, sizeof(*mdbSearchIndexData), miecmp);
-
-		for (i=0; i<mdbSearchIndexSize; i++)
+	for (i=1; i<mdbDataSize; i++)
+	{
+		if ((mdbData[i].mie.general.record_flags==MDB_USED) && mdbData[i].mie.general.fingerprint && mdbData[i].mie.general.modtype.integer.i)
 		{
-			DEBUG_PRINT("%5d => 0x%08"PRIx32" %"PRIu64" 0x%02x%02x%02x%02x%02x%02x%02x%02x\n",
-				i, mdbSearchIndexData[i], mdbData[mdbSearchIndexData[i]].mie.general.size,
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[0],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[1],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[2],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[3],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[4],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[5],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[6],
-				mdbData[mdbSearchIndexData[i]].mie.general.filename_hash[7]);
+			mdbFingerprintIndexAdd (i);
 		}
 	}
 
+	if (mdbSharedStringsBuild ())
+	{
+		fprintf (stderr, "Failed to allocate mdbSharedStrings\n");
+		goto errorout;
+	}
+
 	mdbCleanSlate = 0;
 
 	fprintf(stderr, "Done\n");
@@ -628,24 +1841,80 @@ errorout:
 	}
 
 	free (path);
-	free (mdbData);
+	if (mdbMapped)
+	{
+		munmap (mdbData, (size_t)mdbMapSize * sizeof(*mdbData));
+	} else {
+		free (mdbData);
+	}
 	free (mdbDirtyMap);
 	free (mdbSearchIndexData);
+	free (mdbFingerprintIndexData);
+	free (mdbSharedStrings);
+	mdbMapped = 0;
+	mdbMapSize = 0;
 	mdbData = 0;
 	mdbDataSize = 0;
-	mdbDataNextFree = 1; /* hack to ignore entry #0, which is header */
+	mdbFreeListClear ();
 	mdbDirtyMap = 0;
 	mdbDirtyMapSize = 0;
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+	mdbFingerprintIndexData = 0;
+	mdbFingerprintIndexCount = 0;
+	mdbFingerprintIndexSize = 0;
+	mdbSharedStrings = 0;
+	mdbSharedStringsCount = 0;
+	mdbSharedStringsSize = 0;
 	return retval;
 }
 
+static void mdbUpdateRange (uint32_t first, uint32_t count)
+{
+	DEBUG_PRINT("  [0x%08"PRIx32" -> 0x%08"PRIx32"] DIRTY\n", first, first + count - 1);
+
+	if (mdbMapped)
+	{
+		/* msync() needs page aligned addresses, mdbData itself is page aligned */
+		size_t pagesize = sysconf (_SC_PAGESIZE);
+		size_t start = ((size_t)first * sizeof(*mdbData)) & ~(pagesize - 1);
+		size_t end = (size_t)(first + count) * sizeof(*mdbData);
+		if (msync ((uint8_t *)mdbData + start, end - start, MS_SYNC))
+		{
+			fprintf(stderr, __FILE__ " msync() to \"CPMODNFO.DAT\" failed: %s\n", strerror(errno));
+		}
+		return;
+	}
+
+	while (count)
+	{
+		ssize_t res;
+
+		res = pwrite(mdbFd, mdbData + first, (size_t)count * sizeof(*mdbData), (off_t)first * sizeof(*mdbData));
+		if (res < 0)
+		{
+			if (errno==EAGAIN)
+				continue;
+			if (errno==EINTR)
+				continue;
+			fprintf(stderr, __FILE__ " write() to \"CPMODNFO.DAT\" failed: %s\n", strerror(errno));
+			exit(1);
+		} else if (res % sizeof(*mdbData))
+		{
+			fprintf(stderr, __FILE__ " write() to \"CPMODNFO.DAT\" returned only partial data\n");
+			exit(1);
+		}
+		first += res / sizeof(*mdbData);
+		count -= res / sizeof(*mdbData);
+	}
+}
+
 /* Unit test available */
 void mdbUpdate (void)
 {
 	uint32_t i;
+	uint32_t first = 0, count = 0;
 	struct mdbheader *header = (struct mdbheader *)mdbData;
 
 	DEBUG_PRINT("mdbUpdate: mdbDirty=%d fsWriteModInfo=%d\n", mdbDirty, fsWriteModInfo);
@@ -661,42 +1930,38 @@ void mdbUpdate (void)
 		return;
 	}
 
-	lseek(mdbFd, 0, SEEK_SET);
 	memcpy(header->sig, mdbsigv2, sizeof(mdbsigv2));
 	header->entries = mdbDataSize;
 	mdbDirtyMap[0] |= 1;
 
+	/* each bit in the map covers one record, and each byte 8 records. Contiguous dirty bytes are written in one go */
 	for (i = 0; i < mdbDataSize; i += 8)
 	{
-		/* we write in 512 byte chunks - fits old hard-drives sector size */
 		if (!mdbDirtyMap[i / 8])
 		{
 			continue;
 		}
+		mdbDirtyMap[i / 8] = 0;
 
-		lseek(mdbFd, (uint64_t)i*sizeof(*mdbData), SEEK_SET);
-		while (1)
+		if (count && ((first + count) == i))
 		{
-			ssize_t res;
-
-			DEBUG_PRINT("  [0x%08"PRIx32" -> 0x%08"PRIx32"] DIRTY\n", i, i+7);
-			res = write(mdbFd, mdbData + i, 8 * sizeof(*mdbData));
-			if (res < 0)
-			{
-				if (errno==EAGAIN)
-					continue;
-				if (errno==EINTR)
-					continue;
-				fprintf(stderr, __FILE__ " write() to \"CPMODNFO.DAT\" failed: %s\n", strerror(errno));
-				exit(1);
-			} else if (res != (signed)((8)*sizeof(*mdbData)))
+			count += 8;
+		} else {
+			if (count)
 			{
-				fprintf(stderr, __FILE__ " write() to \"CPMODNFO.DAT\" returned only partial data\n");
-				exit(1);
-			} else
-				break;
+				mdbUpdateRange (first, count);
+			}
+			first = i;
+			count = 8;
 		}
-		mdbDirtyMap[i / 8] = 0;
+		if ((first + count) > mdbDataSize)
+		{
+			count = mdbDataSize - first;
+		}
+	}
+	if (count)
+	{
+		mdbUpdateRange (first, count);
 	}
 }
 
@@ -708,19 +1973,34 @@ void mdbClose (void)
 		close(mdbFd);
 		mdbFd = -1;
 	}
-	free(mdbData);
+	if (mdbMapped)
+	{
+		munmap (mdbData, (size_t)mdbMapSize * sizeof(*mdbData));
+	} else {
+		free(mdbData);
+	}
 	free(mdbDirtyMap);
 	free(mdbSearchIndexData);
+	free(mdbFingerprintIndexData);
+	free(mdbSharedStrings);
 
+	mdbMapped = 0;
+	mdbMapSize = 0;
 	mdbData = 0;
 	mdbDataSize = 0;
-	mdbDataNextFree = 1;
+	mdbFreeListClear ();
 	mdbDirty = 0;
 	mdbDirtyMap = 0;
 	mdbDirtyMapSize = 0;
 	mdbSearchIndexData = 0;
 	mdbSearchIndexCount = 0;
 	mdbSearchIndexSize = 0;
+	mdbFingerprintIndexData = 0;
+	mdbFingerprintIndexCount = 0;
+	mdbFingerprintIndexSize = 0;
+	mdbSharedStrings = 0;
+	mdbSharedStringsCount = 0;
+	mdbSharedStringsSize = 0;
 }
 
 /* Unit test available */
@@ -728,9 +2008,7 @@ static uint32_t mdbGetModuleReference (const char *name, uint64_t size)
 {
 	uint32_t i;
 
-	uint32_t *min=mdbSearchIndexData;
-	uint32_t num=mdbSearchIndexCount;
-	uint32_t mn;
+	uint32_t *slot;
 	struct modinfoentry *m;
 	uint8_t hash[8]; /* to byte align with header, byte 0 is ignored */
 
@@ -744,85 +2022,27 @@ static uint32_t mdbGetModuleReference (const char *name, uint64_t size)
 		hash[1+((i+1)%7)] ^= name[i];
 	}
 
-	/* Iterate fast.. If size to to big, set current to be the minimum, and
-	 * set the current to point in the new center, else half the current.
-	 *
-	 * That code is VERY clever. Took me some minutes to read it :-) nice
-	 * work guys
-	 *   - Stian
-	 */
-
 	DEBUG_PRINT("mdbGetModuleReference(%s=>0x%02x%02x%0x%02x%02x%02x%02x %"PRIu64")\n", name, hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], size);
-	while (num)
+
+	/* grow before lookup, so the returned slot stays valid */
+	if (((mdbSearchIndexCount + 1) > (mdbSearchIndexSize / 4 * 3)) && mdbSearchIndexResize (mdbSearchIndexSize ? (mdbSearchIndexSize << 1) : 64))
 	{
-		struct modinfoentry *m=&mdbData[min[num>>1]];
-		int ret;
-#ifdef MDB_DEBUG
-		{
-			uint32_t x;
-			for (x = 0; x < num; x++)
-			{
-				DEBUG_PRINT("  %08x %"PRIu64" 0x%02x%02x%02x%02x%02x%02x%02x\n",
-					min[x],
-					mdbData[min[x]].mie.general.size,
-					mdbData[min[x]].mie.general.filename_hash[0],
-					mdbData[min[x]].mie.general.filename_hash[1],
-					mdbData[min[x]].mie.general.filename_hash[2],
-					mdbData[min[x]].mie.general.filename_hash[3],
-					mdbData[min[x]].mie.general.filename_hash[4],
-					mdbData[min[x]].mie.general.filename_hash[5],
-					mdbData[min[x]].mie.general.filename_hash[6]);
-			}
-			DEBUG_PRINT("  ----------\n");
-		}
-#endif
-		if (size==m->mie.general.size)
-		{
-			ret = memcmp(hash+1, m->mie.general.filename_hash, 7);
-		} else {
-			if (size < m->mie.general.size)
-			{
-				ret = -1;
-			} else {
-				ret = 1;
-			}
-		}
-		if (!ret)
-		{
-			DEBUG_PRINT("mdbGetModuleReference(\"%s\" %"PRIu64") => mdbSearchIndexData => 0x%08"PRIx32"\n", name, size, min[num>>1]);
-			return min[num>>1];
-		}
-		if (ret<0)
-		{
-			num >>= 1;
-		} else {
-			min += (num >> 1)  + 1;
-			num  = (num  - 1) >> 1;
-		}
+		return UINT32_MAX;
+	}
+
+	slot = mdbSearchIndexLocate (size, hash + 1);
+	if (*slot)
+	{
+		DEBUG_PRINT("mdbGetModuleReference(\"%s\" %"PRIu64") => mdbSearchIndexData => 0x%08"PRIx32"\n", name, size, *slot);
+		return *slot;
 	}
-	mn = min - mdbSearchIndexData;
 
 	i=mdbNew(1);
 	if (i==UINT32_MAX)
 	{
 		return UINT32_MAX;
 	}
-	if (mdbSearchIndexCount == mdbSearchIndexSize)
-	{
-		void *n;
-		mdbSearchIndexSize += 512;
-		if (!(n = realloc(mdbSearchIndexData, sizeof (*mdbSearchIndexData) * mdbSearchIndexSize)))
-		{
-			mdbFree (i, 1);
-			return UINT32_MAX;
-		}
-		mdbSearchIndexData = (uint32_t *)n;
-	}
-
-	memmove( mdbSearchIndexData + mn + 1,
-	         mdbSearchIndexData + mn,
-		(mdbSearchIndexCount - mn ) * sizeof (*mdbSearchIndexData));
-	mdbSearchIndexData[mn]=i;
+	*slot=i;
 	mdbSearchIndexCount++;
 
 	m = &mdbData[i];
@@ -839,6 +2059,7 @@ static uint32_t mdbGetModuleReference (const char *name, uint64_t size)
 	m->mie.general.style_ref = UINT32_MAX;
 	m->mie.general.comment_ref = UINT32_MAX;
 	m->mie.general.album_ref = UINT32_MAX;
+	m->mie.general.fingerprint = 0;
 	bzero (m->mie.general.reserved, sizeof (m->mie.general.reserved));
 	DEBUG_PRINT("mdbGetModuleReference(\"%s\" %"PRIu64") => new => 0x%08"PRIx32"\n", name, size, i);
 	return i;
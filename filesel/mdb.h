@@ -69,6 +69,14 @@ enum
   mdbEvInit, mdbEvDone
 };
 
+struct mdbreadinfosig /* a magic that must be present for ReadInfo to be able to accept the file */
+{
+	uint16_t offset;
+	uint8_t length;    /* length 0 terminates the list */
+	const char *bytes;
+	const char *mask;  /* optional, bits that are cleared are ignored in the compare */
+};
+
 struct mdbreadinforegstruct /* this is to test a file, and give it a tag..*/
 {
 	const char *name; /* for debugging */
@@ -76,9 +84,23 @@ struct mdbreadinforegstruct /* this is to test a file, and give it a tag..*/
 	int (*ReadInfo)(struct moduleinfostruct *m, struct ocpfilehandle_t *f, const char *buf, size_t len);
 	void (*Event)(int mdbEv);
 	struct mdbreadinforegstruct *next;
+
+	/* If Signatures and/or Extensions are given, ReadInfo is only called for files that matches at least one of them.
+	 * Both lists must cover every file that ReadInfo can react on, plugins that can not promise this leaves both as NULL */
+	const struct mdbreadinfosig *Signatures;
+	const char * const *Extensions; /* NULL terminated, including the dot, e.g. ".mid", compared case-insensitive */
 };
 
 #define MDBREADINFOREGSTRUCT_TAIL ,0
+#define MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(signatures,extensions) ,0,signatures,extensions
+
+struct mdbwritenotifyregstruct /* get notified when the information about a file has been changed */
+{
+	void (*Notify)(uint32_t mdb_ref);
+	struct mdbwritenotifyregstruct *next;
+};
+
+#define MDBWRITENOTIFYREGSTRUCT_TAIL ,0
 
 struct ocpfile_t;
 
@@ -96,6 +118,9 @@ int mdbGetModuleInfo(struct moduleinfostruct *m, uint32_t fileref); // returns z
 void mdbRegisterReadInfo(struct mdbreadinforegstruct *r);
 void mdbUnregisterReadInfo(struct mdbreadinforegstruct *r);
 
+void mdbRegisterWriteNotify(struct mdbwritenotifyregstruct *r);
+void mdbUnregisterWriteNotify(struct mdbwritenotifyregstruct *r);
+
 extern const char mdbsigv1[60];
 extern const char mdbsigv2[60];
 
@@ -0,0 +1,421 @@
+/* unit test for modlist.c */
+
+#include "modlist.c"
+#include <time.h>
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/* dirdb_ref is used as an index into this table */
+static char **names;
+static int names_count;
+
+void dirdbGetName_internalstr (uint32_t ref, const char **name)
+{
+	*name = ((int)ref < names_count) ? names[ref] : 0;
+}
+
+void utf8_XdotY_name (const int X, const int Y, char *shortname, const char *source)
+{
+	shortname[0] = 0;
+}
+
+uint32_t mdbGetModuleReference2 (uint32_t dirdb_ref, uint64_t filesize)
+{
+	return UINT32_MAX;
+}
+
+static void dummy_file_ref (struct ocpfile_t *f)
+{
+}
+
+static void dummy_dir_ref (struct ocpdir_t *d)
+{
+}
+
+static void test_append (struct modlist *ml, struct ocpfile_t *files, struct ocpdir_t *dirs, int index, int flags, int is_archive, int is_playlist, int is_dir)
+{
+	struct modlistentry entry = {0};
+
+	if (is_dir)
+	{
+		dirs[index].ref = dummy_dir_ref;
+		dirs[index].unref = dummy_dir_ref;
+		dirs[index].dirdb_ref = index;
+		dirs[index].is_archive = is_archive;
+		dirs[index].is_playlist = is_playlist;
+		entry.dir = &dirs[index];
+	} else {
+		files[index].ref = dummy_file_ref;
+		files[index].unref = dummy_file_ref;
+		files[index].dirdb_ref = index;
+		entry.file = &files[index];
+	}
+	entry.flags = flags;
+	entry.mdb_ref = UINT32_MAX;
+	snprintf (entry.utf8_16_dot_3, 13, "%s", names[index]); /* a short name that differs from the full name is good enough */
+	modlist_append (ml, &entry);
+}
+
+static int test_verify (struct modlist *ml, const char * const *expected, int count)
+{
+	int retval = 0;
+	int i;
+
+	for (i=0; i < count; i++)
+	{
+		struct modlistentry *m = modlist_get (ml, i);
+		const char *name = names[m->file ? m->file->dirdb_ref : m->dir->dirdb_ref];
+		if (strcmp (name, expected[i]))
+		{
+			printf (ANSI_COLOR_RED " entry %d is \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", i, name, expected[i]);
+			retval = 1;
+		}
+	}
+	return retval;
+}
+
+static int modlist_test_natural (void)
+{
+	static const char *input[] = {"track10.mod", "Track2.mod", "track1.mod", "TRACK02.mod", "alpha.mod", "track1b.mod", "Alpha.mod", "100.mod", "9.mod"};
+	static const char *expected[] = {"9.mod", "100.mod", "alpha.mod", "Alpha.mod", "track1.mod", "track1b.mod", "Track2.mod", "TRACK02.mod", "track10.mod"};
+	struct ocpfile_t files[9] = {0};
+	struct modlist *ml = modlist_create ();
+	int retval;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing natural, case-insensitive sorting of names" ANSI_COLOR_RESET "\n");
+
+	names = (char **)input;
+	names_count = 9;
+	for (i=0; i < 9; i++)
+	{
+		test_append (ml, files, 0, i, 0, 0, 0, 0);
+	}
+	modlist_sort (ml);
+
+	retval = test_verify (ml, expected, 9);
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	modlist_free (ml);
+	names = 0;
+	names_count = 0;
+	return retval;
+}
+
+static int modlist_test_categories (void)
+{
+	static const char *input[] = {"zz.mod", "drive:", "list.m3u", "archive.zip", "dir", "..", "aa.mod", "adir"};
+	static const char *expected[] = {"..", "adir", "dir", "archive.zip", "list.m3u", "aa.mod", "zz.mod", "drive:"};
+	struct ocpfile_t files[8] = {0};
+	struct ocpdir_t dirs[8] = {0};
+	struct modlist *ml = modlist_create ();
+	int retval;
+
+	printf (ANSI_COLOR_CYAN "Testing sorting of entry categories" ANSI_COLOR_RESET "\n");
+
+	names = (char **)input;
+	names_count = 8;
+	test_append (ml, files, dirs, 0, 0, 0, 0, 0);
+	test_append (ml, files, dirs, 1, MODLIST_FLAG_DRV, 0, 0, 1);
+	test_append (ml, files, dirs, 2, 0, 0, 1, 1);
+	test_append (ml, files, dirs, 3, 0, 1, 0, 1);
+	test_append (ml, files, dirs, 4, 0, 0, 0, 1);
+	test_append (ml, files, dirs, 5, MODLIST_FLAG_DOTDOT, 0, 0, 1);
+	test_append (ml, files, dirs, 6, 0, 0, 0, 0);
+	test_append (ml, files, dirs, 7, 0, 0, 0, 1);
+	modlist_sort (ml);
+
+	retval = test_verify (ml, expected, 8);
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	modlist_free (ml);
+	names = 0;
+	names_count = 0;
+	return retval;
+}
+
+static int modlist_test_large (void)
+{
+	const int count = 100000;
+	struct ocpfile_t *files = calloc (count, sizeof (files[0]));
+	struct modlist *ml = modlist_create ();
+	struct timespec t1, t2;
+	int retval = 0;
+	int i;
+
+	printf (ANSI_COLOR_CYAN "Testing sorting of %d entries" ANSI_COLOR_RESET "\n", count);
+
+	names = calloc (count, sizeof (names[0]));
+	names_count = count;
+	srand (1);
+	for (i=0; i < count; i++)
+	{ /* every name is unique, but they are appended in a random order */
+		int j = rand() % (i + 1);
+		names[i] = names[j];
+		names[j] = malloc (32);
+		snprintf (names[j], 32, "Song %d.mod", i);
+	}
+	for (i=0; i < count; i++)
+	{
+		test_append (ml, files, 0, i, 0, 0, 0, 0);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	modlist_sort (ml);
+	clock_gettime (CLOCK_MONOTONIC, &t2);
+
+	for (i=0; i < count; i++)
+	{
+		struct modlistentry *m = modlist_get (ml, i);
+		char expected[32];
+		snprintf (expected, sizeof (expected), "Song %d.mod", i);
+		if (strcmp (names[m->file->dirdb_ref], expected))
+		{
+			printf (ANSI_COLOR_RED " entry %d is \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", i, names[m->file->dirdb_ref], expected);
+			retval = 1;
+			break;
+		}
+	}
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET " (%ld ms)\n", (long)((t2.tv_sec - t1.tv_sec) * 1000 + (t2.tv_nsec - t1.tv_nsec) / 1000000));
+	}
+
+	modlist_free (ml);
+	for (i=0; i < count; i++)
+	{
+		free (names[i]);
+	}
+	free (names);
+	free (files);
+	names = 0;
+	names_count = 0;
+	return retval;
+}
+
+static int modlist_test_sort_tail (void)
+{
+	const int count = 5000;
+	struct ocpfile_t *files = calloc (count, sizeof (files[0]));
+	struct modlist *ml1 = modlist_create ();
+	struct modlist *ml2 = modlist_create ();
+	int retval = 0;
+	int i, chunk;
+
+	printf (ANSI_COLOR_CYAN "Testing merge of appended entries into a sorted list" ANSI_COLOR_RESET "\n");
+
+	names = calloc (count, sizeof (names[0]));
+	names_count = count;
+	srand (2);
+	for (i=0; i < count; i++)
+	{ /* plenty of duplicates, so the order of equal names is tested too */
+		names[i] = malloc (32);
+		snprintf (names[i], 32, "%c%d.mod", 'a' + rand() % 3, rand() % 1000);
+	}
+
+	for (i=0, chunk=1; i < count; chunk = (chunk * 3) % 97 + 1)
+	{ /* ml2 is sorted after every chunk, like the file selector does while a directory is read */
+		int sorted = ml2->num;
+		int j;
+		for (j=0; (j < chunk) && (i < count); j++, i++)
+		{
+			test_append (ml1, files, 0, i, 0, 0, 0, 0);
+			test_append (ml2, files, 0, i, 0, 0, 0, 0);
+		}
+		modlist_sort_tail (ml2, sorted);
+	}
+	modlist_sort (ml1);
+
+	for (i=0; i < count; i++)
+	{
+		if (ml1->sortindex[i] != ml2->sortindex[i])
+		{
+			printf (ANSI_COLOR_RED " entry %d is \"%s\", expected \"%s\"" ANSI_COLOR_RESET "\n", i, names[ml2->sortindex[i]], names[ml1->sortindex[i]]);
+			retval = 1;
+			break;
+		}
+	}
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	modlist_free (ml1);
+	modlist_free (ml2);
+	for (i=0; i < count; i++)
+	{
+		free (names[i]);
+	}
+	free (names);
+	free (files);
+	names = 0;
+	names_count = 0;
+	return retval;
+}
+
+/* the linear search that modlist_fuzzyfind() used before it got an index */
+static unsigned int reference_common (const char *dst, const char *src)
+{
+	unsigned int i;
+	for (i=0; dst[i] && src[i] && (toupper ((unsigned char)dst[i]) == toupper ((unsigned char)src[i])); i++)
+	{
+	}
+	return i;
+}
+
+static int reference_fuzzyfind (struct modlist *ml, const char *filename)
+{
+	unsigned int retval=0;
+	unsigned int hitscore=0;
+	unsigned int i;
+	unsigned int len = strlen(filename);
+	if (!len)
+		return 0;
+	for (i=0;i<ml->num;i++)
+	{
+		struct modlistentry *m = modlist_get (ml, i);
+		unsigned int score;
+
+		score = reference_common (names[m->file->dirdb_ref], filename);
+		if (score==len)
+		{
+			return i;
+		} else if (score>hitscore)
+		{
+			retval=i;
+			hitscore=score;
+		}
+
+		score = reference_common (m->utf8_16_dot_3, filename);
+		if (score==len)
+		{
+			return i;
+		} else if (score>hitscore)
+		{
+			retval=i;
+			hitscore=score;
+		}
+	}
+	return retval;
+}
+
+static int modlist_test_fuzzyfind (void)
+{
+	static const char *words[] = {"Song", "song", "Track", "TRACK", "intro", "Intermezzo", "a", "the", "The_End", "x"};
+	static const char *queries[] = {"s", "so", "SONG", "song 1", "Song 12", "song 123", "t", "tr", "track 9", "the", "the_", "the_end 4", "intr", "INTE", "q", "zzz", "a", "a 1", "x 99", "song 12.m"};
+	const int count = 3000;
+	struct ocpfile_t *files = calloc (count, sizeof (files[0]));
+	struct modlist *ml = modlist_create ();
+	int retval = 0;
+	int round;
+	int i, j;
+
+	printf (ANSI_COLOR_CYAN "Testing modlist_fuzzyfind() against a linear search" ANSI_COLOR_RESET "\n");
+
+	names = calloc (count, sizeof (names[0]));
+	names_count = count;
+	srand (2);
+	for (i=0; i < count; i++)
+	{
+		names[i] = malloc (64);
+		snprintf (names[i], 64, "%s %d.mod", words[rand() % 10], rand() % 2000);
+	}
+
+	/* the list is built in five steps, and modified between the searches */
+	for (round=0; round < 5; round++)
+	{
+		for (i = round * count / 5; i < (round + 1) * count / 5; i++)
+		{
+			test_append (ml, files, 0, i, 0, 0, 0, 0);
+			if ((i % 97) == 0)
+			{ /* search while the unordered tail is short */
+				int a = modlist_fuzzyfind (ml, "song 1");
+				int b = reference_fuzzyfind (ml, "song 1");
+				if (a != b)
+				{
+					printf (ANSI_COLOR_RED " after append %d \"song 1\" gave %d, expected %d" ANSI_COLOR_RESET "\n", i, a, b);
+					retval = 1;
+				}
+			}
+		}
+		if (round == 1)
+		{
+			modlist_sort (ml);
+		}
+		if (round == 2)
+		{
+			for (j=0; j < 50; j++)
+			{
+				modlist_swap (ml, rand() % ml->num, rand() % ml->num);
+			}
+		}
+		if (round == 3)
+		{
+			for (j=0; j < 50; j++)
+			{
+				modlist_remove (ml, rand() % ml->num);
+			}
+		}
+		for (j=0; j < (int)(sizeof (queries) / sizeof (queries[0])); j++)
+		{
+			int a = modlist_fuzzyfind (ml, queries[j]);
+			int b = reference_fuzzyfind (ml, queries[j]);
+			if (a != b)
+			{
+				printf (ANSI_COLOR_RED " round %d \"%s\" gave %d, expected %d" ANSI_COLOR_RESET "\n", round, queries[j], a, b);
+				retval = 1;
+			}
+		}
+	}
+
+	modlist_clear (ml);
+	test_append (ml, files, 0, 0, 0, 0, 0, 0);
+	if (modlist_fuzzyfind (ml, names[0]) != 0)
+	{
+		printf (ANSI_COLOR_RED " search after modlist_clear() failed" ANSI_COLOR_RESET "\n");
+		retval = 1;
+	}
+
+	if (!retval)
+	{
+		printf (ANSI_COLOR_GREEN " OK" ANSI_COLOR_RESET "\n");
+	}
+
+	modlist_free (ml);
+	for (i=0; i < count; i++)
+	{
+		free (names[i]);
+	}
+	free (names);
+	free (files);
+	names = 0;
+	names_count = 0;
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	retval |= modlist_test_natural ();
+	retval |= modlist_test_categories ();
+	retval |= modlist_test_large ();
+	retval |= modlist_test_sort_tail ();
+	retval |= modlist_test_fuzzyfind ();
+
+	printf ("\n");
+
+	return retval;
+}
@@ -48,6 +48,269 @@
 #include "stuff/poutput.h"
 #include "stuff/utf-8.h"
 
+/* Index for modlist_fuzzyfind(). Both the dirdb name and the 16.3 name of every entry are stored upper-cased, and the index
+ * records are kept ordered by name, so the entries that share the longest prefix with the search string are neighbours that
+ * can be found with a binary search. Records for entries appended after the last search are kept unordered at the end, and
+ * are merged into the ordered part by the next search if there are many of them. Removing entries renumbers files[], so that
+ * causes a rebuild on the next search instead.
+ */
+#define MODLIST_FINDINDEX_TAIL 64
+
+struct modlist_findentry
+{
+	unsigned int offset; /* into keys */
+	int          index;  /* into modlist->files */
+};
+
+struct modlist_findindex
+{
+	int                       valid;
+
+	char                     *keys;
+	size_t                    keyssize;
+	size_t                    keysfill;
+
+	struct modlist_findentry *entries;
+	unsigned int              num;
+	unsigned int              max;
+	unsigned int              sorted; /* entries[0 .. sorted-1] are ordered by key */
+
+	int                      *position; /* files index to presented index, entries appended after this was built are missing */
+	unsigned int              positionnum;
+	int                       positionvalid;
+};
+
+static void modlist_findindex_free (struct modlist *modlist)
+{
+	if (modlist->findindex)
+	{
+		free (modlist->findindex->keys);
+		free (modlist->findindex->entries);
+		free (modlist->findindex->position);
+		free (modlist->findindex);
+		modlist->findindex = 0;
+	}
+}
+
+static void modlist_findindex_invalidate (struct modlist *modlist)
+{
+	if (modlist->findindex)
+	{
+		modlist->findindex->valid = 0;
+		modlist->findindex->positionvalid = 0;
+	}
+}
+
+/* sortindex has been changed */
+static void modlist_findindex_reorder (struct modlist *modlist)
+{
+	if (modlist->findindex)
+	{
+		modlist->findindex->positionvalid = 0;
+	}
+}
+
+static int modlist_findindex_add_key (struct modlist_findindex *fi, int index, const char *name)
+{
+	size_t len = strlen (name);
+	size_t i;
+
+	if (fi->keysfill + len + 1 > fi->keyssize)
+	{
+		size_t newsize = fi->keyssize ? fi->keyssize * 2 : 4096;
+		char *newkeys;
+		while (fi->keysfill + len + 1 > newsize)
+		{
+			newsize *= 2;
+		}
+		newkeys = realloc (fi->keys, newsize);
+		if (!newkeys)
+		{
+			return -1;
+		}
+		fi->keys = newkeys;
+		fi->keyssize = newsize;
+	}
+	if (fi->num == fi->max)
+	{
+		struct modlist_findentry *newentries = realloc (fi->entries, (fi->max + 1024) * sizeof (fi->entries[0]));
+		if (!newentries)
+		{
+			return -1;
+		}
+		fi->entries = newentries;
+		fi->max += 1024;
+	}
+
+	for (i=0; i < len; i++)
+	{
+		fi->keys[fi->keysfill + i] = toupper ((unsigned char)name[i]);
+	}
+	fi->keys[fi->keysfill + len] = 0;
+	fi->entries[fi->num].offset = fi->keysfill;
+	fi->entries[fi->num].index = index;
+	fi->keysfill += len + 1;
+	fi->num++;
+
+	return 0;
+}
+
+static int modlist_findindex_add (struct modlist *modlist, int index)
+{
+	struct modlistentry *m = &modlist->files[index];
+	const char *name = 0;
+
+	dirdbGetName_internalstr (m->file ? m->file->dirdb_ref : m->dir->dirdb_ref, &name);
+	if (name && modlist_findindex_add_key (modlist->findindex, index, name))
+	{
+		return -1;
+	}
+	return modlist_findindex_add_key (modlist->findindex, index, m->utf8_16_dot_3);
+}
+
+/* a new entry has been appended to files[] */
+static void modlist_findindex_append (struct modlist *modlist, int index)
+{
+	if (modlist->findindex && modlist->findindex->valid)
+	{
+		if (modlist_findindex_add (modlist, index))
+		{
+			modlist_findindex_invalidate (modlist);
+		}
+	}
+}
+
+static void modlist_findindex_mergesort (struct modlist_findentry *entries, struct modlist_findentry *temp, unsigned int num, const char *keys)
+{
+	struct modlist_findentry *src = entries, *dst = temp, *swap;
+	unsigned int width, i;
+
+	for (width = 1; width < num; width *= 2)
+	{
+		unsigned int left;
+		for (left = 0; left < num; left += 2 * width)
+		{
+			unsigned int mid   = (left + width     < num) ? left + width     : num;
+			unsigned int right = (left + 2 * width < num) ? left + 2 * width : num;
+			unsigned int a = left, b = mid, o = left;
+
+			while ((a < mid) && (b < right))
+			{
+				if (strcmp (keys + src[b].offset, keys + src[a].offset) < 0)
+				{
+					dst[o++] = src[b++];
+				} else {
+					dst[o++] = src[a++];
+				}
+			}
+			while (a < mid)
+			{
+				dst[o++] = src[a++];
+			}
+			while (b < right)
+			{
+				dst[o++] = src[b++];
+			}
+		}
+		swap = src; src = dst; dst = swap;
+	}
+	if (src != entries)
+	{
+		for (i=0; i < num; i++)
+		{
+			entries[i] = src[i];
+		}
+	}
+}
+
+/* make sure that the index is up to date and fully ordered, returns non-zero on failure */
+static int modlist_findindex_update (struct modlist *modlist)
+{
+	struct modlist_findindex *fi;
+
+	if (!modlist->findindex)
+	{
+		modlist->findindex = calloc (1, sizeof (*modlist->findindex));
+		if (!modlist->findindex)
+		{
+			return -1;
+		}
+	}
+	fi = modlist->findindex;
+
+	if (!fi->valid)
+	{
+		unsigned int i;
+
+		fi->num = 0;
+		fi->sorted = 0;
+		fi->keysfill = 0;
+		for (i=0; i < modlist->num; i++)
+		{
+			if (modlist_findindex_add (modlist, i))
+			{
+				return -1;
+			}
+		}
+		fi->valid = 1;
+	}
+
+	if ((fi->num - fi->sorted) > MODLIST_FINDINDEX_TAIL)
+	{
+		struct modlist_findentry *temp = malloc (fi->num * sizeof (temp[0]));
+		unsigned int a = 0, b, o = 0;
+		unsigned int tail = fi->num - fi->sorted;
+
+		if (!temp)
+		{
+			return -1;
+		}
+
+		/* order the new records, and merge them with the already ordered ones */
+		modlist_findindex_mergesort (fi->entries + fi->sorted, temp, tail, fi->keys);
+		memcpy (temp, fi->entries, fi->num * sizeof (temp[0]));
+		b = fi->sorted;
+		while ((a < fi->sorted) && (b < fi->num))
+		{
+			if (strcmp (fi->keys + temp[b].offset, fi->keys + temp[a].offset) < 0)
+			{
+				fi->entries[o++] = temp[b++];
+			} else {
+				fi->entries[o++] = temp[a++];
+			}
+		}
+		while (a < fi->sorted)
+		{
+			fi->entries[o++] = temp[a++];
+		}
+		while (b < fi->num)
+		{
+			fi->entries[o++] = temp[b++];
+		}
+		fi->sorted = fi->num;
+		free (temp);
+	}
+
+	if (!fi->positionvalid)
+	{
+		unsigned int i;
+		int *newposition = realloc (fi->position, (modlist->num ? modlist->num : 1) * sizeof (fi->position[0]));
+		if (!newposition)
+		{
+			return -1;
+		}
+		fi->position = newposition;
+		for (i=0; i < modlist->num; i++)
+		{
+			fi->position[modlist->sortindex[i]] = i;
+		}
+		fi->positionnum = modlist->num;
+		fi->positionvalid = 1;
+	}
+
+	return 0;
+}
+
 void modlist_free (struct modlist *modlist)
 {
 	unsigned int i;
@@ -66,6 +329,7 @@ void modlist_free (struct modlist *modlist)
 	}
 	free (modlist->files);
 	free (modlist->sortindex);
+	modlist_findindex_free (modlist);
 	free(modlist);
 }
 
@@ -126,6 +390,8 @@ void modlist_append (struct modlist *modlist, struct modlistentry *entry)
 		entry->dir->ref (entry->dir);
 	}
 	modlist->num++;
+
+	modlist_findindex_append (modlist, modlist->num - 1);
 }
 
 void modlist_append_dir (struct modlist *modlist, struct ocpdir_t *dir)
@@ -249,6 +515,14 @@ void modlist_clear(struct modlist *modlist)
 		}
 	}
 	modlist->num = 0;
+
+	if (modlist->findindex)
+	{
+		modlist->findindex->num = 0;
+		modlist->findindex->sorted = 0;
+		modlist->findindex->keysfill = 0;
+		modlist->findindex->positionvalid = 0;
+	}
 }
 
 void modlist_remove(struct modlist *modlist, unsigned int index) /* by sortindex */
@@ -269,6 +543,8 @@ void modlist_remove(struct modlist *modlist, unsigned int index) /* by sortindex
 	memmove(&modlist->sortindex[index], &modlist->sortindex[index+1], (modlist->num - index - 1) * sizeof (modlist->sortindex[0]));
 	modlist->num -= 1;
 
+	modlist_findindex_invalidate (modlist);
+
 	/* repair the sort-index */
 	for (i = 0; i < modlist->num; i++)
 	{
@@ -318,70 +594,146 @@ void modlist_swap(struct modlist *modlist, unsigned int index1, unsigned int ind
 	entry = modlist->sortindex[index1];
 	modlist->sortindex[index1] = modlist->sortindex[index2];
 	modlist->sortindex[index2] = entry;
+
+	modlist_findindex_reorder (modlist);
 }
 
-static const char *fuzzycmp(const char *dst, const char *src)
+/* number of leading characters shared by the upper-cased key and the search string */
+static unsigned int modlist_findindex_common (const char *key, const char *search)
 {
-	char DST, SRC;
-	while ((*dst)&&(*src))
+	unsigned int i;
+	for (i=0; key[i] && search[i] && (key[i] == search[i]); i++)
 	{
-		DST=toupper(*dst);
-		SRC=toupper(*src);
-		if (DST==SRC)
+	}
+	return i;
+}
+
+/* the first ordered record that is not less than search, when only the first len characters are compared */
+static unsigned int modlist_findindex_lower (struct modlist_findindex *fi, const char *search, unsigned int len)
+{
+	unsigned int low = 0, high = fi->sorted;
+	while (low < high)
+	{
+		unsigned int mid = low + (high - low) / 2;
+		if (strncmp (fi->keys + fi->entries[mid].offset, search, len) < 0)
 		{
-			dst++;
-			src++;
-		} else
-			break;
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/* the first ordered record that is greater than search, when only the first len characters are compared */
+static unsigned int modlist_findindex_upper (struct modlist_findindex *fi, const char *search, unsigned int len)
+{
+	unsigned int low = 0, high = fi->sorted;
+	while (low < high)
+	{
+		unsigned int mid = low + (high - low) / 2;
+		if (strncmp (fi->keys + fi->entries[mid].offset, search, len) <= 0)
+		{
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
 	}
-	return dst;
+	return low;
+}
+
+static int modlist_findindex_position (struct modlist_findindex *fi, int index)
+{
+	return ((unsigned int)index < fi->positionnum) ? fi->position[index] : index; /* appended entries are at the end of sortindex */
 }
 
+/* Returns the presented index of the first entry that shares most leading characters with filename, ignoring case, compared
+ * against both the full name and the 16.3 name. Returns 0 if no entry shares any.
+ */
 #warning input is CP437, search is done on UTF-8
 int modlist_fuzzyfind(struct modlist *modlist, const char *filename)
 {
-	unsigned int retval=0;
-	int hitscore=0;
-	unsigned int i;
+	struct modlist_findindex *fi;
+	char *search;
 	unsigned int len = strlen(filename);
-	if (!len)
+	unsigned int best = 0;
+	int retval = -1;
+	unsigned int i;
+
+	if ((!len) || (!modlist->num))
 		return 0;
-	for (i=0;i<modlist->num;i++)
+
+	if (modlist_findindex_update (modlist))
 	{
-		const char *temp = 0;
-		const char *diff;
-		int score;
-		int index = modlist->sortindex[i];
-		struct modlistentry *m = &modlist->files[index];
+		fprintf (stderr, "modlist_fuzzyfind: out of memory\n");
+		modlist_findindex_free (modlist);
+		return 0;
+	}
+	fi = modlist->findindex;
 
-		dirdbGetName_internalstr (m->file ? m->file->dirdb_ref : m->dir->dirdb_ref, &temp);
-		diff = fuzzycmp(temp, filename);
-		score = diff - temp;
+	search = malloc (len + 1);
+	if (!search)
+	{
+		fprintf (stderr, "modlist_fuzzyfind: out of memory\n");
+		return 0;
+	}
+	for (i=0; i < len; i++)
+	{
+		search[i] = toupper ((unsigned char)filename[i]);
+	}
+	search[len] = 0;
 
-		if ((unsigned)score==len)
+	/* the longest common prefix in the ordered records is found next to where the search string would be inserted */
+	if (fi->sorted)
+	{
+		unsigned int p = modlist_findindex_lower (fi, search, len);
+		if (p > 0)
+		{
+			unsigned int c = modlist_findindex_common (fi->keys + fi->entries[p - 1].offset, search);
+			if (c > best) best = c;
+		}
+		if (p < fi->sorted)
 		{
-			return i;
-		} else if (score>hitscore)
+			unsigned int c = modlist_findindex_common (fi->keys + fi->entries[p].offset, search);
+			if (c > best) best = c;
+		}
+		if (best)
 		{
-			retval=i;
-			hitscore=score;
+			unsigned int first = modlist_findindex_lower (fi, search, best);
+			unsigned int last = modlist_findindex_upper (fi, search, best);
+			for (p = first; p < last; p++)
+			{
+				int position = modlist_findindex_position (fi, fi->entries[p].index);
+				if ((retval < 0) || (position < retval))
+				{
+					retval = position;
+				}
+			}
 		}
+	}
+
+	/* records appended since the last merge are checked one by one */
+	for (i = fi->sorted; i < fi->num; i++)
+	{
+		unsigned int c = modlist_findindex_common (fi->keys + fi->entries[i].offset, search);
+		int position = modlist_findindex_position (fi, fi->entries[i].index);
 
-		diff = fuzzycmp(m->utf8_16_dot_3, filename);
-		score = diff - m->utf8_16_dot_3;
-		if ((unsigned)score==len)
+		if ((!c) || (c < best))
 		{
-			return i;
-		} else if (score>hitscore)
+			continue;
+		}
+		if ((c > best) || (position < retval))
 		{
-			retval=i;
-			hitscore=score;
+			best = c;
+			retval = position;
 		}
 	}
-	return retval;
+
+	free (search);
+
+	return (retval < 0) ? 0 : retval;
 }
 
-static struct modlist *sorting;
 static int mlecmp_score (const struct modlistentry *e1)
 {
 	int i1;
@@ -412,34 +764,266 @@ static int mlecmp_score (const struct modlistentry *e1)
 
 	return i1;
 }
-static int mlecmp (const void *a, const void *b)
+
+/* Sort keys are made once per entry, so the sort itself only needs memcmp(). A key is the inverted score, followed by the
+ * case-folded name where each run of digits is replaced by '0', the number of significant digits and the digits themselves,
+ * making "file2" sort before "file10". The first 16 bytes are also stored big-endian in prefix[], so most comparisons never
+ * leave the key array.
+ */
+struct modlist_sortkey
+{
+	uint64_t     prefix[2];
+	unsigned int offset; /* into the key buffer */
+	unsigned int length;
+	int          index;  /* into modlist->files */
+};
+
+static unsigned int modlist_sortkey_make (unsigned char *dst, const struct modlistentry *e)
 {
-	int _1 = *(int *)a;
-	int _2 = *(int *)b;
-	const struct modlistentry *e1 = &sorting->files[_1];
-	const struct modlistentry *e2 = &sorting->files[_2];
+	const unsigned char *src;
+	const char *name = 0;
+	unsigned int len = 0;
 
-	int i1 = mlecmp_score (e1);
-	int i2 = mlecmp_score (e2);
+	dst[len++] = 16 - mlecmp_score (e);
 
-	const char *n1, *n2;
+	dirdbGetName_internalstr (e->file ? e->file->dirdb_ref : e->dir->dirdb_ref, &name);
+	src = (const unsigned char *)(name ? name : "");
 
-	if (i1 != i2)
+	while (*src)
 	{
-		return i2 - i1;
+		if ((*src >= '0') && (*src <= '9'))
+		{
+			const unsigned char *digits;
+			unsigned int count;
+
+			while (src[0] == '0' && (src[1] >= '0') && (src[1] <= '9'))
+			{
+				src++;
+			}
+			for (digits = src; (*src >= '0') && (*src <= '9'); src++)
+			{
+			}
+			count = src - digits;
+			if (count > 255)
+			{ /* absurd numbers are compared by their first 255 digits only */
+				count = 255;
+			}
+			dst[len++] = '0';
+			dst[len++] = count;
+			memcpy (dst + len, digits, count);
+			len += count;
+		} else {
+			dst[len++] = tolower (*src);
+			src++;
+		}
 	}
 
-	dirdbGetName_internalstr (e1->file ? e1->file->dirdb_ref : e1->dir->dirdb_ref, &n1);
-	dirdbGetName_internalstr (e2->file ? e2->file->dirdb_ref : e2->dir->dirdb_ref, &n2);
+	return len;
+}
+
+static int modlist_sortkey_cmp (const struct modlist_sortkey *k1, const unsigned char *keys1, const struct modlist_sortkey *k2, const unsigned char *keys2)
+{
+	unsigned int len;
+	int r;
 
-	return strcasecmp(n1, n2);
+	if (k1->prefix[0] != k2->prefix[0])
+	{
+		return (k1->prefix[0] < k2->prefix[0]) ? -1 : 1;
+	}
+	if (k1->prefix[1] != k2->prefix[1])
+	{
+		return (k1->prefix[1] < k2->prefix[1]) ? -1 : 1;
+	}
+	len = (k1->length < k2->length) ? k1->length : k2->length;
+	if (len > 16)
+	{
+		if ((r = memcmp (keys1 + k1->offset + 16, keys2 + k2->offset + 16, len - 16)))
+		{
+			return r;
+		}
+	}
+	return (int)k1->length - (int)k2->length;
+}
+
+/* the digit encoding makes a key at most twice the length of the name, plus the score */
+static size_t modlist_sortkey_size (const struct modlistentry *e)
+{
+	const char *name = 0;
+	dirdbGetName_internalstr (e->file ? e->file->dirdb_ref : e->dir->dirdb_ref, &name);
+	return (name ? strlen (name) : 0) * 2 + 2;
+}
+
+/* makes the key of files[index] at keys + offset, and returns its length */
+static unsigned int modlist_sortkey_fill (struct modlist_sortkey *k, const struct modlist *modlist, int index, unsigned char *keys, unsigned int offset)
+{
+	unsigned char *key = keys + offset;
+	unsigned int length = modlist_sortkey_make (key, &modlist->files[index]);
+	uint64_t prefix[2] = {0, 0};
+	unsigned int j;
+
+	for (j=0; j < 16; j++)
+	{
+		prefix[j >> 3] = (prefix[j >> 3] << 8) | ((j < length) ? key[j] : 0);
+	}
+	k->prefix[0] = prefix[0];
+	k->prefix[1] = prefix[1];
+	k->offset = offset;
+	k->length = length;
+	k->index = index;
+
+	return length;
+}
+
+/* bottom-up merge sort, stable so equal names keep the order they were appended in. Returns either sortkeys or temp */
+static struct modlist_sortkey *modlist_sortkeys_sort (struct modlist_sortkey *sortkeys, struct modlist_sortkey *temp, unsigned int num, const unsigned char *keys)
+{
+	struct modlist_sortkey *src = sortkeys, *dst = temp;
+	unsigned int width;
+
+	for (width = 1; width < num; width *= 2)
+	{
+		unsigned int left;
+		for (left = 0; left < num; left += 2 * width)
+		{
+			unsigned int mid   = (left + width     < num) ? left + width     : num;
+			unsigned int right = (left + 2 * width < num) ? left + 2 * width : num;
+			unsigned int a = left, b = mid, o = left;
+
+			while ((a < mid) && (b < right))
+			{
+				if (modlist_sortkey_cmp (&src[b], keys, &src[a], keys) < 0)
+				{
+					dst[o++] = src[b++];
+				} else {
+					dst[o++] = src[a++];
+				}
+			}
+			while (a < mid)
+			{
+				dst[o++] = src[a++];
+			}
+			while (b < right)
+			{
+				dst[o++] = src[b++];
+			}
+		}
+		temp = src; src = dst; dst = temp;
+	}
+
+	return src;
 }
 
 void modlist_sort (struct modlist *modlist)
 {
-	sorting = modlist; /* dirty HACK that is not thread-safe / reentrant what so ever */
-	qsort(modlist->sortindex, modlist->num, sizeof(modlist->sortindex[0]), mlecmp);
-	sorting = 0;
+	modlist_sort_tail (modlist, 0);
+}
+
+void modlist_sort_tail (struct modlist *modlist, unsigned int sorted)
+{
+	struct modlist_sortkey *sortkeys, *src;
+	unsigned char *keys;
+	unsigned char *scratch = 0;
+	size_t scratchsize = 0;
+	size_t keyssize = 0, keysfill = 0;
+	unsigned int count, i, lo;
+	int *newindex;
+
+	if (sorted > modlist->num)
+	{
+		sorted = 0;
+	}
+	count = modlist->num - sorted;
+	if ((modlist->num < 2) || (!count))
+	{
+		return;
+	}
+
+	for (i=sorted; i < modlist->num; i++)
+	{
+		keyssize += modlist_sortkey_size (&modlist->files[modlist->sortindex[i]]);
+	}
+
+	keys = malloc (keyssize);
+	sortkeys = malloc (sizeof (sortkeys[0]) * count * 2);
+	newindex = sorted ? malloc (sizeof (newindex[0]) * modlist->num) : 0;
+	if ((!keys) || (!sortkeys) || (sorted && !newindex))
+	{
+		fprintf (stderr, "modlist_sort: out of memory\n");
+		free (keys);
+		free (sortkeys);
+		free (newindex);
+		return;
+	}
+
+	for (i=0; i < count; i++)
+	{ /* when everything is sorted, walk files in memory order, it is a lot more cache friendly */
+		keysfill += modlist_sortkey_fill (&sortkeys[i], modlist, sorted ? modlist->sortindex[sorted + i] : (int)i, keys, keysfill);
+	}
+	src = modlist_sortkeys_sort (sortkeys, sortkeys + count, count, keys);
+
+	if (!sorted)
+	{
+		for (i=0; i < count; i++)
+		{
+			modlist->sortindex[i] = src[i].index;
+		}
+	} else {
+		/* Merge the new entries into the part that is already sorted. Keys of the sorted part are only made for the entries that
+		 * the binary searches visit, apart from copying the index this does not depend on the size of the list */
+		unsigned int o = 0, prev = 0;
+
+		lo = 0;
+		for (i=0; i < count; i++)
+		{
+			unsigned int hi = sorted;
+
+			while (lo < hi)
+			{ /* find the first entry that is larger, equal names keep the order they were appended in */
+				unsigned int mid = lo + (hi - lo) / 2;
+				struct modlist_sortkey k;
+				size_t size = modlist_sortkey_size (&modlist->files[modlist->sortindex[mid]]);
+
+				if (size > scratchsize)
+				{
+					unsigned char *temp = realloc (scratch, size);
+					if (!temp)
+					{
+						fprintf (stderr, "modlist_sort: out of memory\n");
+						free (scratch);
+						free (keys);
+						free (sortkeys);
+						free (newindex);
+						return;
+					}
+					scratch = temp;
+					scratchsize = size;
+				}
+				modlist_sortkey_fill (&k, modlist, modlist->sortindex[mid], scratch, 0);
+				if (modlist_sortkey_cmp (&src[i], keys, &k, scratch) < 0)
+				{
+					hi = mid;
+				} else {
+					lo = mid + 1;
+				}
+			}
+			while (prev < lo)
+			{
+				newindex[o++] = modlist->sortindex[prev++];
+			}
+			newindex[o++] = src[i].index;
+		}
+		while (prev < sorted)
+		{
+			newindex[o++] = modlist->sortindex[prev++];
+		}
+		memcpy (modlist->sortindex, newindex, sizeof (newindex[0]) * modlist->num);
+	}
+	modlist_findindex_reorder (modlist);
+
+	free (scratch);
+	free (keys);
+	free (sortkeys);
+	free (newindex);
 }
 
 struct modlist *modlist_create (void)
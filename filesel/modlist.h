@@ -3,6 +3,7 @@
 
 struct ocpdir_t;
 struct ocpfile_t;
+struct modlist_findindex;
 
 struct modlistentry
 {
@@ -29,6 +30,8 @@ struct modlist
 
 	unsigned int max; /* current array size */
 	unsigned int num; /* entries used */
+
+	struct modlist_findindex *findindex; /* internal, made by modlist_fuzzyfind() */
 };
 
 struct dmDrive;
@@ -36,6 +39,7 @@ struct dmDrive;
 struct modlist *modlist_create(void);
 void modlist_free(struct modlist *modlist);
 void modlist_sort(struct modlist *modlist);
+void modlist_sort_tail(struct modlist *modlist, unsigned int sorted); /* the first sorted entries are already in order, merge the rest into them */
 void modlist_append(struct modlist *modlist, struct modlistentry *entry);
 void modlist_append_dir (struct modlist *modlist, struct ocpdir_t *dir);
 void modlist_append_dotdot (struct modlist *modlist, struct ocpdir_t *dir);
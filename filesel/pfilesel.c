@@ -74,12 +74,14 @@
 #include "dirdb.h"
 #include "filesystem.h"
 #include "filesystem-drive.h"
+#include "filesystem-filehandle-cache.h"
 #include "filesystem-bzip2.h"
 #include "filesystem-gzip.h"
 #include "filesystem-playlist.h"
 #include "filesystem-playlist-m3u.h"
 #include "filesystem-playlist-pls.h"
 #include "filesystem-setup.h"
+#include "filesystem-spill.h"
 #include "filesystem-tar.h"
 #include "filesystem-unix.h"
 #include "filesystem-z.h"
@@ -122,8 +124,12 @@ struct fsReadDir_token_t
 
 	int             cancel_recursive;
 	char           *parent_displaydir;
+
+	int             async; /* flattened archives are pushed to fsScanDirLevels instead of being read at once */
 };
 
+static int fsScanDirPush (struct ocpdir_t *dir, ocpdirhandle_pt dh);
+
 static void fsReadDir_file (void *_token, struct ocpfile_t *file)
 {
 	struct fsReadDir_token_t *token = _token;
@@ -157,7 +163,14 @@ static void fsReadDir_file (void *_token, struct ocpfile_t *file)
 				{
 					fsReadDir (token->ml, dir, token->mask, token->opt);
 				}
-				if ((!dir->is_playlist) && fsPutArcs && dir->readflatdir_start)
+				if ((!dir->is_playlist) && fsPutArcs && dir->readflatdir_start && token->async)
+				{
+					ocpdirhandle_pt dh = dir->readflatdir_start (dir, fsReadDir_file, token); /* recycle the same token... */
+					if (dh && fsScanDirPush (dir, dh))
+					{
+						dir->readdir_cancel (dh);
+					}
+				} else if ((!dir->is_playlist) && fsPutArcs && dir->readflatdir_start)
 				{
 					unsigned int mlTop=plScrHeight/2-2;
 					unsigned int i;
@@ -299,6 +312,7 @@ int fsReadDir (struct modlist *ml, struct ocpdir_t *dir, const char *mask, unsig
 	token.ml = ml;
 	token.cancel_recursive = 0;
 	token.parent_displaydir = 0;
+	token.async = 0;
 #ifndef FNM_CASEFOLD
 	token.mask = strupr(strdup (mask));
 #else
@@ -428,6 +442,27 @@ void fsRegisterExt(const char *ext)
 	}
 }
 
+/* Hash of the registered extensions, independent of the order they were registered in
+ */
+uint32_t fsModuleExtensionsStamp (void)
+{
+	uint32_t retval = 0;
+	char **e;
+
+	for (e=moduleextensions; e && *e; e++)
+	{ /* FNV-1a of each extension, case-insensitive like fsIsModule() */
+		uint32_t h = 2166136261u;
+		const unsigned char *c;
+		for (c = (const unsigned char *)*e; *c; c++)
+		{
+			h ^= toupper (*c);
+			h *= 16777619u;
+		}
+		retval += h;
+	}
+	return retval;
+}
+
 /* This function tells if a file ends with a valid extension or not
  */
 int fsIsModule (const char *ext)
@@ -614,6 +649,201 @@ int fsFilesLeft(void)
 	return (isnextplay!=NextPlayNone)||playlist->num;
 }
 
+/* Directory listings in the file selector are read progressively: fsScanDir() reads until the first screen is filled (or the
+ * frame deadline passes), and the remaining entries are read by fsScanDirIterate() while the file selector is idle. Archives
+ * that are flattened into the listing (fsScanArcs) are pushed on a stack of open handles instead of being read in one go.
+ */
+struct fsScanDirLevel_t
+{
+	struct ocpdir_t *dir;
+	ocpdirhandle_pt  dh;
+};
+static struct fsReadDir_token_t fsScanDirToken;
+static struct fsScanDirLevel_t *fsScanDirLevels;
+static int fsScanDirLevelsCount;
+static int fsScanDirLevelsSize;
+static int fsScanDirPlace;               /* cursor should be placed at fsScanDirPos, user has not moved it yet */
+static unsigned int fsScanDirPos;
+static uint32_t fsScanDirSelectRef = DIRDB_CLEAR; /* cursor should be placed on this entry once it has been read */
+static unsigned int fsScanDirSorted;     /* currentdir entries that are in sorted order, the rest has been appended since */
+
+static int fsScanDirPush (struct ocpdir_t *dir, ocpdirhandle_pt dh)
+{
+	if (fsScanDirLevelsCount >= fsScanDirLevelsSize)
+	{
+		struct fsScanDirLevel_t *temp = realloc (fsScanDirLevels, (fsScanDirLevelsSize + 8) * sizeof (fsScanDirLevels[0]));
+		if (!temp)
+		{
+			fprintf (stderr, "pfilesel.c: fsScanDirPush() realloc() failed\n");
+			return -1;
+		}
+		fsScanDirLevels = temp;
+		fsScanDirLevelsSize += 8;
+	}
+	dir->ref (dir);
+	fsScanDirLevels[fsScanDirLevelsCount].dir = dir;
+	fsScanDirLevels[fsScanDirLevelsCount].dh = dh;
+	fsScanDirLevelsCount++;
+	return 0;
+}
+
+static void fsScanDirPop (int level)
+{
+	struct ocpdir_t *dir = fsScanDirLevels[level].dir;
+
+	dir->readdir_cancel (fsScanDirLevels[level].dh);
+	dir->unref (dir);
+	memmove (fsScanDirLevels + level, fsScanDirLevels + level + 1, (fsScanDirLevelsCount - level - 1) * sizeof (fsScanDirLevels[0]));
+	fsScanDirLevelsCount--;
+}
+
+static void fsScanDirSelectClear (void)
+{
+	if (fsScanDirSelectRef != DIRDB_CLEAR)
+	{
+		dirdbUnref (fsScanDirSelectRef, dirdb_use_pfilesel);
+		fsScanDirSelectRef = DIRDB_CLEAR;
+	}
+}
+
+static void fsScanDirCancel (void)
+{
+	while (fsScanDirLevelsCount)
+	{
+		fsScanDirPop (fsScanDirLevelsCount - 1);
+	}
+	free (fsScanDirLevels);
+	fsScanDirLevels = 0;
+	fsScanDirLevelsSize = 0;
+#ifndef FNM_CASEFOLD
+	free ((char *)fsScanDirToken.mask);
+#endif
+	fsScanDirToken.mask = 0;
+	fsScanDirSelectClear ();
+	fsScanDirPlace = 0;
+}
+
+/* the user moved the cursor, stop placing it */
+static void fsScanDirUserMoved (void)
+{
+	fsScanDirSelectClear ();
+	fsScanDirPlace = 0;
+}
+
+/* place the cursor on the given entry, now if it has already been read, else when it appears */
+static void fsScanDirSelect (uint32_t dirdb_ref)
+{
+	int i = modlist_find (currentdir, dirdb_ref);
+
+	fsScanDirSelectClear ();
+	if (i >= 0)
+	{
+		currentdir->pos = i;
+		fsScanDirPlace = 0;
+	} else if (fsScanDirLevelsCount)
+	{
+		fsScanDirSelectRef = dirdb_ref;
+		dirdbRef (fsScanDirSelectRef, dirdb_use_pfilesel);
+	}
+}
+
+/* merge new entries into the sorted part of currentdir, and put the cursor back on the entry it was on before, or where it has
+ * been requested to be */
+static void fsScanDirSort (void)
+{
+	int realindex = (currentdir->pos < currentdir->num) ? (int)currentdir->sortindex[currentdir->pos] : -1;
+	unsigned int i;
+
+	if (fsScanDirSorted == currentdir->num)
+	{
+		return;
+	}
+	modlist_sort_tail (currentdir, fsScanDirSorted);
+	fsScanDirSorted = currentdir->num;
+
+	if (fsScanDirSelectRef != DIRDB_CLEAR)
+	{
+		int j = modlist_find (currentdir, fsScanDirSelectRef);
+		if (j >= 0)
+		{
+			currentdir->pos = j;
+			fsScanDirSelectClear ();
+			fsScanDirPlace = 0;
+			return;
+		}
+	}
+	if (fsScanDirPlace)
+	{
+		currentdir->pos = (fsScanDirPos >= currentdir->num) ? (currentdir->num ? currentdir->num - 1 : 0) : fsScanDirPos;
+		return;
+	}
+	for (i=0; i < currentdir->num; i++)
+	{
+		if (currentdir->sortindex[i] == realindex)
+		{
+			currentdir->pos = i;
+			break;
+		}
+	}
+}
+
+/* read one more entry of the directory listing */
+static void fsScanDirStep (void)
+{
+	struct ocpdir_t *dir = fsScanDirLevels[fsScanDirLevelsCount - 1].dir;
+	ocpdirhandle_pt dh = fsScanDirLevels[fsScanDirLevelsCount - 1].dh;
+
+	if (!dir->readdir_iterate (dh))
+	{ /* fsReadDir_file() might have pushed a new level during the iteration, so search for the handle */
+		int i;
+		for (i = fsScanDirLevelsCount - 1; i >= 0; i--)
+		{
+			if (fsScanDirLevels[i].dh == dh)
+			{
+				fsScanDirPop (i);
+				break;
+			}
+		}
+	}
+}
+
+static void fsScanDirComplete (void)
+{
+	fsScanDirSort ();
+	if (!fsScanDirLevelsCount)
+	{
+		fsScanDirCancel ();
+		quickfindpos=0;
+		scanposf=fsScanNames?0:~0;
+		adbMetaCommit ();
+	}
+}
+
+/* returns non-zero if the frame deadline was reached before the listing was complete */
+static int fsScanDirIterate (void)
+{
+	int stopped = 0;
+
+	if (!fsScanDirLevelsCount)
+	{
+		return 0;
+	}
+
+	while (fsScanDirLevelsCount)
+	{
+		fsScanDirStep ();
+		if (poll_framelock())
+		{
+			stopped = 1;
+			break;
+		}
+	}
+
+	fsScanDirComplete ();
+
+	return stopped;
+}
+
 /* returns zero if fsReadDir() fails */
 /* pos = 0, move cursor to the top
  * pos = 1, maintain current cursor position
@@ -622,6 +852,10 @@ int fsFilesLeft(void)
 static char fsScanDir (int pos)
 {
 	unsigned int op=0;
+	ocpdirhandle_pt dh;
+	struct ocpdir_t *dir = dmCurDrive->cwd;
+	struct dmDrive *d;
+
 	switch (pos)
 	{
 		case 0:
@@ -634,20 +868,54 @@ static char fsScanDir (int pos)
 			op=currentdir->pos?(currentdir->pos-1):0;
 			break;
 	}
+	fsScanDirCancel ();
 	modlist_clear (currentdir);
+	fsScanDirSorted = 0;
 	nextplay=0;
 
-	if (!fsReadDir (currentdir, dmCurDrive->cwd, curmask, RD_PUTDRIVES | RD_PUTSUBS | (fsScanArcs?RD_ARCSCAN:0)))
+	for (d=dmDrives; d; d=d->next)
+	{
+		modlist_append_drive (currentdir, d);
+	}
+	if (dir->parent)
 	{
+		modlist_append_dotdot (currentdir, dir->parent);
+	}
+
+	fsScanDirToken.ml = currentdir;
+	fsScanDirToken.cancel_recursive = 0;
+	fsScanDirToken.parent_displaydir = 0;
+#ifndef FNM_CASEFOLD
+	fsScanDirToken.mask = strupr(strdup (curmask));
+#else
+	fsScanDirToken.mask = curmask;
+#endif
+	fsScanDirToken.opt = RD_PUTSUBS | (fsScanArcs?RD_ARCSCAN:0);
+	fsScanDirToken.async = 1;
+	fsScanDirPlace = 1;
+	fsScanDirPos = op;
+
+	dh = dir->readdir_start (dir, fsReadDir_file, fsReadDir_dir, &fsScanDirToken);
+	if (!dh)
+	{
+		fsScanDirCancel ();
+		return 0;
+	}
+	if (fsScanDirPush (dir, dh))
+	{
+		dir->readdir_cancel (dh);
+		fsScanDirCancel ();
 		return 0;
 	}
 
-	modlist_sort(currentdir);
-	currentdir->pos=(op>=currentdir->num)?(currentdir->num-1):op;
+	/* fill the first screen right away, fsFileSelect() reads the rest */
+	while (fsScanDirLevelsCount && (currentdir->num < plScrHeight))
+	{
+		fsScanDirStep ();
+	}
 	quickfindpos=0;
 	scanposf=fsScanNames?0:~0;
-
-	adbMetaCommit ();
+	fsScanDirComplete ();
 
 	return 1;
 }
@@ -658,6 +926,24 @@ void fsRescanDir(void)
 	conSave();
 }
 
+/* Players read in small pieces, so let a thread read ahead of them when the file can be used from another thread. Network mounts gain the most */
+static struct ocpfilehandle_t *fsOpenPlayFile (struct ocpfile_t *file)
+{
+	struct ocpfilehandle_t *retval = file->open (file);
+
+	if (retval && !retval->ioctl (retval, IOCTL_FILEHANDLE_THREAD_SAFE, 0))
+	{
+		struct ocpfilehandle_t *cached = cache_filehandle_open_readahead (retval);
+		if (cached)
+		{
+			retval->unref (retval);
+			retval = cached;
+		}
+	}
+
+	return retval;
+}
+
 int fsGetPrevFile (struct moduleinfostruct *info, struct ocpfilehandle_t **filehandle)
 {
 	struct modlistentry *m;
@@ -696,7 +982,7 @@ int fsGetPrevFile (struct moduleinfostruct *info, struct ocpfilehandle_t **fileh
 	{
 		if (m->file)
 		{
-			*filehandle = m->file->open (m->file);
+			*filehandle = fsOpenPlayFile (m->file);
 		}
 
 		if (*filehandle)
@@ -768,7 +1054,7 @@ int fsGetNextFile (struct moduleinfostruct *info, struct ocpfilehandle_t **fileh
 
 	if (m->file)
 	{
-		*filehandle = m->file->open (m->file);
+		*filehandle = fsOpenPlayFile (m->file);
 	}
 
 	if (*filehandle)
@@ -834,6 +1120,8 @@ int fsPreInit(void)
 
 	adbMetaInit(); /* archive database cache - ignore failures */
 
+	fsWriteModInfo=cfGetProfileBool2(sec, "fileselector", "writeinfo", 1, 1); /* mdbInit() only maps the database if we are allowed to write to it */
+
 	if (!mdbInit())
 		return 0;
 
@@ -847,7 +1135,6 @@ int fsPreInit(void)
 	fsScrType=cfGetProfileInt2(cfScreenSec, "screen", "screentype", 7, 10)&7;
 	fsColorTypes=cfGetProfileBool2(sec, "fileselector", "typecolors", 1, 1);
 	fsEditWin=cfGetProfileBool2(sec, "fileselector", "editwin", 1, 1);
-	fsWriteModInfo=cfGetProfileBool2(sec, "fileselector", "writeinfo", 1, 1);
 	fsScanInArc=cfGetProfileBool2(sec, "fileselector", "scaninarcs", 1, 1);
 	fsScanNames=cfGetProfileBool2(sec, "fileselector", "scanmodinfo", 1, 1);
 	fsScanArcs=cfGetProfileBool2(sec, "fileselector", "scanarchives", 1, 1);
@@ -860,6 +1147,9 @@ int fsPreInit(void)
 	fsLoopMods=cfGetProfileBool("commandline_f", "l", fsLoopMods, 0);
 	fsPlaylistOnly=!!cfGetProfileString("commandline", "p", 0);
 
+	filesystem_spill_init ((uint64_t)cfGetProfileInt2(sec, "fileselector", "spillmemory", 16384, 10) * 1024,
+	                       (uint64_t)cfGetProfileInt2(sec, "fileselector", "spilldisk", 262144, 10) * 1024);
+
 	filesystem_drive_init ();
 
 	filesystem_unix_init ();
@@ -962,6 +1252,8 @@ int fsInit(void)
 
 void fsClose(void)
 {
+	fsScanDirCancel ();
+
 	if (currentdir)
 	{
 		modlist_free(currentdir);
@@ -975,6 +1267,8 @@ void fsClose(void)
 
 	musicbrainz_done();
 
+	cache_filehandle_done ();
+	filesystem_spill_done ();
 	filesystem_unix_done ();
 	filesystem_drive_done ();
 	dmCurDrive = 0;
@@ -3052,16 +3346,40 @@ superbreak:
 			state = 0;
 		}
 
-		if (!ekbhit()&&fsScanNames)
+		if (!ekbhit()&&(fsScanNames||fsScanDirLevelsCount))
 		{
 			int poll = 1;
-			if (m->file && (!mdbInfoIsAvailable(m->mdb_ref)) && (!(m->flags&MODLIST_FLAG_SCANNED)))
+			if (fsScanNames)
 			{
-				mdbScan(m->file, m->mdb_ref);
-				m->flags |= MODLIST_FLAG_SCANNED;
+				if (m && m->file && (!mdbInfoIsAvailable(m->mdb_ref)) && (!(m->flags&MODLIST_FLAG_SCANNED)))
+				{
+					mdbScan(m->file, m->mdb_ref);
+					m->flags |= MODLIST_FLAG_SCANNED;
+				}
+
+				/* entries that are visible comes first */
+				for (i=firstv; poll && (i<currentdir->num) && (i<(unsigned long)(firstv+dirwinheight)); i++)
+				{
+					struct modlistentry *scanm = modlist_get(currentdir, i);
+					if (scanm && scanm->file && (!mdbInfoIsAvailable(scanm->mdb_ref)) && (!(scanm->flags&MODLIST_FLAG_SCANNED)))
+					{
+						mdbScan(scanm->file, scanm->mdb_ref);
+						scanm->flags |= MODLIST_FLAG_SCANNED;
+						if (poll_framelock())
+						{
+							poll = 0;
+						}
+					}
+				}
 			}
 
-			while (((!win)||(scanposp>=playlist->num)) && (scanposf<currentdir->num))
+			if (poll && fsScanDirIterate())
+			{
+				poll = 0;
+			}
+
+			/* the rest of the entries are scanned once the directory listing is complete */
+			while (poll && fsScanNames && (!fsScanDirLevelsCount) && ((!win)||(scanposp>=playlist->num)) && (scanposf<currentdir->num))
 			{
 				struct modlistentry *scanm;
 				if ((scanm=modlist_get(currentdir, scanposf++)))
@@ -3082,7 +3400,7 @@ superbreak:
 					}
 				}
 			}
-			while (((win)||(scanposf>=currentdir->num)) && (scanposp<playlist->num))
+			while (poll && fsScanNames && ((win)||(scanposf>=currentdir->num)) && (scanposp<playlist->num))
 			{
 				struct modlistentry *scanm;
 				if ((scanm=modlist_get(playlist, scanposp++)))
@@ -3111,6 +3429,7 @@ superbreak:
 		} else while (ekbhit())
 		{
 			c=egetch();
+			fsScanDirUserMoved ();
 
 			if (!editmode)
 			{
@@ -3277,7 +3596,6 @@ superbreak:
 						if (m->dir)
 						{
 							uint32_t olddirpath = dmCurDrive->cwd->dirdb_ref;
-							unsigned int i;
 
 							dirdbRef (olddirpath, dirdb_use_pfilesel);
 
@@ -3291,11 +3609,7 @@ superbreak:
 							dmCurDrive->cwd = m->dir;
 
 							fsScanDir(0);
-							i = modlist_find (currentdir, olddirpath);
-							if (i >= 0)
-							{
-								currentdir->pos = i;
-							}
+							fsScanDirSelect (olddirpath);
 							dirdbUnref(olddirpath, dirdb_use_pfilesel);
 						} else if (m->file)
 						{
@@ -50,6 +50,7 @@ uint8_t fsModTypeColor(struct moduletype modtype); /* replaces fsTypeCols[] */
 
 extern void fsRegisterExt(const char *ext);
 extern int fsIsModule(const char *ext);
+extern uint32_t fsModuleExtensionsStamp(void); /* changes when the set of registered extensions changes */
 
 struct preprocregstruct
 {
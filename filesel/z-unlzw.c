@@ -58,6 +58,8 @@ struct lzw_handle_t
 	uint16_t tab_prefix[1L<<MAX_BITS];
 	uint8_t  tab_suffix[2L*WSIZE]; // window
 
+	int     cleared; /* set when a CLEAR code has been digested, the next code-group starts on a fresh dictionary */
+
 	int     outpos;
 	int	outlen;
 	uint8_t outbuf[DIST_BUFSIZE-1];
@@ -90,6 +92,7 @@ static void unlzw_init (struct lzw_handle_t *h)
 	h->n_bits     = 9;
 	h->writecodes = 0;
 	h->readcodes  = 8;
+	h->cleared    = 0;
 }
 
 static signed int unlzw_feed (struct lzw_handle_t *h, uint8_t input)
@@ -195,6 +198,7 @@ again:
 	if (code == CLEAR && h->block_mode)
 	{
 		h->readcodes = 8; /* discard remaining codes in the buffer */
+		h->cleared = 1;
 
 		bzero (h->tab_prefix, 256*sizeof (h->tab_prefix[0]));
 		h->free_ent = FIRST - 1;
@@ -260,3 +264,21 @@ again:
 
 	return 1;
 }
+
+/* Prepare to decode the code-group that follows a CLEAR code. Only the header byte is needed, since the dictionary is empty at this point */
+static signed int unlzw_resume_after_clear (struct lzw_handle_t *h, uint8_t header)
+{
+	unlzw_init (h);
+	if (unlzw_feed (h, header) < 0)
+	{
+		return -1;
+	}
+	if (!h->block_mode)
+	{
+		return -1;
+	}
+	h->free_ent = FIRST - 1;
+	h->oldcode = 0; /* the first code after CLEAR fills the unused entry FIRST-1, like the encoder expects */
+
+	return 0;
+}
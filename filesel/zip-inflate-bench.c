@@ -0,0 +1,175 @@
+/* throughput benchmark for zip-inflate.c, not part of "make test"
+ *
+ * Compares the buffered path (inflate into out_buffer, then memcpy) with the direct path, using the same read sizes as a player/detector would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "zip-inflate.c"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_GREEN   "\x1b[32m"
+#define ANSI_COLOR_CYAN    "\x1b[36m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define BENCH_SIZE (64*1024*1024)
+#define BENCH_INPUTSIZE 65536 /* matches the input chunks handed over by filesystem-zip.c */
+
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* something that compresses roughly like tracker modules, a mix of repeating patterns and noise */
+static void bench_generate (uint8_t *dst, size_t len)
+{
+	uint32_t seed = 0x12345678;
+	size_t i = 0;
+
+	while (i < len)
+	{
+		int run, j;
+		seed = seed * 1103515245 + 12345;
+		run = 16 + ((seed >> 16) & 255);
+		if (run > (len - i))
+		{
+			run = len - i;
+		}
+		if (seed & 0x80000000)
+		{
+			for (j=0; j < run; j++)
+			{
+				dst[i + j] = (uint8_t)(j * ((seed >> 8) & 7));
+			}
+		} else {
+			for (j=0; j < run; j++)
+			{
+				seed = seed * 1103515245 + 12345;
+				dst[i + j] = seed >> 24;
+			}
+		}
+		i += run;
+	}
+}
+
+static int bench_run (const char *name, const uint8_t *src, size_t srclen, uint8_t *dst, int readsize, int direct, uLong expect_crc)
+{
+	struct zip_inflate_t *z = calloc (1, sizeof (*z));
+	size_t srcpos = 0, dstpos = 0;
+	double t0, t1;
+	uLong crc;
+
+	zip_inflate_init (z);
+
+	t0 = now ();
+	while (dstpos < BENCH_SIZE)
+	{
+		int64_t res;
+		int len = readsize;
+
+		if (len > (BENCH_SIZE - dstpos))
+		{
+			len = BENCH_SIZE - dstpos;
+		}
+
+		if (z->out_buffer_fill)
+		{
+			if (len > z->out_buffer_fill)
+			{
+				len = z->out_buffer_fill;
+			}
+			memcpy (dst + dstpos, z->out_buffer_readnext, len);
+			z->out_buffer_fill -= len;
+			z->out_buffer_readnext += len;
+			dstpos += len;
+			continue;
+		}
+
+		if (direct && (len >= ZIP_INFLATE_DIRECT_MINIMUM))
+		{
+			res = zip_inflate_digest_direct (z, dst + dstpos, len);
+			if (res > 0)
+			{
+				dstpos += res;
+				continue;
+			}
+		} else {
+			res = zip_inflate_digest (z);
+			if (res > 0)
+			{
+				continue;
+			}
+		}
+		if ((res < 0) || (srcpos >= srclen))
+		{
+			break;
+		}
+		len = BENCH_INPUTSIZE;
+		if (len > (srclen - srcpos))
+		{
+			len = srclen - srcpos;
+		}
+		zip_inflate_feed (z, (uint8_t *)src + srcpos, len);
+		srcpos += len;
+	}
+	t1 = now ();
+
+	zip_inflate_done (z);
+	free (z);
+
+	crc = crc32 (0, dst, dstpos);
+	if ((dstpos != BENCH_SIZE) || (crc != expect_crc))
+	{
+		printf ("%-32s" ANSI_COLOR_RED "Failed" ANSI_COLOR_RESET "\n", name);
+		return 1;
+	}
+	printf ("%-32s%8.1f MB/s\n", name, BENCH_SIZE / (t1 - t0) / (1024.0 * 1024.0));
+	return 0;
+}
+
+int main (int argc, char *argv[])
+{
+	uint8_t *plain = malloc (BENCH_SIZE);
+	uint8_t *dst = malloc (BENCH_SIZE);
+	uLongf compressedsize = compressBound (BENCH_SIZE);
+	uint8_t *compressed = malloc (compressedsize);
+	z_stream strm;
+	uLong crc;
+	double t0, t1;
+	int retval = 0;
+
+	printf (ANSI_COLOR_CYAN "Benchmarking zip-inflate" ANSI_COLOR_RESET "\n");
+
+	bench_generate (plain, BENCH_SIZE);
+
+	t0 = now ();
+	crc = crc32 (0, plain, BENCH_SIZE);
+	t1 = now ();
+	printf ("%-32s%8.1f MB/s\n", "crc32 (zlib)", BENCH_SIZE / (t1 - t0) / (1024.0 * 1024.0));
+
+	memset (&strm, 0, sizeof (strm));
+	deflateInit2 (&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); /* raw deflate, like inside ZIP files */
+	strm.next_in = plain;
+	strm.avail_in = BENCH_SIZE;
+	strm.next_out = compressed;
+	strm.avail_out = compressedsize;
+	deflate (&strm, Z_FINISH);
+	compressedsize = strm.total_out;
+	deflateEnd (&strm);
+	printf ("%d MB compressed to %d KB\n", BENCH_SIZE / (1024 * 1024), (int)(compressedsize / 1024));
+
+	retval |= bench_run ("buffered, 1KB reads",     compressed, compressedsize, dst,   1024, 0, crc);
+	retval |= bench_run ("buffered, 64KB reads",    compressed, compressedsize, dst,  65536, 0, crc);
+	retval |= bench_run ("buffered, 1MB reads",     compressed, compressedsize, dst, 1048576, 0, crc);
+	retval |= bench_run ("direct, 64KB reads",      compressed, compressedsize, dst,  65536, 1, crc);
+	retval |= bench_run ("direct, 1MB reads",       compressed, compressedsize, dst, 1048576, 1, crc);
+
+	free (plain);
+	free (dst);
+	free (compressed);
+
+	return retval;
+}
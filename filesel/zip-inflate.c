@@ -22,6 +22,8 @@
 #include <string.h>
 #include <zlib.h>
 
+#define ZIP_INFLATE_DIRECT_MINIMUM 4096 /* reads this size or larger are inflated directly into the destination */
+
 struct zip_inflate_t
 {
 	Bytef out_buffer[65536];
@@ -59,69 +61,73 @@ static void zip_inflate_done (struct zip_inflate_t *self)
 	}
 }
 
+static int64_t zip_inflate_run (struct zip_inflate_t *self, uint8_t *dst, uint32_t len)
+{
+	int res;
+
+	self->strm.next_out = dst;
+	self->strm.avail_out = len;
+
+	res = inflate (&self->strm, Z_NO_FLUSH);
+	if (res == Z_STREAM_END)
+	{
+		self->eof_hit = 1;
+		return self->strm.next_out - dst;
+	}
+	if (res == Z_OK)
+	{
+		return self->strm.next_out - dst;
+	}
+	self->eof_hit = 1; /* we treat all errors as EOF */
+	return -1;
+}
+
 /* call this when readnext is exhausted */
 static int64_t zip_inflate_digest(struct zip_inflate_t *self)
 {
+	int64_t res;
+
 	if (self->eof_hit)
 	{
 		return -1;
 	}
-	if (self->strm.avail_in)
+	if (!self->strm.avail_in)
+	{
+		return 0;
+	}
+
+	self->out_buffer_readnext = self->out_buffer;
+	res = zip_inflate_run (self, self->out_buffer, sizeof (self->out_buffer));
+	self->out_buffer_fill = (res > 0) ? res : 0;
+	return res;
+}
+
+/* same as zip_inflate_digest(), but the data is inflated straight into dst, skipping the copy via out_buffer. Only use when readnext is exhausted */
+static int64_t zip_inflate_digest_direct (struct zip_inflate_t *self, uint8_t *dst, uint32_t len)
+{
+	if (self->eof_hit)
 	{
-		int res;
-
-		self->out_buffer_readnext = self->out_buffer;
-		self->strm.next_out = self->out_buffer;
-		self->strm.avail_out = sizeof (self->out_buffer);
-
-		res = inflate (&self->strm, Z_SYNC_FLUSH);
-		if (res == Z_STREAM_END)
-		{
-			self->eof_hit = 1;
-			self->out_buffer_fill = self->strm.next_out - self->out_buffer;
-			return self->out_buffer_fill;
-		}
-		if (res == Z_OK)
-		{
-			self->out_buffer_fill = self->strm.next_out - self->out_buffer;
-			return self->out_buffer_fill;
-		}
-		self->eof_hit = 1; /* we treat all errors as EOF */
-		self->out_buffer_fill = 0;
 		return -1;
 	}
-	return 0;
+	if (!self->strm.avail_in)
+	{
+		return 0;
+	}
+
+	self->out_buffer_fill = 0;
+	return zip_inflate_run (self, dst, len);
 }
 
-/* call this when both readnext is exhausted, and digest above yielded no new data */
+/* call this when both readnext is exhausted, and digest above yielded no new data. The buffer must stay valid until digest returns 0 again */
 static int zip_inflate_feed (struct zip_inflate_t *self, uint8_t *src, uint32_t len)
 {
-	int res;
-
 	if (self->eof_hit)
 	{
 		return -1;
 	}
 
-	self->out_buffer_readnext = self->out_buffer;
 	self->strm.next_in = src;
 	self->strm.avail_in = len;
-	self->strm.next_out = self->out_buffer;
-	self->strm.avail_out = sizeof (self->out_buffer);
 
-	res = inflate (&self->strm, Z_SYNC_FLUSH);
-	if (res == Z_STREAM_END)
-	{
-		self->eof_hit = 1;
-		self->out_buffer_fill = self->strm.next_out - self->out_buffer;
-		return self->out_buffer_fill;
-	}
-	if (res == Z_OK)
-	{
-		self->out_buffer_fill = self->strm.next_out - self->out_buffer;
-		return self->out_buffer_fill;
-	}
-	self->eof_hit = 1; /* we treat all errors as EOF */
-	self->out_buffer_fill = 0;
-	return -1;
+	return 0;
 }
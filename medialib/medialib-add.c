@@ -330,12 +330,15 @@ static interfaceReturnEnum medialibAddRun (void)
 				case KEY_RIGHT:
 				case KEY_INSERT:
 					dirdbTagSetParent (medialibAddCurDir->dirdb_ref);
+					mlStatBegin (medialibAddCurDir->dirdb_ref);
 
 					if (mlScan (medialibAddCurDir))
 					{
+						mlStatEnd (0);
 						dirdbTagCancel ();
 					} else {
 						int i;
+						mlStatEnd (1);
 						for (i=0; i < medialib_sources_count; i++)
 						{
 							if (medialib_sources[i].dirdb_ref == medialibAddCurDir->dirdb_ref)
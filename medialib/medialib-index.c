@@ -0,0 +1,477 @@
+/* OpenCP Module Player
+ * copyright (c) 2022 Stian Skjelstad <stian.skjelstad@gmail.com>
+ *
+ * MEDIALIBRARY search index
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Trigram inverted index. Each (upper-cased) three byte sequence in a text
+ * has a posting list of the documents that contains it. A search query is
+ * answered by intersecting the posting lists of all the trigrams in the query,
+ * and the candidates are then verified against the real text.
+ *
+ * Posting lists are stored as delta-encoded varints, so documents must be
+ * added in incrementing order. Documents that are added out of order (changed
+ * later) are put in a dirty list, and are always considered candidates. When
+ * the dirty list grows too big, the index is rebuilt.
+ *
+ * Two indexes are kept: filenames keyed on dirdb_ref, and module information
+ * (title, composer, artist, album and comment) keyed on mdb_ref.
+ */
+
+#define MLINDEX_DIRTY_MAX 4096
+
+struct mlIndexPosting_t
+{
+	uint8_t  *data;
+	uint32_t  datalen;
+	uint32_t  datasize;
+	uint32_t  count;
+	uint32_t  last; /* last document added */
+};
+
+struct mlIndex_t
+{
+	uint32_t                *keys; /* trigram | 0x01000000, 0 = unused */
+	struct mlIndexPosting_t *postings;
+	uint32_t                 size; /* power of two */
+	uint32_t                 fill;
+
+	uint32_t                *dirty;
+	uint32_t                 dirtycount;
+	uint32_t                 dirtysize;
+};
+
+static struct mlIndex_t mlIndexFilename; /* documents are dirdb_ref */
+static struct mlIndex_t mlIndexInfo;     /* documents are mdb_ref */
+
+/* documents that are already indexed */
+static const char **mlIndexFilenameStamp; /* dirdbGetName_internalstr() pointer, the node is re-indexed if it changes */
+static uint32_t    *mlIndexFilenameMdb;   /* the mdb_ref the node had when indexed */
+static uint32_t     mlIndexFilenameSize;
+static uint8_t     *mlIndexInfoDone;      /* bitmap */
+static uint32_t     mlIndexInfoSize;      /* in bits */
+
+static void mlIndexFree (struct mlIndex_t *index)
+{
+	uint32_t i;
+	for (i=0; i < index->size; i++)
+	{
+		free (index->postings[i].data);
+	}
+	free (index->keys);
+	free (index->postings);
+	free (index->dirty);
+	memset (index, 0, sizeof (*index));
+}
+
+static void mlIndexClear (void)
+{
+	mlIndexFree (&mlIndexFilename);
+	mlIndexFree (&mlIndexInfo);
+	free (mlIndexFilenameStamp); mlIndexFilenameStamp = 0;
+	free (mlIndexFilenameMdb);   mlIndexFilenameMdb = 0;
+	mlIndexFilenameSize = 0;
+	free (mlIndexInfoDone);      mlIndexInfoDone = 0;
+	mlIndexInfoSize = 0;
+}
+
+static inline uint32_t mlIndexHash (uint32_t key)
+{
+	key ^= key >> 15;
+	key *= 0x2c1b3c6d;
+	key ^= key >> 12;
+	return key;
+}
+
+static struct mlIndexPosting_t *mlIndexLookup (struct mlIndex_t *index, uint32_t key, int create)
+{
+	uint32_t i;
+
+	if (create && ((index->fill + 1) > (index->size / 4 * 3)))
+	{
+		uint32_t newsize = index->size ? index->size * 2 : 4096;
+		uint32_t *newkeys = calloc (newsize, sizeof (newkeys[0]));
+		struct mlIndexPosting_t *newpostings = calloc (newsize, sizeof (newpostings[0]));
+		if ((!newkeys) || (!newpostings))
+		{
+			free (newkeys);
+			free (newpostings);
+			return 0;
+		}
+		for (i=0; i < index->size; i++)
+		{
+			if (index->keys[i])
+			{
+				uint32_t j = mlIndexHash (index->keys[i]) & (newsize - 1);
+				while (newkeys[j])
+				{
+					j = (j + 1) & (newsize - 1);
+				}
+				newkeys[j] = index->keys[i];
+				newpostings[j] = index->postings[i];
+			}
+		}
+		free (index->keys);
+		free (index->postings);
+		index->keys = newkeys;
+		index->postings = newpostings;
+		index->size = newsize;
+	}
+
+	if (!index->size)
+	{
+		return 0;
+	}
+
+	i = mlIndexHash (key) & (index->size - 1);
+	while (index->keys[i])
+	{
+		if (index->keys[i] == key)
+		{
+			return index->postings + i;
+		}
+		i = (i + 1) & (index->size - 1);
+	}
+	if (!create)
+	{
+		return 0;
+	}
+	index->keys[i] = key;
+	index->fill++;
+	return index->postings + i;
+}
+
+static void mlIndexDirty (struct mlIndex_t *index, uint32_t doc)
+{
+	if (index->dirtycount && (index->dirty[index->dirtycount - 1] == doc))
+	{
+		return;
+	}
+	if (index->dirtycount >= index->dirtysize)
+	{
+		uint32_t *temp = realloc (index->dirty, (index->dirtysize + 256) * sizeof (index->dirty[0]));
+		if (!temp)
+		{
+			return;
+		}
+		index->dirty = temp;
+		index->dirtysize += 256;
+	}
+	index->dirty[index->dirtycount++] = doc;
+}
+
+/* returns non-zero if the document could not be added in order */
+static int mlIndexPostingAdd (struct mlIndexPosting_t *p, uint32_t doc)
+{
+	uint32_t delta;
+
+	if (p->count)
+	{
+		if (p->last == doc)
+		{
+			return 0;
+		}
+		if (p->last > doc)
+		{
+			return 1;
+		}
+	}
+
+	if ((p->datalen + 5) > p->datasize)
+	{ /* grow by doubling, common trigrams get a posting for almost every document */
+		uint32_t newsize = p->datasize ? (p->datasize * 2) : 32;
+		uint8_t *temp = realloc (p->data, newsize);
+		if (!temp)
+		{
+			return 1;
+		}
+		p->data = temp;
+		p->datasize = newsize;
+	}
+
+	delta = p->count ? (doc - p->last) : doc;
+	while (delta >= 0x80)
+	{
+		p->data[p->datalen++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	p->data[p->datalen++] = delta;
+	p->count++;
+	p->last = doc;
+	return 0;
+}
+
+static void mlIndexAddText (struct mlIndex_t *index, uint32_t doc, const char *text)
+{
+	uint32_t key;
+	int len = 0;
+	int dirty = 0;
+
+	for (key = 0; *text; text++)
+	{
+		struct mlIndexPosting_t *p;
+
+		key = ((key << 8) | (uint8_t)toupper (*text)) & 0x00ffffff;
+		if (++len < 3)
+		{
+			continue;
+		}
+		p = mlIndexLookup (index, key | 0x01000000, 1);
+		if ((!p) || mlIndexPostingAdd (p, doc))
+		{
+			dirty = 1;
+		}
+	}
+	if (dirty)
+	{
+		mlIndexDirty (index, doc);
+	}
+}
+
+static uint32_t *mlIndexPostingDecode (const struct mlIndexPosting_t *p)
+{
+	uint32_t *retval = malloc ((p->count + 1) * sizeof (retval[0]));
+	uint32_t i, pos = 0, doc = 0;
+
+	if (!retval)
+	{
+		return 0;
+	}
+	for (i=0; i < p->count; i++)
+	{
+		uint32_t delta = 0;
+		int shift = 0;
+		while (p->data[pos] & 0x80)
+		{
+			delta |= (p->data[pos++] & 0x7f) << shift;
+			shift += 7;
+		}
+		delta |= p->data[pos++] << shift;
+		doc = i ? (doc + delta) : delta;
+		retval[i] = doc;
+	}
+	return retval;
+}
+
+/* Marks all candidate documents in the bitmap (that must be cleared by the caller), using the upper-case query.
+ * Returns 1 if the query is too short to use the index, -1 on out of memory.
+ */
+static int mlIndexQuery (struct mlIndex_t *index, const char *query, uint8_t *bitmap, uint32_t bitmapsize)
+{
+	const struct mlIndexPosting_t *posting[64];
+	int postings = 0;
+	uint32_t key = 0;
+	uint32_t *result;
+	uint32_t resultcount;
+	int len = 0;
+	int i, j;
+	uint32_t k;
+
+	for (; *query && (postings < 64); query++)
+	{
+		const struct mlIndexPosting_t *p;
+
+		key = ((key << 8) | (uint8_t)*query) & 0x00ffffff;
+		if (++len < 3)
+		{
+			continue;
+		}
+		p = mlIndexLookup (index, key | 0x01000000, 0);
+		if (!p)
+		{ /* trigram is not present in any document */
+			postings = -1;
+			break;
+		}
+		for (i=0; i < postings; i++)
+		{
+			if (posting[i] == p)
+			{
+				break;
+			}
+		}
+		if (i == postings)
+		{
+			posting[postings++] = p;
+		}
+	}
+	if (!postings)
+	{
+		return 1;
+	}
+
+	for (k=0; k < index->dirtycount; k++)
+	{
+		if (index->dirty[k] < bitmapsize)
+		{
+			bitmap[index->dirty[k] >> 3] |= 1 << (index->dirty[k] & 7);
+		}
+	}
+
+	if (postings < 0)
+	{
+		return 0;
+	}
+
+	/* start with the shortest list */
+	for (i=1; i < postings; i++)
+	{
+		if (posting[i]->count < posting[0]->count)
+		{
+			const struct mlIndexPosting_t *t = posting[0];
+			posting[0] = posting[i];
+			posting[i] = t;
+		}
+	}
+
+	result = mlIndexPostingDecode (posting[0]);
+	if (!result)
+	{
+		return -1;
+	}
+	resultcount = posting[0]->count;
+
+	for (i=1; (i < postings) && resultcount; i++)
+	{
+		uint32_t *other = mlIndexPostingDecode (posting[i]);
+		uint32_t a = 0, b = 0;
+		if (!other)
+		{
+			free (result);
+			return -1;
+		}
+		for (j=0; (a < resultcount) && (b < posting[i]->count);)
+		{
+			if (result[a] < other[b])
+			{
+				a++;
+			} else if (result[a] > other[b])
+			{
+				b++;
+			} else {
+				result[j++] = result[a];
+				a++;
+				b++;
+			}
+		}
+		resultcount = j;
+		free (other);
+	}
+
+	for (k=0; k < resultcount; k++)
+	{
+		if (result[k] < bitmapsize)
+		{
+			bitmap[result[k] >> 3] |= 1 << (result[k] & 7);
+		}
+	}
+	free (result);
+
+	return 0;
+}
+
+static void mlIndexInfoNotify (uint32_t mdb_ref)
+{
+	if (mdb_ref < mlIndexInfoSize)
+	{
+		mlIndexInfoDone[mdb_ref >> 3] &= ~(1 << (mdb_ref & 7));
+	}
+}
+
+static struct mdbwritenotifyregstruct mlIndexInfoNotifyReg = {mlIndexInfoNotify MDBWRITENOTIFYREGSTRUCT_TAIL};
+
+static int mlIndexEnsureSize (uint32_t dirdb_ref, uint32_t mdb_ref)
+{
+	if (dirdb_ref >= mlIndexFilenameSize)
+	{
+		uint32_t newsize = (dirdb_ref + 4096) & ~4095;
+		const char **temp1;
+		uint32_t *temp2;
+		if (!(temp1 = realloc (mlIndexFilenameStamp, newsize * sizeof (temp1[0]))))
+		{
+			return -1;
+		}
+		mlIndexFilenameStamp = temp1;
+		if (!(temp2 = realloc (mlIndexFilenameMdb, newsize * sizeof (temp2[0]))))
+		{
+			return -1;
+		}
+		mlIndexFilenameMdb = temp2;
+		memset (mlIndexFilenameStamp + mlIndexFilenameSize, 0, (newsize - mlIndexFilenameSize) * sizeof (temp1[0]));
+		memset (mlIndexFilenameMdb + mlIndexFilenameSize, 0, (newsize - mlIndexFilenameSize) * sizeof (temp2[0]));
+		mlIndexFilenameSize = newsize;
+	}
+	if (mdb_ref >= mlIndexInfoSize)
+	{
+		uint32_t newsize = (mdb_ref + 4096) & ~4095;
+		uint8_t *temp = realloc (mlIndexInfoDone, newsize / 8);
+		if (!temp)
+		{
+			return -1;
+		}
+		mlIndexInfoDone = temp;
+		memset (mlIndexInfoDone + mlIndexInfoSize / 8, 0, (newsize - mlIndexInfoSize) / 8);
+		mlIndexInfoSize = newsize;
+	}
+	return 0;
+}
+
+/* Brings the index up to date with dirdb and mdb. The first call indexes everything,
+ * later calls only looks at nodes that are new or changed since the last call.
+ */
+static int mlIndexUpdate (void)
+{
+	uint32_t dirdb_ref, mdb_ref;
+	int first = 1;
+	struct moduleinfostruct info;
+
+	if ((mlIndexFilename.dirtycount > MLINDEX_DIRTY_MAX) || (mlIndexInfo.dirtycount > MLINDEX_DIRTY_MAX))
+	{
+		mlIndexClear ();
+	}
+
+	while (!dirdbGetMdb(&dirdb_ref, &mdb_ref, &first))
+	{
+		const char *filename;
+
+		if (mlIndexEnsureSize (dirdb_ref, mdb_ref))
+		{
+			return -1;
+		}
+
+		dirdbGetName_internalstr (dirdb_ref, &filename);
+		if (filename && ((mlIndexFilenameStamp[dirdb_ref] != filename) || (mlIndexFilenameMdb[dirdb_ref] != mdb_ref)))
+		{
+			mlIndexAddText (&mlIndexFilename, dirdb_ref, filename);
+			mlIndexFilenameStamp[dirdb_ref] = filename;
+			mlIndexFilenameMdb[dirdb_ref] = mdb_ref;
+		}
+
+		if (!(mlIndexInfoDone[mdb_ref >> 3] & (1 << (mdb_ref & 7))))
+		{
+			if (mdbGetModuleInfo (&info, mdb_ref))
+			{
+				mlIndexAddText (&mlIndexInfo, mdb_ref, info.title);
+				mlIndexAddText (&mlIndexInfo, mdb_ref, info.composer);
+				mlIndexAddText (&mlIndexInfo, mdb_ref, info.artist);
+				mlIndexAddText (&mlIndexInfo, mdb_ref, info.album);
+				mlIndexAddText (&mlIndexInfo, mdb_ref, info.comment);
+			}
+			mlIndexInfoDone[mdb_ref >> 3] |= 1 << (mdb_ref & 7);
+		}
+	}
+	return 0;
+}
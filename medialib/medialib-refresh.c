@@ -169,11 +169,14 @@ static interfaceReturnEnum medialibRefreshRun (void)
 						}
 
 						dirdbTagSetParent (medialib_sources[medialibRefreshSelected].dirdb_ref);
+						mlStatBegin (medialib_sources[medialibRefreshSelected].dirdb_ref);
 
 						if (mlScan (dir))
 						{
+							mlStatEnd (0);
 							dirdbTagCancel ();
 						} else {
+							mlStatEnd (1);
 							dirdbTagRemoveUntaggedAndSubmit ();
 							dirdbFlush ();
 							mdbUpdate ();
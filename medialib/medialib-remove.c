@@ -173,6 +173,7 @@ static interfaceReturnEnum medialibRemoveRun (void)
 							}
 						}
 						dirdbTagRemoveUntaggedAndSubmit ();
+						mlStatRemoveRoot (medialib_sources[medialibRemoveSelected].dirdb_ref);
 						dirdbFlush ();
 						mdbUpdate ();
 						adbMetaCommit ();
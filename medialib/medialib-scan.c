@@ -22,6 +22,193 @@
  *    -first release
  */
 
+/* Files are probed on the main thread. The ReadInfo probes have never been
+ * audited for re-entrancy, and handles inside archives share state with their
+ * owner, so running mdbScan() in worker threads is not safe today. To avoid
+ * waiting for the disk, the directory walk runs up to MLSCAN_QUEUE new files
+ * ahead of the probing, and a pool of worker threads only reads the start and
+ * end of these files into the page cache while they wait in the queue. The
+ * workers never touch dirdb, mdb or any ocpfile_t. Each directory level probes
+ * what is left of its own files before it returns.
+ */
+#define MLSCAN_QUEUE       64
+#define MLSCAN_WORKERS_MAX 8
+#define MLSCAN_PREFETCH    (256*1024)
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	pthread_t       threads[MLSCAN_WORKERS_MAX];
+	int             threadcount;
+	int             shutdown;
+	char           *paths[MLSCAN_QUEUE]; /* ring buffer */
+	int             pathhead;
+	int             pathcount;
+} mlScanPrefetch;
+
+static struct
+{
+	struct ocpfile_t  *file;
+	uint32_t           mdbref;
+	struct scanlist_t *token; /* the directory level that found the file */
+} mlScanPending[MLSCAN_QUEUE]; /* ring buffer */
+static int mlScanPendingHead;
+static int mlScanPendingCount;
+static int mlScanDepth;
+
+static void *mlScanPrefetchThread (void *arg)
+{
+	char *buffer = malloc (65536);
+
+	pthread_mutex_lock (&mlScanPrefetch.mutex);
+	while (1)
+	{
+		char *path;
+		int fd;
+
+		while ((!mlScanPrefetch.pathcount) && (!mlScanPrefetch.shutdown))
+		{
+			pthread_cond_wait (&mlScanPrefetch.cond, &mlScanPrefetch.mutex);
+		}
+		if (mlScanPrefetch.shutdown)
+		{
+			break;
+		}
+		path = mlScanPrefetch.paths[mlScanPrefetch.pathhead];
+		mlScanPrefetch.pathhead = (mlScanPrefetch.pathhead + 1) % MLSCAN_QUEUE;
+		mlScanPrefetch.pathcount--;
+		pthread_mutex_unlock (&mlScanPrefetch.mutex);
+
+		fd = buffer ? open (path, O_RDONLY) : -1;
+		if (fd >= 0)
+		{
+			struct stat st;
+			off_t pos;
+
+			for (pos = 0; pos < MLSCAN_PREFETCH; pos += 65536)
+			{
+				if (pread (fd, buffer, 65536, pos) < 65536)
+				{
+					break;
+				}
+			}
+			/* some probes look for tags at the end of the file */
+			if ((!fstat (fd, &st)) && (st.st_size > MLSCAN_PREFETCH))
+			{
+				pread (fd, buffer, 65536, st.st_size - 65536);
+			}
+			close (fd);
+		}
+		free (path);
+
+		pthread_mutex_lock (&mlScanPrefetch.mutex);
+	}
+	pthread_mutex_unlock (&mlScanPrefetch.mutex);
+
+	free (buffer);
+	return 0;
+}
+
+static void mlScanPrefetchStart (void)
+{
+	long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	int i;
+
+	if (cpus < 2)
+	{
+		cpus = 2;
+	} else if (cpus > MLSCAN_WORKERS_MAX)
+	{
+		cpus = MLSCAN_WORKERS_MAX;
+	}
+
+	pthread_mutex_init (&mlScanPrefetch.mutex, NULL);
+	pthread_cond_init (&mlScanPrefetch.cond, NULL);
+	mlScanPrefetch.shutdown = 0;
+	mlScanPrefetch.pathhead = 0;
+	mlScanPrefetch.pathcount = 0;
+	mlScanPrefetch.threadcount = 0;
+	for (i=0; i < cpus; i++)
+	{
+		if (pthread_create (&mlScanPrefetch.threads[mlScanPrefetch.threadcount], NULL, mlScanPrefetchThread, NULL))
+		{
+			break;
+		}
+		mlScanPrefetch.threadcount++;
+	}
+}
+
+static void mlScanPrefetchStop (void)
+{
+	int i;
+
+	pthread_mutex_lock (&mlScanPrefetch.mutex);
+	mlScanPrefetch.shutdown = 1;
+	pthread_cond_broadcast (&mlScanPrefetch.cond);
+	pthread_mutex_unlock (&mlScanPrefetch.mutex);
+
+	for (i=0; i < mlScanPrefetch.threadcount; i++)
+	{
+		pthread_join (mlScanPrefetch.threads[i], NULL);
+	}
+	mlScanPrefetch.threadcount = 0;
+
+	while (mlScanPrefetch.pathcount)
+	{
+		free (mlScanPrefetch.paths[mlScanPrefetch.pathhead]);
+		mlScanPrefetch.pathhead = (mlScanPrefetch.pathhead + 1) % MLSCAN_QUEUE;
+		mlScanPrefetch.pathcount--;
+	}
+
+	pthread_cond_destroy (&mlScanPrefetch.cond);
+	pthread_mutex_destroy (&mlScanPrefetch.mutex);
+}
+
+/* only files that lives directly on the unix filesystem can be prefetched */
+static void mlScanPrefetchSubmit (struct ocpfile_t *file)
+{
+	struct ocpdir_t *iter;
+	char *path = 0;
+
+	if (!mlScanPrefetch.threadcount)
+	{
+		return;
+	}
+
+	for (iter = file->parent; iter; iter = iter->parent)
+	{
+		if (iter->is_archive || iter->is_playlist)
+		{
+			return;
+		}
+	}
+
+	dirdbGetFullname_malloc (file->dirdb_ref, &path, 0);
+	if (!path)
+	{
+		return;
+	}
+	if (strncmp (path, "file:", 5))
+	{
+		free (path);
+		return;
+	}
+	memmove (path, path + 5, strlen (path + 5) + 1);
+
+	pthread_mutex_lock (&mlScanPrefetch.mutex);
+	if (mlScanPrefetch.pathcount < MLSCAN_QUEUE)
+	{
+		mlScanPrefetch.paths[(mlScanPrefetch.pathhead + mlScanPrefetch.pathcount) % MLSCAN_QUEUE] = path;
+		mlScanPrefetch.pathcount++;
+		path = 0;
+		pthread_cond_signal (&mlScanPrefetch.cond);
+	}
+	pthread_mutex_unlock (&mlScanPrefetch.mutex);
+
+	free (path); /* queue was full */
+}
+
 struct scanlist_t
 {
 	char *path;
@@ -29,6 +216,11 @@ struct scanlist_t
 	int entries;
 	int size;
 	int abort;
+
+	/* change tracking, only for directories directly on the unix filesystem */
+	char *statpath;
+	uint32_t dirdb_ref;
+	int noreplay;
 };
 
 static void mlScanDraw(const char *title, struct scanlist_t *token)
@@ -127,6 +319,80 @@ static void mlScanDraw(const char *title, struct scanlist_t *token)
 
 static int mlScan(struct ocpdir_t *dir);
 
+static void mlScanAddToList (struct scanlist_t *token, struct ocpfile_t *file)
+{
+	if (token->entries >= token->size)
+	{
+		struct ocpfile_t **temp = realloc (token->files, (token->size + 64) * sizeof (token->files[0]));
+		if (!temp)
+		{
+			return;
+		}
+		token->files = temp;
+		token->size += 64;
+	}
+	file->ref(file);
+	token->files[token->entries] = file;
+	token->entries++;
+}
+
+/* probe the oldest file in the queue, and commit the result */
+static void mlScanCommitEntry (int i)
+{
+	struct ocpfile_t *file = mlScanPending[i].file;
+	uint32_t mdbref = mlScanPending[i].mdbref;
+	struct scanlist_t *token = mlScanPending[i].token;
+
+	if (!token->abort)
+	{
+		if (!mdbInfoIsAvailable (mdbref)) /* an identical file might have been probed while we were queued */
+		{
+			mdbScan(file, mdbref);
+		}
+		dirdbMakeMdbRef(file->dirdb_ref, mdbref);
+		mlScanAddToList (token, file);
+	}
+	file->unref (file);
+}
+
+/* probe the oldest file in the queue, it might belong to one of the parent directories */
+static void mlScanCommitOne (void)
+{
+	mlScanCommitEntry (mlScanPendingHead);
+	mlScanPendingHead = (mlScanPendingHead + 1) % MLSCAN_QUEUE;
+	mlScanPendingCount--;
+}
+
+/* Probe the files that token queued, before the directory level returns and token goes away.
+ * Subdirectories have already done the same, and the parents can not queue anything while we
+ * are scanning, so our files are the tail of the queue.
+ */
+static void mlScanCommitLevel (struct scanlist_t *token)
+{
+	int n = 0;
+	int i;
+
+	while ((n < mlScanPendingCount) && (mlScanPending[(mlScanPendingHead + mlScanPendingCount - n - 1) % MLSCAN_QUEUE].token == token))
+	{
+		n++;
+	}
+	for (i = mlScanPendingCount - n; i < mlScanPendingCount; i++)
+	{
+		if (poll_framelock())
+		{
+			mlScanDraw ("Scanning", token);
+		}
+		mlScanCommitEntry ((mlScanPendingHead + i) % MLSCAN_QUEUE);
+	}
+	mlScanPendingCount -= n;
+}
+
+/* a directory records itself after all its content, so it should be the last entry */
+static int mlScanIsRecorded (uint32_t dirdb_ref)
+{
+	return mlStatNewCount && (mlStatNew[mlStatNewCount - 1].dirdb_ref == dirdb_ref) && (mlStatNew[mlStatNewCount - 1].mdb_ref == DIRDB_NO_MDBREF);
+}
+
 static void mlScan_dir (void *_token, struct ocpdir_t *dir)
 {
 	struct scanlist_t *token = _token;
@@ -134,6 +400,78 @@ static void mlScan_dir (void *_token, struct ocpdir_t *dir)
 	{
 		token->abort = 1;
 	}
+	if (token->statpath && !mlScanIsRecorded (dir->dirdb_ref))
+	{
+		token->noreplay = 1;
+	}
+}
+
+/* The directory has not changed since the last scan, so the module files and directories in it are the same.
+ * Check that the files are unchanged, and scan the subdirectories. Returns non-zero if a full scan is needed.
+ */
+static int mlScanReplay (struct ocpdir_t *dir, struct scanlist_t *token)
+{
+	uint32_t count, i;
+	const struct mlStatEntry_t *children = mlStatFindChildren (dir->dirdb_ref, &count);
+	struct stat *st;
+
+	st = malloc ((count + 1) * sizeof (st[0]));
+	if (!st)
+	{
+		return -1;
+	}
+
+	for (i=0; i < count; i++)
+	{
+		char *path;
+		int res;
+
+		if (children[i].mdb_ref == DIRDB_NO_MDBREF)
+		{
+			continue;
+		}
+		path = mlStatChildPath (token->statpath, children[i].dirdb_ref);
+		if (!path)
+		{
+			free (st);
+			return -1;
+		}
+		res = stat (path, st + i);
+		free (path);
+		if (res || !mlStatMatch (children + i, st + i))
+		{
+			free (st);
+			return -1;
+		}
+	}
+
+	for (i=0; (i < count) && (!token->abort); i++)
+	{
+		struct ocpdir_t *sub;
+
+		if (poll_framelock())
+		{
+			mlScanDraw ("Scanning", token);
+		}
+
+		if (children[i].mdb_ref != DIRDB_NO_MDBREF)
+		{
+			dirdbMakeMdbRef (children[i].dirdb_ref, children[i].mdb_ref);
+			mlStatRecord (children[i].dirdb_ref, dir->dirdb_ref, children[i].mdb_ref, st + i, 0);
+			continue;
+		}
+
+		sub = dir->readdir_dir (dir, children[i].dirdb_ref);
+		if (!sub)
+		{
+			token->noreplay = 1;
+			continue;
+		}
+		mlScan_dir (token, sub);
+		sub->unref (sub);
+	}
+	free (st);
+	return 0;
 }
 
 static void mlScan_file (void *_token, struct ocpfile_t *file)
@@ -170,6 +508,7 @@ static void mlScan_file (void *_token, struct ocpfile_t *file)
 		{
 			if (!dir->is_playlist)
 			{
+				token->noreplay = 1; /* we do not track the content of archives */
 				if (mlScan (dir))
 				{
 					token->abort = 1;
@@ -190,25 +529,42 @@ static void mlScan_file (void *_token, struct ocpfile_t *file)
 	curext = 0;
 
 	mdbref = mdbGetModuleReference2 (file->dirdb_ref, file->filesize(file));
-	if (!mdbInfoIsAvailable (mdbref))
+	if (mdbref == UINT32_MAX)
 	{
-		mdbScan(file, mdbref);
+		token->noreplay = 1;
+		return;
 	}
-	dirdbMakeMdbRef(file->dirdb_ref, mdbref);
 
-	if (token->entries >= token->size)
+	if (token->statpath)
 	{
-		struct ocpfile_t **temp = realloc (token->files, (token->size + 64) * sizeof (token->files[0]));
-		if (!temp)
+		char *path = mlStatChildPath (token->statpath, file->dirdb_ref);
+		struct stat st;
+		if (path && !stat (path, &st))
 		{
-			return;
+			mlStatRecord (file->dirdb_ref, token->dirdb_ref, mdbref, &st, 0);
+		} else {
+			token->noreplay = 1;
 		}
-		token->files = temp;
-		token->size += 64;
+		free (path);
 	}
-	file->ref(file);
-	token->files[token->entries] = file;
-	token->entries++;
+
+	if (mdbInfoIsAvailable (mdbref))
+	{ /* nothing to probe, commit at once */
+		dirdbMakeMdbRef(file->dirdb_ref, mdbref);
+		mlScanAddToList (token, file);
+		return;
+	}
+
+	if (mlScanPendingCount >= MLSCAN_QUEUE)
+	{
+		mlScanCommitOne ();
+	}
+	file->ref (file);
+	mlScanPending[(mlScanPendingHead + mlScanPendingCount) % MLSCAN_QUEUE].file = file;
+	mlScanPending[(mlScanPendingHead + mlScanPendingCount) % MLSCAN_QUEUE].mdbref = mdbref;
+	mlScanPending[(mlScanPendingHead + mlScanPendingCount) % MLSCAN_QUEUE].token = token;
+	mlScanPendingCount++;
+	mlScanPrefetchSubmit (file);
 }
 
 /* returns non-zero on KEY_ESC */
@@ -217,6 +573,7 @@ static int mlScan(struct ocpdir_t *dir)
 	struct scanlist_t token;
 	int i;
 	ocpdirhandle_pt *handle;
+	struct stat st;
 
 	bzero (&token, sizeof (token));
 
@@ -226,20 +583,56 @@ static int mlScan(struct ocpdir_t *dir)
 		return 0;
 	}
 
-	handle = dir->readdir_start (dir, mlScan_file, mlScan_dir, &token);
-	if (!handle)
+	token.dirdb_ref = dir->dirdb_ref;
+	token.statpath = mlStatGetPath (dir);
+	if (token.statpath && stat (token.statpath, &st))
 	{
-		free (token.path);
-		return 0;
+		free (token.statpath);
+		token.statpath = 0;
+	}
+
+	if (!mlScanDepth++)
+	{
+		mlScanPrefetchStart ();
 	}
-	while (dir->readdir_iterate (handle) && (!token.abort))
+
+	if (token.statpath)
 	{
-		if (poll_framelock())
+		const struct mlStatEntry_t *e = mlStatFindDir (dir->dirdb_ref);
+		if (e && (!(e->flags & MLSTAT_NOREPLAY)) && mlStatMatch (e, &st) && !mlScanReplay (dir, &token))
 		{
-			mlScanDraw ("Scanning", &token);
+			goto done;
 		}
 	}
-	dir->readdir_cancel (handle);
+
+	handle = dir->readdir_start (dir, mlScan_file, mlScan_dir, &token);
+	if (!handle)
+	{ /* do not record this directory, so our parent can not be replayed either */
+		free (token.statpath);
+		token.statpath = 0;
+	} else {
+		while (dir->readdir_iterate (handle) && (!token.abort))
+		{
+			if (poll_framelock())
+			{
+				mlScanDraw ("Scanning", &token);
+			}
+		}
+		dir->readdir_cancel (handle);
+	}
+
+done:
+	if (token.statpath && !token.abort)
+	{
+		mlStatRecord (dir->dirdb_ref, dir->parent ? dir->parent->dirdb_ref : DIRDB_NOPARENT, DIRDB_NO_MDBREF, &st, token.noreplay ? MLSTAT_NOREPLAY : 0);
+	}
+	free (token.statpath);
+
+	mlScanCommitLevel (&token);
+	if (!--mlScanDepth)
+	{ /* the outermost directory is done, so the queue is empty */
+		mlScanPrefetchStop ();
+	}
 
 	for (i=0; i < token.entries; i++)
 	{
@@ -33,6 +33,10 @@ static int                mlSearchResultCount;
 static int                mlSearchResultSize;
 static int                mlSearchFirst = 1;
 static uint32_t           mlSearchDirDbRef;
+static uint8_t           *mlSearchFilenameCandidates; /* bitmap of dirdb_ref, 0 if the index can not be used */
+static uint8_t           *mlSearchInfoCandidates;     /* bitmap of mdb_ref */
+static uint32_t           mlSearchFilenameCandidatesSize;
+static uint32_t           mlSearchInfoCandidatesSize;
 
 static void mlSearchClear (void)
 {
@@ -49,6 +53,36 @@ static void mlSearchClear (void)
 	mlSearchResultCount = 0;
 	mlSearchResultSize = 0;
 	mlSearchFirst = 1;
+	free (mlSearchFilenameCandidates);
+	      mlSearchFilenameCandidates = 0;
+	free (mlSearchInfoCandidates);
+	      mlSearchInfoCandidates = 0;
+	mlSearchFilenameCandidatesSize = 0;
+	mlSearchInfoCandidatesSize = 0;
+}
+
+/* Use the search index to find the candidates. If the query is too short, or we run out of memory, fall back to test all entries */
+static void mlSearchPrepareCandidates (void)
+{
+	if (mlIndexUpdate ())
+	{
+		return;
+	}
+
+	mlSearchFilenameCandidatesSize = mlIndexFilenameSize;
+	mlSearchInfoCandidatesSize = mlIndexInfoSize;
+	mlSearchFilenameCandidates = calloc (1, mlSearchFilenameCandidatesSize / 8 + 1);
+	mlSearchInfoCandidates = calloc (1, mlSearchInfoCandidatesSize / 8 + 1);
+
+	if ((!mlSearchFilenameCandidates) || (!mlSearchInfoCandidates) ||
+	    mlIndexQuery (&mlIndexFilename, mlSearchQuery, mlSearchFilenameCandidates, mlSearchFilenameCandidatesSize) ||
+	    mlIndexQuery (&mlIndexInfo, mlSearchQuery, mlSearchInfoCandidates, mlSearchInfoCandidatesSize))
+	{
+		free (mlSearchFilenameCandidates);
+		      mlSearchFilenameCandidates = 0;
+		free (mlSearchInfoCandidates);
+		      mlSearchInfoCandidates = 0;
+	}
 }
 
 static int mlSearchPerformQuery (void)
@@ -63,7 +97,9 @@ static int mlSearchPerformQuery (void)
 	[
 		MAX(sizeof(info.title),
 		MAX(sizeof(info.composer),
-		    sizeof(info.comment)))
+		MAX(sizeof(info.artist),
+		MAX(sizeof(info.album),
+		    sizeof(info.comment)))))
 	];
 
 	if (!mlSearchQuery)
@@ -71,6 +107,11 @@ static int mlSearchPerformQuery (void)
 		return 1;
 	}
 
+	if (mlSearchFirst)
+	{
+		mlSearchPrepareCandidates ();
+	}
+
 	while (1)
 	{
 		if (dirdbGetMdb(&mlSearchDirDbRef, &mdb_ref, &mlSearchFirst)) /* does not refcount.... */
@@ -78,6 +119,13 @@ static int mlSearchPerformQuery (void)
 			return 1;
 		}
 
+		if (mlSearchFilenameCandidates &&
+		    ((mlSearchDirDbRef >= mlSearchFilenameCandidatesSize) || !(mlSearchFilenameCandidates[mlSearchDirDbRef >> 3] & (1 << (mlSearchDirDbRef & 7)))) &&
+		    ((mdb_ref >= mlSearchInfoCandidatesSize) || !(mlSearchInfoCandidates[mdb_ref >> 3] & (1 << (mdb_ref & 7)))))
+		{ /* the index says that this entry can not match */
+			continue;
+		}
+
 		dirdbGetName_malloc (mlSearchDirDbRef, &filename);
 		if (!filename)
 		{ /* out of memory probably */
@@ -103,6 +151,7 @@ static int mlSearchPerformQuery (void)
 		{
 			*ptr = toupper (*ptr2);
 		}
+		*ptr = 0;
 		if (strstr (buffer, mlSearchQuery))
 		{
 			break; /* goto add; */
@@ -112,6 +161,27 @@ static int mlSearchPerformQuery (void)
 		{
 			*ptr = toupper (*ptr2);
 		}
+		*ptr = 0;
+		if (strstr (buffer, mlSearchQuery))
+		{
+			break; /* goto add; */
+		}
+
+		for (ptr=buffer, ptr2=info.artist; *ptr2; ptr++, ptr2++)
+		{
+			*ptr = toupper (*ptr2);
+		}
+		*ptr = 0;
+		if (strstr (buffer, mlSearchQuery))
+		{
+			break; /* goto add; */
+		}
+
+		for (ptr=buffer, ptr2=info.album; *ptr2; ptr++, ptr2++)
+		{
+			*ptr = toupper (*ptr2);
+		}
+		*ptr = 0;
 		if (strstr (buffer, mlSearchQuery))
 		{
 			break; /* goto add; */
@@ -121,6 +191,7 @@ static int mlSearchPerformQuery (void)
 		{
 			*ptr = toupper (*ptr2);
 		}
+		*ptr = 0;
 		if (strstr (buffer, mlSearchQuery))
 		{
 			break; /* goto add; */
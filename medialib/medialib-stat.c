@@ -0,0 +1,394 @@
+/* OpenCP Module Player
+ * copyright (c) 2022 Stian Skjelstad <stian.skjelstad@gmail.com>
+ *
+ * MEDIALIBRARY change tracking, used by refresh to skip unchanged directories
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* While scanning directories that lives directly on the unix filesystem, we
+ * record the (inode, mtime, size) of each directory and each module file found.
+ * The next time we scan, a directory with an unchanged mtime still has the same
+ * entries, so instead of reading the directory and checking each file we only
+ * need to stat() the module files we found last time. Subdirectories are
+ * checked the same way.
+ *
+ * The records of each medialib source are stored in adbmeta as ("medialib",
+ * source dirdb_ref, "MS"), and replaced each time the source is scanned
+ * successfully. They are tagged with the set of module extensions and the
+ * fsScanArcs setting, since a directory that has not changed can still contain
+ * files that would be picked up now. If the tag does not match, the records are
+ * thrown away.
+ */
+
+#define MLSTAT_NOREPLAY 1 /* directory contained something we did not record (archives, failing stat()), it must always be scanned */
+
+struct mlStatEntry_t
+{
+	uint32_t dirdb_ref;
+	uint32_t parent_ref; /* the directory we were found in */
+	uint32_t root_ref;   /* the medialib source */
+	uint32_t mdb_ref;    /* DIRDB_NO_MDBREF for directories */
+	uint64_t ino;
+	uint64_t size;
+	int64_t  mtime;      /* nanoseconds */
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct mlStatHeader_t
+{
+	char     sig[16];
+	uint32_t extensions; /* fsModuleExtensionsStamp() */
+	uint32_t options;    /* MLSTAT_OPTION_* */
+};
+
+#define MLSTAT_OPTION_SCANARCS 1
+
+static const char mlStatSig[16] = "OCP medialib st\x02";
+
+static struct mlStatEntry_t *mlStatOld;        /* records of mlStatOldRoot, sorted on parent_ref */
+static uint32_t              mlStatOldCount;
+static uint32_t             *mlStatOldByRef;   /* index into mlStatOld, sorted on dirdb_ref */
+static uint32_t              mlStatOldRoot = DIRDB_NOPARENT; /* DIRDB_NOPARENT = nothing loaded */
+
+static struct mlStatEntry_t *mlStatNew;        /* recorded during the current scan */
+static uint32_t              mlStatNewCount;
+static uint32_t              mlStatNewSize;
+static uint32_t              mlStatRoot = DIRDB_NOPARENT; /* DIRDB_NOPARENT = not recording */
+
+static int mlStatParentCmp (const void *_a, const void *_b)
+{
+	const struct mlStatEntry_t *a = _a;
+	const struct mlStatEntry_t *b = _b;
+	if (a->parent_ref != b->parent_ref)
+	{
+		return (a->parent_ref < b->parent_ref) ? -1 : 1;
+	}
+	if (a->dirdb_ref != b->dirdb_ref)
+	{
+		return (a->dirdb_ref < b->dirdb_ref) ? -1 : 1;
+	}
+	return 0;
+}
+
+static int mlStatRefCmp (const void *_a, const void *_b)
+{
+	uint32_t a = mlStatOld[*(const uint32_t *)_a].dirdb_ref;
+	uint32_t b = mlStatOld[*(const uint32_t *)_b].dirdb_ref;
+	if (a != b)
+	{
+		return (a < b) ? -1 : 1;
+	}
+	return 0;
+}
+
+static void mlStatOldClear (void)
+{
+	free (mlStatOld);      mlStatOld = 0;
+	free (mlStatOldByRef); mlStatOldByRef = 0;
+	mlStatOldCount = 0;
+	mlStatOldRoot = DIRDB_NOPARENT;
+}
+
+static void mlStatOldIndex (void)
+{
+	uint32_t i;
+
+	free (mlStatOldByRef);
+	mlStatOldByRef = 0;
+	if (!mlStatOldCount)
+	{
+		return;
+	}
+	qsort (mlStatOld, mlStatOldCount, sizeof (mlStatOld[0]), mlStatParentCmp);
+	mlStatOldByRef = malloc (mlStatOldCount * sizeof (mlStatOldByRef[0]));
+	if (!mlStatOldByRef)
+	{ /* without the index, we can not replay anything */
+		free (mlStatOld);
+		mlStatOld = 0;
+		mlStatOldCount = 0;
+		return;
+	}
+	for (i=0; i < mlStatOldCount; i++)
+	{
+		mlStatOldByRef[i] = i;
+	}
+	qsort (mlStatOldByRef, mlStatOldCount, sizeof (mlStatOldByRef[0]), mlStatRefCmp);
+}
+
+static void mlStatHeaderMake (struct mlStatHeader_t *h)
+{
+	memset (h, 0, sizeof (*h));
+	memcpy (h->sig, mlStatSig, sizeof (h->sig));
+	h->extensions = fsModuleExtensionsStamp ();
+	h->options = fsScanArcs ? MLSTAT_OPTION_SCANARCS : 0;
+}
+
+static void mlStatLoad (uint32_t root)
+{
+	struct mlStatHeader_t header;
+	unsigned char *data = 0;
+	size_t datasize = 0;
+
+	if (mlStatOldRoot == root)
+	{
+		return;
+	}
+	mlStatOldClear ();
+	mlStatOldRoot = root;
+
+	if (adbMetaGet ("medialib", root, "MS", &data, &datasize))
+	{
+		return;
+	}
+	mlStatHeaderMake (&header);
+	if ((datasize < sizeof (header)) || memcmp (data, header.sig, sizeof (header.sig)) || ((datasize - sizeof (header)) % sizeof (mlStatOld[0])))
+	{
+		fprintf (stderr, "medialib: ignoring invalid change tracking data\n");
+		free (data);
+		return;
+	}
+	if (memcmp (data, &header, sizeof (header)))
+	{ /* module extensions or fsScanArcs have changed, unchanged directories might still have new content for us */
+		free (data);
+		return;
+	}
+	mlStatOldCount = (datasize - sizeof (header)) / sizeof (mlStatOld[0]);
+	if (mlStatOldCount)
+	{
+		mlStatOld = malloc (mlStatOldCount * sizeof (mlStatOld[0]));
+		if (!mlStatOld)
+		{
+			mlStatOldCount = 0;
+		} else {
+			memcpy (mlStatOld, data + sizeof (header), mlStatOldCount * sizeof (mlStatOld[0]));
+		}
+	}
+	free (data);
+	mlStatOldIndex ();
+}
+
+static void mlStatSave (void)
+{
+	struct mlStatHeader_t header;
+	unsigned char *data;
+	size_t datasize = sizeof (header) + mlStatOldCount * sizeof (mlStatOld[0]);
+
+	if (!mlStatOldCount)
+	{
+		adbMetaRemove ("medialib", mlStatOldRoot, "MS");
+		return;
+	}
+	data = malloc (datasize);
+	if (!data)
+	{
+		return;
+	}
+	mlStatHeaderMake (&header);
+	memcpy (data, &header, sizeof (header));
+	memcpy (data + sizeof (header), mlStatOld, mlStatOldCount * sizeof (mlStatOld[0]));
+	adbMetaAdd ("medialib", mlStatOldRoot, "MS", data, datasize);
+	free (data);
+}
+
+/* Start recording, root is the medialib source being scanned */
+static void mlStatBegin (uint32_t root)
+{
+	mlStatLoad (root);
+	mlStatRoot = root;
+	mlStatNewCount = 0;
+}
+
+/* Stop recording. If the scan completed, the records of the scanned source are replaced */
+static void mlStatEnd (int completed)
+{
+	if (completed && (mlStatRoot != DIRDB_NOPARENT) && (mlStatRoot == mlStatOldRoot))
+	{
+		free (mlStatOld);
+		mlStatOld = mlStatNew;
+		mlStatOldCount = mlStatNewCount;
+		mlStatNew = 0;
+		mlStatOldIndex ();
+		mlStatSave ();
+	}
+
+	free (mlStatNew);
+	mlStatNew = 0;
+	mlStatNewCount = 0;
+	mlStatNewSize = 0;
+	mlStatRoot = DIRDB_NOPARENT;
+}
+
+/* Forget all records for a medialib source that is being removed */
+static void mlStatRemoveRoot (uint32_t root)
+{
+	if (mlStatOldRoot == root)
+	{
+		mlStatOldClear ();
+	}
+	adbMetaRemove ("medialib", root, "MS");
+}
+
+static int64_t mlStatTime (const struct stat *st)
+{
+#ifdef __APPLE__
+	return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static void mlStatRecord (uint32_t dirdb_ref, uint32_t parent_ref, uint32_t mdb_ref, const struct stat *st, uint32_t flags)
+{
+	struct mlStatEntry_t *e;
+
+	if (mlStatRoot == DIRDB_NOPARENT)
+	{
+		return;
+	}
+	if (mlStatNewCount >= mlStatNewSize)
+	{
+		struct mlStatEntry_t *temp = realloc (mlStatNew, (mlStatNewSize + 1024) * sizeof (mlStatNew[0]));
+		if (!temp)
+		{
+			return;
+		}
+		mlStatNew = temp;
+		mlStatNewSize += 1024;
+	}
+	e = mlStatNew + mlStatNewCount++;
+	memset (e, 0, sizeof (*e));
+	e->dirdb_ref = dirdb_ref;
+	e->parent_ref = parent_ref;
+	e->root_ref = mlStatRoot;
+	e->mdb_ref = mdb_ref;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = mlStatTime (st);
+	e->flags = flags;
+}
+
+static int mlStatMatch (const struct mlStatEntry_t *e, const struct stat *st)
+{
+	return (e->ino == (uint64_t)st->st_ino) &&
+	       (e->size == (uint64_t)st->st_size) &&
+	       (e->mtime == mlStatTime (st));
+}
+
+static const struct mlStatEntry_t *mlStatFindDir (uint32_t dirdb_ref)
+{
+	uint32_t min = 0, max = mlStatOldCount;
+
+	while (min < max)
+	{
+		uint32_t mid = (min + max) / 2;
+		const struct mlStatEntry_t *e = mlStatOld + mlStatOldByRef[mid];
+		if (e->dirdb_ref < dirdb_ref)
+		{
+			min = mid + 1;
+		} else {
+			max = mid;
+		}
+	}
+	for (; (min < mlStatOldCount) && (mlStatOld[mlStatOldByRef[min]].dirdb_ref == dirdb_ref); min++)
+	{
+		const struct mlStatEntry_t *e = mlStatOld + mlStatOldByRef[min];
+		if (e->mdb_ref == DIRDB_NO_MDBREF)
+		{
+			return e;
+		}
+	}
+	return 0;
+}
+
+/* children of a directory are stored next to each other */
+static const struct mlStatEntry_t *mlStatFindChildren (uint32_t parent_ref, uint32_t *count)
+{
+	uint32_t min = 0, max = mlStatOldCount, end;
+
+	while (min < max)
+	{
+		uint32_t mid = (min + max) / 2;
+		if (mlStatOld[mid].parent_ref < parent_ref)
+		{
+			min = mid + 1;
+		} else {
+			max = mid;
+		}
+	}
+	for (end = min; (end < mlStatOldCount) && (mlStatOld[end].parent_ref == parent_ref); end++)
+	{
+	}
+	*count = end - min;
+	return mlStatOld + min;
+}
+
+/* returns the path on the unix filesystem, or NULL if dir is not directly on it (archive, playlist, other drives) */
+static char *mlStatGetPath (struct ocpdir_t *dir)
+{
+	struct ocpdir_t *iter;
+	char *path = 0;
+
+	if (mlStatRoot == DIRDB_NOPARENT)
+	{
+		return 0;
+	}
+	for (iter = dir; iter; iter = iter->parent)
+	{
+		if (iter->is_archive || iter->is_playlist)
+		{
+			return 0;
+		}
+	}
+	dirdbGetFullname_malloc (dir->dirdb_ref, &path, 0);
+	if (!path)
+	{
+		return 0;
+	}
+	if (strncmp (path, "file:", 5))
+	{
+		free (path);
+		return 0;
+	}
+	memmove (path, path + 5, strlen (path + 5) + 1);
+	return path;
+}
+
+static char *mlStatChildPath (const char *dirpath, uint32_t dirdb_ref)
+{
+	const char *name = 0;
+	char *retval;
+	size_t len;
+
+	dirdbGetName_internalstr (dirdb_ref, &name);
+	if (!name)
+	{
+		return 0;
+	}
+	len = strlen (dirpath);
+	retval = malloc (len + strlen (name) + 2);
+	if (!retval)
+	{
+		return 0;
+	}
+	strcpy (retval, dirpath);
+	if ((!len) || (retval[len - 1] != '/'))
+	{
+		retval[len++] = '/';
+	}
+	strcpy (retval + len, name);
+	return retval;
+}
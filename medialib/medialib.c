@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -174,6 +175,8 @@ static void mlFlushBlob (void)
 	free (data);
 }
 
+#include "medialib-stat.c"
+
 #include "medialib-scan.c"
 
 #include "medialib-add.c"
@@ -184,6 +187,8 @@ static void mlFlushBlob (void)
 
 #include "medialib-listall.c"
 
+#include "medialib-index.c"
+
 #include "medialib-search.c"
 
 static int mlint(void)
@@ -203,6 +208,8 @@ static int mlint(void)
 
 	dmMEDIALIB=RegisterDrive("medialib:", r, r);
 
+	mdbRegisterWriteNotify (&mlIndexInfoNotifyReg);
+
 	if (!adbMetaGet ("medialib", 1, "ML", &data, &datasize))
 	{
 		medialib_decode_blob (data, datasize);
@@ -286,6 +293,9 @@ static void mlclose(void)
 	}
 
 	mlSearchClear();
+	mdbUnregisterWriteNotify (&mlIndexInfoNotifyReg);
+	mlIndexClear();
+	mlStatOldClear();
 
 	plUnregisterInterface (&medialibRemoveIntr);
 	if (removefiles)
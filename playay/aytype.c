@@ -142,6 +142,12 @@ static void __attribute__((destructor))done(void)
 	mdbUnregisterReadInfo(&ayReadInfoReg);
 }
 
-static struct mdbreadinforegstruct ayReadInfoReg = {"AY", ayReadInfo, ayEvent MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig ayReadInfoSigs[] =
+{
+	{0, 8, "ZXAYEMUL"},
+	{0, 0}
+};
+
+static struct mdbreadinforegstruct ayReadInfoReg = {"AY", ayReadInfo, ayEvent MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(ayReadInfoSigs, 0)};
 char *dllinfo = "";
 struct linkinfostruct dllextinfo = {.name = "aytype", .desc = "OpenCP AY Detection (c) 2005-'22 Stian Skjelstad", .ver = DLLVERSION, .size = 0};
@@ -244,6 +244,12 @@ static void __attribute__((destructor))done(void)
 	mdbUnregisterReadInfo(&flacReadInfoReg);
 }
 
-static struct mdbreadinforegstruct flacReadInfoReg = {"FLAC", flacReadInfo, flacEvent MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig flacReadInfoSigs[] =
+{
+	{0, 4, "fLaC"},
+	{0, 0}
+};
+
+static struct mdbreadinforegstruct flacReadInfoReg = {"FLAC", flacReadInfo, flacEvent MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(flacReadInfoSigs, 0)};
 char *dllinfo = "";
 struct linkinfostruct dllextinfo = {.name = "flacptype", .desc = "OpenCP FLAC Detection (c) 2007-'22 Stian Skjelstad", .ver = DLLVERSION, .size = 0};
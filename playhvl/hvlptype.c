@@ -261,4 +261,11 @@ struct interfaceparameters HVL_p =
 	0, 0
 };
 
-struct mdbreadinforegstruct hvlReadInfoReg = {"HVL/AHX", hvlReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig hvlReadInfoSigs[] =
+{
+	{0, 3, "THX"},
+	{0, 3, "HVL"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct hvlReadInfoReg = {"HVL/AHX", hvlReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(hvlReadInfoSigs, 0)};
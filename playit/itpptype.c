@@ -121,4 +121,11 @@ struct interfaceparameters IT_p =
 };
 
 
-struct mdbreadinforegstruct itpReadInfoReg = {"IT", itpReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig itpReadInfoSigs[] =
+{
+	{0, 4, "IMPM"},
+	{0, 8, "ziRCONia"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct itpReadInfoReg = {"IT", itpReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(itpReadInfoSigs, 0)};
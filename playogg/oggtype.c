@@ -146,4 +146,10 @@ const struct interfaceparameters OGG_p =
 };
 
 
-struct mdbreadinforegstruct oggReadInfoReg = {"OGG", oggReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig oggReadInfoSigs[] =
+{
+	{0, 4, "OggS"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct oggReadInfoReg = {"OGG", oggReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(oggReadInfoSigs, 0)};
@@ -75,6 +75,11 @@ struct interfaceparameters OPL_p =
 	0, 0
 };
 
+static const char **oplExtensions;
+
+static void oplEvent(int event);
+static struct mdbreadinforegstruct oplReadInfoReg = {"adplug", oplReadInfo, oplEvent MDBREADINFOREGSTRUCT_TAIL};
+
 static void oplEvent(int event)
 {
 	switch (event)
@@ -82,12 +87,22 @@ static void oplEvent(int event)
 		case mdbEvInit:
 		{
 			CPlayers::const_iterator i;
-			int j;
+			int j, k;
 			const char *s;
 			char _s[6];
 			struct moduletype mt;
 
-			for(i = CAdPlug::players.begin(); i != CAdPlug::players.end(); i++)
+			for(k = 0, i = CAdPlug::players.begin(); i != CAdPlug::players.end(); i++)
+			{
+				for(j = 0; (*i)->get_extension(j); j++)
+				{
+					k++;
+				}
+			}
+			free (oplExtensions);
+			oplExtensions = (const char **)calloc (k + 1, sizeof (oplExtensions[0]));
+
+			for(k = 0, i = CAdPlug::players.begin(); i != CAdPlug::players.end(); i++)
 			{
 				for(j = 0; (s=(*i)->get_extension(j)); j++)
 				{
@@ -95,8 +110,14 @@ static void oplEvent(int event)
 					_s[5]=0;
 					strupr(_s);
 					fsRegisterExt(_s);
+					if (oplExtensions)
+					{
+						oplExtensions[k++] = s;
+					}
 				}
 			}
+			/* oplReadInfo only reacts on extensions, so the mdb only needs to call it for these files */
+			oplReadInfoReg.Extensions = oplExtensions;
 
 			mt.integer.i = MODULETYPE("OPL");
 			fsTypeRegister (mt, OPL_description, "plOpenCP", &OPL_p);
@@ -104,8 +125,6 @@ static void oplEvent(int event)
 	}
 }
 
-static struct mdbreadinforegstruct oplReadInfoReg = {"adplug", oplReadInfo, oplEvent MDBREADINFOREGSTRUCT_TAIL};
-
 static void __attribute__((constructor))init(void)
 {
 	mdbRegisterReadInfo(&oplReadInfoReg);
@@ -114,6 +133,8 @@ static void __attribute__((constructor))init(void)
 static void __attribute__((destructor))done(void)
 {
 	mdbUnregisterReadInfo(&oplReadInfoReg);
+	free (oplExtensions);
+	oplExtensions = 0;
 }
 
 extern "C" {
@@ -116,7 +116,16 @@ static int sidReadInfo(struct moduleinfostruct *m, struct ocpfilehandle_t *fp, c
 	return 0;
 }
 
-static struct mdbreadinforegstruct sidReadInfoReg = {"SID", sidReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig sidReadInfoSigs[] =
+{
+	{0, 4, "PSID"},
+	{0, 4, "RSID"},
+	{0, 16, "SIDPLAY INFOFILE"},
+	{0, 6, "\x00\x00\x4c\x00\x00\x4c", "\xff\x00\xff\x00\x00\xff"}, /* raw SID */
+	{0, 0}
+};
+
+static struct mdbreadinforegstruct sidReadInfoReg = {"SID", sidReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(sidReadInfoSigs, 0)};
 
 static const char *SID_description[] =
 {
@@ -130,4 +130,11 @@ struct interfaceparameters MIDI_p =
 };
 
 
-struct mdbreadinforegstruct timidityReadInfoReg = {"MIDI", timidityReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig timidityReadInfoSigs[] =
+{
+	{0, 4, "MThd"},
+	{0, 12, "RIFF\0\0\0\0RMID", "\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct timidityReadInfoReg = {"MIDI", timidityReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(timidityReadInfoSigs, 0)};
@@ -200,4 +200,10 @@ struct interfaceparameters WAV_p =
 	0, 0
 };
 
-struct mdbreadinforegstruct wavReadInfoReg = {"WAVE", wavReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL};
+static const struct mdbreadinfosig wavReadInfoSigs[] =
+{
+	{0, 12, "RIFF\0\0\0\0WAVE", "\xff\xff\xff\xff\0\0\0\0\xff\xff\xff\xff"},
+	{0, 0}
+};
+
+struct mdbreadinforegstruct wavReadInfoReg = {"WAVE", wavReadInfo, 0 MDBREADINFOREGSTRUCT_TAIL_SIGNATURES(wavReadInfoSigs, 0)};